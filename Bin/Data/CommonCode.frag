@@ -15,6 +15,29 @@ layout(std140) uniform LightsPS3
     vec4 dirShadowFade;
 };
 
+#ifdef CLUSTERED
+layout(std140) uniform ClusterLightsPS4
+{
+    vec4 clusterViewRows[3];
+    vec4 clusterSizeParameters;
+    vec4 clusterDepthParameters;
+    vec4 clusterLightPositions[128];
+    vec4 clusterLightDirections[128];
+    vec4 clusterLightAttenuations[128];
+    vec4 clusterLightColors[128];
+};
+
+layout(std140) uniform ClusterRangesPS5
+{
+    uvec4 clusterRanges[768];
+};
+
+layout(std140) uniform ClusterIndicesPS6
+{
+    uvec4 clusterLightIndices[1024];
+};
+#endif
+
 uniform sampler2DShadow shadowMap8[4];
 uniform samplerCube faceSelectionTex12;
 uniform samplerCube faceSelectionTex13;
@@ -134,6 +157,42 @@ vec3 CalculateShadowPointLight(int index, vec4 worldPos, vec3 normal)
     return atten * lightColors[index].rgb;
 }
 
+#ifdef CLUSTERED
+vec3 CalculateClusteredLights(vec4 worldPos, vec3 normal)
+{
+    // Find the cluster from the view space position. The clusters divide the view frustum into 16x8 tiles and 24 depth slices
+    vec4 position = vec4(worldPos.xyz, 1.0);
+    vec3 viewPos = vec3(dot(clusterViewRows[0], position), dot(clusterViewRows[1], position), dot(clusterViewRows[2], position));
+    float viewZ = max(viewPos.z, clusterDepthParameters.w);
+    vec2 halfSize = clusterSizeParameters.xz + clusterSizeParameters.yw * viewZ;
+    ivec2 tile = clamp(ivec2((viewPos.xy / halfSize * 0.5 + 0.5) * vec2(16.0, 8.0)), ivec2(0, 0), ivec2(15, 7));
+    int slice = clamp(int(log2(viewZ) * clusterDepthParameters.x + viewZ * clusterDepthParameters.y + clusterDepthParameters.z), 0, 23);
+    int cluster = (slice * 8 + tile.y) * 16 + tile.x;
+
+    // The range has the start index in the low 16 bits and the light count in the high 16 bits
+    uint range = clusterRanges[cluster >> 2][cluster & 3];
+    uint start = range & 0xffffu;
+    uint end = start + (range >> 16u);
+
+    vec3 totalLight = vec3(0.0, 0.0, 0.0);
+    for (uint i = start; i < end; ++i)
+    {
+        // Four 8-bit light indices are packed into each unsigned int
+        uint index = (clusterLightIndices[i >> 4u][(i >> 2u) & 3u] >> ((i & 3u) * 8u)) & 0xffu;
+        vec3 lightVec = (clusterLightPositions[index].xyz - worldPos.xyz) * clusterLightAttenuations[index].x;
+        float lightDist = length(lightVec);
+        vec3 localDir = lightVec / lightDist;
+        float NdotL = clamp(dot(normal, localDir), 0.0, 1.0);
+        // Point lights have a cone cutoff and scale that saturate the cone term to 1 in all directions
+        float spotEffect = dot(localDir, clusterLightDirections[index].xyz);
+        float spotAtten = clamp((spotEffect - clusterLightAttenuations[index].y) * clusterLightAttenuations[index].z, 0.0, 1.0);
+        totalLight += NdotL * spotAtten * clamp(1.0 - lightDist * lightDist, 0.0, 1.0) * clusterLightColors[index].rgb;
+    }
+
+    return totalLight;
+}
+#endif
+
 #ifdef NUMSHADOWCOORDS
 vec4 CalculateLighting(vec4 worldPos, vec3 normal, vec4 shadowPos[NUMSHADOWCOORDS])
 #else
@@ -150,6 +209,10 @@ vec4 CalculateLighting(vec4 worldPos, vec3 normal)
     totalLight.rgb += ambientColor;
     #endif
 
+    #ifdef CLUSTERED
+    totalLight.rgb += CalculateClusteredLights(worldPos, normal);
+    #endif
+
     #ifdef DIRLIGHT0
     #ifdef SHADOW0
     totalLight.rgb += CalculateShadowDirLight(0, worldPos, normal, shadowPos);
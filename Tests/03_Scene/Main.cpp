@@ -12,6 +12,56 @@
 
 using namespace Turso3D;
 
+/// Node that writes extra data after its attributes and children by overriding Save() and Load().
+class CustomNode : public Node
+{
+    OBJECT(CustomNode);
+
+public:
+    /// Construct.
+    CustomNode() :
+        value(0)
+    {
+    }
+
+    /// Register factory and attributes.
+    static void RegisterObject()
+    {
+        RegisterFactory<CustomNode>();
+        CopyBaseAttributes<CustomNode, Node>();
+    }
+
+    /// Save to binary stream.
+    void Save(Stream& dest) override
+    {
+        Node::Save(dest);
+        dest.Write(value);
+    }
+
+    /// Load from binary stream.
+    void Load(Stream& source, ObjectResolver& resolver) override
+    {
+        Node::Load(source, resolver);
+        value = source.Read<int>();
+    }
+
+    /// Extra value not stored as an attribute.
+    int value;
+};
+
+/// Node that registers only its factory, without copying the Node attributes.
+class PlainNode : public Node
+{
+    OBJECT(PlainNode);
+
+public:
+    /// Register factory.
+    static void RegisterObject()
+    {
+        RegisterFactory<PlainNode>();
+    }
+};
+
 int main()
 {
     #ifdef _MSC_VER
@@ -23,6 +73,8 @@ int main()
     printf("Size of SpatialNode: %d\n", sizeof(SpatialNode));
     
     RegisterSceneLibrary();
+    CustomNode::RegisterObject();
+    PlainNode::RegisterObject();
 
     printf("\nTesting scene serialization\n");
     
@@ -44,6 +96,11 @@ int main()
             node->SetTagName("TestTag");
         }
 
+        CustomNode* custom = scene.CreateChild<CustomNode>("Custom");
+        custom->value = 1234;
+        custom->CreateChild<SpatialNode>("CustomChild");
+        scene.CreateChild<PlainNode>()->CreateChild<SpatialNode>("PlainChild");
+
         {
             File binaryFile("Scene.bin", FILE_WRITE);
             scene.Save(binaryFile);
@@ -65,11 +122,25 @@ int main()
                     Node* child = loadScene.Child(i);
                     printf("Child name: %s layer: %d tag: %d\n", child->Name().CString(), (int)child->Layer(), (int)child->Tag());
                 }
+                CustomNode* loadCustom = static_cast<CustomNode*>(loadScene.FindChild(CustomNode::TypeStatic()));
+                printf("Custom node value after load: %d (children %d)\n", loadCustom ? loadCustom->value : 0,
+                    loadCustom ? (int)loadCustom->NumChildren() : 0);
+                Node* loadPlain = loadScene.FindChild(PlainNode::TypeStatic());
+                printf("Plain node after load: %d (children %d)\n", loadPlain ? 1 : 0, loadPlain ? (int)loadPlain->NumChildren() : 0);
             }
             else
                 printf("Failed to load scene from binary data\n");
         }
 
+        {
+            VectorBuffer buffer;
+            custom->Save(buffer);
+            buffer.Seek(0);
+            Node* instance = scene.Instantiate(buffer);
+            printf("Custom node value after instantiate: %d\n", (instance && instance->Type() == CustomNode::TypeStatic()) ?
+                static_cast<CustomNode*>(instance)->value : 0);
+        }
+
         profiler.EndFrame();
         LOGRAW(profiler.OutputResults(false, false, 16));
     }
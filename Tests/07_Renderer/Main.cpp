@@ -10,7 +10,11 @@
 #include <cstdio>
 #include <cstdlib>
 
-#include "Windows.h"
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#define VK_SHIFT 0x10
+#endif
 
 using namespace Turso3D;
 
@@ -31,6 +35,7 @@ public:
         log = new Log();
         input = new Input();
         profiler = new Profiler();
+        workQueue = new WorkQueue();
         graphics = new Graphics();
         renderer = new Renderer();
 
@@ -167,6 +172,7 @@ public:
     AutoPtr<Input> input;
     AutoPtr<Log> log;
     AutoPtr<Profiler> profiler;
+    AutoPtr<WorkQueue> workQueue;
 };
 
 int main()
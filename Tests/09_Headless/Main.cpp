@@ -0,0 +1,808 @@
+// For conditions of distribution and use, see copyright notice in License.txt
+
+#include "Turso3D.h"
+#include "Debug/DebugNew.h"
+
+#ifdef _MSC_VER
+#include <crtdbg.h>
+#endif
+
+#include <cstdio>
+#include <cstdlib>
+
+using namespace Turso3D;
+
+const unsigned NUM_FRAMES = 100;
+const unsigned NUM_TRANSFORM_SYSTEM_FRAMES = 20;
+const unsigned NUM_LIGHT_INTERACTION_FRAMES = 10;
+const unsigned NUM_THREADED_TRANSFORM_FRAMES = 10;
+const int SHADOW_MAP_SIZE = 2048;
+
+bool CompareTransformPositions(const Matrix3x4& lhs, const Matrix3x4& rhs)
+{
+    if (lhs.m03 != rhs.m03)
+        return lhs.m03 < rhs.m03;
+    if (lhs.m13 != rhs.m13)
+        return lhs.m13 < rhs.m13;
+    return lhs.m23 < rhs.m23;
+}
+
+class HeadlessTest : public Object
+{
+    OBJECT(HeadlessTest);
+
+public:
+    /// Run the test. Return true if a frame was rendered and all checks matched.
+    bool Run()
+    {
+        RegisterGraphicsLibrary();
+        RegisterResourceLibrary();
+        RegisterRendererLibrary();
+
+        cache = new ResourceCache();
+        cache->AddResourceDir(ExecutableDir() + "Data");
+
+        log = new Log();
+        profiler = new Profiler();
+        // Use at least 2 worker threads so that the threaded renderer and transform updates are checked even on a single core
+        workQueue = new WorkQueue(Max((int)Thread::NumCPUCores() - 1, 2));
+        graphics = new Graphics();
+        renderer = new Renderer();
+
+        if (!graphics->SetMode(IntVector2(800, 600)))
+            return false;
+
+        renderer->SetupShadowMaps(1, SHADOW_MAP_SIZE, FMT_D16);
+
+        SharedPtr<Scene> scene = new Scene();
+        scene->CreateChild<Octree>();
+        Camera* camera = scene->CreateChild<Camera>();
+        camera->SetPosition(Vector3(0.0f, 20.0f, -75.0f));
+        camera->SetAmbientColor(Color(0.1f, 0.1f, 0.1f));
+        camera->SetAspectRatio((float)graphics->Width() / (float)graphics->Height());
+
+        SetRandomSeed(1);
+
+        for (int y = -5; y <= 5; ++y)
+        {
+            for (int x = -5; x <= 5; ++x)
+            {
+                StaticModel* object = scene->CreateChild<StaticModel>();
+                object->SetPosition(Vector3(10.5f * x, -0.1f, 10.5f * y));
+                object->SetScale(Vector3(10.0f, 0.1f, 10.0f));
+                object->SetModel(cache->LoadResource<Model>("Box.mdl"));
+                object->SetMaterial(cache->LoadResource<Material>("Stone.json"));
+            }
+        }
+
+        for (unsigned i = 0; i < 435; ++i)
+        {
+            StaticModel* object = scene->CreateChild<StaticModel>();
+            object->SetPosition(Vector3(Random() * 100.0f - 50.0f, 1.0f, Random() * 100.0f - 50.0f));
+            object->SetScale(1.5f);
+            object->SetModel(cache->LoadResource<Model>("Mushroom.mdl"));
+            object->SetMaterial(cache->LoadResource<Material>("Mushroom.json"));
+            object->SetCastShadows(true);
+            object->SetLodBias(2.0f);
+        }
+
+        for (unsigned i = 0; i < 10; ++i)
+        {
+            Light* light = scene->CreateChild<Light>();
+            light->SetLightType(LIGHT_POINT);
+            light->SetCastShadows(true);
+            Vector3 colorVec = 2.0f * Vector3(Random(), Random(), Random()).Normalized();
+            light->SetColor(Color(colorVec.x, colorVec.y, colorVec.z));
+            light->SetFov(90.0f);
+            light->SetRange(20.0f);
+            light->SetPosition(Vector3(Random() * 120.0f - 60.0f, 7.0f, Random() * 120.0f - 60.0f));
+            light->SetDirection(Vector3(0.0f, -1.0f, 0.0f));
+            light->SetShadowMapSize(256);
+        }
+
+        Vector<PassDesc> passes;
+        passes.Push(PassDesc("opaque", SORT_STATE, true));
+        passes.Push(PassDesc("alpha", SORT_BACK_TO_FRONT, true));
+
+        // Render the first frame separately to exclude shader loading from the timing
+        RenderFrame(scene, camera, passes, 0.0f);
+        const GraphicsStats& firstStats = graphics->Stats();
+        printf("First frame: %d draws %d instanced draws %d skipped draws %d shader compiles\n", (int)firstStats.draws,
+            (int)firstStats.instancedDraws, (int)firstStats.skippedDraws, (int)firstStats.shaderCompiles);
+        if (!firstStats.draws && !firstStats.instancedDraws)
+        {
+            printf("Error: no draw calls recorded\n");
+            return false;
+        }
+
+        graphics->ResetStats();
+        profiler->BeginInterval();
+
+        HiresTimer timer;
+        for (unsigned i = 0; i < NUM_FRAMES; ++i)
+        {
+            profiler->BeginFrame();
+            RenderFrame(scene, camera, passes, 360.0f * i / NUM_FRAMES);
+            profiler->EndFrame();
+        }
+        long long totalUSec = timer.ElapsedUSec();
+
+        const GraphicsStats& stats = graphics->Stats();
+        printf("%d frames in %d ms, average %.3f ms per frame\n", NUM_FRAMES, (int)(totalUSec / 1000), totalUSec / 1000.0f /
+            NUM_FRAMES);
+        printf("Per frame: %.1f draws %.1f instanced draws %.1f instances %.1f primitives %.1f shader changes %.1f state changes\n",
+            (float)stats.draws / NUM_FRAMES, (float)stats.instancedDraws / NUM_FRAMES, (float)stats.instances / NUM_FRAMES,
+            (float)stats.primitives / NUM_FRAMES, (float)stats.shaderChanges / NUM_FRAMES, (float)stats.stateChanges / NUM_FRAMES);
+        printf("Per frame: %.1f rendertarget changes %.1f clears %.1f data updates (%.1f KB)\n", (float)stats.renderTargetChanges /
+            NUM_FRAMES, (float)stats.clears / NUM_FRAMES, (float)stats.dataUpdates / NUM_FRAMES, stats.dataUpdateBytes / 1024.0f /
+            NUM_FRAMES);
+
+        LOGRAW(profiler->OutputResults());
+
+        bool success = TestLightInteractions(false);
+        success &= TestLightInteractions(true);
+        success &= TestClusteredLighting(passes);
+        success &= TestThreadedTransformUpdates();
+        success &= TestTransformSystemBatches(passes);
+        success &= TestSceneStreamingResources();
+        return success;
+    }
+
+    bool TestLightInteractions(bool aabbTree)
+    {
+        // Check that the light lists and shadow maps assigned by the threaded CollectLightInteractions() match a serial reference
+        // assignment, in which each light is processed in distance order and also lights the shadow casters outside the view
+        // that earlier lights prepared
+        SharedPtr<Scene> scene = new Scene();
+        if (aabbTree)
+            scene->CreateChild<AABBTree>();
+        else
+            scene->CreateChild<Octree>();
+        Camera* camera = scene->CreateChild<Camera>();
+        camera->SetPosition(Vector3(0.0f, 20.0f, 0.0f));
+        camera->SetFarClip(1000.0f);
+        camera->SetAspectRatio((float)graphics->Width() / (float)graphics->Height());
+
+        SetRandomSeed(3);
+        Vector<GeometryNode*> geometries;
+        StaticModel* floor = scene->CreateChild<StaticModel>();
+        floor->SetPosition(Vector3(0.0f, -0.1f, 0.0f));
+        floor->SetScale(Vector3(200.0f, 0.1f, 200.0f));
+        floor->SetModel(cache->LoadResource<Model>("Box.mdl"));
+        floor->SetMaterial(cache->LoadResource<Material>("Stone.json"));
+        geometries.Push(floor);
+
+        for (unsigned i = 0; i < 1500; ++i)
+        {
+            StaticModel* object = scene->CreateChild<StaticModel>();
+            object->SetPosition(Vector3(Random(-100.0f, 100.0f), 1.0f, Random(-100.0f, 100.0f)));
+            object->SetRotation(Quaternion(Random(360.0f), Vector3::UP));
+            object->SetScale(1.5f);
+            object->SetModel(cache->LoadResource<Model>(i & 1 ? "Box.mdl" : "Mushroom.mdl"));
+            object->SetMaterial(cache->LoadResource<Material>(i & 1 ? "Stone.json" : "Mushroom.json"));
+            object->SetCastShadows(true);
+            geometries.Push(object);
+        }
+
+        Light* dirLight = scene->CreateChild<Light>();
+        dirLight->SetLightType(LIGHT_DIRECTIONAL);
+        dirLight->SetDirection(Vector3(0.5f, -1.0f, 0.3f));
+        dirLight->SetCastShadows(true);
+
+        for (unsigned i = 0; i < 32; ++i)
+        {
+            Light* light = scene->CreateChild<Light>();
+            light->SetPosition(Vector3(Random(-100.0f, 100.0f), 7.0f, Random(-100.0f, 100.0f)));
+            if (i & 1)
+            {
+                light->SetLightType(LIGHT_SPOT);
+                light->SetRange(30.0f);
+                light->SetFov(60.0f);
+                light->SetDirection(Vector3(Random(-0.5f, 0.5f), -1.0f, Random(-0.5f, 0.5f)));
+                light->SetShadowMapSize(512);
+            }
+            else
+            {
+                light->SetLightType(LIGHT_POINT);
+                light->SetRange(20.0f);
+                light->SetShadowMapSize(256);
+            }
+            light->SetCastShadows(i < 12);
+        }
+
+        unsigned char shadowPassIndex = Material::PassIndex("shadow");
+        Vector<AutoPtr<ShadowView> > shadowViews;
+        Vector<OctreeNode*> litGeometries;
+        Vector<OctreeNode*> shadowCasters;
+        HashSet<GeometryNode*> prepared;
+        HashMap<GeometryNode*, Vector<Light*> > lightLists;
+        Vector<Texture*> actualShadowMaps;
+        Vector<IntRect> actualShadowRects;
+        bool match = true;
+        size_t numShadowed = 0;
+        size_t numOutsideCasters = 0;
+
+        for (unsigned i = 0; i < NUM_LIGHT_INTERACTION_FRAMES && match; ++i)
+        {
+            camera->SetRotation(Quaternion(20.0f, 360.0f * i / NUM_LIGHT_INTERACTION_FRAMES, 0.0f));
+            renderer->CollectObjects(scene, camera);
+            renderer->CollectLightInteractions();
+
+            const Vector<GeometryNode*>& visibleGeometries = renderer->Geometries();
+            const Vector<Light*>& lights = renderer->Lights();
+            Frustum viewFrustum = camera->WorldFrustum();
+            unsigned frameNumber = floor->LastFrameNumber();
+
+            actualShadowMaps.Clear();
+            actualShadowRects.Clear();
+            for (auto it = lights.Begin(); it != lights.End(); ++it)
+            {
+                actualShadowMaps.Push((*it)->ShadowMap());
+                actualShadowRects.Push((*it)->ShadowRect());
+            }
+
+            prepared.Clear();
+            lightLists.Clear();
+            for (auto it = visibleGeometries.Begin(); it != visibleGeometries.End(); ++it)
+                prepared.Insert(*it);
+
+            AreaAllocator allocator(SHADOW_MAP_SIZE, SHADOW_MAP_SIZE, 0, 0, false);
+            size_t usedShadowViews = 0;
+
+            for (size_t j = 0; j < lights.Size(); ++j)
+            {
+                Light* light = lights[j];
+                LightType type = light->GetLightType();
+                bool hasReceivers = false;
+
+                litGeometries.Clear();
+                if (type == LIGHT_DIRECTIONAL)
+                {
+                    for (auto it = visibleGeometries.Begin(); it != visibleGeometries.End(); ++it)
+                    {
+                        if ((*it)->LayerMask() & light->LightMask())
+                            litGeometries.Push(*it);
+                    }
+                }
+                else if (type == LIGHT_POINT)
+                    FindNodes(scene, litGeometries, light->WorldSphere(), NF_ENABLED | NF_GEOMETRY, light->LightMask());
+                else
+                    FindNodes(scene, litGeometries, light->WorldFrustum(), NF_ENABLED | NF_GEOMETRY, light->LightMask());
+
+                for (auto it = litGeometries.Begin(); it != litGeometries.End(); ++it)
+                {
+                    GeometryNode* node = static_cast<GeometryNode*>(*it);
+                    if (prepared.Contains(node))
+                    {
+                        lightLists[node].Push(light);
+                        hasReceivers = true;
+                    }
+                }
+
+                Texture* expectedShadowMap = nullptr;
+                IntRect expectedShadowRect;
+
+                if (light->CastShadows() && hasReceivers)
+                {
+                    IntVector2 request = light->TotalShadowMapSize();
+                    int x = 0, y = 0;
+                    bool allocated = false;
+                    for (size_t k = 0; k < 3 && !allocated; ++k)
+                    {
+                        allocated = allocator.Allocate(request.x, request.y, x, y);
+                        if (!allocated)
+                            request /= 2;
+                    }
+
+                    if (allocated)
+                    {
+                        light->SetShadowMap(actualShadowMaps[j], IntRect(x, y, x + request.x, y + request.y));
+                        size_t startView = usedShadowViews;
+                        light->SetupShadowViews(camera, shadowViews, usedShadowViews);
+                        bool hasShadowBatches = false;
+
+                        for (size_t k = startView; k < usedShadowViews; ++k)
+                        {
+                            Frustum shadowFrustum = shadowViews[k]->shadowCamera.WorldFrustum();
+                            shadowCasters.Clear();
+
+                            if (type == LIGHT_DIRECTIONAL)
+                            {
+                                FindNodes(scene, shadowCasters, shadowFrustum, NF_ENABLED | NF_GEOMETRY | NF_CASTSHADOWS,
+                                    light->LightMask());
+                            }
+                            else if (type == LIGHT_SPOT || viewFrustum.IsInsideFast(BoundingBox(shadowFrustum)))
+                            {
+                                for (auto it = litGeometries.Begin(); it != litGeometries.End(); ++it)
+                                {
+                                    if (((*it)->Flags() & NF_CASTSHADOWS) && (type == LIGHT_SPOT ||
+                                        shadowFrustum.IsInsideFast((*it)->WorldBoundingBox())))
+                                        shadowCasters.Push(*it);
+                                }
+                            }
+
+                            for (auto it = shadowCasters.Begin(); it != shadowCasters.End(); ++it)
+                            {
+                                GeometryNode* node = static_cast<GeometryNode*>(*it);
+                                if (!prepared.Contains(node))
+                                {
+                                    prepared.Insert(node);
+                                    ++numOutsideCasters;
+                                }
+
+                                const Vector<SourceBatch>& batches = node->Batches();
+                                for (auto bIt = batches.Begin(); bIt != batches.End(); ++bIt)
+                                    hasShadowBatches |= bIt->material->GetPass(shadowPassIndex) != nullptr;
+                            }
+                        }
+
+                        if (hasShadowBatches)
+                        {
+                            expectedShadowMap = actualShadowMaps[j];
+                            expectedShadowRect = light->ShadowRect();
+                        }
+                        else
+                            usedShadowViews = startView;
+                    }
+                }
+
+                if (actualShadowMaps[j] != expectedShadowMap || (expectedShadowMap && actualShadowRects[j] != expectedShadowRect))
+                    match = false;
+                if (expectedShadowMap)
+                    ++numShadowed;
+            }
+
+            // Compare the light lists as sets, as the renderer sorts them by light pointer
+            for (auto it = lightLists.Begin(); it != lightLists.End(); ++it)
+            {
+                const LightList* list = it->first->GetLightList();
+                Vector<Light*>& expected = it->second;
+                if (!list || list->lights.Size() != expected.Size())
+                {
+                    match = false;
+                    break;
+                }
+                Sort(expected.Begin(), expected.End());
+                if (!(list->lights == expected))
+                {
+                    match = false;
+                    break;
+                }
+            }
+
+            // Geometries that no light reaches must have no light list
+            for (auto it = geometries.Begin(); it != geometries.End(); ++it)
+            {
+                GeometryNode* node = *it;
+                if (node->LastFrameNumber() == frameNumber && node->GetLightList() && !lightLists.Contains(node))
+                    match = false;
+            }
+        }
+
+        printf("Light interactions, %s, %d frames %d shadowed lights %d casters outside view %d threads: match %d\n", aabbTree ?
+            "AABB tree" : "octree", NUM_LIGHT_INTERACTION_FRAMES, (int)numShadowed, (int)numOutsideCasters,
+            (int)workQueue->NumThreads(), match ? 1 : 0);
+        return match;
+    }
+
+    bool TestClusteredLighting(const Vector<PassDesc>& passes)
+    {
+        // Render the same view with per-node light lists and with clustered lighting. The clustered lights must leave the light
+        // lists, so that they cause no additive passes, and the base passes must use the clustered shader variation. Then find
+        // the clusters of points in view like the shaders do, from the uploaded constants, and check that they list every
+        // clustered light reaching the point. The light must shade the point as it would in a per-light pass
+        SharedPtr<Scene> scene = new Scene();
+        scene->CreateChild<Octree>();
+        Camera* camera = scene->CreateChild<Camera>();
+        camera->SetPosition(Vector3(0.0f, 20.0f, -75.0f));
+        camera->SetFarClip(300.0f);
+        camera->SetAspectRatio((float)graphics->Width() / (float)graphics->Height());
+
+        SetRandomSeed(5);
+        StaticModel* floor = scene->CreateChild<StaticModel>();
+        floor->SetPosition(Vector3(0.0f, -0.1f, 0.0f));
+        floor->SetScale(Vector3(200.0f, 0.1f, 200.0f));
+        floor->SetModel(cache->LoadResource<Model>("Box.mdl"));
+        floor->SetMaterial(cache->LoadResource<Material>("Stone.json"));
+
+        for (unsigned i = 0; i < 300; ++i)
+        {
+            StaticModel* object = scene->CreateChild<StaticModel>();
+            object->SetPosition(Vector3(Random(-100.0f, 100.0f), 1.0f, Random(-100.0f, 100.0f)));
+            object->SetScale(1.5f);
+            object->SetModel(cache->LoadResource<Model>(i & 1 ? "Box.mdl" : "Mushroom.mdl"));
+            object->SetMaterial(cache->LoadResource<Material>(i & 1 ? "Stone.json" : "Mushroom.json"));
+        }
+
+        Light* dirLight = scene->CreateChild<Light>();
+        dirLight->SetLightType(LIGHT_DIRECTIONAL);
+        dirLight->SetDirection(Vector3(0.5f, -1.0f, 0.3f));
+        dirLight->SetCastShadows(true);
+
+        for (unsigned i = 0; i < 100; ++i)
+        {
+            Light* light = scene->CreateChild<Light>();
+            light->SetPosition(Vector3(Random(-100.0f, 100.0f), Random(2.0f, 8.0f), Random(-100.0f, 100.0f)));
+            light->SetLightType(i & 1 ? LIGHT_SPOT : LIGHT_POINT);
+            light->SetRange(Random(10.0f, 25.0f));
+            light->SetFov(Random(30.0f, 90.0f));
+            light->SetDirection(Vector3(Random(-0.5f, 0.5f), -1.0f, Random(-0.5f, 0.5f)));
+        }
+
+        size_t draws[2];
+        for (size_t i = 0; i < 2; ++i)
+        {
+            renderer->SetClusteredLighting(i == 1);
+            graphics->ResetStats();
+            RenderFrame(scene, camera, passes, 0.0f);
+            draws[i] = graphics->Stats().draws + graphics->Stats().instancedDraws;
+        }
+        renderer->SetClusteredLighting(false);
+
+        const Vector<Light*>& clusteredLights = renderer->ClusteredLights();
+        bool match = clusteredLights.Size() > 0 && draws[1] < draws[0];
+
+        HashSet<Light*> clustered;
+        for (auto it = clusteredLights.Begin(); it != clusteredLights.End(); ++it)
+        {
+            clustered.Insert(*it);
+            match &= (*it)->GetLightType() != LIGHT_DIRECTIONAL && !(*it)->CastShadows();
+        }
+        for (auto it = renderer->Geometries().Begin(); it != renderer->Geometries().End(); ++it)
+        {
+            const LightList* list = (*it)->GetLightList();
+            for (size_t j = 0; list && j < list->lights.Size(); ++j)
+                match &= !clustered.Contains(list->lights[j]);
+        }
+
+        Pass* basePass = cache->LoadResource<Material>("Stone.json")->GetPass(Material::PassIndex("opaque"));
+        bool hasClusteredShader = false;
+        for (auto it = basePass->shaderVariations[SHADER_PS].Begin(); it != basePass->shaderVariations[SHADER_PS].End(); ++it)
+            hasClusteredShader |= it->second && it->second->FullName().Contains("CLUSTERED");
+        match &= hasClusteredShader && graphics->GetConstantBuffer(SHADER_PS, CB_CLUSTER_INDICES) ==
+            renderer->psClusterIndexConstantBuffer;
+
+        ConstantBuffer* lightBuffer = renderer->psClusterLightConstantBuffer;
+        ConstantBuffer* rangeBuffer = renderer->psClusterRangeConstantBuffer;
+        ConstantBuffer* indexBuffer = renderer->psClusterIndexConstantBuffer;
+        Vector4 sizeParameters = lightBuffer->ConstantValue<Vector4>(PS_CLUSTER_SIZE_PARAMETERS);
+        Vector4 depthParameters = lightBuffer->ConstantValue<Vector4>(PS_CLUSTER_DEPTH_PARAMETERS);
+        Frustum viewFrustum = camera->WorldFrustum();
+        size_t numChecked = 0;
+        size_t numShaded = 0;
+        float maxError = 0.0f;
+
+        for (unsigned i = 0; i < 20000; ++i)
+        {
+            Vector3 point(Random(-100.0f, 100.0f), Random(0.0f, 3.0f), Random(-100.0f, 100.0f));
+            if (viewFrustum.IsInside(point) == OUTSIDE)
+                continue;
+
+            Vector3 normal = Vector3(Random(-1.0f, 1.0f), 1.0f, Random(-1.0f, 1.0f)).Normalized();
+            Vector4 position(point, 1.0f);
+            Vector3 viewPos(lightBuffer->ConstantValue<Vector4>(PS_CLUSTER_VIEW_ROWS, 0).DotProduct(position),
+                lightBuffer->ConstantValue<Vector4>(PS_CLUSTER_VIEW_ROWS, 1).DotProduct(position),
+                lightBuffer->ConstantValue<Vector4>(PS_CLUSTER_VIEW_ROWS, 2).DotProduct(position));
+            float viewZ = Max(viewPos.z, depthParameters.w);
+            int x = Clamp((int)((viewPos.x / (sizeParameters.x + sizeParameters.y * viewZ) * 0.5f + 0.5f) * 16.0f), 0, 15);
+            int y = Clamp((int)((viewPos.y / (sizeParameters.z + sizeParameters.w * viewZ) * 0.5f + 0.5f) * 8.0f), 0, 7);
+            int z = Clamp((int)(log2f(viewZ) * depthParameters.x + viewZ * depthParameters.y + depthParameters.z), 0, 23);
+            int cluster = (z * 8 + y) * 16 + x;
+
+            const unsigned* range = static_cast<const unsigned*>(rangeBuffer->ConstantValue(PS_CLUSTER_RANGES, cluster >> 2));
+            unsigned start = range[cluster & 3] & 0xffff;
+            unsigned end = start + (range[cluster & 3] >> 16);
+
+            for (size_t j = 0; j < clusteredLights.Size(); ++j)
+            {
+                Light* light = clusteredLights[j];
+                Vector3 lightVec = point - light->WorldPosition();
+                float distance = lightVec.Length();
+                // Leave a margin for the points on the light volume's edges
+                if (distance >= light->Range() * 0.95f || (light->GetLightType() == LIGHT_SPOT && lightVec.Normalized().DotProduct(
+                    light->WorldDirection()) <= cosf(light->Fov() * 0.5f * M_DEGTORAD) + 0.01f))
+                    continue;
+
+                bool found = false;
+                for (unsigned k = start; k < end && !found; ++k)
+                {
+                    const unsigned* indices = static_cast<const unsigned*>(indexBuffer->ConstantValue(PS_CLUSTER_LIGHT_INDICES, k >>
+                        4));
+                    found = ((indices[(k >> 2) & 3] >> ((k & 3) * 8)) & 0xff) == j;
+                }
+                match &= found;
+                ++numChecked;
+
+                // Shade like CalculateClusteredLights() from the uploaded constants, and like the point and spot light
+                // functions of the per-light passes from the light itself
+                Vector4 lightPosition = lightBuffer->ConstantValue<Vector4>(PS_CLUSTER_LIGHT_POSITIONS, j);
+                Vector4 lightDirection = lightBuffer->ConstantValue<Vector4>(PS_CLUSTER_LIGHT_DIRECTIONS, j);
+                Vector4 lightAttenuation = lightBuffer->ConstantValue<Vector4>(PS_CLUSTER_LIGHT_ATTENUATIONS, j);
+                Vector3 clusterVec = (Vector3(lightPosition.x, lightPosition.y, lightPosition.z) - point) * lightAttenuation.x;
+                Vector3 clusterDir = clusterVec.Normalized();
+                float spotEffect = clusterDir.DotProduct(Vector3(lightDirection.x, lightDirection.y, lightDirection.z));
+                float clusterAtten = Clamp(normal.DotProduct(clusterDir), 0.0f, 1.0f) * Clamp((spotEffect - lightAttenuation.y) *
+                    lightAttenuation.z, 0.0f, 1.0f) * Clamp(1.0f - clusterVec.LengthSquared(), 0.0f, 1.0f);
+
+                Vector3 localDir = -lightVec.Normalized();
+                float expectedAtten = Clamp(normal.DotProduct(localDir), 0.0f, 1.0f) * Clamp(1.0f - distance * distance /
+                    (light->Range() * light->Range()), 0.0f, 1.0f);
+                if (light->GetLightType() == LIGHT_SPOT)
+                {
+                    float cutoff = cosf(light->Fov() * 0.5f * M_DEGTORAD);
+                    expectedAtten *= Clamp((localDir.DotProduct(-light->WorldDirection()) - cutoff) / (1.0f - cutoff), 0.0f,
+                        1.0f);
+                }
+
+                maxError = Max(maxError, Abs(clusterAtten - expectedAtten));
+                if (expectedAtten > 0.0f)
+                    ++numShaded;
+            }
+        }
+        match &= numShaded > 0 && maxError < 0.001f;
+
+        printf("Clustered lighting, %d lights %d clustered: %d draws with light lists %d draws clustered, %d lit points %d shaded "
+            "max error %f: match %d\n", (int)(clusteredLights.Size() + renderer->Lights().Size()), (int)clusteredLights.Size(),
+            (int)draws[0], (int)draws[1], (int)numChecked, (int)numShaded, maxError, match ? 1 : 0);
+        return match;
+    }
+
+    /// Query the octree or the AABB tree of the scene for nodes using a volume.
+    template <class T> void FindNodes(Scene* scene, Vector<OctreeNode*>& result, const T& volume, unsigned short nodeFlags,
+        unsigned layerMask)
+    {
+        Octree* octree = scene->FindChild<Octree>();
+        if (octree)
+            octree->FindNodes(result, volume, nodeFlags, layerMask);
+        else
+            scene->FindChild<AABBTree>()->FindNodes(result, volume, nodeFlags, layerMask);
+    }
+
+    bool TestThreadedTransformUpdates()
+    {
+        // Check that the threaded and serial transform system updates give identical world transforms on a deep hierarchy, which
+        // the threaded update divides between tasks
+        SharedPtr<Scene> scenes[2];
+        Vector<SpatialNode*> nodes[2];
+        for (size_t i = 0; i < 2; ++i)
+        {
+            SetRandomSeed(4);
+            scenes[i] = new Scene();
+            scenes[i]->CreateChild<TransformSystem>()->SetThreadedUpdate(i == 0);
+            for (unsigned j = 0; j < 8; ++j)
+                CreateHierarchy(scenes[i], 9, nodes[i]);
+        }
+
+        TransformSystem* threaded = scenes[0]->FindChild<TransformSystem>();
+        TransformSystem* serial = scenes[1]->FindChild<TransformSystem>();
+        bool match = true;
+
+        for (unsigned i = 0; i < NUM_THREADED_TRANSFORM_FRAMES; ++i)
+        {
+            for (unsigned j = 0; j < 500; ++j)
+            {
+                size_t index = (size_t)Random((int)nodes[0].Size());
+                Vector3 position(Random(-1.0f, 1.0f), Random(-1.0f, 1.0f), Random(-1.0f, 1.0f));
+                Quaternion rotation(Random(360.0f), Random(360.0f), Random(360.0f));
+                float scale = Random(0.9f, 1.1f);
+                for (size_t k = 0; k < 2; ++k)
+                    nodes[k][index]->SetTransform(position, rotation, scale);
+            }
+
+            threaded->Update();
+            serial->Update();
+
+            for (size_t j = 0; j < nodes[0].Size(); ++j)
+            {
+                if (!(nodes[0][j]->WorldTransform() == nodes[1][j]->WorldTransform()))
+                {
+                    match = false;
+                    break;
+                }
+            }
+        }
+
+        printf("Threaded transform update, %d transforms %d frames %d threads: match %d\n", (int)threaded->NumNodes(),
+            NUM_THREADED_TRANSFORM_FRAMES, (int)workQueue->NumThreads(), match ? 1 : 0);
+        return match;
+    }
+
+    /// Create a binary tree of spatial nodes and collect the nodes in creation order.
+    void CreateHierarchy(Node* parent, int depth, Vector<SpatialNode*>& nodes)
+    {
+        SpatialNode* node = parent->CreateChild<SpatialNode>();
+        node->SetTransform(Vector3(Random(-1.0f, 1.0f), Random(-1.0f, 1.0f), Random(-1.0f, 1.0f)), Quaternion(Random(360.0f),
+            Vector3::UP), Random(0.9f, 1.1f));
+        nodes.Push(node);
+
+        if (depth > 1)
+        {
+            CreateHierarchy(node, depth - 1, nodes);
+            CreateHierarchy(node, depth - 1, nodes);
+        }
+    }
+
+    bool TestTransformSystemBatches(const Vector<PassDesc>& passes)
+    {
+        // Spawn, reparent and remove nodes under a transform system across frames, which moves the world transforms in memory.
+        // The batches must still use the current world transforms of the visible geometries
+        SharedPtr<Scene> scene = new Scene();
+        scene->CreateChild<Octree>();
+        scene->CreateChild<TransformSystem>();
+        Camera* camera = scene->CreateChild<Camera>();
+        camera->SetPosition(Vector3(0.0f, 20.0f, -75.0f));
+        camera->SetRotation(Quaternion(20.0f, 0.0f, 0.0f));
+        camera->SetAspectRatio((float)graphics->Width() / (float)graphics->Height());
+
+        Vector<SpatialNode*> groups;
+        for (unsigned i = 0; i < 4; ++i)
+        {
+            SpatialNode* group = scene->CreateChild<SpatialNode>();
+            group->SetPosition(Vector3(-15.0f + 10.0f * i, 0.0f, 0.0f));
+            groups.Push(group);
+        }
+
+        SetRandomSeed(2);
+        Vector<StaticModel*> objects;
+        Vector<Matrix3x4> expected;
+        Vector<Matrix3x4> actual;
+        bool match = true;
+
+        for (unsigned i = 0; i < NUM_TRANSFORM_SYSTEM_FRAMES; ++i)
+        {
+            for (unsigned j = 0; j < 50; ++j)
+            {
+                StaticModel* object = groups[Random((int)groups.Size())]->CreateChild<StaticModel>();
+                object->SetPosition(Vector3(Random(-20.0f, 20.0f), Random(0.0f, 10.0f), Random(0.0f, 40.0f)));
+                object->SetModel(cache->LoadResource<Model>(j & 1 ? "Box.mdl" : "Mushroom.mdl"));
+                object->SetMaterial(cache->LoadResource<Material>(j & 1 ? "Stone.json" : "Mushroom.json"));
+                objects.Push(object);
+            }
+            for (unsigned j = 0; j < 10; ++j)
+            {
+                StaticModel* object = objects[Random((int)objects.Size())];
+                SharedPtr<Node> keep(object);
+                object->SetParent(groups[Random((int)groups.Size())]);
+            }
+            for (unsigned j = 0; j < 30; ++j)
+            {
+                size_t index = Random((int)objects.Size());
+                objects[index]->Parent()->RemoveChild(objects[index]);
+                objects.Erase(index);
+            }
+            groups[i % groups.Size()]->Yaw(10.0f);
+
+            renderer->PrepareView(scene, camera, passes);
+
+            // Each visible geometry has one batch in the opaque pass, as there are no lights
+            expected.Clear();
+            const Vector<GeometryNode*>& geometries = renderer->Geometries();
+            for (auto it = geometries.Begin(); it != geometries.End(); ++it)
+                expected.Push((*it)->WorldTransform());
+
+            actual.Clear();
+            const BatchQueue* queue = renderer->GetBatchQueue("opaque");
+            const Vector<Matrix3x4>& instanceTransforms = renderer->InstanceTransforms();
+            for (auto it = queue->batches.Begin(); it != queue->batches.End(); ++it)
+            {
+                if (it->type == GEOM_INSTANCED)
+                    actual.Push(&instanceTransforms[it->instanceStart], it->instanceCount);
+                else
+                    actual.Push(*it->worldMatrix);
+            }
+
+            Sort(expected.Begin(), expected.End(), CompareTransformPositions);
+            Sort(actual.Begin(), actual.End(), CompareTransformPositions);
+            match &= expected.Size() && expected == actual;
+
+            renderer->RenderShadowMaps();
+            graphics->ResetRenderTargets();
+            graphics->ResetViewport();
+            graphics->Clear(CLEAR_COLOR | CLEAR_DEPTH, Color::BLACK);
+            renderer->RenderBatches(passes);
+            graphics->Present();
+        }
+
+        printf("Transform system batches, %d frames %d objects: match %d\n", NUM_TRANSFORM_SYSTEM_FRAMES, (int)objects.Size(),
+            match ? 1 : 0);
+        return match;
+    }
+
+    bool TestSceneStreamingResources()
+    {
+        // Stream a partition whose models, materials and textures are not loaded. The textures of the materials must be loaded
+        // in the background too, so the main thread should not load any resource synchronously
+        VectorBuffer data;
+        {
+            SharedPtr<Scene> source = new Scene();
+            SpatialNode* root = source->CreateChild<SpatialNode>();
+            for (unsigned i = 0; i < 2; ++i)
+            {
+                StaticModel* object = root->CreateChild<StaticModel>();
+                object->SetModel(cache->LoadResource<Model>(i ? "Box.mdl" : "Mushroom.mdl"));
+                object->SetMaterial(cache->LoadResource<Material>(i ? "Stone.json" : "Mushroom.json"));
+            }
+            root->Save(data);
+        }
+        cache->UnloadResources(Model::TypeStatic(), true);
+        cache->UnloadResources(Material::TypeStatic(), true);
+        cache->UnloadResources(Texture::TypeStatic(), true);
+
+        SharedPtr<Scene> scene = new Scene();
+        scene->CreateChild<Octree>();
+        SceneStreamer* streamer = scene->CreateChild<SceneStreamer>();
+
+        int oldLevel = log->Level();
+        log->SetLevel(LOG_DEBUG);
+        log->SetQuiet(true);
+        SubscribeToEvent(log->logMessageEvent, &HeadlessTest::HandleLogMessage);
+        synchronousLoads = 0;
+
+        SharedPtr<ScenePartition> partition = streamer->Load(new MemoryBuffer(data.Data(), data.Size()));
+        for (unsigned i = 0; i < 10000 && !partition->IsLoaded() && partition->State() != PARTITION_FAILED; ++i)
+        {
+            streamer->Update();
+            Thread::Sleep(1);
+        }
+
+        UnsubscribeFromEvent(log->logMessageEvent);
+        log->SetQuiet(false);
+        log->SetLevel(oldLevel);
+
+        const char* textures[] = { "Mushroom.dds", "StoneDiffuse.dds", "StoneNormal.dds" };
+        size_t numTextures = 0;
+        for (size_t i = 0; i < 3; ++i)
+        {
+            if (cache->FindResource(Texture::TypeStatic(), textures[i]))
+                ++numTextures;
+        }
+        Material* material = static_cast<Material*>(cache->FindResource(Material::TypeStatic(), "Stone.json"));
+        bool match = partition->IsLoaded() && !synchronousLoads && numTextures == 3 && material && material->GetTexture(0) ==
+            cache->FindResource(Texture::TypeStatic(), "StoneDiffuse.dds");
+
+        printf("Scene streaming resources, %d textures: %d synchronous loads match %d\n", (int)numTextures, synchronousLoads,
+            match ? 1 : 0);
+        return match;
+    }
+
+    void HandleLogMessage(LogMessageEvent& event)
+    {
+        if (event.message.Contains("Loading resource "))
+            ++synchronousLoads;
+    }
+
+    void RenderFrame(Scene* scene, Camera* camera, const Vector<PassDesc>& passes, float yaw)
+    {
+        PROFILE(RenderScene);
+
+        camera->SetRotation(Quaternion(20.0f, yaw, 0.0f));
+        renderer->PrepareView(scene, camera, passes);
+        renderer->RenderShadowMaps();
+        graphics->ResetRenderTargets();
+        graphics->ResetViewport();
+        graphics->Clear(CLEAR_COLOR | CLEAR_DEPTH, Color::BLACK);
+        renderer->RenderBatches(passes);
+        graphics->Present();
+    }
+
+    AutoPtr<ResourceCache> cache;
+    AutoPtr<Graphics> graphics;
+    AutoPtr<Renderer> renderer;
+    AutoPtr<Log> log;
+    AutoPtr<Profiler> profiler;
+    AutoPtr<WorkQueue> workQueue;
+    int synchronousLoads;
+};
+
+int main()
+{
+    #ifdef _MSC_VER
+    _CrtSetDbgFlag(_CRTDBG_ALLOC_MEM_DF | _CRTDBG_LEAK_CHECK_DF);
+    #endif
+
+    HeadlessTest test;
+    bool success = test.Run();
+    printf(success ? "All checks passed\n" : "Some checks failed\n");
+
+    return success ? 0 : 1;
+}
@@ -0,0 +1,391 @@
+// For conditions of distribution and use, see copyright notice in License.txt
+
+#include "Turso3D.h"
+#include "Debug/DebugNew.h"
+
+#ifdef _MSC_VER
+#include <crtdbg.h>
+#endif
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+using namespace Turso3D;
+
+/// Benchmark configuration, settable from the command line.
+struct BenchmarkConfig
+{
+    int objects = 10000;
+    int pointLights = 32;
+    int spotLights = 16;
+    int directionalLights = 1;
+    int shadowedLights = 8;
+    int movingObjects = 1000;
+    int occluders = 0;
+    bool occlusion = false;
+    bool aabbTree = false;
+    bool autoResize = false;
+    bool transformSystem = false;
+    float areaScale = 1.0f;
+    int frames = 200;
+    int warmupFrames = 10;
+    int threads = -1;
+    int seed = 1;
+    String output;
+};
+
+/// CPU stages to measure, by profiler block name. CollectObjects includes UpdateTransforms, UpdateOctree or UpdateAABBTree and DrawOccluders, and CollectBatches includes SortBatches.
+static const char* stageNames[] =
+{
+    "UpdateTransforms",
+    "UpdateOctree",
+    "UpdateAABBTree",
+    "DrawOccluders",
+    "CollectObjects",
+    "CollectLightInteractions",
+    "CollectBatches",
+    "SortBatches",
+    nullptr
+};
+
+class RendererBenchmark : public Object
+{
+    OBJECT(RendererBenchmark);
+
+public:
+    void Run(const BenchmarkConfig& config)
+    {
+        #ifndef TURSO3D_PROFILING
+        printf("Error: the renderer benchmark requires profiling to be enabled\n");
+        return;
+        #endif
+
+        RegisterGraphicsLibrary();
+        RegisterResourceLibrary();
+        RegisterRendererLibrary();
+
+        cache = new ResourceCache();
+        cache->AddResourceDir(ExecutableDir() + "Data");
+
+        log = new Log();
+        log->SetLevel(LOG_WARNING);
+        profiler = new Profiler();
+        workQueue = new WorkQueue(config.threads);
+        graphics = new Graphics();
+        renderer = new Renderer();
+
+        if (!graphics->SetMode(IntVector2(1280, 720)))
+            return;
+
+        renderer->SetupShadowMaps(1, 2048, FMT_D16);
+        renderer->SetOcclusionCulling(config.occlusion);
+
+        SharedPtr<Scene> scene = new Scene();
+        if (config.aabbTree)
+            scene->CreateChild<AABBTree>();
+        else
+            scene->CreateChild<Octree>()->SetAutoResize(config.autoResize);
+        if (config.transformSystem)
+            scene->CreateChild<TransformSystem>();
+        Camera* camera = scene->CreateChild<Camera>();
+        camera->SetFarClip(1000.0f);
+        camera->SetAmbientColor(Color(0.1f, 0.1f, 0.1f));
+        camera->SetAspectRatio((float)graphics->Width() / (float)graphics->Height());
+
+        CreateScene(scene, config);
+
+        Vector<PassDesc> passes;
+        passes.Push(PassDesc("opaque", SORT_STATE, true));
+        passes.Push(PassDesc("alpha", SORT_BACK_TO_FRONT, true));
+
+        size_t numStages = 0;
+        while (stageNames[numStages])
+            ++numStages;
+
+        Vector<Vector<float> > stageTimes(numStages);
+        Vector<float> frameTimes;
+        Vector<float> visibleGeometries;
+
+        for (int i = 0; i < config.warmupFrames + config.frames; ++i)
+        {
+            HiresTimer timer;
+            profiler->BeginFrame();
+            UpdateFrame(camera, i);
+            renderer->PrepareView(scene, camera, passes);
+            profiler->EndFrame();
+            long long frameUSec = timer.ElapsedUSec();
+
+            if (i < config.warmupFrames)
+                continue;
+
+            for (size_t j = 0; j < numStages; ++j)
+                stageTimes[j].Push(StageTime(profiler->RootBlock(), stageNames[j]) / 1000.0f);
+            frameTimes.Push(frameUSec / 1000.0f);
+            visibleGeometries.Push((float)renderer->Geometries().Size());
+        }
+
+        JSONValue result;
+        JSONValue& sceneJson = result["scene"];
+        sceneJson["objects"] = config.objects;
+        sceneJson["pointLights"] = config.pointLights;
+        sceneJson["spotLights"] = config.spotLights;
+        sceneJson["directionalLights"] = config.directionalLights;
+        sceneJson["shadowedLights"] = config.shadowedLights;
+        sceneJson["movingObjects"] = config.movingObjects;
+        sceneJson["occluders"] = config.occluders;
+        sceneJson["seed"] = config.seed;
+        result["frames"] = config.frames;
+        result["warmupFrames"] = config.warmupFrames;
+        result["threads"] = (int)workQueue->NumThreads();
+        result["occlusionCulling"] = config.occlusion;
+        result["spatialIndex"] = config.aabbTree ? "AABBTree" : "Octree";
+        result["transformSystem"] = config.transformSystem;
+        if (!config.aabbTree)
+        {
+            Octree* octree = scene->FindChild<Octree>();
+            OctreeStats octreeStats = octree->Stats();
+            JSONValue& octreeJson = result["octree"];
+            octreeJson["autoResize"] = config.autoResize;
+            octreeJson["boundingBox"] = octree->Bounds().ToString();
+            octreeJson["numLevels"] = octree->NumLevels();
+            octreeJson["octants"] = (int)octreeStats.numOctants;
+            octreeJson["rootOverflowNodes"] = (int)octreeStats.numRootOverflowNodes;
+        }
+        result["unit"] = "ms";
+
+        JSONValue& stagesJson = result["stages"];
+        for (size_t j = 0; j < numStages; ++j)
+            stagesJson[stageNames[j]] = Statistics(stageTimes[j]);
+        stagesJson["Frame"] = Statistics(frameTimes);
+        result["visibleGeometries"] = Statistics(visibleGeometries);
+
+        String json = result.ToString();
+        printf("%s\n", json.CString());
+
+        if (config.output.Length())
+        {
+            File file(config.output, FILE_WRITE);
+            if (!file.IsOpen())
+                printf("Error: could not open %s for writing\n", config.output.CString());
+            else
+                file.WriteLine(json);
+        }
+    }
+
+    void CreateScene(Scene* scene, const BenchmarkConfig& config)
+    {
+        SetRandomSeed(config.seed);
+
+        // Scale the area so that object density stays constant regardless of object count
+        float areaSize = sqrtf((float)config.objects) * 5.0f * config.areaScale;
+        float halfSize = 0.5f * areaSize;
+
+        StaticModel* floor = scene->CreateChild<StaticModel>();
+        floor->SetPosition(Vector3(0.0f, -0.1f, 0.0f));
+        floor->SetScale(Vector3(areaSize, 0.1f, areaSize));
+        floor->SetModel(cache->LoadResource<Model>("Box.mdl"));
+        floor->SetMaterial(cache->LoadResource<Material>("Stone.json"));
+
+        for (int i = 0; i < config.objects; ++i)
+        {
+            StaticModel* object = scene->CreateChild<StaticModel>();
+            object->SetPosition(Vector3(Random(-halfSize, halfSize), 1.0f, Random(-halfSize, halfSize)));
+            object->SetRotation(Quaternion(Random(360.0f), Vector3::UP));
+            if (Random() < 0.75f)
+            {
+                object->SetScale(1.5f);
+                object->SetModel(cache->LoadResource<Model>("Mushroom.mdl"));
+                object->SetMaterial(cache->LoadResource<Material>("Mushroom.json"));
+            }
+            else
+            {
+                object->SetScale(Random(0.5f, 2.0f));
+                object->SetModel(cache->LoadResource<Model>("Box.mdl"));
+                object->SetMaterial(cache->LoadResource<Material>("Stone.json"));
+            }
+            object->SetCastShadows(true);
+
+            if (i < config.movingObjects)
+            {
+                movingObjects.Push(object);
+                movingVelocities.Push(Vector3(Random(-5.0f, 5.0f), 0.0f, Random(-5.0f, 5.0f)));
+            }
+        }
+
+        // Occluders are wall-like boxes, which hide the objects behind them when occlusion culling is enabled
+        for (int i = 0; i < config.occluders; ++i)
+        {
+            StaticModel* object = scene->CreateChild<StaticModel>();
+            object->SetPosition(Vector3(Random(-halfSize, halfSize), 4.0f, Random(-halfSize, halfSize)));
+            object->SetRotation(Quaternion(Random(360.0f), Vector3::UP));
+            object->SetScale(Vector3(Random(10.0f, 30.0f), 8.0f, 1.0f));
+            object->SetModel(cache->LoadResource<Model>("Box.mdl"));
+            object->SetMaterial(cache->LoadResource<Material>("Stone.json"));
+            object->SetCastShadows(true);
+            object->SetOccluder(true);
+        }
+
+        int shadowed = 0;
+
+        for (int i = 0; i < config.directionalLights; ++i)
+        {
+            Light* light = scene->CreateChild<Light>();
+            light->SetLightType(LIGHT_DIRECTIONAL);
+            light->SetColor(Color(0.5f, 0.5f, 0.5f));
+            light->SetDirection(Vector3(Random(-1.0f, 1.0f), -1.0f, Random(-1.0f, 1.0f)));
+            light->SetCastShadows(shadowed++ < config.shadowedLights);
+        }
+
+        for (int i = 0; i < config.pointLights + config.spotLights; ++i)
+        {
+            Light* light = scene->CreateChild<Light>();
+            Vector3 colorVec = 2.0f * Vector3(Random(), Random(), Random()).Normalized();
+            light->SetColor(Color(colorVec.x, colorVec.y, colorVec.z));
+            light->SetPosition(Vector3(Random(-halfSize, halfSize), 7.0f, Random(-halfSize, halfSize)));
+            if (i < config.pointLights)
+            {
+                light->SetLightType(LIGHT_POINT);
+                light->SetRange(20.0f);
+                light->SetShadowMapSize(256);
+            }
+            else
+            {
+                light->SetLightType(LIGHT_SPOT);
+                light->SetRange(30.0f);
+                light->SetFov(60.0f);
+                light->SetDirection(Vector3(Random(-0.5f, 0.5f), -1.0f, Random(-0.5f, 0.5f)));
+                light->SetShadowMapSize(512);
+            }
+            light->SetCastShadows(shadowed++ < config.shadowedLights);
+        }
+
+        areaHalfSize = halfSize;
+    }
+
+    void UpdateFrame(Camera* camera, int frameNumber)
+    {
+        // Use a fixed timestep so that every run sees the same object movement
+        const float timeStep = 1.0f / 60.0f;
+
+        for (size_t i = 0; i < movingObjects.Size(); ++i)
+        {
+            StaticModel* object = movingObjects[i];
+            Vector3 position = object->Position() + movingVelocities[i] * timeStep;
+            if (position.x < -areaHalfSize || position.x > areaHalfSize)
+                movingVelocities[i].x = -movingVelocities[i].x;
+            if (position.z < -areaHalfSize || position.z > areaHalfSize)
+                movingVelocities[i].z = -movingVelocities[i].z;
+            object->SetPosition(position);
+        }
+
+        float yaw = 0.5f * frameNumber;
+        camera->SetPosition(Vector3(0.0f, 20.0f, 0.0f));
+        camera->SetRotation(Quaternion(20.0f, yaw, 0.0f));
+    }
+
+    static long long StageTime(const ProfilerBlock* block, const char* name)
+    {
+        long long time = strcmp(block->name, name) ? 0 : block->frameTime;
+        for (auto it = block->children.Begin(); it != block->children.End(); ++it)
+            time += StageTime(*it, name);
+        return time;
+    }
+
+    static JSONValue Statistics(Vector<float>& times)
+    {
+        JSONValue ret;
+        if (times.IsEmpty())
+            return ret;
+
+        Sort(times.Begin(), times.End());
+        size_t p99Index = (times.Size() * 99 + 99) / 100 - 1;
+        float sum = 0.0f;
+        for (auto it = times.Begin(); it != times.End(); ++it)
+            sum += *it;
+
+        ret["min"] = times[0];
+        ret["median"] = times[times.Size() / 2];
+        ret["p99"] = times[p99Index];
+        ret["max"] = times.Back();
+        ret["mean"] = sum / times.Size();
+        return ret;
+    }
+
+    AutoPtr<ResourceCache> cache;
+    AutoPtr<Graphics> graphics;
+    AutoPtr<Renderer> renderer;
+    AutoPtr<Log> log;
+    AutoPtr<Profiler> profiler;
+    AutoPtr<WorkQueue> workQueue;
+    Vector<StaticModel*> movingObjects;
+    Vector<Vector3> movingVelocities;
+    float areaHalfSize;
+};
+
+int main(int argc, char** argv)
+{
+    #ifdef _MSC_VER
+    _CrtSetDbgFlag(_CRTDBG_ALLOC_MEM_DF | _CRTDBG_LEAK_CHECK_DF);
+    #endif
+
+    BenchmarkConfig config;
+    const Vector<String>& arguments = ParseArguments(argc, argv);
+    bool valid = arguments.Size() % 2 == 0;
+
+    for (size_t i = 0; valid && i < arguments.Size(); i += 2)
+    {
+        const String& name = arguments[i];
+        const String& value = arguments[i + 1];
+
+        if (name == "-objects")
+            config.objects = value.ToInt();
+        else if (name == "-pointlights")
+            config.pointLights = value.ToInt();
+        else if (name == "-spotlights")
+            config.spotLights = value.ToInt();
+        else if (name == "-dirlights")
+            config.directionalLights = value.ToInt();
+        else if (name == "-shadowed")
+            config.shadowedLights = value.ToInt();
+        else if (name == "-moving")
+            config.movingObjects = value.ToInt();
+        else if (name == "-occluders")
+            config.occluders = value.ToInt();
+        else if (name == "-occlusion")
+            config.occlusion = value.ToInt() != 0;
+        else if (name == "-aabbtree")
+            config.aabbTree = value.ToInt() != 0;
+        else if (name == "-autoresize")
+            config.autoResize = value.ToInt() != 0;
+        else if (name == "-transforms")
+            config.transformSystem = value.ToInt() != 0;
+        else if (name == "-areascale")
+            config.areaScale = value.ToFloat();
+        else if (name == "-frames")
+            config.frames = value.ToInt();
+        else if (name == "-warmup")
+            config.warmupFrames = value.ToInt();
+        else if (name == "-threads")
+            config.threads = value.ToInt();
+        else if (name == "-seed")
+            config.seed = value.ToInt();
+        else if (name == "-output")
+            config.output = value;
+        else
+            valid = false;
+    }
+
+    if (!valid)
+    {
+        printf("Usage: 10_RendererBenchmark [-objects n] [-pointlights n] [-spotlights n] [-dirlights n] [-shadowed n] "
+            "[-moving n] [-occluders n] [-occlusion 0|1] [-aabbtree 0|1] [-autoresize 0|1] [-transforms 0|1] [-areascale n] "
+            "[-frames n] [-warmup n] [-threads n] [-seed n] [-output file]\n");
+        return 1;
+    }
+
+    RendererBenchmark benchmark;
+    benchmark.Run(config);
+
+    return 0;
+}
@@ -0,0 +1,374 @@
+// For conditions of distribution and use, see copyright notice in License.txt
+
+#include "Turso3D.h"
+#include "Debug/DebugNew.h"
+
+#ifdef _MSC_VER
+#include <crtdbg.h>
+#endif
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+using namespace Turso3D;
+
+/// Number of queries of each kind per round.
+const size_t NUM_QUERIES = 64;
+/// Number of query kinds.
+const size_t NUM_QUERY_KINDS = 6;
+/// Number of rays in a ray packet query.
+const size_t NUM_PACKET_RAYS = 32;
+/// Number of nearest nodes to find.
+const size_t NUM_NEAREST = 8;
+
+/// Stress test configuration, settable from the command line.
+struct StressConfig
+{
+    int objects = 20000;
+    int rounds = 10;
+    int repeats = 2;
+    int threads = -1;
+};
+
+/// Query results of one task.
+struct QueryTaskResult
+{
+    /// Index of the first query to run, so that the tasks run different queries at the same time.
+    size_t startQuery;
+    /// Number of queries run.
+    size_t numQueries;
+    /// Number of results that differed from the main thread's.
+    size_t numMismatches;
+};
+
+/// Combine a value into a checksum.
+inline void Combine(unsigned long long& checksum, unsigned long long value)
+{
+    checksum = (checksum ^ value) * 1099511628211ULL;
+}
+
+/// Combine a float into a checksum by its bits.
+inline void Combine(unsigned long long& checksum, float value)
+{
+    unsigned bits;
+    memcpy(&bits, &value, sizeof bits);
+    Combine(checksum, (unsigned long long)bits);
+}
+
+/// Combine a node into a checksum by its id.
+inline void Combine(unsigned long long& checksum, OctreeNode* node)
+{
+    Combine(checksum, (unsigned long long)(node ? node->Id() + 1 : 0));
+}
+
+class ConcurrentQueryTest : public Object
+{
+    OBJECT(ConcurrentQueryTest);
+
+public:
+    /// Run the test. Return true if all queries from the worker threads matched the main thread's results.
+    bool Run(const StressConfig& config)
+    {
+        RegisterRendererLibrary();
+
+        log = new Log();
+        profiler = new Profiler();
+        // Use several worker threads even on machines with few cores, as the point is to run the queries concurrently
+        workQueue = new WorkQueue(config.threads >= 0 ? config.threads : Max((int)Thread::NumCPUCores() - 1, 3));
+
+        SharedPtr<Scene> scene = new Scene();
+        octree = scene->CreateChild<Octree>();
+
+        SetRandomSeed(1);
+        Vector<Light*> lights;
+        for (int i = 0; i < config.objects; ++i)
+        {
+            Light* light = scene->CreateChild<Light>();
+            light->SetLightType(i % 5 ? LIGHT_POINT : LIGHT_SPOT);
+            light->SetRange(Random(0.5f, 10.0f));
+            light->SetPosition(Vector3(Random(-900.0f, 900.0f), Random(-50.0f, 50.0f), Random(-900.0f, 900.0f)));
+            light->SetRotation(Quaternion(Random(-90.0f, 90.0f), Random(360.0f), 0.0f));
+            light->SetLayer(i % 3);
+            lights.Push(light);
+        }
+
+        size_t numTasks = (workQueue->NumThreads() + 1) * 2;
+        Vector<AutoPtr<MemberFunctionTask<ConcurrentQueryTest> > > tasks;
+        Vector<QueryTaskResult> taskResults(numTasks);
+        for (size_t i = 0; i < numTasks; ++i)
+            tasks.Push(new MemberFunctionTask<ConcurrentQueryTest>(this, &ConcurrentQueryTest::QueryWork));
+
+        repeats = config.repeats;
+        size_t totalQueries = 0;
+        size_t totalMismatches = 0;
+        HiresTimer timer;
+
+        for (int round = 0; round < config.rounds; ++round)
+        {
+            profiler->BeginFrame();
+
+            // Modify the scene and update the octree while no queries are running
+            for (size_t i = round % 10; i < lights.Size(); i += 10)
+                lights[i]->Translate(Vector3(Random(-5.0f, 5.0f), Random(-1.0f, 1.0f), Random(-5.0f, 5.0f)));
+            octree->Update();
+
+            GenerateQueries();
+            for (size_t i = 0; i < NUM_QUERIES * NUM_QUERY_KINDS; ++i)
+                expected[i] = RunQuery(i, mainBuffers);
+
+            for (size_t i = 0; i < numTasks; ++i)
+            {
+                QueryTaskResult& result = taskResults[i];
+                result.startQuery = i * NUM_QUERIES * NUM_QUERY_KINDS / numTasks;
+                result.numQueries = 0;
+                result.numMismatches = 0;
+                tasks[i]->start = &result;
+                workQueue->AddTask(tasks[i]);
+            }
+            workQueue->Complete();
+
+            for (size_t i = 0; i < numTasks; ++i)
+            {
+                totalQueries += taskResults[i].numQueries;
+                totalMismatches += taskResults[i].numMismatches;
+            }
+
+            profiler->EndFrame();
+        }
+
+        printf("%d worker threads, %d tasks, %d rounds: %d queries %d mismatches in %d msec\n", (int)workQueue->NumThreads(),
+            (int)numTasks, config.rounds, (int)totalQueries, (int)totalMismatches, (int)(timer.ElapsedUSec() / 1000));
+        printf("%s", profiler->OutputResults(false, true).CString());
+
+        return totalMismatches == 0 && TestManyOctrees();
+    }
+
+    /// Query more octrees than there are thread local storage keys from all threads at once. Return true if all results were correct.
+    bool TestManyOctrees()
+    {
+        const size_t numOctrees = 2000;
+
+        Vector<SharedPtr<Scene> > scenes;
+        for (size_t i = 0; i < numOctrees; ++i)
+        {
+            Scene* scene = new Scene();
+            scenes.Push(SharedPtr<Scene>(scene));
+            manyOctrees.Push(scene->CreateChild<Octree>());
+            Light* light = scene->CreateChild<Light>();
+            light->SetRange(Random(0.5f, 10.0f));
+            light->SetPosition(Vector3(Random(-900.0f, 900.0f), 0.0f, Random(-900.0f, 900.0f)));
+            manyOctreeNodes.Push(light);
+            manyOctrees.Back()->Update();
+        }
+
+        size_t numTasks = (workQueue->NumThreads() + 1) * 2;
+        Vector<AutoPtr<MemberFunctionTask<ConcurrentQueryTest> > > tasks;
+        Vector<QueryTaskResult> taskResults(numTasks);
+        for (size_t i = 0; i < numTasks; ++i)
+        {
+            tasks.Push(new MemberFunctionTask<ConcurrentQueryTest>(this, &ConcurrentQueryTest::ManyOctreesWork));
+            taskResults[i].startQuery = i * numOctrees / numTasks;
+            taskResults[i].numQueries = 0;
+            taskResults[i].numMismatches = 0;
+            tasks[i]->start = &taskResults[i];
+            workQueue->AddTask(tasks[i]);
+        }
+        workQueue->Complete();
+
+        size_t totalQueries = 0;
+        size_t totalMismatches = 0;
+        for (size_t i = 0; i < numTasks; ++i)
+        {
+            totalQueries += taskResults[i].numQueries;
+            totalMismatches += taskResults[i].numMismatches;
+        }
+
+        printf("%d octrees: %d queries %d mismatches\n", (int)numOctrees, (int)totalQueries, (int)totalMismatches);
+        manyOctrees.Clear();
+        manyOctreeNodes.Clear();
+        return totalMismatches == 0;
+    }
+
+    /// Work function for raycasting each octree from above its only node and finding the nearest node to it, starting from a different octree in each task.
+    void ManyOctreesWork(Task* task, unsigned)
+    {
+        QueryTaskResult* result = reinterpret_cast<QueryTaskResult*>(task->start);
+        Vector<NearestResult> nearestResults;
+
+        for (int i = 0; i < repeats; ++i)
+        {
+            for (size_t j = 0; j < manyOctrees.Size(); ++j)
+            {
+                size_t index = (result->startQuery + j) % manyOctrees.Size();
+                Octree* octree = manyOctrees[index];
+                OctreeNode* node = manyOctreeNodes[index];
+                Vector3 position = node->WorldPosition();
+
+                RaycastResult hit = octree->RaycastSingle(Ray(position + Vector3(0.0f, 100.0f, 0.0f), Vector3::DOWN), NF_ENABLED);
+                octree->FindNearest(nearestResults, position, 1, NF_ENABLED);
+                if (hit.node != node || nearestResults.Size() != 1 || nearestResults[0].node != node)
+                    ++result->numMismatches;
+                ++result->numQueries;
+            }
+        }
+    }
+
+    /// Work function for running all the queries of a round in a worker thread and comparing to the main thread's results.
+    void QueryWork(Task* task, unsigned)
+    {
+        QueryTaskResult* result = reinterpret_cast<QueryTaskResult*>(task->start);
+        ThreadResults buffers;
+
+        PROFILE(QueryWork);
+
+        size_t numQueries = NUM_QUERIES * NUM_QUERY_KINDS;
+        for (int i = 0; i < repeats; ++i)
+        {
+            for (size_t j = 0; j < numQueries; ++j)
+            {
+                size_t index = (result->startQuery + j) % numQueries;
+                if (RunQuery(index, buffers) != expected[index])
+                    ++result->numMismatches;
+                ++result->numQueries;
+            }
+        }
+    }
+
+private:
+    /// Query results of one thread.
+    struct ThreadResults
+    {
+        /// Node query results.
+        Vector<OctreeNode*> nodes;
+        /// Raycast results.
+        Vector<RaycastResult> raycastResults;
+        /// Ray packet results.
+        RaycastResult packetResults[NUM_PACKET_RAYS];
+        /// Nearest node results.
+        Vector<NearestResult> nearestResults;
+    };
+
+    /// Generate the queries of a round.
+    void GenerateQueries()
+    {
+        for (size_t i = 0; i < NUM_QUERIES; ++i)
+        {
+            Vector3 position(Random(-900.0f, 900.0f), Random(-20.0f, 20.0f), Random(-900.0f, 900.0f));
+            frusta[i].Define(Random(30.0f, 90.0f), 1.5f, 1.0f, 0.1f, Random(50.0f, 300.0f), Matrix3x4(position, Quaternion(Random(-30.0f,
+                30.0f), Random(360.0f), 0.0f), Vector3::ONE));
+            spheres[i] = Sphere(position, Random(5.0f, 100.0f));
+            rays[i] = Ray(position, Vector3(Random(-1.0f, 1.0f), Random(-0.1f, 0.1f), Random(-1.0f, 1.0f)));
+            for (size_t j = 0; j < NUM_PACKET_RAYS; ++j)
+                packetRays[i][j] = Ray(position, Vector3(1.0f, Random(-0.05f, 0.05f), Random(-0.5f, 0.5f)));
+            nearestPositions[i] = position;
+            layerMasks[i] = i % 4 ? LAYERMASK_ALL : 1u << (i % 3);
+        }
+    }
+
+    /// Run a query by index and return the checksum of its results.
+    unsigned long long RunQuery(size_t index, ThreadResults& buffers)
+    {
+        size_t i = index % NUM_QUERIES;
+        unsigned long long checksum = 14695981039346656037ULL;
+
+        switch (index / NUM_QUERIES)
+        {
+        case 0:
+            buffers.nodes.Clear();
+            octree->FindNodes(buffers.nodes, frusta[i], NF_ENABLED, layerMasks[i]);
+            for (auto it = buffers.nodes.Begin(); it != buffers.nodes.End(); ++it)
+                Combine(checksum, *it);
+            break;
+
+        case 1:
+            buffers.nodes.Clear();
+            octree->FindNodes(buffers.nodes, spheres[i], NF_ENABLED, layerMasks[i]);
+            for (auto it = buffers.nodes.Begin(); it != buffers.nodes.End(); ++it)
+                Combine(checksum, *it);
+            break;
+
+        case 2:
+            octree->Raycast(buffers.raycastResults, rays[i], NF_ENABLED, 500.0f, layerMasks[i]);
+            for (auto it = buffers.raycastResults.Begin(); it != buffers.raycastResults.End(); ++it)
+                Combine(checksum, it->distance);
+            break;
+
+        case 3:
+            {
+                RaycastResult result = octree->RaycastSingle(rays[i], NF_ENABLED, 500.0f, layerMasks[i]);
+                Combine(checksum, result.node);
+                Combine(checksum, result.distance);
+            }
+            break;
+
+        case 4:
+            octree->RaycastSingle(buffers.packetResults, packetRays[i], NUM_PACKET_RAYS, NF_ENABLED, 500.0f, layerMasks[i]);
+            for (size_t j = 0; j < NUM_PACKET_RAYS; ++j)
+                Combine(checksum, buffers.packetResults[j].distance);
+            break;
+
+        default:
+            octree->FindNearest(buffers.nearestResults, nearestPositions[i], NUM_NEAREST, NF_ENABLED, M_INFINITY, layerMasks[i]);
+            for (auto it = buffers.nearestResults.Begin(); it != buffers.nearestResults.End(); ++it)
+                Combine(checksum, it->distance);
+            break;
+        }
+
+        return checksum;
+    }
+
+    AutoPtr<Log> log;
+    AutoPtr<Profiler> profiler;
+    AutoPtr<WorkQueue> workQueue;
+    Octree* octree;
+    /// Octrees of the many octrees test.
+    Vector<Octree*> manyOctrees;
+    /// Only node of each octree in the many octrees test.
+    Vector<OctreeNode*> manyOctreeNodes;
+    int repeats;
+    Frustum frusta[NUM_QUERIES];
+    Sphere spheres[NUM_QUERIES];
+    Ray rays[NUM_QUERIES];
+    Ray packetRays[NUM_QUERIES][NUM_PACKET_RAYS];
+    Vector3 nearestPositions[NUM_QUERIES];
+    unsigned layerMasks[NUM_QUERIES];
+    unsigned long long expected[NUM_QUERIES * NUM_QUERY_KINDS];
+    ThreadResults mainBuffers;
+};
+
+int main(int argc, char** argv)
+{
+    #ifdef _MSC_VER
+    _CrtSetDbgFlag(_CRTDBG_ALLOC_MEM_DF | _CRTDBG_LEAK_CHECK_DF);
+    #endif
+
+    StressConfig config;
+    const Vector<String>& arguments = ParseArguments(argc, argv);
+
+    for (size_t i = 0; i + 1 < arguments.Size(); i += 2)
+    {
+        const String& name = arguments[i];
+        const String& value = arguments[i + 1];
+
+        if (name == "-objects")
+            config.objects = value.ToInt();
+        else if (name == "-rounds")
+            config.rounds = value.ToInt();
+        else if (name == "-repeats")
+            config.repeats = value.ToInt();
+        else if (name == "-threads")
+            config.threads = value.ToInt();
+        else
+        {
+            printf("Usage: 11_ConcurrentQueries [-objects n] [-rounds n] [-repeats n] [-threads n]\n");
+            return 1;
+        }
+    }
+
+    ConcurrentQueryTest test;
+    bool success = test.Run(config);
+    printf(success ? "All queries matched\n" : "Queries from worker threads did not match\n");
+
+    return success ? 0 : 1;
+}
@@ -104,6 +104,9 @@ public:
         AllocatorUninitialize(allocator);
         allocator = nullptr;
     }
+
+    /// Return number of objects the allocated blocks can hold.
+    size_t Capacity() const { return allocator ? allocator->capacity : 0; }
     
 private:
     /// Prevent copy construction.
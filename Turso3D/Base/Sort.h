@@ -9,6 +9,8 @@ namespace Turso3D
 {
 
 static const int QUICKSORT_THRESHOLD = 16;
+static const size_t RADIX_SORT_BITS = 8;
+static const size_t RADIX_SORT_BUCKETS = 1 << RADIX_SORT_BITS;
 
 // Based on Comparison of several sorting algorithms by Juha Nieminen
 // http://warp.povusers.org/SortComparison/
@@ -121,4 +123,65 @@ template <class T, class U> void Sort(RandomAccessIterator<T> begin, RandomAcces
     InsertionSort(begin, end, compare);
 }
 
+/// Unsigned integer key and index pair for radix sorting.
+template <class T> struct RadixSortPair
+{
+    /// Sort key.
+    T key;
+    /// Index of the sorted element.
+    unsigned index;
+};
+
+/// Perform a stable least significant digit radix sort on key and index pairs, using a temporary buffer of the same size. Digits that are equal in all keys are skipped. Return the buffer that holds the sorted pairs, which is either the original or the temporary buffer.
+template <class T> RadixSortPair<T>* RadixSort(RadixSortPair<T>* pairs, RadixSortPair<T>* temp, size_t count)
+{
+    static const size_t NUM_DIGITS = sizeof(T) * 8 / RADIX_SORT_BITS;
+    static const T DIGIT_MASK = RADIX_SORT_BUCKETS - 1;
+
+    if (count < 2)
+        return pairs;
+
+    // Build the histograms of all digits in one pass
+    size_t counts[NUM_DIGITS][RADIX_SORT_BUCKETS];
+    for (size_t i = 0; i < NUM_DIGITS; ++i)
+    {
+        for (size_t j = 0; j < RADIX_SORT_BUCKETS; ++j)
+            counts[i][j] = 0;
+    }
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        T key = pairs[i].key;
+        for (size_t j = 0; j < NUM_DIGITS; ++j)
+            ++counts[j][(key >> (j * RADIX_SORT_BITS)) & DIGIT_MASK];
+    }
+
+    RadixSortPair<T>* src = pairs;
+    RadixSortPair<T>* dest = temp;
+
+    for (size_t i = 0; i < NUM_DIGITS; ++i)
+    {
+        size_t shift = i * RADIX_SORT_BITS;
+        size_t* digitCounts = counts[i];
+        if (digitCounts[(src[0].key >> shift) & DIGIT_MASK] == count)
+            continue;
+
+        // Convert counts to bucket start offsets
+        size_t offset = 0;
+        for (size_t j = 0; j < RADIX_SORT_BUCKETS; ++j)
+        {
+            size_t digitCount = digitCounts[j];
+            digitCounts[j] = offset;
+            offset += digitCount;
+        }
+
+        for (size_t j = 0; j < count; ++j)
+            dest[digitCounts[(src[j].key >> shift) & DIGIT_MASK]++] = src[j];
+
+        Swap(src, dest);
+    }
+
+    return src;
+}
+
 }
@@ -154,6 +154,8 @@ public:
     void Push(const T& value) { Resize(Size() + 1, &value); }
     /// Add another vector at the end.
     void Push(const Vector<T>& vector) { Resize(Size() + vector.Size(), vector.Buffer()); }
+    /// Add elements at the end.
+    void Push(const T* values, size_t count) { Resize(Size() + count, values); }
 
     /// Remove the last element.
     void Pop()
@@ -14,6 +14,9 @@ namespace Turso3D
 static const int LINE_MAX_LENGTH = 256;
 static const int NAME_MAX_LENGTH = 30;
 
+// Non-null in the threads that have disabled profiling
+static ThreadLocalValue threadProfilingDisabled;
+
 ProfilerBlock::ProfilerBlock(ProfilerBlock* parent_, const char* name_) :
     name(name_),
     parent(parent_),
@@ -118,23 +121,42 @@ Profiler::~Profiler()
 
 void Profiler::BeginBlock(const char* name)
 {
-    // Currently profiling is a no-op if attempted from outside main thread
-    if (!Thread::IsMainThread())
-        return;
-    
-    current = current->FindOrCreateChild(name);
-    current->Begin();
+    if (Thread::IsMainThread())
+    {
+        current = current->FindOrCreateChild(name);
+        current->Begin();
+    }
+    else
+    {
+        ProfilerBlock* block = ThreadCurrentBlock();
+        if (!block)
+            return;
+
+        block = block->FindOrCreateChild(name);
+        block->Begin();
+        threadCurrent.SetValue(block);
+    }
 }
 
 void Profiler::EndBlock()
 {
-    if (!Thread::IsMainThread())
-        return;
-    
-    if (current != root)
+    if (Thread::IsMainThread())
+    {
+        if (current != root)
+        {
+            current->End();
+            current = current->parent;
+        }
+    }
+    else
     {
-        current->End();
-        current = current->parent;
+        ProfilerBlock* block = ThreadCurrentBlock();
+        // The thread's root block has no parent
+        if (block && block->parent)
+        {
+            block->End();
+            threadCurrent.SetValue(block->parent);
+        }
     }
 }
 
@@ -155,15 +177,28 @@ void Profiler::EndFrame()
         ++totalFrames;
         root->EndFrame();
         current = root;
+
+        MutexLock lock(threadsMutex);
+        for (auto it = threads.Begin(); it != threads.End(); ++it)
+            (*it)->root->EndFrame();
     }
 }
 
 void Profiler::BeginInterval()
 {
     root->BeginInterval();
+
+    MutexLock lock(threadsMutex);
+    for (auto it = threads.Begin(); it != threads.End(); ++it)
+        (*it)->root->BeginInterval();
     intervalFrames = 0;
 }
 
+void Profiler::SetThreadProfiling(bool enable)
+{
+    threadProfilingDisabled.SetValue(enable ? nullptr : &threadProfilingDisabled);
+}
+
 String Profiler::OutputResults(bool showUnused, bool showTotal, size_t maxDepth) const
 {
     String output;
@@ -179,12 +214,43 @@ String Profiler::OutputResults(bool showUnused, bool showTotal, size_t maxDepth)
     if (!maxDepth)
         maxDepth = 1;
 
-    OutputResults(root, output, 0, maxDepth, showUnused, showTotal);
+    OutputResults(root, root, output, 0, maxDepth, showUnused, showTotal);
+
+    // Output the other threads' blocks after a line with the thread name
+    MutexLock lock(threadsMutex);
+    for (auto it = threads.Begin(); it != threads.End(); ++it)
+    {
+        output += "\n" + (*it)->name + "\n\n";
+        OutputResults((*it)->root, (*it)->root, output, 0, maxDepth, showUnused, showTotal);
+    }
 
     return output;
 }
 
-void Profiler::OutputResults(ProfilerBlock* block, String& output, size_t depth, size_t maxDepth, bool showUnused, bool showTotal) const
+ProfilerBlock* Profiler::ThreadCurrentBlock()
+{
+    if (!threadCurrent.Valid() || threadProfilingDisabled.Value())
+        return nullptr;
+
+    ProfilerBlock* block = static_cast<ProfilerBlock*>(threadCurrent.Value());
+    if (!block)
+    {
+        MutexLock lock(threadsMutex);
+
+        AutoPtr<ProfilerThread> thread(new ProfilerThread());
+        thread->name = "Thread" + String((int)threads.Size() + 1);
+        thread->root = new ProfilerBlock(nullptr, thread->name.CString());
+        block = thread->root;
+        threads.Push(thread);
+
+        threadCurrent.SetValue(block);
+    }
+
+    return block;
+}
+
+void Profiler::OutputResults(ProfilerBlock* block, ProfilerBlock* rootBlock, String& output, size_t depth, size_t maxDepth,
+    bool showUnused, bool showTotal) const
 {
     char line[LINE_MAX_LENGTH];
     char indentedName[LINE_MAX_LENGTH];
@@ -197,7 +263,7 @@ void Profiler::OutputResults(ProfilerBlock* block, String& output, size_t depth,
         return;
 
     // Do not print the root block as it does not collect any actual data
-    if (block != root)
+    if (block != rootBlock)
     {
         if (showUnused || block->intervalCount || (showTotal && block->totalCount))
         {
@@ -238,7 +304,7 @@ void Profiler::OutputResults(ProfilerBlock* block, String& output, size_t depth,
     }
 
     for (auto it = block->children.Begin(); it != block->children.End(); ++it)
-        OutputResults(*it, output, depth, maxDepth, showUnused, showTotal);
+        OutputResults(*it, rootBlock, output, depth, maxDepth, showUnused, showTotal);
 }
 
 }
@@ -6,6 +6,8 @@
 #include "../Base/String.h"
 #include "../Math/Math.h"
 #include "../Object/Object.h"
+#include "../Thread/Mutex.h"
+#include "../Thread/ThreadLocalValue.h"
 #include "../Thread/Timer.h"
 
 namespace Turso3D
@@ -65,7 +67,16 @@ public:
     unsigned totalCount;
 };
 
-/// Hierarchical performance profiler subsystem.
+/// Profiling block tree of a thread other than the main thread.
+struct TURSO3D_API ProfilerThread
+{
+    /// Thread name, which is the name of the root block.
+    String name;
+    /// Root profiling block.
+    AutoPtr<ProfilerBlock> root;
+};
+
+/// Hierarchical performance profiler subsystem. Threads other than the main thread profile into their own block trees, which are output after the main thread's. Frames should be begun and ended, and results output, only when other threads are not profiling, for example after WorkQueue::Complete(). Threads that can not follow this should disable profiling with SetThreadProfiling().
 class TURSO3D_API Profiler : public Object
 {
     OBJECT(Profiler);
@@ -76,9 +87,9 @@ public:
     /// Destruct.
     ~Profiler();
 
-    /// Begin a profiling block. The name must be persistent; string literals are recommended.
+    /// Begin a profiling block in the calling thread. The name must be persistent; string literals are recommended.
     void BeginBlock(const char* name);
-    /// End the current profiling block.
+    /// End the calling thread's current profiling block.
     void EndBlock();
     /// Begin the next profiling frame.
     void BeginFrame();
@@ -86,22 +97,36 @@ public:
     void EndFrame();
     /// Begin a profiler interval.
     void BeginInterval();
+    /// Set whether the calling thread profiles. Has no effect on the main thread. Enabled by default. Threads that run while the main thread begins and ends frames should disable profiling.
+    static void SetThreadProfiling(bool enable);
 
     /// Output results into a string.
     String OutputResults(bool showUnused = false, bool showTotal = false, size_t maxDepth = M_MAX_UNSIGNED) const;
-    /// Return the current profiling block.
+    /// Return the main thread's current profiling block.
     const ProfilerBlock* CurrentBlock() const { return current; }
-    /// Return the root profiling block.
+    /// Return the main thread's root profiling block.
     const ProfilerBlock* RootBlock() const { return root; }
+    /// Return number of other threads that have profiled.
+    size_t NumThreads() const { return threads.Size(); }
+    /// Return the root profiling block of another thread by index.
+    const ProfilerBlock* ThreadRootBlock(size_t index) const { return index < threads.Size() ? threads[index]->root.Get() : nullptr; }
 
 private:
+    /// Return the calling thread's current profiling block, which is thread-local for threads other than the main thread. Create the thread's block tree if necessary.
+    ProfilerBlock* ThreadCurrentBlock();
     /// Output results recursively.
-    void OutputResults(ProfilerBlock* block, String& output, size_t depth, size_t maxDepth, bool showUnused, bool showTotal) const;
+    void OutputResults(ProfilerBlock* block, ProfilerBlock* rootBlock, String& output, size_t depth, size_t maxDepth, bool showUnused, bool showTotal) const;
 
-    /// Current profiling block.
+    /// Main thread's current profiling block.
     ProfilerBlock* current;
-    /// Root profiling block.
+    /// Main thread's root profiling block.
     AutoPtr<ProfilerBlock> root;
+    /// Block trees of the other threads.
+    Vector<AutoPtr<ProfilerThread> > threads;
+    /// Current profiling block of the other threads.
+    ThreadLocalValue threadCurrent;
+    /// Mutex for adding and iterating the other threads' block trees.
+    mutable Mutex threadsMutex;
     /// Frames in the current interval.
     size_t intervalFrames;
     /// Total frames since start.
@@ -9,4 +9,7 @@
 #endif
 #ifdef TURSO3D_OPENGL
     #include "GL/GLConstantBuffer.h"
+#endif
+#ifdef TURSO3D_NULL
+    #include "Null/NullConstantBuffer.h"
 #endif
\ No newline at end of file
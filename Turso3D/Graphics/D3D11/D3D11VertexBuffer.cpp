@@ -45,7 +45,7 @@ void VertexBuffer::Release()
     }
 }
 
-bool VertexBuffer::SetData(size_t firstVertex, size_t numVertices_, const void* data)
+bool VertexBuffer::SetData(size_t firstVertex, size_t numVertices_, const void* data, bool discard)
 {
     PROFILE(UpdateVertexBuffer);
 
@@ -77,7 +77,8 @@ bool VertexBuffer::SetData(size_t firstVertex, size_t numVertices_, const void*
             D3D11_MAPPED_SUBRESOURCE mappedData;
             mappedData.pData = nullptr;
 
-            d3dDeviceContext->Map((ID3D11Buffer*)buffer, 0, D3D11_MAP_WRITE_DISCARD, 0, &mappedData);
+            d3dDeviceContext->Map((ID3D11Buffer*)buffer, 0, discard ? D3D11_MAP_WRITE_DISCARD : D3D11_MAP_WRITE_NO_OVERWRITE, 0,
+                &mappedData);
             if (mappedData.pData)
             {
                 memcpy((unsigned char*)mappedData.pData + firstVertex * vertexSize, data, numVertices_ * vertexSize);
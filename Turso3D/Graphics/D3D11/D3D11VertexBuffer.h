@@ -26,8 +26,8 @@ public:
     bool Define(ResourceUsage usage, size_t numVertices, const Vector<VertexElement>& elements, bool useShadowData, const void* data = nullptr);
     /// Define buffer. Immutable buffers must specify initial data here. Return true on success.
     bool Define(ResourceUsage usage, size_t numVertices, size_t numElements, const VertexElement* elements, bool useShadowData, const void* data = nullptr);
-    /// Redefine buffer data either completely or partially. Not supported for immutable buffers. Return true on success.
-    bool SetData(size_t firstVertex, size_t numVertices, const void* data);
+    /// Redefine buffer data either completely or partially. Not supported for immutable buffers. A dynamic buffer's other data may be lost on discard; without discard, the range must not be in use by draw calls already issued. Return true on success.
+    bool SetData(size_t firstVertex, size_t numVertices, const void* data, bool discard = true);
 
     /// Return CPU-side shadow data if exists.
     unsigned char* ShadowData() const { return shadowData.Get(); }
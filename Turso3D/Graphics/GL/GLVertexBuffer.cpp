@@ -58,7 +58,7 @@ void VertexBuffer::Recreate()
     }
 }
 
-bool VertexBuffer::SetData(size_t firstVertex, size_t numVertices_, const void* data)
+bool VertexBuffer::SetData(size_t firstVertex, size_t numVertices_, const void* data, bool discard)
 {
     PROFILE(UpdateVertexBuffer);
 
@@ -83,6 +83,7 @@ bool VertexBuffer::SetData(size_t firstVertex, size_t numVertices_, const void*
 
     if (buffer)
     {
+        // Sub-updates are synchronized with pending draws by the driver, so the discard hint is not needed
         graphics->BindVBO(buffer);
         if (numVertices_ == numVertices)
             glBufferData(GL_ARRAY_BUFFER, numVertices_ * vertexSize, data, usage == USAGE_DYNAMIC ? GL_DYNAMIC_DRAW : GL_STATIC_DRAW);
@@ -2,9 +2,14 @@
 
 #pragma once
 
+#include "../Turso3DConfig.h"
+
 #ifdef TURSO3D_D3D11
     #include "D3D11/D3D11Graphics.h"
 #endif
 #ifdef TURSO3D_OPENGL
     #include "GL/GLGraphics.h"
 #endif
+#ifdef TURSO3D_NULL
+    #include "Null/NullGraphics.h"
+#endif
\ No newline at end of file
@@ -9,4 +9,7 @@
 #endif
 #ifdef TURSO3D_OPENGL
     #include "GL/GLIndexBuffer.h"
+#endif
+#ifdef TURSO3D_NULL
+    #include "Null/NullIndexBuffer.h"
 #endif
\ No newline at end of file
@@ -0,0 +1,91 @@
+// For conditions of distribution and use, see copyright notice in License.txt
+
+#include "../../Debug/Log.h"
+#include "../../Debug/Profiler.h"
+#include "NullConstantBuffer.h"
+#include "NullGraphics.h"
+
+#include "../../Debug/DebugNew.h"
+
+namespace Turso3D
+{
+
+ConstantBuffer::ConstantBuffer() :
+    created(false),
+    byteSize(0),
+    usage(USAGE_DEFAULT),
+    dirty(false)
+{
+}
+
+ConstantBuffer::~ConstantBuffer()
+{
+    Release();
+}
+
+void ConstantBuffer::Release()
+{
+    if (graphics)
+    {
+        for (size_t i = 0; i < MAX_SHADER_STAGES; ++i)
+        {
+            for (size_t j = 0; j < MAX_CONSTANT_BUFFERS; ++j)
+            {
+                if (graphics->GetConstantBuffer((ShaderStage)i, j) == this)
+                    graphics->SetConstantBuffer((ShaderStage)i, j, 0);
+            }
+        }
+    }
+
+    created = false;
+}
+
+void ConstantBuffer::Recreate()
+{
+    if (constants.Size())
+    {
+        // Make a copy of the current constants, as they are passed by reference and manipulated by Define()
+        Vector<Constant> srcConstants = constants;
+        Define(usage, srcConstants);
+        Apply();
+    }
+}
+
+bool ConstantBuffer::SetData(const void* data, bool copyToShadow)
+{
+    if (copyToShadow)
+        memcpy(shadowData.Get(), data, byteSize);
+
+    if (usage == USAGE_IMMUTABLE)
+    {
+        if (!created)
+            return Create(data);
+        else
+        {
+            LOGERROR("Apply can only be called once on an immutable constant buffer");
+            return false;
+        }
+    }
+
+    if (created)
+        graphics->RecordDataUpdate(byteSize);
+
+    dirty = false;
+    return true;
+}
+
+bool ConstantBuffer::Create(const void* data)
+{
+    dirty = false;
+
+    if (graphics && graphics->IsInitialized())
+    {
+        created = true;
+        if (data)
+            graphics->RecordDataUpdate(byteSize);
+    }
+
+    return true;
+}
+
+}
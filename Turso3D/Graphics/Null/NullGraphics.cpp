@@ -0,0 +1,626 @@
+// For conditions of distribution and use, see copyright notice in License.txt
+
+#include "../../Debug/Log.h"
+#include "../../Debug/Profiler.h"
+#include "../../Window/Window.h"
+#include "../GPUObject.h"
+#include "../Shader.h"
+#include "NullGraphics.h"
+#include "NullConstantBuffer.h"
+#include "NullIndexBuffer.h"
+#include "NullShaderVariation.h"
+#include "NullTexture.h"
+#include "NullVertexBuffer.h"
+
+#include "../../Debug/DebugNew.h"
+
+namespace Turso3D
+{
+
+static const char* primitiveTypeNames[] =
+{
+    "",
+    "POINT_LIST",
+    "LINE_LIST",
+    "LINE_STRIP",
+    "TRIANGLE_LIST",
+    "TRIANGLE_STRIP"
+};
+
+/// Return number of primitives formed from a number of vertices or indices.
+static size_t NumPrimitives(PrimitiveType type, size_t elementCount)
+{
+    switch (type)
+    {
+    case POINT_LIST:
+        return elementCount;
+
+    case LINE_LIST:
+        return elementCount / 2;
+
+    case LINE_STRIP:
+        return elementCount > 1 ? elementCount - 1 : 0;
+
+    case TRIANGLE_LIST:
+        return elementCount / 3;
+
+    case TRIANGLE_STRIP:
+        return elementCount > 2 ? elementCount - 2 : 0;
+
+    default:
+        return 0;
+    }
+}
+
+void GraphicsStats::Reset()
+{
+    draws = 0;
+    instancedDraws = 0;
+    skippedDraws = 0;
+    primitives = 0;
+    instances = 0;
+    shaderChanges = 0;
+    textureChanges = 0;
+    constantBufferChanges = 0;
+    bufferChanges = 0;
+    stateChanges = 0;
+    renderTargetChanges = 0;
+    viewportChanges = 0;
+    clears = 0;
+    dataUpdates = 0;
+    dataUpdateBytes = 0;
+    shaderCompiles = 0;
+    presents = 0;
+}
+
+Graphics::Graphics() :
+    backbufferSize(IntVector2::ZERO),
+    renderTargetSize(IntVector2::ZERO),
+    multisample(1),
+    vsync(false),
+    logCalls(false)
+{
+    RegisterSubsystem(this);
+    window = new Window();
+    SubscribeToEvent(window->resizeEvent, &Graphics::HandleResize);
+    ResetState();
+}
+
+Graphics::~Graphics()
+{
+    Close();
+    RemoveSubsystem(this);
+}
+
+bool Graphics::SetMode(const IntVector2& size, bool fullscreen, bool resizable, int multisample_)
+{
+    if (!window->SetSize(size, fullscreen, resizable))
+        return false;
+
+    multisample = Clamp(multisample_, 1, 16);
+    backbufferSize = window->Size();
+    ResetRenderTargets();
+    ResetViewport();
+
+    screenModeEvent.size = backbufferSize;
+    screenModeEvent.fullscreen = IsFullscreen();
+    screenModeEvent.resizable = IsResizable();
+    screenModeEvent.multisample = multisample;
+    SendEvent(screenModeEvent);
+
+    LOGDEBUGF("Set null screen mode %dx%d fullscreen %d resizable %d multisample %d", backbufferSize.x, backbufferSize.y,
+        IsFullscreen(), IsResizable(), multisample);
+
+    return true;
+}
+
+bool Graphics::SetFullscreen(bool enable)
+{
+    if (!IsInitialized())
+        return false;
+    else
+        return SetMode(backbufferSize, enable, window->IsResizable(), multisample);
+}
+
+bool Graphics::SetMultisample(int multisample_)
+{
+    if (!IsInitialized())
+        return false;
+    else
+        return SetMode(backbufferSize, window->IsFullscreen(), window->IsResizable(), multisample_);
+}
+
+void Graphics::SetVSync(bool enable)
+{
+    vsync = enable;
+}
+
+void Graphics::Close()
+{
+    // Release all GPU objects
+    for (auto it = gpuObjects.Begin(); it != gpuObjects.End(); ++it)
+    {
+        GPUObject* object = *it;
+        object->Release();
+    }
+
+    window->Close();
+    ResetState();
+}
+
+void Graphics::Present()
+{
+    PROFILE(Present);
+
+    ++stats.presents;
+    if (logCalls)
+        LOGDEBUGF("Present frame %u", (unsigned)stats.presents);
+}
+
+void Graphics::SetRenderTarget(Texture* renderTarget_, Texture* depthStencil_)
+{
+    renderTargetVector.Resize(1);
+    renderTargetVector[0] = renderTarget_;
+    SetRenderTargets(renderTargetVector, depthStencil_);
+}
+
+void Graphics::SetRenderTargets(const Vector<Texture*>& renderTargets_, Texture* depthStencil_)
+{
+    bool changed = false;
+
+    for (size_t i = 0; i < MAX_RENDERTARGETS; ++i)
+    {
+        Texture* renderTarget = (i < renderTargets_.Size() && renderTargets_[i] && renderTargets_[i]->IsRenderTarget()) ?
+            renderTargets_[i] : nullptr;
+        if (renderTarget != renderTargets[i])
+        {
+            renderTargets[i] = renderTarget;
+            changed = true;
+        }
+    }
+
+    Texture* newDepthStencil = (depthStencil_ && depthStencil_->IsDepthStencil()) ? depthStencil_ : nullptr;
+    if (newDepthStencil != depthStencil)
+    {
+        depthStencil = newDepthStencil;
+        changed = true;
+    }
+
+    if (renderTargets[0])
+        renderTargetSize = IntVector2(renderTargets[0]->Width(), renderTargets[0]->Height());
+    else if (depthStencil)
+        renderTargetSize = IntVector2(depthStencil->Width(), depthStencil->Height());
+    else
+        renderTargetSize = backbufferSize;
+
+    if (changed)
+    {
+        ++stats.renderTargetChanges;
+        if (logCalls)
+            LOGDEBUGF("SetRenderTargets size %dx%d", renderTargetSize.x, renderTargetSize.y);
+    }
+}
+
+void Graphics::SetViewport(const IntRect& viewport_)
+{
+    /// \todo Implement a member function in IntRect for clipping
+    viewport.left = Clamp(viewport_.left, 0, renderTargetSize.x - 1);
+    viewport.top = Clamp(viewport_.top, 0, renderTargetSize.y - 1);
+    viewport.right = Clamp(viewport_.right, viewport.left + 1, renderTargetSize.x);
+    viewport.bottom = Clamp(viewport_.bottom, viewport.top + 1, renderTargetSize.y);
+
+    ++stats.viewportChanges;
+    if (logCalls)
+        LOGDEBUGF("SetViewport %s", viewport.ToString().CString());
+}
+
+void Graphics::SetVertexBuffer(size_t index, VertexBuffer* buffer)
+{
+    if (index < MAX_VERTEX_STREAMS && buffer != vertexBuffers[index])
+    {
+        vertexBuffers[index] = buffer;
+        ++stats.bufferChanges;
+        if (logCalls)
+            LOGDEBUGF("SetVertexBuffer %u numVertices %u", (unsigned)index, buffer ? (unsigned)buffer->NumVertices() : 0);
+    }
+}
+
+void Graphics::SetIndexBuffer(IndexBuffer* buffer)
+{
+    if (indexBuffer != buffer)
+    {
+        indexBuffer = buffer;
+        ++stats.bufferChanges;
+        if (logCalls)
+            LOGDEBUGF("SetIndexBuffer numIndices %u", buffer ? (unsigned)buffer->NumIndices() : 0);
+    }
+}
+
+void Graphics::SetConstantBuffer(ShaderStage stage, size_t index, ConstantBuffer* buffer)
+{
+    if (stage < MAX_SHADER_STAGES && index < MAX_CONSTANT_BUFFERS && buffer != constantBuffers[stage][index])
+    {
+        constantBuffers[stage][index] = buffer;
+        ++stats.constantBufferChanges;
+        if (logCalls)
+            LOGDEBUGF("SetConstantBuffer stage %d index %u byteSize %u", (int)stage, (unsigned)index, buffer ? (unsigned)buffer->ByteSize() : 0);
+    }
+}
+
+void Graphics::SetTexture(size_t index, Texture* texture)
+{
+    if (index < MAX_TEXTURE_UNITS && texture != textures[index])
+    {
+        textures[index] = texture;
+        ++stats.textureChanges;
+        if (logCalls)
+            LOGDEBUGF("SetTexture %u %s", (unsigned)index, texture ? texture->Name().CString() : "null");
+    }
+}
+
+void Graphics::SetShaders(ShaderVariation* vs, ShaderVariation* ps)
+{
+    if (vs == vertexShader && ps == pixelShader)
+        return;
+
+    if (vs != vertexShader)
+    {
+        if (vs && vs->Stage() == SHADER_VS)
+        {
+            if (!vs->IsCompiled())
+                vs->Compile();
+        }
+
+        vertexShader = vs;
+    }
+
+    if (ps != pixelShader)
+    {
+        if (ps && ps->Stage() == SHADER_PS)
+        {
+            if (!ps->IsCompiled())
+                ps->Compile();
+        }
+
+        pixelShader = ps;
+    }
+
+    ++stats.shaderChanges;
+    if (logCalls)
+    {
+        LOGDEBUGF("SetShaders %s %s", vertexShader ? vertexShader->FullName().CString() : "null",
+            pixelShader ? pixelShader->FullName().CString() : "null");
+    }
+}
+
+void Graphics::SetColorState(const BlendModeDesc& blendMode, bool alphaToCoverage, unsigned char colorWriteMask)
+{
+    renderState.blendMode = blendMode;
+    renderState.colorWriteMask = colorWriteMask;
+    renderState.alphaToCoverage = alphaToCoverage;
+
+    ++stats.stateChanges;
+}
+
+void Graphics::SetColorState(BlendMode blendMode, bool alphaToCoverage, unsigned char colorWriteMask)
+{
+    SetColorState(blendModes[blendMode], alphaToCoverage, colorWriteMask);
+}
+
+void Graphics::SetDepthState(CompareFunc depthFunc, bool depthWrite, bool depthClip, int depthBias, float slopeScaledDepthBias)
+{
+    renderState.depthFunc = depthFunc;
+    renderState.depthWrite = depthWrite;
+    renderState.depthClip = depthClip;
+    renderState.depthBias = depthBias;
+    renderState.slopeScaledDepthBias = slopeScaledDepthBias;
+
+    ++stats.stateChanges;
+}
+
+void Graphics::SetRasterizerState(CullMode cullMode, FillMode fillMode)
+{
+    renderState.cullMode = cullMode;
+    renderState.fillMode = fillMode;
+
+    ++stats.stateChanges;
+}
+
+void Graphics::SetScissorTest(bool scissorEnable, const IntRect& scissorRect)
+{
+    renderState.scissorEnable = scissorEnable;
+    /// \todo Implement a member function in IntRect for clipping
+    renderState.scissorRect.left = Clamp(scissorRect.left, 0, renderTargetSize.x - 1);
+    renderState.scissorRect.top = Clamp(scissorRect.top, 0, renderTargetSize.y - 1);
+    renderState.scissorRect.right = Clamp(scissorRect.right, renderState.scissorRect.left + 1, renderTargetSize.x);
+    renderState.scissorRect.bottom = Clamp(scissorRect.bottom, renderState.scissorRect.top + 1, renderTargetSize.y);
+
+    ++stats.stateChanges;
+}
+
+void Graphics::SetStencilTest(bool stencilEnable, const StencilTestDesc& stencilTest, unsigned char stencilRef)
+{
+    renderState.stencilEnable = stencilEnable;
+    renderState.stencilTest = stencilTest;
+    renderState.stencilRef = stencilRef;
+
+    ++stats.stateChanges;
+}
+
+void Graphics::ResetRenderTargets()
+{
+    SetRenderTarget(nullptr, nullptr);
+}
+
+void Graphics::ResetViewport()
+{
+    SetViewport(IntRect(0, 0, renderTargetSize.x, renderTargetSize.y));
+}
+
+void Graphics::ResetVertexBuffers()
+{
+    for (size_t i = 0; i < MAX_VERTEX_STREAMS; ++i)
+        SetVertexBuffer(i, nullptr);
+}
+
+void Graphics::ResetConstantBuffers()
+{
+    for (size_t i = 0; i < MAX_SHADER_STAGES; ++i)
+    {
+        for (size_t j = 0; j < MAX_CONSTANT_BUFFERS; ++j)
+            SetConstantBuffer((ShaderStage)i, j, nullptr);
+    }
+}
+
+void Graphics::ResetTextures()
+{
+    for (size_t i = 0; i < MAX_TEXTURE_UNITS; ++i)
+        SetTexture(i, nullptr);
+}
+
+void Graphics::Clear(unsigned clearFlags, const Color& clearColor, float clearDepth, unsigned char clearStencil)
+{
+    ++stats.clears;
+    if (logCalls)
+    {
+        LOGDEBUGF("Clear flags %u color %s depth %f stencil %d", clearFlags, clearColor.ToString().CString(), clearDepth,
+            (int)clearStencil);
+    }
+}
+
+void Graphics::Draw(PrimitiveType type, size_t vertexStart, size_t vertexCount)
+{
+    if (!vertexBuffers[0] || vertexStart + vertexCount > vertexBuffers[0]->NumVertices())
+    {
+        LOGERROR("Out of bounds vertex range for draw call");
+        ++stats.skippedDraws;
+        return;
+    }
+    if (!PrepareDraw(type, vertexCount))
+        return;
+
+    if (logCalls)
+        LOGDEBUGF("Draw %s vertexStart %u vertexCount %u", primitiveTypeNames[type], (unsigned)vertexStart, (unsigned)vertexCount);
+}
+
+void Graphics::DrawIndexed(PrimitiveType type, size_t indexStart, size_t indexCount, size_t vertexStart)
+{
+    if (!indexBuffer || indexBuffer->IsDataLost() || indexStart + indexCount > indexBuffer->NumIndices())
+    {
+        LOGERROR("Out of bounds index range for draw call");
+        ++stats.skippedDraws;
+        return;
+    }
+    if (!PrepareDraw(type, indexCount))
+        return;
+
+    if (logCalls)
+    {
+        LOGDEBUGF("DrawIndexed %s indexStart %u indexCount %u vertexStart %u", primitiveTypeNames[type], (unsigned)indexStart,
+            (unsigned)indexCount, (unsigned)vertexStart);
+    }
+}
+
+void Graphics::DrawInstanced(PrimitiveType type, size_t vertexStart, size_t vertexCount, size_t instanceStart, size_t
+    instanceCount)
+{
+    if (!vertexBuffers[0] || vertexStart + vertexCount > vertexBuffers[0]->NumVertices())
+    {
+        LOGERROR("Out of bounds vertex range for draw call");
+        ++stats.skippedDraws;
+        return;
+    }
+    if (!PrepareDraw(type, vertexCount, instanceStart, instanceCount))
+        return;
+
+    if (logCalls)
+    {
+        LOGDEBUGF("DrawInstanced %s vertexStart %u vertexCount %u instanceStart %u instanceCount %u", primitiveTypeNames[type],
+            (unsigned)vertexStart, (unsigned)vertexCount, (unsigned)instanceStart, (unsigned)instanceCount);
+    }
+}
+
+void Graphics::DrawIndexedInstanced(PrimitiveType type, size_t indexStart, size_t indexCount, size_t vertexStart, size_t instanceStart,
+    size_t instanceCount)
+{
+    if (!indexBuffer || indexBuffer->IsDataLost() || indexStart + indexCount > indexBuffer->NumIndices())
+    {
+        LOGERROR("Out of bounds index range for draw call");
+        ++stats.skippedDraws;
+        return;
+    }
+    if (!PrepareDraw(type, indexCount, instanceStart, instanceCount))
+        return;
+
+    if (logCalls)
+    {
+        LOGDEBUGF("DrawIndexedInstanced %s indexStart %u indexCount %u vertexStart %u instanceStart %u instanceCount %u",
+            primitiveTypeNames[type], (unsigned)indexStart, (unsigned)indexCount, (unsigned)vertexStart, (unsigned)instanceStart,
+            (unsigned)instanceCount);
+    }
+}
+
+void Graphics::SetLogCalls(bool enable)
+{
+    logCalls = enable;
+}
+
+void Graphics::ResetStats()
+{
+    stats.Reset();
+}
+
+bool Graphics::IsInitialized() const
+{
+    return window->IsOpen();
+}
+
+bool Graphics::IsFullscreen() const
+{
+    return window->IsFullscreen();
+}
+
+bool Graphics::IsResizable() const
+{
+    return window->IsResizable();
+}
+
+Window* Graphics::RenderWindow() const
+{
+    return window;
+}
+
+Texture* Graphics::RenderTarget(size_t index) const
+{
+    return index < MAX_RENDERTARGETS ? renderTargets[index] : nullptr;
+}
+
+VertexBuffer* Graphics::GetVertexBuffer(size_t index) const
+{
+    return index < MAX_VERTEX_STREAMS ? vertexBuffers[index] : nullptr;
+}
+
+ConstantBuffer* Graphics::GetConstantBuffer(ShaderStage stage, size_t index) const
+{
+    return (stage < MAX_SHADER_STAGES && index < MAX_CONSTANT_BUFFERS) ? constantBuffers[stage][index] : nullptr;
+}
+
+Texture* Graphics::GetTexture(size_t index) const
+{
+    return (index < MAX_TEXTURE_UNITS) ? textures[index] : nullptr;
+}
+
+void Graphics::AddGPUObject(GPUObject* object)
+{
+    if (object)
+        gpuObjects.Push(object);
+}
+
+void Graphics::RemoveGPUObject(GPUObject* object)
+{
+    /// \todo Requires a linear search, needs to be profiled whether becomes a problem with a large number of objects
+    gpuObjects.Remove(object);
+}
+
+void Graphics::RecordDataUpdate(size_t bytes)
+{
+    ++stats.dataUpdates;
+    stats.dataUpdateBytes += bytes;
+}
+
+void Graphics::RecordShaderCompile(ShaderVariation* shader)
+{
+    ++stats.shaderCompiles;
+    if (logCalls && shader)
+        LOGDEBUG("Compile shader " + shader->FullName());
+}
+
+void Graphics::HandleResize(WindowResizeEvent& event)
+{
+    // Reset viewport in case the application does not set it
+    if (IsInitialized())
+    {
+        backbufferSize = event.size;
+        ResetRenderTargets();
+        ResetViewport();
+    }
+}
+
+bool Graphics::PrepareDraw(PrimitiveType type, size_t elementCount, size_t instanceStart, size_t instanceCount)
+{
+    if (!vertexShader || !pixelShader || !vertexShader->IsValid() || !pixelShader->IsValid())
+    {
+        ++stats.skippedDraws;
+        return false;
+    }
+
+    if (instanceCount)
+    {
+        // Check that the per-instance data of the bound vertex buffers covers the instance range
+        for (size_t i = 0; i < MAX_VERTEX_STREAMS; ++i)
+        {
+            VertexBuffer* buffer = vertexBuffers[i];
+            if (!buffer)
+                continue;
+
+            const Vector<VertexElement>& elements = buffer->Elements();
+            for (auto it = elements.Begin(); it != elements.End(); ++it)
+            {
+                if (it->perInstance && instanceStart + instanceCount > buffer->NumVertices())
+                {
+                    LOGERROR("Out of bounds instance range for draw call");
+                    ++stats.skippedDraws;
+                    return false;
+                }
+            }
+        }
+
+        ++stats.instancedDraws;
+        stats.instances += instanceCount;
+        stats.primitives += NumPrimitives(type, elementCount) * instanceCount;
+    }
+    else
+    {
+        ++stats.draws;
+        stats.primitives += NumPrimitives(type, elementCount);
+    }
+
+    return true;
+}
+
+void Graphics::ResetState()
+{
+    for (size_t i = 0; i < MAX_VERTEX_STREAMS; ++i)
+        vertexBuffers[i] = nullptr;
+
+    for (size_t i = 0; i < MAX_SHADER_STAGES; ++i)
+    {
+        for (size_t j = 0; j < MAX_CONSTANT_BUFFERS; ++j)
+            constantBuffers[i][j] = nullptr;
+    }
+
+    for (size_t i = 0; i < MAX_TEXTURE_UNITS; ++i)
+        textures[i] = nullptr;
+
+    for (size_t i = 0; i < MAX_RENDERTARGETS; ++i)
+        renderTargets[i] = nullptr;
+
+    indexBuffer = nullptr;
+    depthStencil = nullptr;
+    vertexShader = nullptr;
+    pixelShader = nullptr;
+    renderState.Reset();
+}
+
+void RegisterGraphicsLibrary()
+{
+    static bool registered = false;
+    if (registered)
+        return;
+    registered = true;
+
+    Shader::RegisterObject();
+    Texture::RegisterObject();
+}
+
+}
@@ -0,0 +1,275 @@
+// For conditions of distribution and use, see copyright notice in License.txt
+
+#pragma once
+
+#include "../../Math/Color.h"
+#include "../../Math/IntRect.h"
+#include "../../Math/IntVector2.h"
+#include "../../Object/Object.h"
+#include "../GraphicsDefs.h"
+
+namespace Turso3D
+{
+
+class ConstantBuffer;
+class GPUObject;
+class IndexBuffer;
+class ShaderVariation;
+class Texture;
+class VertexBuffer;
+class Window;
+class WindowResizeEvent;
+
+/// Screen mode set event.
+class ScreenModeEvent : public Event
+{
+public:
+    /// New backbuffer size.
+    IntVector2 size;
+    /// Fullscreen flag.
+    bool fullscreen;
+    /// Window resizable flag.
+    bool resizable;
+    /// Multisample level.
+    int multisample;
+};
+
+/// Counters of the rendering API calls recorded by the null graphics backend.
+struct TURSO3D_API GraphicsStats
+{
+    /// Construct with zero counters.
+    GraphicsStats()
+    {
+        Reset();
+    }
+
+    /// Reset all counters to zero.
+    void Reset();
+
+    /// Number of non-instanced draw calls.
+    size_t draws;
+    /// Number of instanced draw calls.
+    size_t instancedDraws;
+    /// Number of draw calls skipped due to missing shaders or out of range buffer access.
+    size_t skippedDraws;
+    /// Number of primitives drawn, including all instances.
+    size_t primitives;
+    /// Number of instances drawn by instanced draw calls.
+    size_t instances;
+    /// Number of shader changes.
+    size_t shaderChanges;
+    /// Number of texture binding changes.
+    size_t textureChanges;
+    /// Number of constant buffer binding changes.
+    size_t constantBufferChanges;
+    /// Number of vertex or index buffer binding changes.
+    size_t bufferChanges;
+    /// Number of render state changes.
+    size_t stateChanges;
+    /// Number of rendertarget changes.
+    size_t renderTargetChanges;
+    /// Number of viewport changes.
+    size_t viewportChanges;
+    /// Number of clears.
+    size_t clears;
+    /// Number of buffer or texture data updates.
+    size_t dataUpdates;
+    /// Total bytes of buffer or texture data updates.
+    size_t dataUpdateBytes;
+    /// Number of shader variations compiled.
+    size_t shaderCompiles;
+    /// Number of presented frames.
+    size_t presents;
+};
+
+/// 3D graphics rendering context, headless null implementation. GPU objects keep only their CPU-side descriptions, and the rendering calls are validated and counted, optionally logged, but nothing is drawn. Allows running the rendering pipeline without a window or a GPU.
+class TURSO3D_API Graphics : public Object
+{
+    OBJECT(Graphics);
+
+public:
+    /// Construct and register subsystem. The graphics mode is not set & window is not opened yet.
+    Graphics();
+    /// Destruct. Clean up the window and GPU objects.
+    ~Graphics();
+
+    /// Set graphics mode. Open the window if not opened yet. Return true on success.
+    bool SetMode(const IntVector2& size, bool fullscreen = false, bool resizable = false, int multisample = 1);
+    /// Set fullscreen mode on/off while retaining previous resolution. The initial graphics mode must have been set first. Return true on success.
+    bool SetFullscreen(bool enable);
+    /// Set new multisample level while retaining previous resolution. The initial graphics mode must have been set first. Return true on success.
+    bool SetMultisample(int multisample);
+    /// Set vertical sync on/off.
+    void SetVSync(bool enable);
+    /// Close the window and release the GPU objects.
+    void Close();
+    /// Present the contents of the backbuffer.
+    void Present();
+    /// Set the color rendertarget and depth stencil buffer.
+    void SetRenderTarget(Texture* renderTarget, Texture* stencilBuffer);
+    /// Set multiple color rendertargets and the depth stencil buffer.
+    void SetRenderTargets(const Vector<Texture*>& renderTargets, Texture* stencilBuffer);
+    /// Set the viewport rectangle. On window resize the viewport will automatically revert to full window.
+    void SetViewport(const IntRect& viewport);
+    /// Bind a vertex buffer.
+    void SetVertexBuffer(size_t index, VertexBuffer* buffer);
+    /// Bind an index buffer.
+    void SetIndexBuffer(IndexBuffer* buffer);
+    /// Bind a constant buffer.
+    void SetConstantBuffer(ShaderStage stage, size_t index, ConstantBuffer* buffer);
+    /// Bind a texture.
+    void SetTexture(size_t index, Texture* texture);
+    /// Bind vertex and pixel shaders.
+    void SetShaders(ShaderVariation* vs, ShaderVariation* ps);
+    /// Set color write and blending related state using an arbitrary blend mode.
+    void SetColorState(const BlendModeDesc& blendMode, bool alphaToCoverage = false, unsigned char colorWriteMask = COLORMASK_ALL);
+    /// Set color write and blending related state using a predefined blend mode.
+    void SetColorState(BlendMode blendMode, bool alphaToCoverage = false, unsigned char colorWriteMask = COLORMASK_ALL);
+    /// Set depth buffer related state.
+    void SetDepthState(CompareFunc depthFunc, bool depthWrite, bool depthClip = true, int depthBias = 0, float slopeScaledDepthBias = 0.0f);
+    /// Set rasterizer related state.
+    void SetRasterizerState(CullMode cullMode, FillMode fillMode);
+    /// Set scissor test.
+    void SetScissorTest(bool scissorEnable = false, const IntRect& scissorRect = IntRect::ZERO);
+    /// Set stencil test.
+    void SetStencilTest(bool stencilEnable, const StencilTestDesc& stencilTest = StencilTestDesc(), unsigned char stencilRef = 0);
+    /// Reset rendertarget and depth stencil buffer to the backbuffer.
+    void ResetRenderTargets();
+    /// Set the viewport to the entire rendertarget or backbuffer.
+    void ResetViewport();
+    /// Reset all bound vertex buffers.
+    void ResetVertexBuffers();
+    /// Reset all bound constant buffers.
+    void ResetConstantBuffers();
+    /// Reset all bound textures.
+    void ResetTextures();
+    /// Clear the current rendertarget. This is not affected by the defined viewport, but will always clear the whole target.
+    void Clear(unsigned clearFlags, const Color& clearColor = Color::BLACK, float clearDepth = 1.0f, unsigned char clearStencil = 0);
+    /// Draw non-indexed geometry.
+    void Draw(PrimitiveType type, size_t vertexStart, size_t vertexCount);
+    /// Draw indexed geometry.
+    void DrawIndexed(PrimitiveType type, size_t indexStart, size_t indexCount, size_t vertexStart);
+    /// Draw instanced non-indexed geometry.
+    void DrawInstanced(PrimitiveType type, size_t vertexStart, size_t vertexCount, size_t instanceStart, size_t instanceCount);
+    /// Draw instanced indexed geometry.
+    void DrawIndexedInstanced(PrimitiveType type, size_t indexStart, size_t indexCount, size_t vertexStart, size_t instanceStart, size_t instanceCount);
+    /// Set whether to log each recorded rendering call. Default false.
+    void SetLogCalls(bool enable);
+    /// Reset the recorded call counters.
+    void ResetStats();
+
+    /// Return whether has the rendering window.
+    bool IsInitialized() const;
+    /// Return backbuffer size, or 0,0 if not initialized.
+    const IntVector2& Size() const { return backbufferSize; }
+    /// Return backbuffer width, or 0 if not initialized.
+    int Width() const { return backbufferSize.x; }
+    /// Return backbuffer height, or 0 if not initialized.
+    int Height() const { return backbufferSize.y; }
+    /// Return multisample level, or 1 if not using multisampling.
+    int Multisample() const { return multisample; }
+    /// Return current rendertarget width.
+    int RenderTargetWidth() const { return renderTargetSize.x; }
+    /// Return current rendertarget height.
+    int RenderTargetHeight() const { return renderTargetSize.y; }
+    /// Return whether is using fullscreen mode.
+    bool IsFullscreen() const;
+    /// Return whether the window is resizable.
+    bool IsResizable() const;
+    /// Return whether is using vertical sync.
+    bool VSync() const { return vsync; }
+    /// Return the rendering window.
+    Window* RenderWindow() const;
+    /// Return the current color rendertarget by index, or null if rendering to the backbuffer.
+    Texture* RenderTarget(size_t index) const;
+    /// Return the current depth-stencil buffer, or null if rendering to the backbuffer.
+    Texture* DepthStencil() const { return depthStencil; }
+    /// Return the current viewport rectangle.
+    const IntRect& Viewport() const { return viewport; }
+    /// Return currently bound vertex buffer by index.
+    VertexBuffer* GetVertexBuffer(size_t index) const;
+    /// Return currently bound index buffer.
+    IndexBuffer* GetIndexBuffer() const { return indexBuffer; }
+    /// Return currently bound constant buffer by shader stage and index.
+    ConstantBuffer* GetConstantBuffer(ShaderStage stage, size_t index) const;
+    /// Return currently bound texture by texture unit.
+    Texture* GetTexture(size_t index) const;
+    /// Return currently bound vertex shader.
+    ShaderVariation* GetVertexShader() const { return vertexShader; }
+    /// Return currently bound pixel shader.
+    ShaderVariation* GetPixelShader() const { return pixelShader; }
+    /// Return the current renderstate.
+    const RenderState& GetRenderState() const { return renderState; }
+    /// Return whether each recorded rendering call is logged.
+    bool LogCalls() const { return logCalls; }
+    /// Return the recorded call counters.
+    const GraphicsStats& Stats() const { return stats; }
+
+    /// Register a GPU object to keep track of.
+    void AddGPUObject(GPUObject* object);
+    /// Remove a GPU object.
+    void RemoveGPUObject(GPUObject* object);
+    /// Record a buffer or texture data update. Called by the GPU objects.
+    void RecordDataUpdate(size_t bytes);
+    /// Record a shader variation compile. Called by the shader variations.
+    void RecordShaderCompile(ShaderVariation* shader);
+
+    /// Screen mode changed event.
+    ScreenModeEvent screenModeEvent;
+    /// %Graphics context lost event.
+    Event contextLossEvent;
+    /// %Graphics context restored event.
+    Event contextRestoreEvent;
+
+private:
+    /// Handle window resize event.
+    void HandleResize(WindowResizeEvent& event);
+    /// Validate the next draw call and record its primitives. Return false if the draw call should not be attempted.
+    bool PrepareDraw(PrimitiveType type, size_t elementCount, size_t instanceStart = 0, size_t instanceCount = 0);
+    /// Reset internally tracked state.
+    void ResetState();
+
+    /// OS-level rendering window.
+    AutoPtr<Window> window;
+    /// Current size of the backbuffer.
+    IntVector2 backbufferSize;
+    /// Current size of the active rendertarget.
+    IntVector2 renderTargetSize;
+    /// Bound vertex buffers.
+    VertexBuffer* vertexBuffers[MAX_VERTEX_STREAMS];
+    /// Bound index buffer.
+    IndexBuffer* indexBuffer;
+    /// Bound constant buffers by shader stage.
+    ConstantBuffer* constantBuffers[MAX_SHADER_STAGES][MAX_CONSTANT_BUFFERS];
+    /// Bound textures by texture unit.
+    Texture* textures[MAX_TEXTURE_UNITS];
+    /// Bound rendertarget textures.
+    Texture* renderTargets[MAX_RENDERTARGETS];
+    /// Bound depth-stencil texture.
+    Texture* depthStencil;
+    /// Helper vector for defining just one color rendertarget.
+    Vector<Texture*> renderTargetVector;
+    /// Bound vertex shader.
+    ShaderVariation* vertexShader;
+    /// Bound pixel shader.
+    ShaderVariation* pixelShader;
+    /// Current renderstate requested by the application.
+    RenderState renderState;
+    /// Current viewport rectangle.
+    IntRect viewport;
+    /// GPU objects.
+    Vector<GPUObject*> gpuObjects;
+    /// Recorded call counters.
+    GraphicsStats stats;
+    /// Multisample level.
+    int multisample;
+    /// Vertical sync flag.
+    bool vsync;
+    /// Log calls flag.
+    bool logCalls;
+};
+
+/// Register Graphics related object factories and attributes.
+TURSO3D_API void RegisterGraphicsLibrary();
+
+}
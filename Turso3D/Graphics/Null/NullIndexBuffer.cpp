@@ -0,0 +1,85 @@
+// For conditions of distribution and use, see copyright notice in License.txt
+
+#include "../../Debug/Log.h"
+#include "../../Debug/Profiler.h"
+#include "NullGraphics.h"
+#include "NullIndexBuffer.h"
+
+#include "../../Debug/DebugNew.h"
+
+namespace Turso3D
+{
+
+IndexBuffer::IndexBuffer() :
+    created(false),
+    numIndices(0),
+    indexSize(0),
+    usage(USAGE_DEFAULT)
+{
+}
+
+IndexBuffer::~IndexBuffer()
+{
+    Release();
+}
+
+void IndexBuffer::Release()
+{
+    if (graphics && graphics->GetIndexBuffer() == this)
+        graphics->SetIndexBuffer(nullptr);
+
+    created = false;
+}
+
+void IndexBuffer::Recreate()
+{
+    if (numIndices)
+    {
+        Define(usage, numIndices, indexSize, !shadowData.IsNull(), shadowData.Get());
+        SetDataLost(!shadowData.IsNull());
+    }
+}
+
+bool IndexBuffer::SetData(size_t firstIndex, size_t numIndices_, const void* data)
+{
+    PROFILE(UpdateIndexBuffer);
+
+    if (!data)
+    {
+        LOGERROR("Null source data for updating index buffer");
+        return false;
+    }
+    if (firstIndex + numIndices_ > numIndices)
+    {
+        LOGERROR("Out of bounds range for updating index buffer");
+        return false;
+    }
+    if (created && usage == USAGE_IMMUTABLE)
+    {
+        LOGERROR("Can not update immutable index buffer");
+        return false;
+    }
+
+    if (shadowData)
+        memcpy(shadowData.Get() + firstIndex * indexSize, data, numIndices_ * indexSize);
+
+    if (created)
+        graphics->RecordDataUpdate(numIndices_ * indexSize);
+
+    return true;
+}
+
+bool IndexBuffer::Create(const void* data)
+{
+    if (graphics && graphics->IsInitialized())
+    {
+        created = true;
+        if (data)
+            graphics->RecordDataUpdate(numIndices * indexSize);
+        LOGDEBUGF("Created index buffer numIndices %u indexSize %u", (unsigned)numIndices, (unsigned)indexSize);
+    }
+
+    return true;
+}
+
+}
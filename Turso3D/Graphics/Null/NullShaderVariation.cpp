@@ -0,0 +1,85 @@
+// For conditions of distribution and use, see copyright notice in License.txt
+
+#include "../../Debug/Log.h"
+#include "../../Debug/Profiler.h"
+#include "../Shader.h"
+#include "NullGraphics.h"
+#include "NullShaderVariation.h"
+
+#include "../../Debug/DebugNew.h"
+
+namespace Turso3D
+{
+
+ShaderVariation::ShaderVariation(Shader* parent_, const String& defines_) :
+    valid(false),
+    parent(parent_),
+    stage(parent->Stage()),
+    defines(defines_),
+    compiled(false)
+{
+}
+
+ShaderVariation::~ShaderVariation()
+{
+    Release();
+}
+
+void ShaderVariation::Release()
+{
+    if (graphics)
+    {
+        if (graphics->GetVertexShader() == this || graphics->GetPixelShader() == this)
+            graphics->SetShaders(nullptr, nullptr);
+    }
+
+    valid = false;
+    compiled = false;
+}
+
+bool ShaderVariation::Compile()
+{
+    if (compiled)
+        return valid;
+
+    PROFILE(CompileShaderVariation);
+
+    // Do not retry without a Release() inbetween
+    compiled = true;
+
+    if (!graphics || !graphics->IsInitialized())
+    {
+        LOGERROR("Can not compile shader without initialized Graphics subsystem");
+        return false;
+    }
+    if (!parent)
+    {
+        LOGERROR("Can not compile shader without parent shader resource");
+        return false;
+    }
+    if (parent->SourceCode().IsEmpty())
+    {
+        LOGERROR("Could not compile shader " + FullName() + ": no source code");
+        return false;
+    }
+
+    valid = true;
+    graphics->RecordShaderCompile(this);
+    LOGDEBUG("Compiled shader " + FullName());
+    return true;
+}
+
+Shader* ShaderVariation::Parent() const
+{
+    return parent;
+}
+
+String ShaderVariation::FullName() const
+{
+    if (parent)
+        return defines.IsEmpty() ? parent->Name() : parent->Name() + " (" + defines + ")";
+    else
+        return String::EMPTY;
+}
+
+}
@@ -0,0 +1,184 @@
+// For conditions of distribution and use, see copyright notice in License.txt
+
+#include "../../Debug/Log.h"
+#include "../../Debug/Profiler.h"
+#include "../../Resource/ResourceCache.h"
+#include "NullGraphics.h"
+#include "NullTexture.h"
+
+#include "../../Debug/DebugNew.h"
+
+namespace Turso3D
+{
+
+Texture::Texture() :
+    created(false),
+    type(TEX_2D),
+    usage(USAGE_DEFAULT),
+    size(IntVector2::ZERO),
+    format(FMT_NONE),
+    numLevels(0)
+{
+}
+
+Texture::~Texture()
+{
+    Release();
+}
+
+void Texture::Release()
+{
+    if (graphics)
+    {
+        for (size_t i = 0; i < MAX_TEXTURE_UNITS; ++i)
+        {
+            if (graphics->GetTexture(i) == this)
+                graphics->SetTexture(i, 0);
+        }
+
+        if (usage == USAGE_RENDERTARGET)
+        {
+            bool clear = false;
+
+            for (size_t i = 0; i < MAX_RENDERTARGETS; ++i)
+            {
+                if (graphics->RenderTarget(i) == this)
+                {
+                    clear = true;
+                    break;
+                }
+            }
+
+            if (!clear && graphics->DepthStencil() == this)
+                clear = true;
+
+            if (clear)
+                graphics->ResetRenderTargets();
+        }
+    }
+
+    created = false;
+}
+
+void Texture::Recreate()
+{
+    // If has a name, attempt to reload through the resource cache
+    if (Name().Length())
+    {
+        ResourceCache* cache = Subsystem<ResourceCache>();
+        if (cache && cache->ReloadResource(this))
+            return;
+    }
+
+    // If failed to reload, recreate the texture without data and mark data lost
+    Define(type, usage, size, format, numLevels);
+    SetDataLost(true);
+}
+
+bool Texture::Define(TextureType type_, ResourceUsage usage_, const IntVector2& size_, ImageFormat format_, size_t numLevels_, const ImageLevel* initialData)
+{
+    PROFILE(DefineTexture);
+
+    Release();
+
+    if (type_ != TEX_2D && type_ != TEX_CUBE)
+    {
+        LOGERROR("Only 2D textures and cube maps supported for now");
+        return false;
+    }
+    if (format_ > FMT_DXT5)
+    {
+        LOGERROR("ETC1 and PVRTC formats are unsupported");
+        return false;
+    }
+    if (type_ == TEX_CUBE && size_.x != size_.y)
+    {
+        LOGERROR("Cube map must have square dimensions");
+        return false;
+    }
+
+    if (numLevels_ < 1)
+        numLevels_ = 1;
+
+    type = type_;
+    usage = usage_;
+
+    if (graphics && graphics->IsInitialized())
+    {
+        created = true;
+        size = size_;
+        format = format_;
+        numLevels = numLevels_;
+
+        if (initialData)
+        {
+            // Hack for allowing immutable texture to set initial data
+            usage = USAGE_DEFAULT;
+            size_t idx = 0;
+            for (size_t i = 0; i < NumFaces(); ++i)
+            {
+                for (size_t j = 0; j < numLevels; ++j)
+                    SetData(i, j, IntRect(0, 0, Max(size.x >> j, 1), Max(size.y >> j, 1)), initialData[idx++]);
+            }
+            usage = usage_;
+        }
+
+        LOGDEBUGF("Created texture width %d height %d format %d numLevels %d", size.x, size.y, (int)format, numLevels);
+    }
+
+    return true;
+}
+
+bool Texture::DefineSampler(TextureFilterMode filter_, TextureAddressMode u, TextureAddressMode v, TextureAddressMode w, unsigned maxAnisotropy_, float minLod_, float maxLod_, const Color& borderColor_)
+{
+    PROFILE(DefineTextureSampler);
+
+    filter = filter_;
+    addressModes[0] = u;
+    addressModes[1] = v;
+    addressModes[2] = w;
+    maxAnisotropy = maxAnisotropy_;
+    minLod = minLod_;
+    maxLod = maxLod_;
+    borderColor = borderColor_;
+
+    return true;
+}
+
+bool Texture::SetData(size_t face, size_t level, IntRect rect, const ImageLevel& data)
+{
+    PROFILE(UpdateTextureLevel);
+
+    if (created)
+    {
+        if (usage == USAGE_IMMUTABLE)
+        {
+            LOGERROR("Can not update immutable texture");
+            return false;
+        }
+        if (face >= NumFaces())
+        {
+            LOGERROR("Face to update out of bounds");
+            return false;
+        }
+        if (level >= numLevels)
+        {
+            LOGERROR("Mipmap level to update out of bounds");
+            return false;
+        }
+
+        IntRect levelRect(0, 0, Max(size.x >> level, 1), Max(size.y >> level, 1));
+        if (levelRect.IsInside(rect) != INSIDE)
+        {
+            LOGERRORF("Texture update region %s is outside level %s", rect.ToString().CString(), levelRect.ToString().CString());
+            return false;
+        }
+
+        if (data.data)
+            graphics->RecordDataUpdate(Image::CalculateDataSize(IntVector2(rect.Width(), rect.Height()), format));
+    }
+
+    return true;
+}
+
+}
@@ -0,0 +1,94 @@
+// For conditions of distribution and use, see copyright notice in License.txt
+
+#include "../../Debug/Log.h"
+#include "../../Debug/Profiler.h"
+#include "NullGraphics.h"
+#include "NullVertexBuffer.h"
+
+#include "../../Debug/DebugNew.h"
+
+namespace Turso3D
+{
+
+VertexBuffer::VertexBuffer() :
+    created(false),
+    numVertices(0),
+    vertexSize(0),
+    elementHash(0),
+    usage(USAGE_DEFAULT)
+{
+}
+
+VertexBuffer::~VertexBuffer()
+{
+    Release();
+}
+
+void VertexBuffer::Release()
+{
+    if (graphics)
+    {
+        for (size_t i = 0; i < MAX_VERTEX_STREAMS; ++i)
+        {
+            if (graphics->GetVertexBuffer(i) == this)
+                graphics->SetVertexBuffer(i, 0);
+        }
+    }
+
+    created = false;
+}
+
+void VertexBuffer::Recreate()
+{
+    if (numVertices)
+    {
+        // Also make a copy of the current vertex elements, as they are passed by reference and manipulated by Define()
+        Vector<VertexElement> srcElements = elements;
+        Define(usage, numVertices, srcElements, !shadowData.IsNull(), shadowData.Get());
+        SetDataLost(!shadowData.IsNull());
+    }
+}
+
+bool VertexBuffer::SetData(size_t firstVertex, size_t numVertices_, const void* data, bool discard)
+{
+    PROFILE(UpdateVertexBuffer);
+
+    if (!data)
+    {
+        LOGERROR("Null source data for updating vertex buffer");
+        return false;
+    }
+    if (firstVertex + numVertices_ > numVertices)
+    {
+        LOGERROR("Out of bounds range for updating vertex buffer");
+        return false;
+    }
+    if (created && usage == USAGE_IMMUTABLE)
+    {
+        LOGERROR("Can not update immutable vertex buffer");
+        return false;
+    }
+
+    if (shadowData)
+        memcpy(shadowData.Get() + firstVertex * vertexSize, data, numVertices_ * vertexSize);
+
+    if (created)
+        graphics->RecordDataUpdate(numVertices_ * vertexSize);
+
+    return true;
+}
+
+bool VertexBuffer::Create(const void* data)
+{
+    if (graphics && graphics->IsInitialized())
+    {
+        created = true;
+        if (data)
+            graphics->RecordDataUpdate(numVertices * vertexSize);
+        LOGDEBUGF("Created vertex buffer numVertices %u vertexSize %u", (unsigned)numVertices, (unsigned)vertexSize);
+    }
+
+    return true;
+}
+
+}
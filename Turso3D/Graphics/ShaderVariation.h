@@ -10,3 +10,7 @@
 #ifdef TURSO3D_OPENGL
     #include "GL/GLShaderVariation.h"
 #endif
+
+#ifdef TURSO3D_NULL
+    #include "Null/NullShaderVariation.h"
+#endif
\ No newline at end of file
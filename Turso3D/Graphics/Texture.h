@@ -9,4 +9,7 @@
 #endif
 #ifdef TURSO3D_OPENGL
     #include "GL/GLTexture.h"
+#endif
+#ifdef TURSO3D_NULL
+    #include "Null/NullTexture.h"
 #endif
\ No newline at end of file
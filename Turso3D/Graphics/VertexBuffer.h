@@ -9,4 +9,7 @@
 #endif
 #ifdef TURSO3D_OPENGL
     #include "GL/GLVertexBuffer.h"
+#endif
+#ifdef TURSO3D_NULL
+    #include "Null/NullVertexBuffer.h"
 #endif
\ No newline at end of file
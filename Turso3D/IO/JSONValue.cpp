@@ -315,7 +315,11 @@ void JSONValue::ToString(String& dest, int spacing, int indent) const
         return;
         
     case JSON_NUMBER:
-        dest += data.numberValue;
+        // Write integers in full, as the default precision would round large values such as node ids
+        if (data.numberValue >= -1e15 && data.numberValue <= 1e15 && data.numberValue == (double)(long long)data.numberValue)
+            dest += (long long)data.numberValue;
+        else
+            dest += data.numberValue;
         return;
         
     case JSON_STRING:
@@ -2,11 +2,187 @@
 
 #include "Frustum.h"
 
+#ifdef TURSO3D_SSE
+#include <xmmintrin.h>
+#endif
+
 #include "../Debug/DebugNew.h"
 
 namespace Turso3D
 {
 
+/// Helper for testing packed volumes against frustum planes, 4 at a time if SSE is enabled.
+class FrustumVolumeTester
+{
+public:
+    /// Construct from a frustum.
+    FrustumVolumeTester(const Frustum& frustum_) :
+        frustum(frustum_)
+    {
+        #ifdef TURSO3D_SSE
+        for (size_t i = 0; i < NUM_FRUSTUM_PLANES; ++i)
+        {
+            const Plane& plane = frustum.planes[i];
+            normalX[i] = _mm_set1_ps(plane.normal.x);
+            normalY[i] = _mm_set1_ps(plane.normal.y);
+            normalZ[i] = _mm_set1_ps(plane.normal.z);
+            absNormalX[i] = _mm_set1_ps(plane.absNormal.x);
+            absNormalY[i] = _mm_set1_ps(plane.absNormal.y);
+            absNormalZ[i] = _mm_set1_ps(plane.absNormal.z);
+            d[i] = _mm_set1_ps(plane.d);
+        }
+        #endif
+    }
+
+    /// Test up to 32 bounding boxes from a start index. Return a bit for each box that is (partially) inside.
+    unsigned Test(const BoundingBoxArrays& boxes, size_t start, size_t count) const
+    {
+        unsigned bits = 0;
+        size_t i = 0;
+
+        #ifdef TURSO3D_SSE
+        __m128 half = _mm_set1_ps(0.5f);
+        __m128 signMask = _mm_set1_ps(-0.0f);
+
+        for (; i + 4 <= count; i += 4)
+        {
+            size_t index = start + i;
+            __m128 minX = _mm_loadu_ps(boxes.minX + index);
+            __m128 minY = _mm_loadu_ps(boxes.minY + index);
+            __m128 minZ = _mm_loadu_ps(boxes.minZ + index);
+            __m128 centerX = _mm_mul_ps(_mm_add_ps(_mm_loadu_ps(boxes.maxX + index), minX), half);
+            __m128 centerY = _mm_mul_ps(_mm_add_ps(_mm_loadu_ps(boxes.maxY + index), minY), half);
+            __m128 centerZ = _mm_mul_ps(_mm_add_ps(_mm_loadu_ps(boxes.maxZ + index), minZ), half);
+            __m128 edgeX = _mm_sub_ps(centerX, minX);
+            __m128 edgeY = _mm_sub_ps(centerY, minY);
+            __m128 edgeZ = _mm_sub_ps(centerZ, minZ);
+            __m128 outside = _mm_setzero_ps();
+
+            for (size_t j = 0; j < NUM_FRUSTUM_PLANES; ++j)
+            {
+                __m128 dist = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(normalX[j], centerX), _mm_mul_ps(normalY[j], centerY)),
+                    _mm_mul_ps(normalZ[j], centerZ)), d[j]);
+                __m128 absDist = _mm_add_ps(_mm_add_ps(_mm_mul_ps(absNormalX[j], edgeX), _mm_mul_ps(absNormalY[j], edgeY)),
+                    _mm_mul_ps(absNormalZ[j], edgeZ));
+                outside = _mm_or_ps(outside, _mm_cmplt_ps(dist, _mm_xor_ps(absDist, signMask)));
+                if (_mm_movemask_ps(outside) == 0xf)
+                    break;
+            }
+
+            bits |= ((unsigned)~_mm_movemask_ps(outside) & 0xf) << i;
+        }
+        #endif
+
+        for (; i < count; ++i)
+        {
+            size_t index = start + i;
+            BoundingBox box(Vector3(boxes.minX[index], boxes.minY[index], boxes.minZ[index]), Vector3(boxes.maxX[index],
+                boxes.maxY[index], boxes.maxZ[index]));
+            if (frustum.IsInsideFast(box) != OUTSIDE)
+                bits |= 1u << i;
+        }
+
+        return bits;
+    }
+
+    /// Test up to 32 spheres from a start index. Return a bit for each sphere that is (partially) inside.
+    unsigned Test(const SphereArrays& spheres, size_t start, size_t count) const
+    {
+        unsigned bits = 0;
+        size_t i = 0;
+
+        #ifdef TURSO3D_SSE
+        __m128 signMask = _mm_set1_ps(-0.0f);
+
+        for (; i + 4 <= count; i += 4)
+        {
+            size_t index = start + i;
+            __m128 centerX = _mm_loadu_ps(spheres.centerX + index);
+            __m128 centerY = _mm_loadu_ps(spheres.centerY + index);
+            __m128 centerZ = _mm_loadu_ps(spheres.centerZ + index);
+            __m128 negRadius = _mm_xor_ps(_mm_loadu_ps(spheres.radius + index), signMask);
+            __m128 outside = _mm_setzero_ps();
+
+            for (size_t j = 0; j < NUM_FRUSTUM_PLANES; ++j)
+            {
+                __m128 dist = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(normalX[j], centerX), _mm_mul_ps(normalY[j], centerY)),
+                    _mm_mul_ps(normalZ[j], centerZ)), d[j]);
+                outside = _mm_or_ps(outside, _mm_cmplt_ps(dist, negRadius));
+                if (_mm_movemask_ps(outside) == 0xf)
+                    break;
+            }
+
+            bits |= ((unsigned)~_mm_movemask_ps(outside) & 0xf) << i;
+        }
+        #endif
+
+        for (; i < count; ++i)
+        {
+            size_t index = start + i;
+            Sphere sphere(Vector3(spheres.centerX[index], spheres.centerY[index], spheres.centerZ[index]), spheres.radius[index]);
+            if (frustum.IsInsideFast(sphere) != OUTSIDE)
+                bits |= 1u << i;
+        }
+
+        return bits;
+    }
+
+private:
+    /// Frustum.
+    const Frustum& frustum;
+    #ifdef TURSO3D_SSE
+    /// Plane normal X components.
+    __m128 normalX[NUM_FRUSTUM_PLANES];
+    /// Plane normal Y components.
+    __m128 normalY[NUM_FRUSTUM_PLANES];
+    /// Plane normal Z components.
+    __m128 normalZ[NUM_FRUSTUM_PLANES];
+    /// Plane absolute normal X components.
+    __m128 absNormalX[NUM_FRUSTUM_PLANES];
+    /// Plane absolute normal Y components.
+    __m128 absNormalY[NUM_FRUSTUM_PLANES];
+    /// Plane absolute normal Z components.
+    __m128 absNormalZ[NUM_FRUSTUM_PLANES];
+    /// Plane constants.
+    __m128 d[NUM_FRUSTUM_PLANES];
+    #endif
+};
+
+template <class T> size_t TestVolumes(const Frustum& frustum, const T& volumes, unsigned* mask)
+{
+    FrustumVolumeTester tester(frustum);
+    size_t numInside = 0;
+
+    for (size_t start = 0; start < volumes.count; start += 32)
+    {
+        size_t count = volumes.count - start;
+        unsigned bits = tester.Test(volumes, start, count < 32 ? count : 32);
+        *mask++ = bits;
+        numInside += CountSetBits(bits);
+    }
+
+    return numInside;
+}
+
+template <class T> size_t CollectVolumes(const Frustum& frustum, const T& volumes, unsigned* indices)
+{
+    FrustumVolumeTester tester(frustum);
+    size_t numInside = 0;
+
+    for (size_t start = 0; start < volumes.count; start += 32)
+    {
+        size_t count = volumes.count - start;
+        unsigned bits = tester.Test(volumes, start, count < 32 ? count : 32);
+        for (unsigned index = (unsigned)start; bits; bits >>= 1, ++index)
+        {
+            if (bits & 1)
+                indices[numInside++] = index;
+        }
+    }
+
+    return numInside;
+}
+
 inline Vector3 ClipEdgeZ(const Vector3& v0, const Vector3& v1, float clipZ)
 {
     return Vector3(
@@ -170,6 +346,26 @@ Rect Frustum::Projected(const Matrix4& projection) const
     return rect;
 }
 
+size_t Frustum::IsInsideFast(const BoundingBoxArrays& boxes, unsigned* mask) const
+{
+    return TestVolumes(*this, boxes, mask);
+}
+
+size_t Frustum::IsInsideFast(const SphereArrays& spheres, unsigned* mask) const
+{
+    return TestVolumes(*this, spheres, mask);
+}
+
+size_t Frustum::CollectInsideFast(const BoundingBoxArrays& boxes, unsigned* indices) const
+{
+    return CollectVolumes(*this, boxes, indices);
+}
+
+size_t Frustum::CollectInsideFast(const SphereArrays& spheres, unsigned* indices) const
+{
+    return CollectVolumes(*this, spheres, indices);
+}
+
 void Frustum::UpdatePlanes()
 {
     planes[PLANE_NEAR].Define(vertices[2], vertices[1], vertices[0]);
@@ -24,6 +24,40 @@ enum FrustumPlane
 static const size_t NUM_FRUSTUM_PLANES = 6;
 static const size_t NUM_FRUSTUM_VERTICES = 8;
 
+/// Bounding boxes in structure of arrays layout for batched culling. Does not own the arrays.
+struct TURSO3D_API BoundingBoxArrays
+{
+    /// Minimum X coordinates.
+    const float* minX;
+    /// Minimum Y coordinates.
+    const float* minY;
+    /// Minimum Z coordinates.
+    const float* minZ;
+    /// Maximum X coordinates.
+    const float* maxX;
+    /// Maximum Y coordinates.
+    const float* maxY;
+    /// Maximum Z coordinates.
+    const float* maxZ;
+    /// Number of bounding boxes.
+    size_t count;
+};
+
+/// Spheres in structure of arrays layout for batched culling. Does not own the arrays.
+struct TURSO3D_API SphereArrays
+{
+    /// Center X coordinates.
+    const float* centerX;
+    /// Center Y coordinates.
+    const float* centerY;
+    /// Center Z coordinates.
+    const float* centerZ;
+    /// Radii.
+    const float* radius;
+    /// Number of spheres.
+    size_t count;
+};
+
 /// Convex constructed of 6 planes.
 class TURSO3D_API Frustum
 {
@@ -135,6 +169,15 @@ public:
         return INSIDE;
     }
     
+    /// Test bounding boxes for being (partially) inside. Set a bit in the visibility mask for each box that is, and return their number. The mask needs (count + 31) / 32 elements. Gives the same results as testing the boxes one by one.
+    size_t IsInsideFast(const BoundingBoxArrays& boxes, unsigned* mask) const;
+    /// Test spheres for being (partially) inside. Set a bit in the visibility mask for each sphere that is, and return their number. The mask needs (count + 31) / 32 elements.
+    size_t IsInsideFast(const SphereArrays& spheres, unsigned* mask) const;
+    /// Test bounding boxes for being (partially) inside. Write the indices of those that are in increasing order and return their number.
+    size_t CollectInsideFast(const BoundingBoxArrays& boxes, unsigned* indices) const;
+    /// Test spheres for being (partially) inside. Write the indices of those that are in increasing order and return their number.
+    size_t CollectInsideFast(const SphereArrays& spheres, unsigned* indices) const;
+
     /// Return distance of a point to the frustum, or 0 if inside.
     float Distance(const Vector3& point) const
     {
@@ -119,4 +119,12 @@ inline unsigned NextPowerOfTwo(unsigned value)
     return ret;
 }
 
+/// Count the number of set bits in an unsigned integer.
+inline unsigned CountSetBits(unsigned value)
+{
+    value = value - ((value >> 1) & 0x55555555);
+    value = (value & 0x33333333) + ((value >> 2) & 0x33333333);
+    return (((value + (value >> 4)) & 0x0f0f0f0f) * 0x01010101) >> 24;
+}
+
 }
@@ -169,13 +169,10 @@ float Ray::HitDistance(const Sphere& sphere) const
     if (d < 0.0f)
         return M_INFINITY;
     
-    // Get the nearer solution
+    // Get the nearer solution. As the origin is outside, the sphere is behind the ray if it is negative
     float dSqrt = sqrtf(d);
     float dist = (-b - dSqrt) / (2.0f * a);
-    if (dist >= 0.0f)
-        return dist;
-    else
-        return (-b + dSqrt) / (2.0f * a);
+    return dist >= 0.0f ? dist : M_INFINITY;
 }
 
 float Ray::HitDistance(const Vector3& v0, const Vector3& v1, const Vector3& v2) const
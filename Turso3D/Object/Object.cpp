@@ -78,6 +78,12 @@ Object* Object::Create(StringHash type)
     return it != factories.End() ? it->second->Create() : nullptr;
 }
 
+ObjectFactory* Object::Factory(StringHash type)
+{
+    auto it = factories.Find(type);
+    return it != factories.End() ? it->second.Get() : nullptr;
+}
+
 const String& Object::TypeNameFromType(StringHash type)
 {
     auto it = factories.Find(type);
@@ -48,6 +48,8 @@ public:
     static void RegisterFactory(ObjectFactory* factory);
     /// Create and return an object through a factory. The caller is assumed to take ownership of the object. Return null if no factory registered. 
     static Object* Create(StringHash type);
+    /// Return an object factory by type, or null if not registered.
+    static ObjectFactory* Factory(StringHash type);
     /// Return a type name from hash, or empty if not known. Requires a registered object factory.
     static const String& TypeNameFromType(StringHash type);
     /// Return a subsystem, template version.
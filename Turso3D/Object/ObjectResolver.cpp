@@ -1,5 +1,6 @@
 // For conditions of distribution and use, see copyright notice in License.txt
 
+#include "../Base/Sort.h"
 #include "../Debug/Log.h"
 #include "../IO/ObjectRef.h"
 #include "ObjectResolver.h"
@@ -10,10 +11,24 @@
 namespace Turso3D
 {
 
+static inline bool CompareObjectIds(const Pair<unsigned, Serializable*>& lhs, const Pair<unsigned, Serializable*>& rhs)
+{
+    return lhs.first < rhs.first;
+}
+
+ObjectResolver::ObjectResolver() :
+    deferResourceRefs(false),
+    objectsSorted(false)
+{
+}
+
 void ObjectResolver::StoreObject(unsigned oldId, Serializable* object)
 {
     if (object)
-        objects[oldId] = object;
+    {
+        objects.Push(MakePair(oldId, object));
+        objectsSorted = false;
+    }
 }
 
 void ObjectResolver::StoreObjectRef(Serializable* object, Attribute* attr, const ObjectRef& value)
@@ -24,18 +39,80 @@ void ObjectResolver::StoreObjectRef(Serializable* object, Attribute* attr, const
 
 void ObjectResolver::Resolve()
 {
-    for (auto it = objectRefs.Begin(); it != objectRefs.End(); ++it)
+    if (objectRefs.IsEmpty())
+        return;
+
+    SortObjects();
+    for (size_t i = 0; i < objectRefs.Size(); ++i)
+        ResolveObjectRef(i);
+}
+
+void ObjectResolver::SortObjects()
+{
+    if (objectRefs.IsEmpty() || objectsSorted)
+        return;
+
+    Sort(objects.Begin(), objects.End(), CompareObjectIds);
+    objectsSorted = true;
+}
+
+void ObjectResolver::ResolveObjectRef(size_t index)
+{
+    if (index >= objectRefs.Size())
+        return;
+
+    assert(objectsSorted);
+
+    const StoredObjectRef& stored = objectRefs[index];
+    // See if we can find the referred to object
+    size_t first = 0;
+    size_t last = objects.Size();
+    while (first < last)
     {
-        auto refIt = objects.Find(it->oldId);
-        // See if we can find the referred to object
-        if (refIt != objects.End())
-        {
-            AttributeImpl<ObjectRef>* typedAttr = static_cast<AttributeImpl<ObjectRef>*>(it->attr);
-            typedAttr->SetValue(it->object, ObjectRef(refIt->second->Id()));
-        }
+        size_t middle = (first + last) / 2;
+        if (objects[middle].first < stored.oldId)
+            first = middle + 1;
         else
-            LOGWARNING("Could not resolve object reference " + String(it->oldId));
+            last = middle;
     }
+
+    if (first < objects.Size() && objects[first].first == stored.oldId)
+    {
+        AttributeImpl<ObjectRef>* typedAttr = static_cast<AttributeImpl<ObjectRef>*>(stored.attr);
+        typedAttr->SetValue(stored.object, ObjectRef(objects[first].second->Id()));
+    }
+    else
+        LOGWARNING("Could not resolve object reference " + String(stored.oldId));
+}
+
+void ObjectResolver::SetDeferResourceRefs(bool enable)
+{
+    deferResourceRefs = enable;
+}
+
+void ObjectResolver::StoreResourceRef(Serializable* object, Attribute* attr, const ResourceRefList& value)
+{
+    if (object && attr && (attr->Type() == ATTR_RESOURCEREF || attr->Type() == ATTR_RESOURCEREFLIST))
+        resourceRefs.Push(StoredResourceRef(object, attr, value));
+}
+
+void ObjectResolver::ResolveResourceRef(size_t index)
+{
+    if (index >= resourceRefs.Size())
+        return;
+
+    StoredResourceRef& stored = resourceRefs[index];
+    if (stored.attr->Type() == ATTR_RESOURCEREF)
+    {
+        ResourceRef ref(stored.value.type, stored.value.names.Size() ? stored.value.names[0] : String::EMPTY);
+        stored.attr->FromValue(stored.object, &ref);
+    }
+    else
+        stored.attr->FromValue(stored.object, &stored.value);
+
+    // Release the names now, so that destroying a resolver with many resource refs does not free them all at once
+    Vector<String> names;
+    names.Swap(stored.value.names);
 }
 
 }
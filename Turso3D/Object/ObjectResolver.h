@@ -3,6 +3,7 @@
 #pragma once
 
 #include "../Base/HashMap.h"
+#include "../IO/ResourceRef.h"
 
 namespace Turso3D
 {
@@ -38,22 +39,74 @@ struct TURSO3D_API StoredObjectRef
     unsigned oldId;
 };
 
-/// Helper class for resolving object ref attributes when loading a scene.
+/// Stored resource ref or resource ref list attribute.
+struct TURSO3D_API StoredResourceRef
+{
+    /// Construct undefined.
+    StoredResourceRef() :
+        object(nullptr),
+        attr(nullptr)
+    {
+    }
+
+    /// Construct with values.
+    StoredResourceRef(Serializable* object_, Attribute* attr_, const ResourceRefList& value_) :
+        object(object_),
+        attr(attr_),
+        value(value_)
+    {
+    }
+
+    /// %Object that contains the attribute.
+    Serializable* object;
+    /// Description of the resource ref or resource ref list attribute.
+    Attribute* attr;
+    /// Resource type and names. A resource ref attribute has one name.
+    ResourceRefList value;
+};
+
+/// Helper class for resolving object ref attributes when loading a scene. Can also store resource ref attributes to be set later, so that nodes can be loaded outside the main thread.
 class TURSO3D_API ObjectResolver
 {
 public:
+    /// Construct.
+    ObjectResolver();
+
     /// Store an object along with its old id from the serialized data.
     void StoreObject(unsigned oldId, Serializable* object);
     /// Store an object ref attribute that needs to be resolved later.
     void StoreObjectRef(Serializable* object, Attribute* attr, const ObjectRef& value);
     /// Resolve the object ref attributes.
     void Resolve();
+    /// Sort the stored objects by their old ids for resolving the object ref attributes one at a time. Does nothing if there are no object ref attributes. Can be called outside the main thread once all objects have been stored.
+    void SortObjects();
+    /// Resolve a stored object ref attribute by index. The objects must have been sorted with SortObjects().
+    void ResolveObjectRef(size_t index);
+    /// Set whether to store resource ref and resource ref list attributes instead of setting them immediately, as setting them may load resources. They must then be set with ResolveResourceRef() in the main thread. Default false.
+    void SetDeferResourceRefs(bool enable);
+    /// Store a resource ref or resource ref list attribute to be set later.
+    void StoreResourceRef(Serializable* object, Attribute* attr, const ResourceRefList& value);
+    /// Set a stored resource ref attribute by index. The stored names are released, as they are not needed again.
+    void ResolveResourceRef(size_t index);
+
+    /// Return whether resource ref attributes are stored instead of set immediately.
+    bool DeferResourceRefs() const { return deferResourceRefs; }
+    /// Return the stored object ref attributes.
+    const Vector<StoredObjectRef>& ObjectRefs() const { return objectRefs; }
+    /// Return the stored resource ref attributes.
+    const Vector<StoredResourceRef>& ResourceRefs() const { return resourceRefs; }
 
 private:
-    /// Mapping of old id's to objects.
-    HashMap<unsigned, Serializable*> objects;
+    /// Objects with their old id's. Sorted by id only when resolving, as most loaded objects are not referred to.
+    Vector<Pair<unsigned, Serializable*> > objects;
     /// Stored object ref attributes.
     Vector<StoredObjectRef> objectRefs;
+    /// Stored resource ref attributes.
+    Vector<StoredResourceRef> resourceRefs;
+    /// Whether to store resource ref attributes.
+    bool deferResourceRefs;
+    /// Whether the objects have been sorted by their old ids.
+    bool objectsSorted;
 };
 
 }
@@ -1,11 +1,14 @@
 // For conditions of distribution and use, see copyright notice in License.txt
 
 #include "../IO/JSONValue.h"
+#include "../IO/MemoryBuffer.h"
 #include "../IO/ObjectRef.h"
 #include "../IO/Stream.h"
 #include "ObjectResolver.h"
 #include "Serializable.h"
 
+#include <cstring>
+
 #include "../Debug/DebugNew.h"
 
 namespace Turso3D
@@ -13,6 +16,26 @@ namespace Turso3D
 
 HashMap<StringHash, Vector<SharedPtr<Attribute> > > Serializable::classAttributes;
 
+AttributeLoadPlan::AttributeLoadPlan() :
+    hasAttributes(false)
+{
+}
+
+AttributeLoadPlan::AttributeLoadPlan(const Vector<SharedPtr<Attribute> >* attributes_) :
+    hasAttributes(attributes_ != nullptr)
+{
+    if (!attributes_)
+        return;
+
+    for (auto it = attributes_->Begin(); it != attributes_->End(); ++it)
+    {
+        Attribute* attr = *it;
+        attributes.Push(attr);
+        types.Push(attr->Type());
+        byteSizes.Push(attr->ByteSize());
+    }
+}
+
 void Serializable::Load(Stream& source, ObjectResolver& resolver)
 {
     const Vector<SharedPtr<Attribute> >* attributes = Attributes();
@@ -32,10 +55,12 @@ void Serializable::Load(Stream& source, ObjectResolver& resolver)
             if (attr->Type() == type)
             {
                 // Store object refs to the resolver instead of immediately setting
-                if (type != ATTR_OBJECTREF)
-                    attr->FromBinary(this, source);
-                else
+                if (type == ATTR_OBJECTREF)
                     resolver.StoreObjectRef(this, attr, source.Read<ObjectRef>());
+                else if (resolver.DeferResourceRefs() && (type == ATTR_RESOURCEREF || type == ATTR_RESOURCEREFLIST))
+                    StoreResourceRef(attr, source, resolver);
+                else
+                    attr->FromBinary(this, source);
                 
                 skip = false;
             }
@@ -46,6 +71,87 @@ void Serializable::Load(Stream& source, ObjectResolver& resolver)
     }
 }
 
+void Serializable::LoadAttributes(MemoryBuffer& source, const AttributeLoadPlan& plan, ObjectResolver& resolver)
+{
+    if (!plan.hasAttributes)
+        return; // Nothing to do
+
+    size_t numAttrs = source.ReadVLE();
+    const unsigned char* start = source.Data();
+    const unsigned char* data = start + source.Position();
+    const unsigned char* end = start + source.Size();
+    // Fixed-size values are copied to aligned storage before setting, as the binary data is not aligned. Matrix4 is the largest
+    float value[16];
+
+    for (size_t i = 0; i < numAttrs && data < end; ++i)
+    {
+        AttributeType type = (AttributeType)*data++;
+        Attribute* attr = i < plan.attributes.Size() && plan.types[i] == type ? plan.attributes[i] : nullptr;
+
+        if (attr)
+        {
+            size_t byteSize = plan.byteSizes[i];
+            if (byteSize)
+            {
+                if ((size_t)(end - data) < byteSize)
+                    break;
+
+                if (type == ATTR_BOOL)
+                {
+                    bool boolValue = *data != 0;
+                    attr->FromValue(this, &boolValue);
+                }
+                else if (type == ATTR_OBJECTREF)
+                {
+                    // Store object refs to the resolver instead of immediately setting
+                    ObjectRef ref;
+                    memcpy(&ref.id, data, sizeof ref.id);
+                    resolver.StoreObjectRef(this, attr, ref);
+                }
+                else
+                {
+                    memcpy(value, data, byteSize);
+                    attr->FromValue(this, value);
+                }
+
+                data += byteSize;
+                continue;
+            }
+            else if (type == ATTR_STRING)
+            {
+                const unsigned char* stringEnd = (const unsigned char*)memchr(data, 0, end - data);
+                String stringValue((const char*)data, (stringEnd ? stringEnd : end) - data);
+                attr->FromValue(this, &stringValue);
+                data = stringEnd ? stringEnd + 1 : end;
+                continue;
+            }
+        }
+
+        // Use the stream for the other variable-sized types, and to skip attributes that do not match
+        source.Seek(data - start);
+        if (attr && resolver.DeferResourceRefs() && (type == ATTR_RESOURCEREF || type == ATTR_RESOURCEREFLIST))
+            StoreResourceRef(attr, source, resolver);
+        else if (attr)
+            attr->FromBinary(this, source);
+        else
+            Attribute::Skip(type, source);
+        data = start + source.Position();
+    }
+
+    source.Seek(data - start);
+}
+
+void Serializable::StoreResourceRef(Attribute* attr, Stream& source, ObjectResolver& resolver)
+{
+    if (attr->Type() == ATTR_RESOURCEREF)
+    {
+        ResourceRef ref = source.Read<ResourceRef>();
+        resolver.StoreResourceRef(this, attr, ResourceRefList(ref.type, Vector<String>(&ref.name, 1)));
+    }
+    else
+        resolver.StoreResourceRef(this, attr, source.Read<ResourceRefList>());
+}
+
 void Serializable::Save(Stream& dest)
 {
     const Vector<SharedPtr<Attribute> >* attributes = Attributes();
@@ -76,10 +182,18 @@ void Serializable::LoadJSON(const JSONValue& source, ObjectResolver& resolver)
         if (jsonIt != object.End())
         {
             // Store object refs to the resolver instead of immediately setting
-            if (attr->Type() != ATTR_OBJECTREF)
-                attr->FromJSON(this, jsonIt->second);
-            else
+            AttributeType type = attr->Type();
+            if (type == ATTR_OBJECTREF)
                 resolver.StoreObjectRef(this, attr, ObjectRef((unsigned)jsonIt->second.GetNumber()));
+            else if (type == ATTR_RESOURCEREF && resolver.DeferResourceRefs())
+            {
+                ResourceRef ref(jsonIt->second.GetString());
+                resolver.StoreResourceRef(this, attr, ResourceRefList(ref.type, Vector<String>(&ref.name, 1)));
+            }
+            else if (type == ATTR_RESOURCEREFLIST && resolver.DeferResourceRefs())
+                resolver.StoreResourceRef(this, attr, ResourceRefList(jsonIt->second.GetString()));
+            else
+                attr->FromJSON(this, jsonIt->second);
         }
     }
 }
@@ -113,8 +227,7 @@ void Serializable::AttributeValue(Attribute* attr, void* dest)
 
 const Vector<SharedPtr<Attribute> >* Serializable::Attributes() const
 {
-    auto it = classAttributes.Find(Type());
-    return it != classAttributes.End() ? &it->second : nullptr;
+    return ClassAttributes(Type());
 }
 
 Attribute* Serializable::FindAttribute(const String& name) const
@@ -191,4 +304,10 @@ void Serializable::Skip(Stream& source)
     }
 }
 
+const Vector<SharedPtr<Attribute> >* Serializable::ClassAttributes(StringHash type)
+{
+    auto it = classAttributes.Find(type);
+    return it != classAttributes.End() ? &it->second : nullptr;
+}
+
 }
@@ -8,14 +8,35 @@
 namespace Turso3D
 {
 
+class MemoryBuffer;
 class ObjectResolver;
 
+/// Precompiled plan for loading the binary attributes of one type from memory.
+struct TURSO3D_API AttributeLoadPlan
+{
+    /// Construct empty.
+    AttributeLoadPlan();
+    /// Construct from the attribute descriptions of a type.
+    AttributeLoadPlan(const Vector<SharedPtr<Attribute> >* attributes);
+
+    /// Attribute descriptions in binary order.
+    Vector<Attribute*> attributes;
+    /// Attribute types in binary order.
+    Vector<AttributeType> types;
+    /// Byte sizes of the attribute data, or 0 for variable-sized types.
+    Vector<size_t> byteSizes;
+    /// Whether the type has registered attributes. If not, no attribute data is saved.
+    bool hasAttributes;
+};
+
 /// Base class for objects with automatic serialization using attributes.
 class TURSO3D_API Serializable : public Object
 {
 public:
-    /// Load from binary stream. Store object ref attributes to be resolved later.
+    /// Load from binary stream. Store object ref attributes, and resource ref attributes if the resolver defers them, to be resolved later.
     virtual void Load(Stream& source, ObjectResolver& resolver);
+    /// Load the attributes from a memory buffer with a plan built from this object's attributes. Read fixed-size and string attributes directly from memory instead of through virtual stream reads. Store object ref attributes to be resolved later.
+    void LoadAttributes(MemoryBuffer& source, const AttributeLoadPlan& plan, ObjectResolver& resolver);
     /// Save to binary stream.
     virtual void Save(Stream& dest);
     /// Load from JSON data. Optionally store object ref attributes to be resolved later.
@@ -78,6 +99,8 @@ public:
     static void CopyBaseAttribute(StringHash type, StringHash baseType, const String& name);
     /// Skip binary data of an object's all attributes.
     static void Skip(Stream& source);
+    /// Return the per-class attribute descriptions of a type, or null if none registered.
+    static const Vector<SharedPtr<Attribute> >* ClassAttributes(StringHash type);
     
     /// Register a per-class attribute, template version. Should not be used for base class attributes unless the type is explicitly specified, as by default the attribute will be re-registered to the base class redundantly.
     template <class T, class U> static void RegisterAttribute(const char* name, U (T::*getFunction)() const, void (T::*setFunction)(U), const U& defaultValue = U(), const char** enumNames = 0)
@@ -110,6 +133,9 @@ public:
     }
     
 private:
+    /// Read a resource ref or resource ref list attribute and store it to the resolver to be set later.
+    void StoreResourceRef(Attribute* attr, Stream& source, ObjectResolver& resolver);
+
     /// Per-class attributes.
     static HashMap<StringHash, Vector<SharedPtr<Attribute> > > classAttributes;
 };
@@ -0,0 +1,832 @@
+// For conditions of distribution and use, see copyright notice in License.txt
+
+#include "../Debug/Log.h"
+#include "../Math/Frustum.h"
+#include "../Math/Ray.h"
+#include "AABBTree.h"
+
+#include <cassert>
+
+#include "../Debug/DebugNew.h"
+
+namespace Turso3D
+{
+
+/// Largest bounding box size used in the surface area heuristic. Keeps the costs of huge boxes, such as directional lights', finite.
+static const float MAX_COST_SIZE = 1.0e18f;
+
+/// Return the surface area of a bounding box for the surface area heuristic.
+static float SurfaceArea(const BoundingBox& box)
+{
+    Vector3 size = box.Size();
+    size.x = Min(size.x, MAX_COST_SIZE);
+    size.y = Min(size.y, MAX_COST_SIZE);
+    size.z = Min(size.z, MAX_COST_SIZE);
+    return 2.0f * (size.x * size.y + size.y * size.z + size.z * size.x);
+}
+
+/// Return the union of two bounding boxes.
+static BoundingBox Union(const BoundingBox& lhs, const BoundingBox& rhs)
+{
+    BoundingBox ret(lhs);
+    ret.Merge(rhs);
+    return ret;
+}
+
+/// Reorder nodes so that the nth has the nth smallest bounding box center on an axis, the ones before it are not larger and the ones after it are not smaller.
+static void SelectNth(Pair<Vector3, size_t>* nodes, size_t count, size_t nth, int axis)
+{
+    size_t first = 0;
+    size_t last = count - 1;
+    while (first < last)
+    {
+        float pivot = nodes[first + (last - first) / 2].first.Data()[axis];
+        size_t i = first;
+        size_t j = last;
+        while (i <= j)
+        {
+            while (nodes[i].first.Data()[axis] < pivot)
+                ++i;
+            while (nodes[j].first.Data()[axis] > pivot)
+                --j;
+            if (i <= j)
+            {
+                Swap(nodes[i], nodes[j]);
+                ++i;
+                if (!j)
+                    break;
+                --j;
+            }
+        }
+
+        if (nth <= j)
+            last = j;
+        else if (nth >= i)
+            first = i;
+        else
+            break;
+    }
+}
+
+/// Child of a branch hit by a ray, for visiting the children in ray order.
+struct TreeNodeHit
+{
+    /// Tree node index.
+    int index;
+    /// Entry distance.
+    float distance;
+};
+
+AABBTree::AABBTree() :
+    root(-1),
+    freeList(-1),
+    margin(DEFAULT_AABB_TREE_MARGIN),
+    numLayoutChanges(0)
+{
+}
+
+AABBTree::~AABBTree()
+{
+    for (auto it = data.nodes.Begin(); it != data.nodes.End(); ++it)
+    {
+        OctreeNode* node = *it;
+        node->octantIndex = 0;
+        node->aabbTree = nullptr;
+    }
+
+    for (auto it = updateQueue.Begin(); it != updateQueue.End(); ++it)
+    {
+        OctreeNode* node = *it;
+        if (node)
+        {
+            node->SetFlag(NF_OCTREE_UPDATE_QUEUED, false);
+            node->aabbTree = nullptr;
+        }
+    }
+}
+
+void AABBTree::RegisterObject()
+{
+    RegisterFactory<AABBTree>();
+    CopyBaseAttributes<AABBTree, Node>();
+    RegisterAttribute("margin", &AABBTree::Margin, &AABBTree::SetMarginAttr, DEFAULT_AABB_TREE_MARGIN);
+}
+
+void AABBTree::Update()
+{
+    PROFILE(UpdateAABBTree);
+
+    size_t numInserted = data.nodes.Size();
+
+    for (auto it = updateQueue.Begin(); it != updateQueue.End(); ++it)
+    {
+        OctreeNode* node = *it;
+        // If node was removed before update could happen, a null pointer will be in its place
+        if (!node)
+            continue;
+
+        node->SetFlag(NF_OCTREE_UPDATE_QUEUED, false);
+        const BoundingBox& box = node->WorldBoundingBox();
+
+        if (IsInserted(node))
+        {
+            // Only refresh the culling data if still fits the leaf's enlarged bounding box
+            size_t index = node->octantIndex;
+            data.SetNodeData(index, node);
+            // A node added earlier in this update gets its leaf below
+            if (index >= numInserted)
+                continue;
+            int leaf = dataLeaves[index];
+            if (treeNodes[leaf].box.IsInside(box) == INSIDE || RefitLeaf(leaf, FatBoundingBox(box)))
+                continue;
+
+            RemoveLeaf(leaf);
+            treeNodes[leaf].box = FatBoundingBox(box);
+            InsertLeaf(leaf);
+        }
+        else
+        {
+            // The new nodes get their leaves after the queue has been processed, as the tree may be rebuilt instead
+            node->octantIndex = data.AddNode(node);
+        }
+    }
+
+    updateQueue.Clear();
+
+    // When the new nodes at least double the tree, such as when a scene is loaded, building the whole tree at once is faster
+    // than inserting them one by one, and leaves the culling data in order
+    size_t numNodes = data.nodes.Size();
+    if (numNodes - numInserted > 1 && numNodes - numInserted >= numInserted)
+    {
+        Build();
+        return;
+    }
+
+    for (size_t i = numInserted; i < numNodes; ++i)
+    {
+        int leaf = AllocateTreeNode();
+        dataLeaves.Push(leaf);
+        SetLeafData(leaf, i);
+        treeNodes[leaf].box = FatBoundingBox(data.NodeBoundingBox(i));
+        InsertLeaf(leaf);
+    }
+
+    // Insertions and removals scatter the subtrees' nodes in the culling data. Reorder when enough have accumulated, so
+    // that the cost is spread over the changes
+    if (numLayoutChanges && numLayoutChanges >= data.nodes.Size() / AABB_TREE_RELAYOUT_DIVISOR)
+        Relayout();
+}
+
+void AABBTree::SetMargin(float margin_)
+{
+    margin = Max(margin_, 0.0f);
+}
+
+void AABBTree::RemoveNode(OctreeNode* node)
+{
+    assert(node);
+    if (IsInserted(node))
+        RemoveNodeData(node);
+    if (node->TestFlag(NF_OCTREE_UPDATE_QUEUED))
+        CancelUpdate(node);
+    node->octantIndex = 0;
+}
+
+void AABBTree::QueueUpdate(OctreeNode* node)
+{
+    assert(node);
+    updateQueue.Push(node);
+    node->SetFlag(NF_OCTREE_UPDATE_QUEUED, true);
+}
+
+void AABBTree::CancelUpdate(OctreeNode* node)
+{
+    assert(node);
+    // Search from the back and drop the cancelled entries at the end, so that removing many nodes in the reverse order of
+    // adding them, such as when unloading a scene partition, does not search the whole queue for each node
+    for (size_t i = updateQueue.Size(); i > 0; --i)
+    {
+        if (updateQueue[i - 1] == node)
+        {
+            updateQueue[i - 1] = nullptr;
+            break;
+        }
+    }
+    while (updateQueue.Size() && !updateQueue.Back())
+        updateQueue.Pop();
+    node->SetFlag(NF_OCTREE_UPDATE_QUEUED, false);
+}
+
+void AABBTree::Raycast(Vector<RaycastResult>& result, const Ray& ray, unsigned short nodeFlags, float maxDistance, unsigned layerMask) const
+{
+    PROFILE(AABBTreeRaycast);
+
+    result.Clear();
+    if (root >= 0)
+        CollectNodes(result, root, ray, nodeFlags, maxDistance, layerMask);
+    Sort(result.Begin(), result.End(), CompareRaycastResults);
+}
+
+RaycastResult AABBTree::RaycastSingle(const Ray& ray, unsigned short nodeFlags, float maxDistance, unsigned layerMask) const
+{
+    PROFILE(AABBTreeRaycastSingle);
+
+    RaycastResult result;
+    result.distance = maxDistance;
+    result.node = nullptr;
+
+    if (root >= 0 && ray.HitDistance(treeNodes[root].box) < maxDistance)
+        CollectClosestHit(result, queryBuffers.Buffers(), root, ray, nodeFlags, layerMask);
+
+    if (!result.node)
+    {
+        result.position = result.normal = Vector3::ZERO;
+        result.distance = M_INFINITY;
+        result.subObject = 0;
+    }
+    return result;
+}
+
+void AABBTree::FindNodes(Vector<Pair<OctreeNode*, unsigned> >& result, const Frustum* frusta, size_t numFrusta,
+    unsigned short nodeFlags, unsigned layerMask) const
+{
+    PROFILE(QueryAABBTree);
+
+    assert(numFrusta <= MAX_QUERY_FRUSTA);
+    if (!numFrusta || root < 0)
+        return;
+
+    unsigned activeMask = numFrusta < MAX_QUERY_FRUSTA ? (1u << numFrusta) - 1 : 0xffffffff;
+    CollectNodes(result, root, frusta, activeMask, 0, nodeFlags, layerMask);
+}
+
+void AABBTree::SetMarginAttr(float margin_)
+{
+    SetMargin(margin_);
+}
+
+int AABBTree::AllocateTreeNode()
+{
+    int index;
+    if (freeList >= 0)
+    {
+        index = freeList;
+        freeList = treeNodes[index].parent;
+    }
+    else
+    {
+        index = (int)treeNodes.Size();
+        treeNodes.Resize(index + 1);
+    }
+
+    AABBTreeNode& treeNode = treeNodes[index];
+    treeNode.parent = -1;
+    treeNode.children[0] = treeNode.children[1] = -1;
+    treeNode.height = 0;
+    treeNode.dataIndex = 0;
+    treeNode.dataEnd = 0;
+    treeNode.numLeaves = 0;
+    return index;
+}
+
+void AABBTree::FreeTreeNode(int index)
+{
+    treeNodes[index].parent = freeList;
+    treeNodes[index].height = -1;
+    freeList = index;
+}
+
+void AABBTree::InsertLeaf(int leaf)
+{
+    ++numLayoutChanges;
+
+    if (root < 0)
+    {
+        root = leaf;
+        treeNodes[root].parent = -1;
+        return;
+    }
+
+    // Find the best sibling by descending towards the child which grows the least in surface area. The cost of creating a new
+    // branch at a node is the union's area plus the growth of all the ancestors
+    BoundingBox leafBox = treeNodes[leaf].box;
+    int index = root;
+    while (!treeNodes[index].IsLeaf())
+    {
+        const AABBTreeNode& treeNode = treeNodes[index];
+        float area = SurfaceArea(treeNode.box);
+        float combinedArea = SurfaceArea(Union(treeNode.box, leafBox));
+        float cost = 2.0f * combinedArea;
+        float inheritanceCost = 2.0f * (combinedArea - area);
+
+        float childCosts[2];
+        for (size_t i = 0; i < 2; ++i)
+        {
+            const AABBTreeNode& child = treeNodes[treeNode.children[i]];
+            float unionArea = SurfaceArea(Union(child.box, leafBox));
+            childCosts[i] = (child.IsLeaf() ? unionArea : unionArea - SurfaceArea(child.box)) + inheritanceCost;
+        }
+
+        if (cost < childCosts[0] && cost < childCosts[1])
+            break;
+        index = childCosts[0] <= childCosts[1] ? treeNode.children[0] : treeNode.children[1];
+    }
+
+    // Create a new branch for the sibling and the leaf
+    int sibling = index;
+    int oldParent = treeNodes[sibling].parent;
+    int newParent = AllocateTreeNode();
+    AABBTreeNode& branch = treeNodes[newParent];
+    branch.parent = oldParent;
+    branch.children[0] = sibling;
+    branch.children[1] = leaf;
+    treeNodes[sibling].parent = newParent;
+    treeNodes[leaf].parent = newParent;
+    CombineChildren(newParent);
+
+    if (oldParent >= 0)
+    {
+        AABBTreeNode& parent = treeNodes[oldParent];
+        if (parent.children[0] == sibling)
+            parent.children[0] = newParent;
+        else
+            parent.children[1] = newParent;
+    }
+    else
+        root = newParent;
+
+    Refit(treeNodes[leaf].parent);
+}
+
+void AABBTree::RemoveLeaf(int leaf)
+{
+    ++numLayoutChanges;
+
+    if (leaf == root)
+    {
+        root = -1;
+        return;
+    }
+
+    // The sibling takes the place of the parent branch, which is freed
+    int parent = treeNodes[leaf].parent;
+    int grandParent = treeNodes[parent].parent;
+    int sibling = treeNodes[parent].children[0] == leaf ? treeNodes[parent].children[1] : treeNodes[parent].children[0];
+
+    if (grandParent >= 0)
+    {
+        AABBTreeNode& branch = treeNodes[grandParent];
+        if (branch.children[0] == parent)
+            branch.children[0] = sibling;
+        else
+            branch.children[1] = sibling;
+        treeNodes[sibling].parent = grandParent;
+        FreeTreeNode(parent);
+        Refit(grandParent);
+    }
+    else
+    {
+        root = sibling;
+        treeNodes[sibling].parent = -1;
+        FreeTreeNode(parent);
+    }
+
+    treeNodes[leaf].parent = -1;
+}
+
+int AABBTree::Balance(int indexA)
+{
+    // Rotate the taller grandchild up if the children's heights differ by more than one
+    AABBTreeNode& a = treeNodes[indexA];
+    if (a.IsLeaf() || a.height < 2)
+        return indexA;
+
+    int indexB = a.children[0];
+    int indexC = a.children[1];
+    int balance = treeNodes[indexC].height - treeNodes[indexB].height;
+    if (balance >= -1 && balance <= 1)
+        return indexA;
+
+    // Rotate the taller child C or B up, making A its child
+    int indexUp = balance > 0 ? indexC : indexB;
+    AABBTreeNode& up = treeNodes[indexUp];
+    int indexF = up.children[0];
+    int indexG = up.children[1];
+
+    up.children[0] = indexA;
+    up.parent = a.parent;
+    a.parent = indexUp;
+
+    if (up.parent >= 0)
+    {
+        AABBTreeNode& parent = treeNodes[up.parent];
+        if (parent.children[0] == indexA)
+            parent.children[0] = indexUp;
+        else
+            parent.children[1] = indexUp;
+    }
+    else
+        root = indexUp;
+
+    // The taller grandchild stays under the rotated node, the shorter one moves under A
+    AABBTreeNode& f = treeNodes[indexF];
+    AABBTreeNode& g = treeNodes[indexG];
+    int indexKeep = f.height > g.height ? indexF : indexG;
+    int indexMove = f.height > g.height ? indexG : indexF;
+    up.children[1] = indexKeep;
+    if (balance > 0)
+        a.children[1] = indexMove;
+    else
+        a.children[0] = indexMove;
+    treeNodes[indexMove].parent = indexA;
+
+    CombineChildren(indexA);
+    CombineChildren(indexUp);
+    return indexUp;
+}
+
+void AABBTree::Refit(int index)
+{
+    while (index >= 0)
+    {
+        index = Balance(index);
+        CombineChildren(index);
+        index = treeNodes[index].parent;
+    }
+}
+
+bool AABBTree::RefitLeaf(int leaf, const BoundingBox& box)
+{
+    // Find a near ancestor which still contains the moved box. The leaf can then stay in place, and only the branches below
+    // the ancestor need their boxes updated, without the search and the rotations of a reinsertion
+    int ancestor = treeNodes[leaf].parent;
+    for (size_t i = 0; i < MAX_AABB_TREE_REFIT_LEVELS && ancestor >= 0; ++i)
+    {
+        if (treeNodes[ancestor].box.IsInside(box) == INSIDE)
+            break;
+        ancestor = treeNodes[ancestor].parent;
+    }
+    if (ancestor < 0 || treeNodes[ancestor].box.IsInside(box) != INSIDE)
+        return false;
+
+    treeNodes[leaf].box = box;
+    for (int index = treeNodes[leaf].parent; index != ancestor; index = treeNodes[index].parent)
+    {
+        AABBTreeNode& treeNode = treeNodes[index];
+        treeNode.box = Union(treeNodes[treeNode.children[0]].box, treeNodes[treeNode.children[1]].box);
+    }
+    return true;
+}
+
+void AABBTree::RemoveNodeData(OctreeNode* node)
+{
+    size_t index = node->octantIndex;
+    int leaf = dataLeaves[index];
+    RemoveLeaf(leaf);
+    FreeTreeNode(leaf);
+
+    // Keep the leaf indices in the same order as the culling data
+    OctreeNode* moved = data.RemoveNode(index);
+    if (moved)
+    {
+        moved->octantIndex = index;
+        int movedLeaf = dataLeaves.Back();
+        dataLeaves[index] = movedLeaf;
+        SetLeafData(movedLeaf, index);
+        UpdateDataRanges(treeNodes[movedLeaf].parent);
+    }
+    dataLeaves.Pop();
+}
+
+void AABBTree::SetLeafData(int leaf, size_t index)
+{
+    AABBTreeNode& treeNode = treeNodes[leaf];
+    treeNode.dataIndex = index;
+    treeNode.dataEnd = index + 1;
+    treeNode.numLeaves = 1;
+}
+
+void AABBTree::CombineChildren(int index)
+{
+    AABBTreeNode& treeNode = treeNodes[index];
+    const AABBTreeNode& child0 = treeNodes[treeNode.children[0]];
+    const AABBTreeNode& child1 = treeNodes[treeNode.children[1]];
+    treeNode.box = Union(child0.box, child1.box);
+    treeNode.height = 1 + Max(child0.height, child1.height);
+    treeNode.dataIndex = child0.dataIndex < child1.dataIndex ? child0.dataIndex : child1.dataIndex;
+    treeNode.dataEnd = child0.dataEnd > child1.dataEnd ? child0.dataEnd : child1.dataEnd;
+    treeNode.numLeaves = child0.numLeaves + child1.numLeaves;
+}
+
+void AABBTree::UpdateDataRanges(int index)
+{
+    while (index >= 0)
+    {
+        AABBTreeNode& treeNode = treeNodes[index];
+        const AABBTreeNode& child0 = treeNodes[treeNode.children[0]];
+        const AABBTreeNode& child1 = treeNodes[treeNode.children[1]];
+        treeNode.dataIndex = child0.dataIndex < child1.dataIndex ? child0.dataIndex : child1.dataIndex;
+        treeNode.dataEnd = child0.dataEnd > child1.dataEnd ? child0.dataEnd : child1.dataEnd;
+        index = treeNode.parent;
+    }
+}
+
+void AABBTree::BeginLayout()
+{
+    size_t numNodes = data.nodes.Size();
+    layoutData.Clear();
+    layoutData.Reserve(numNodes);
+    layoutLeaves.Clear();
+    layoutLeaves.Reserve(numNodes);
+    layoutTreeNodes.Clear();
+    layoutTreeNodes.Reserve(numNodes ? 2 * numNodes - 1 : 0);
+}
+
+void AABBTree::EndLayout()
+{
+    // The free tree nodes are left out of the new layout
+    data.Swap(layoutData);
+    dataLeaves.Swap(layoutLeaves);
+    treeNodes.Swap(layoutTreeNodes);
+    freeList = -1;
+    numLayoutChanges = 0;
+}
+
+void AABBTree::Relayout()
+{
+    PROFILE(RelayoutAABBTree);
+
+    BeginLayout();
+    if (root >= 0)
+        root = LayoutSubtree(root, -1);
+    EndLayout();
+}
+
+int AABBTree::LayoutSubtree(int index, int parent)
+{
+    int newIndex = (int)layoutTreeNodes.Size();
+    layoutTreeNodes.Push(treeNodes[index]);
+    layoutTreeNodes[newIndex].parent = parent;
+
+    const AABBTreeNode& treeNode = treeNodes[index];
+    if (treeNode.IsLeaf())
+    {
+        size_t dataIndex = layoutData.AddNode(data, treeNode.dataIndex);
+        layoutData.nodes[dataIndex]->octantIndex = dataIndex;
+        layoutLeaves.Push(newIndex);
+        AABBTreeNode& newLeaf = layoutTreeNodes[newIndex];
+        newLeaf.dataIndex = dataIndex;
+        newLeaf.dataEnd = dataIndex + 1;
+    }
+    else
+    {
+        int child0 = LayoutSubtree(treeNode.children[0], newIndex);
+        int child1 = LayoutSubtree(treeNode.children[1], newIndex);
+        AABBTreeNode& newBranch = layoutTreeNodes[newIndex];
+        newBranch.children[0] = child0;
+        newBranch.children[1] = child1;
+        newBranch.dataIndex = layoutTreeNodes[child0].dataIndex;
+        newBranch.dataEnd = layoutTreeNodes[child1].dataEnd;
+    }
+
+    return newIndex;
+}
+
+void AABBTree::Build()
+{
+    PROFILE(BuildAABBTree);
+
+    // Split by the node bounding box centers, copied next to the culling data indices so that the splits do not need to access
+    // the culling data
+    size_t numNodes = data.nodes.Size();
+    buildNodes.Resize(numNodes);
+    for (size_t i = 0; i < numNodes; ++i)
+    {
+        buildNodes[i].first = Vector3(0.5f * data.nodeMinX[i] + 0.5f * data.nodeMaxX[i], 0.5f * data.nodeMinY[i] + 0.5f * data.nodeMaxY[i],
+            0.5f * data.nodeMinZ[i] + 0.5f * data.nodeMaxZ[i]);
+        buildNodes[i].second = i;
+    }
+
+    BeginLayout();
+    root = numNodes ? BuildSubtree(&buildNodes[0], numNodes, -1) : -1;
+    EndLayout();
+}
+
+int AABBTree::BuildSubtree(Pair<Vector3, size_t>* nodes, size_t count, int parent)
+{
+    int newIndex = (int)layoutTreeNodes.Size();
+    layoutTreeNodes.Resize(newIndex + 1);
+
+    if (count == 1)
+    {
+        size_t dataIndex = layoutData.AddNode(data, nodes[0].second);
+        layoutData.nodes[dataIndex]->octantIndex = dataIndex;
+        layoutLeaves.Push(newIndex);
+
+        AABBTreeNode& leaf = layoutTreeNodes[newIndex];
+        leaf.box = FatBoundingBox(layoutData.NodeBoundingBox(dataIndex));
+        leaf.parent = parent;
+        leaf.children[0] = leaf.children[1] = -1;
+        leaf.height = 0;
+        leaf.dataIndex = dataIndex;
+        leaf.dataEnd = dataIndex + 1;
+        leaf.numLeaves = 1;
+        return newIndex;
+    }
+
+    // Split at the median of the node centers along the axis where they are spread the widest, which keeps the tree balanced
+    Vector3 minCenter = nodes[0].first;
+    Vector3 maxCenter = nodes[0].first;
+    for (size_t i = 1; i < count; ++i)
+    {
+        const Vector3& center = nodes[i].first;
+        minCenter.x = Min(minCenter.x, center.x);
+        minCenter.y = Min(minCenter.y, center.y);
+        minCenter.z = Min(minCenter.z, center.z);
+        maxCenter.x = Max(maxCenter.x, center.x);
+        maxCenter.y = Max(maxCenter.y, center.y);
+        maxCenter.z = Max(maxCenter.z, center.z);
+    }
+
+    Vector3 spread = maxCenter - minCenter;
+    int splitAxis = spread.x >= spread.y && spread.x >= spread.z ? 0 : (spread.y >= spread.z ? 1 : 2);
+    size_t split = count / 2;
+    SelectNth(nodes, count, split, splitAxis);
+    int child0 = BuildSubtree(nodes, split, newIndex);
+    int child1 = BuildSubtree(nodes + split, count - split, newIndex);
+
+    AABBTreeNode& branch = layoutTreeNodes[newIndex];
+    const AABBTreeNode& left = layoutTreeNodes[child0];
+    const AABBTreeNode& right = layoutTreeNodes[child1];
+    branch.box = Union(left.box, right.box);
+    branch.parent = parent;
+    branch.children[0] = child0;
+    branch.children[1] = child1;
+    branch.height = 1 + Max(left.height, right.height);
+    branch.dataIndex = left.dataIndex;
+    branch.dataEnd = right.dataEnd;
+    branch.numLeaves = count;
+    return newIndex;
+}
+
+BoundingBox AABBTree::FatBoundingBox(const BoundingBox& box) const
+{
+    Vector3 pad = box.Size() * AABB_TREE_MARGIN_FRACTION + Vector3(margin, margin, margin);
+    BoundingBox ret(box.min - pad, box.max + pad);
+
+    // Huge boxes would overflow to infinity
+    ret.min.x = Max(ret.min.x, -M_MAX_FLOAT);
+    ret.min.y = Max(ret.min.y, -M_MAX_FLOAT);
+    ret.min.z = Max(ret.min.z, -M_MAX_FLOAT);
+    ret.max.x = Min(ret.max.x, M_MAX_FLOAT);
+    ret.max.y = Min(ret.max.y, M_MAX_FLOAT);
+    ret.max.z = Min(ret.max.z, M_MAX_FLOAT);
+    return ret;
+}
+
+void AABBTree::CollectNodes(Vector<OctreeNode*>& result, int index, unsigned short nodeFlags, unsigned layerMask) const
+{
+    const AABBTreeNode& treeNode = treeNodes[index];
+    if (treeNode.IsContiguous())
+    {
+        for (size_t i = treeNode.dataIndex; i < treeNode.dataEnd; ++i)
+        {
+            if (MatchData(i, nodeFlags, layerMask))
+                result.Push(data.nodes[i]);
+        }
+    }
+    else
+    {
+        CollectNodes(result, treeNode.children[0], nodeFlags, layerMask);
+        CollectNodes(result, treeNode.children[1], nodeFlags, layerMask);
+    }
+}
+
+void AABBTree::CollectRangeNodes(Vector<OctreeNode*>& result, size_t start, size_t end, const Frustum& frustum,
+    unsigned short nodeFlags, unsigned layerMask) const
+{
+    unsigned visibleMask[(AABB_TREE_BUCKET_SIZE + 31) / 32];
+    if (!frustum.IsInsideFast(data.NodeBoundingBoxes(start, end), visibleMask))
+        return;
+
+    for (size_t i = start; i < end; ++i)
+    {
+        size_t j = i - start;
+        if ((visibleMask[j >> 5] & (1u << (j & 31))) && MatchData(i, nodeFlags, layerMask))
+            result.Push(data.nodes[i]);
+    }
+}
+
+void AABBTree::CollectNodes(Vector<Pair<OctreeNode*, unsigned> >& result, int index, const Frustum* frusta, unsigned activeMask,
+    unsigned insideMask, unsigned short nodeFlags, unsigned layerMask) const
+{
+    const AABBTreeNode& treeNode = treeNodes[index];
+    bool isLeaf = treeNode.IsLeaf();
+    if (isLeaf && !MatchLeaf(treeNode, nodeFlags, layerMask))
+        return;
+
+    // Test the subtree only against the frusta that still intersect it partially. Leaves use the node's own bounding box
+    BoundingBox box = isLeaf ? data.NodeBoundingBox(treeNode.dataIndex) : treeNode.box;
+    unsigned testMask = activeMask & ~insideMask;
+    for (unsigned i = 0; i < MAX_QUERY_FRUSTA && (testMask >> i); ++i)
+    {
+        unsigned bit = 1u << i;
+        if (!(testMask & bit))
+            continue;
+
+        Intersection res = frusta[i].IsInside(box);
+        if (res == OUTSIDE)
+            activeMask &= ~bit;
+        else if (res == INSIDE)
+            insideMask |= bit;
+    }
+
+    if (!activeMask)
+        return;
+
+    if (isLeaf)
+        result.Push(MakePair(data.nodes[treeNode.dataIndex], activeMask));
+    else if (activeMask == insideMask && treeNode.IsContiguous())
+    {
+        // All remaining frusta contain the subtree
+        for (size_t i = treeNode.dataIndex; i < treeNode.dataEnd; ++i)
+        {
+            if (MatchData(i, nodeFlags, layerMask))
+                result.Push(MakePair(data.nodes[i], activeMask));
+        }
+    }
+    else
+    {
+        CollectNodes(result, treeNode.children[0], frusta, activeMask, insideMask, nodeFlags, layerMask);
+        CollectNodes(result, treeNode.children[1], frusta, activeMask, insideMask, nodeFlags, layerMask);
+    }
+}
+
+void AABBTree::CollectNodes(Vector<RaycastResult>& result, int index, const Ray& ray, unsigned short nodeFlags, float maxDistance,
+    unsigned layerMask) const
+{
+    const AABBTreeNode& treeNode = treeNodes[index];
+    if (ray.HitDistance(treeNode.box) >= maxDistance)
+        return;
+
+    if (treeNode.IsLeaf())
+    {
+        size_t i = treeNode.dataIndex;
+        if (MatchLeaf(treeNode, nodeFlags, layerMask) && ray.HitDistance(data.NodeBoundingBox(i)) < maxDistance)
+            data.nodes[i]->OnRaycast(result, ray, maxDistance);
+    }
+    else
+    {
+        CollectNodes(result, treeNode.children[0], ray, nodeFlags, maxDistance, layerMask);
+        CollectNodes(result, treeNode.children[1], ray, nodeFlags, maxDistance, layerMask);
+    }
+}
+
+void AABBTree::CollectClosestHit(RaycastResult& result, QueryBuffers& buffers, int index, const Ray& ray, unsigned short nodeFlags,
+    unsigned layerMask) const
+{
+    const AABBTreeNode& treeNode = treeNodes[index];
+    if (treeNode.IsLeaf())
+    {
+        size_t i = treeNode.dataIndex;
+        if (!MatchLeaf(treeNode, nodeFlags, layerMask) || ray.HitDistance(data.NodeBoundingBox(i)) >= result.distance)
+            return;
+
+        Vector<RaycastResult>& finalRes = buffers.finalRes;
+        finalRes.Clear();
+        data.nodes[i]->OnRaycast(finalRes, ray, result.distance);
+        for (auto hit = finalRes.Begin(); hit != finalRes.End(); ++hit)
+        {
+            if (hit->distance < result.distance)
+                result = *hit;
+        }
+        return;
+    }
+
+    // Visit the nearer child first. The farther one can be skipped if the closest hit is nearer than it
+    TreeNodeHit childHits[2];
+    size_t numChildHits = 0;
+    for (size_t i = 0; i < 2; ++i)
+    {
+        int child = treeNode.children[i];
+        float distance = ray.HitDistance(treeNodes[child].box);
+        if (distance < result.distance)
+        {
+            childHits[numChildHits].index = child;
+            childHits[numChildHits].distance = distance;
+            ++numChildHits;
+        }
+    }
+
+    if (numChildHits == 2 && childHits[1].distance < childHits[0].distance)
+    {
+        TreeNodeHit temp = childHits[0];
+        childHits[0] = childHits[1];
+        childHits[1] = temp;
+    }
+
+    for (size_t i = 0; i < numChildHits && childHits[i].distance < result.distance; ++i)
+        CollectClosestHit(result, buffers, childHits[i].index, ray, nodeFlags, layerMask);
+}
+
+}
@@ -0,0 +1,357 @@
+// For conditions of distribution and use, see copyright notice in License.txt
+
+#pragma once
+
+#include "Octree.h"
+
+namespace Turso3D
+{
+
+/// Default margin in world units by which the AABB tree leaf bounding boxes are enlarged.
+static const float DEFAULT_AABB_TREE_MARGIN = 0.1f;
+/// Fraction of the node bounding box size by which the AABB tree leaf bounding boxes are enlarged in addition to the margin.
+static const float AABB_TREE_MARGIN_FRACTION = 0.5f;
+/// Maximum number of levels above a moved leaf searched for a branch which still contains it, so that the leaf can be refit in place instead of reinserted.
+static const size_t MAX_AABB_TREE_REFIT_LEVELS = 8;
+/// Maximum number of leaves in a subtree whose nodes are tested directly from the culling data in a volume query, instead of descending to the leaves.
+static const size_t AABB_TREE_BUCKET_SIZE = 32;
+/// Divisor of the node count which gives the number of leaf insertions and removals after which the culling data is reordered to follow the tree.
+static const size_t AABB_TREE_RELAYOUT_DIVISOR = 4;
+
+/// Node of a dynamic AABB tree. A leaf refers to one octree node, a branch has two children.
+struct TURSO3D_API AABBTreeNode
+{
+    /// Return whether is a leaf.
+    bool IsLeaf() const { return children[0] < 0; }
+
+    /// Bounding box. For a leaf, the octree node's bounding box enlarged by the margin, so that small movements do not need reinsertion.
+    BoundingBox box;
+    /// Parent node index, or the next free node index if the node is free.
+    int parent;
+    /// Child node indices. Negative for a leaf.
+    int children[2];
+    /// Height from the leaves. Zero for a leaf and negative for a free node.
+    int height;
+    /// Index in the culling data for a leaf. For a branch, the lowest index of the nodes in the subtree.
+    size_t dataIndex;
+    /// One past the highest index of the nodes in the subtree in the culling data.
+    size_t dataEnd;
+    /// Number of leaves in the subtree.
+    size_t numLeaves;
+
+    /// Return whether the nodes of the subtree are contiguous in the culling data, so that they can be collected as one range. Always true for a leaf.
+    bool IsContiguous() const { return dataEnd - dataIndex == numLeaves; }
+};
+
+/// Dynamic bounding volume hierarchy for rendering, an alternative to the octree for very non-uniform scenes. Nodes are inserted by the surface area heuristic and the tree is kept balanced with rotations. Has the same queries as the octree. The culling data is kept in the order of the leaves, so that subtrees inside a query volume are collected as ranges and small subtrees are tested in batches like the octants of the octree. Raycasts are faster than the octree's, but inserting and updating nodes is slower; 08_Benchmark compares the two. Should be created as a child of the scene root instead of an octree; the Renderer uses whichever the scene has, preferring the octree. Queries that do not modify the tree can run in several threads at once under the same conditions as with the octree.
+class TURSO3D_API AABBTree : public Node
+{
+    OBJECT(AABBTree);
+
+public:
+    /// Construct.
+    AABBTree();
+    /// Destruct. Detach the nodes.
+    ~AABBTree();
+
+    /// Register factory and attributes.
+    static void RegisterObject();
+
+    /// Process the queue of nodes to be reinserted. Nodes which still fit their leaf bounding box only refresh their culling data. Nodes which still fit a near ancestor branch have their leaf refit in place, others are removed and reinserted. If the new nodes at least double the tree, build the whole tree top down instead of inserting them one by one. Otherwise reorder the culling data to follow the tree after enough insertions and removals.
+    void Update();
+    /// Set the margin by which the leaf bounding boxes are enlarged. Larger margins mean fewer reinsertions, but looser culling of the branches. Applies to leaves inserted afterward.
+    void SetMargin(float margin);
+    /// Remove a node from the tree.
+    void RemoveNode(OctreeNode* node);
+    /// Queue a reinsertion for a node.
+    void QueueUpdate(OctreeNode* node);
+    /// Cancel a pending reinsertion.
+    void CancelUpdate(OctreeNode* node);
+    /// Query for nodes with a raycast and return all results.
+    void Raycast(Vector<RaycastResult>& result, const Ray& ray, unsigned short nodeFlags, float maxDistance = M_INFINITY, unsigned layerMask = LAYERMASK_ALL) const;
+    /// Query for nodes with a raycast and return the closest result. Visits the branches in ray order and stops when the closest hit is nearer than the next branch.
+    RaycastResult RaycastSingle(const Ray& ray, unsigned short nodeFlags, float maxDistance = M_INFINITY, unsigned layerMask = LAYERMASK_ALL) const;
+
+    /// Return the margin by which the leaf bounding boxes are enlarged.
+    float Margin() const { return margin; }
+    /// Return number of nodes in the tree.
+    size_t NumNodes() const { return data.nodes.Size(); }
+    /// Return height of the tree. Zero if empty or only one node.
+    int Height() const { return root >= 0 ? treeNodes[root].height : 0; }
+    /// Return bounding box of all nodes, including the margins.
+    BoundingBox RootBoundingBox() const { return root >= 0 ? treeNodes[root].box : BoundingBox(); }
+    /// Return the culling data of the nodes in the tree.
+    const NodeCullingData& CullingData() const { return data; }
+
+    /// Query for nodes using a volume such as frustum or sphere.
+    template <class T> void FindNodes(Vector<OctreeNode*>& result, const T& volume, unsigned short nodeFlags, unsigned layerMask = LAYERMASK_ALL) const
+    {
+        PROFILE(QueryAABBTree);
+        if (root >= 0)
+            CollectNodes(result, root, volume, nodeFlags, layerMask);
+    }
+
+    /// Query for nodes using several frusta in one traversal, such as the shadow views of a light. Return each node inside any of the frusta once, with a bitmask of the frusta it is inside.
+    void FindNodes(Vector<Pair<OctreeNode*, unsigned> >& result, const Frustum* frusta, size_t numFrusta, unsigned short nodeFlags, unsigned layerMask = LAYERMASK_ALL) const;
+
+    /// Query for nodes using a volume such as frustum or sphere. Invoke a function for each leaf in the volume, and once for the nodes of each subtree inside it.
+    template <class T> void FindNodes(const T& volume, void(*callback)(Vector<OctreeNode*>::ConstIterator, Vector<OctreeNode*>::ConstIterator, bool)) const
+    {
+        PROFILE(QueryAABBTree);
+        if (root >= 0)
+            CollectNodesCallback(root, volume, callback);
+    }
+
+    /// Query for nodes using a volume such as frustum or sphere. Invoke a member function for each leaf in the volume, and once for the nodes of each subtree inside it.
+    template <class T, class U> void FindNodes(const T& volume, U* object, void (U::*callback)(Vector<OctreeNode*>::ConstIterator, Vector<OctreeNode*>::ConstIterator, bool)) const
+    {
+        PROFILE(QueryAABBTree);
+        if (root >= 0)
+            CollectNodesMemberCallback(root, volume, object, callback);
+    }
+
+    /// Query for node ranges using a volume such as frustum or sphere. Invoke a member function for the node of each leaf in the volume, and once for the nodes of each subtree inside it. The leaf's own bounding box has already been tested, so the node is flagged as inside.
+    template <class T, class U> void FindNodeRanges(const T& volume, U* object, void (U::*callback)(const NodeCullingData*, size_t, size_t, bool)) const
+    {
+        PROFILE(QueryAABBTree);
+        if (root >= 0)
+            CollectNodeRangesMemberCallback(root, volume, object, callback);
+    }
+
+private:
+    /// Set margin. Used in serialization.
+    void SetMarginAttr(float margin);
+    /// Allocate a tree node from the free list.
+    int AllocateTreeNode();
+    /// Return a tree node to the free list.
+    void FreeTreeNode(int index);
+    /// Insert a leaf, choosing the sibling by the surface area heuristic.
+    void InsertLeaf(int leaf);
+    /// Remove a leaf. Its parent branch is freed and the sibling takes its place.
+    void RemoveLeaf(int leaf);
+    /// Rotate a subtree if it is imbalanced. Return the index of the subtree's new root.
+    int Balance(int index);
+    /// Refit the bounding boxes and heights of the ancestors of a node, rotating imbalanced subtrees on the way.
+    void Refit(int index);
+    /// Set a moved leaf's bounding box in place if one of its near ancestors still contains it, and update the boxes of the branches in between. Return false if the leaf needs to be reinserted.
+    bool RefitLeaf(int leaf, const BoundingBox& box);
+    /// Remove a node's culling data and free its leaf.
+    void RemoveNodeData(OctreeNode* node);
+    /// Set a leaf's index in the culling data.
+    void SetLeafData(int leaf, size_t index);
+    /// Set a branch's bounding box, height and culling data range from its children.
+    void CombineChildren(int index);
+    /// Update the culling data ranges of a node's ancestors after the node's range changed.
+    void UpdateDataRanges(int index);
+    /// Clear and reserve the layout buffers for a relayout or a build.
+    void BeginLayout();
+    /// Swap the layout buffers in place of the tree nodes and the culling data.
+    void EndLayout();
+    /// Reorder the culling data in the order of the leaves, so that each subtree's nodes are contiguous, and the tree nodes depth first, so that each subtree's tree nodes are near each other.
+    void Relayout();
+    /// Copy a subtree's tree nodes depth first and its leaves' culling data in order to the layout buffers. Return the subtree's new root index.
+    int LayoutSubtree(int index, int parent);
+    /// Build the whole tree top down from the culling data, with the culling data and the tree nodes in depth first order.
+    void Build();
+    /// Build a subtree from nodes given by their bounding box centers and culling data indices to the layout buffers. Return the subtree's root index.
+    int BuildSubtree(Pair<Vector3, size_t>* nodes, size_t count, int parent);
+    /// Return whether a node is in the tree.
+    bool IsInserted(const OctreeNode* node) const { return node->octantIndex < data.nodes.Size() && data.nodes[node->octantIndex] == node; }
+    /// Return a node's bounding box enlarged by the margin.
+    BoundingBox FatBoundingBox(const BoundingBox& box) const;
+
+    /// Get all nodes matching flags from a subtree.
+    void CollectNodes(Vector<OctreeNode*>& result, int index, unsigned short nodeFlags, unsigned layerMask) const;
+    /// Get the nodes matching flags from a culling data range that intersects a frustum. Uses the batched frustum test.
+    void CollectRangeNodes(Vector<OctreeNode*>& result, size_t start, size_t end, const Frustum& frustum, unsigned short nodeFlags, unsigned layerMask) const;
+    /// Get all nodes matching flags using several frusta. The frusta in the inside mask contain the whole subtree and are not tested further.
+    void CollectNodes(Vector<Pair<OctreeNode*, unsigned> >& result, int index, const Frustum* frusta, unsigned activeMask, unsigned insideMask, unsigned short nodeFlags, unsigned layerMask) const;
+    /// Get all nodes matching flags along a ray.
+    void CollectNodes(Vector<RaycastResult>& result, int index, const Ray& ray, unsigned short nodeFlags, float maxDistance, unsigned layerMask) const;
+    /// Find the closest raycast hit from a subtree, visiting the children in ray order. Update the closest distance.
+    void CollectClosestHit(RaycastResult& result, QueryBuffers& buffers, int index, const Ray& ray, unsigned short nodeFlags, unsigned layerMask) const;
+
+    /// Return whether a leaf's node matches flags and layer mask.
+    bool MatchLeaf(const AABBTreeNode& leaf, unsigned short nodeFlags, unsigned layerMask) const
+    {
+        return MatchData(leaf.dataIndex, nodeFlags, layerMask);
+    }
+
+    /// Return whether a node in the culling data matches flags and layer mask.
+    bool MatchData(size_t index, unsigned short nodeFlags, unsigned layerMask) const
+    {
+        return (data.nodeFlags[index] & nodeFlags) == nodeFlags && (data.nodeLayerMasks[index] & layerMask);
+    }
+
+    /// Get the nodes matching flags from a culling data range that intersects a volume, testing their bounding boxes.
+    template <class T> void CollectRangeNodes(Vector<OctreeNode*>& result, size_t start, size_t end, const T& volume, unsigned short nodeFlags, unsigned layerMask) const
+    {
+        for (size_t i = start; i < end; ++i)
+        {
+            if (MatchData(i, nodeFlags, layerMask) && volume.IsInsideFast(data.NodeBoundingBox(i)) != OUTSIDE)
+                result.Push(data.nodes[i]);
+        }
+    }
+
+    /// Collect nodes matching flags using a volume such as frustum or sphere.
+    template <class T> void CollectNodes(Vector<OctreeNode*>& result, int index, const T& volume, unsigned short nodeFlags, unsigned layerMask) const
+    {
+        const AABBTreeNode& treeNode = treeNodes[index];
+        Intersection res = volume.IsInside(treeNode.box);
+        if (res == OUTSIDE)
+            return;
+
+        // If the subtree is completely inside the volume, can include all its nodes without further tests. A small subtree
+        // whose nodes are contiguous is tested directly from the culling data instead of descending to the leaves
+        if (res == INSIDE)
+            CollectNodes(result, index, nodeFlags, layerMask);
+        else if (treeNode.numLeaves <= AABB_TREE_BUCKET_SIZE && treeNode.IsContiguous())
+            CollectRangeNodes(result, treeNode.dataIndex, treeNode.dataEnd, volume, nodeFlags, layerMask);
+        else
+        {
+            CollectNodes(result, treeNode.children[0], volume, nodeFlags, layerMask);
+            CollectNodes(result, treeNode.children[1], volume, nodeFlags, layerMask);
+        }
+    }
+
+    /// Collect nodes from a subtree. Invoke a function for each contiguous range of nodes.
+    void CollectNodesCallback(int index, void(*callback)(Vector<OctreeNode*>::ConstIterator, Vector<OctreeNode*>::ConstIterator, bool)) const
+    {
+        const AABBTreeNode& treeNode = treeNodes[index];
+        if (treeNode.IsContiguous())
+        {
+            auto it = data.nodes.Begin();
+            callback(it + treeNode.dataIndex, it + treeNode.dataEnd, true);
+        }
+        else
+        {
+            CollectNodesCallback(treeNode.children[0], callback);
+            CollectNodesCallback(treeNode.children[1], callback);
+        }
+    }
+
+    /// Collect nodes using a volume such as frustum or sphere. Invoke a function for each leaf.
+    template <class T> void CollectNodesCallback(int index, const T& volume, void(*callback)(Vector<OctreeNode*>::ConstIterator, Vector<OctreeNode*>::ConstIterator, bool)) const
+    {
+        const AABBTreeNode& treeNode = treeNodes[index];
+        Intersection res = volume.IsInside(treeNode.box);
+        if (res == OUTSIDE)
+            return;
+
+        if (res == INSIDE)
+            CollectNodesCallback(index, callback);
+        else if (treeNode.IsLeaf())
+        {
+            auto it = data.nodes.Begin() + treeNode.dataIndex;
+            callback(it, it + 1, false);
+        }
+        else
+        {
+            CollectNodesCallback(treeNode.children[0], volume, callback);
+            CollectNodesCallback(treeNode.children[1], volume, callback);
+        }
+    }
+
+    /// Collect nodes from a subtree. Invoke a member function for each contiguous range of nodes.
+    template <class T> void CollectNodesMemberCallback(int index, T* object, void (T::*callback)(Vector<OctreeNode*>::ConstIterator, Vector<OctreeNode*>::ConstIterator, bool)) const
+    {
+        const AABBTreeNode& treeNode = treeNodes[index];
+        if (treeNode.IsContiguous())
+        {
+            auto it = data.nodes.Begin();
+            (object->*callback)(it + treeNode.dataIndex, it + treeNode.dataEnd, true);
+        }
+        else
+        {
+            CollectNodesMemberCallback(treeNode.children[0], object, callback);
+            CollectNodesMemberCallback(treeNode.children[1], object, callback);
+        }
+    }
+
+    /// Collect nodes using a volume such as frustum or sphere. Invoke a member function for each leaf.
+    template <class T, class U> void CollectNodesMemberCallback(int index, const T& volume, U* object, void (U::*callback)(Vector<OctreeNode*>::ConstIterator, Vector<OctreeNode*>::ConstIterator, bool)) const
+    {
+        const AABBTreeNode& treeNode = treeNodes[index];
+        Intersection res = volume.IsInside(treeNode.box);
+        if (res == OUTSIDE)
+            return;
+
+        if (res == INSIDE)
+            CollectNodesMemberCallback(index, object, callback);
+        else if (treeNode.IsLeaf())
+        {
+            auto it = data.nodes.Begin() + treeNode.dataIndex;
+            (object->*callback)(it, it + 1, false);
+        }
+        else
+        {
+            CollectNodesMemberCallback(treeNode.children[0], volume, object, callback);
+            CollectNodesMemberCallback(treeNode.children[1], volume, object, callback);
+        }
+    }
+
+    /// Collect the node ranges of a subtree. Invoke a member function for each contiguous range of nodes.
+    template <class T> void CollectNodeRangesMemberCallback(int index, T* object, void (T::*callback)(const NodeCullingData*, size_t, size_t, bool)) const
+    {
+        const AABBTreeNode& treeNode = treeNodes[index];
+        if (treeNode.IsContiguous())
+            (object->*callback)(&data, treeNode.dataIndex, treeNode.dataEnd, true);
+        else
+        {
+            CollectNodeRangesMemberCallback(treeNode.children[0], object, callback);
+            CollectNodeRangesMemberCallback(treeNode.children[1], object, callback);
+        }
+    }
+
+    /// Collect node ranges using a volume such as frustum or sphere. Invoke a member function for each leaf whose node is in the volume.
+    template <class T, class U> void CollectNodeRangesMemberCallback(int index, const T& volume, U* object, void (U::*callback)(const NodeCullingData*, size_t, size_t, bool)) const
+    {
+        const AABBTreeNode& treeNode = treeNodes[index];
+        Intersection res = volume.IsInside(treeNode.box);
+        if (res == OUTSIDE)
+            return;
+
+        if (res == INSIDE)
+            CollectNodeRangesMemberCallback(index, object, callback);
+        else if (treeNode.IsLeaf())
+        {
+            // Test the node's own bounding box, which is tighter than the leaf's
+            if (volume.IsInsideFast(data.NodeBoundingBox(treeNode.dataIndex)) != OUTSIDE)
+                (object->*callback)(&data, treeNode.dataIndex, treeNode.dataIndex + 1, true);
+        }
+        else
+        {
+            CollectNodeRangesMemberCallback(treeNode.children[0], volume, object, callback);
+            CollectNodeRangesMemberCallback(treeNode.children[1], volume, object, callback);
+        }
+    }
+
+    /// Tree nodes.
+    Vector<AABBTreeNode> treeNodes;
+    /// Culling data of the nodes in the tree.
+    NodeCullingData data;
+    /// Leaf index of each node in the culling data.
+    Vector<int> dataLeaves;
+    /// Culling data being reordered by a relayout. Kept to reuse the allocation.
+    NodeCullingData layoutData;
+    /// Leaf indices being reordered by a relayout.
+    Vector<int> layoutLeaves;
+    /// Tree nodes being reordered by a relayout.
+    Vector<AABBTreeNode> layoutTreeNodes;
+    /// Bounding box centers and culling data indices of the nodes being split by a build.
+    Vector<Pair<Vector3, size_t> > buildNodes;
+    /// Queue of nodes to be reinserted.
+    Vector<OctreeNode*> updateQueue;
+    /// Query buffers of each thread.
+    mutable ThreadQueryBuffers queryBuffers;
+    /// Root node index, or negative if empty.
+    int root;
+    /// First free node index, or negative if none.
+    int freeList;
+    /// Leaf bounding box margin.
+    float margin;
+    /// Number of leaf insertions and removals since the last relayout.
+    size_t numLayoutChanges;
+};
+
+}
@@ -9,6 +9,9 @@
 namespace Turso3D
 {
 
+/// Use comparison sort for batch vectors smaller than this.
+static const size_t BATCH_RADIX_SORT_THRESHOLD = 256;
+
 inline bool CompareBatchState(Batch& lhs, Batch& rhs)
 {
     return lhs.sortKey < rhs.sortKey;
@@ -24,6 +27,20 @@ inline bool CompareBatchDistanceBackToFront(Batch& lhs, Batch& rhs)
     return lhs.distance > rhs.distance;
 }
 
+/// Convert a float to an unsigned integer that sorts in the same order.
+inline unsigned long long FloatToSortKey(float value)
+{
+    union
+    {
+        float f;
+        unsigned u;
+    } bits;
+
+    bits.f = value;
+    // Negative values: flip all bits. Positive values: flip the sign bit
+    return (bits.u & 0x80000000) ? ~bits.u : (bits.u | 0x80000000);
+}
+
 void BatchQueue::Clear()
 {
     batches.Clear();
@@ -31,61 +48,232 @@ void BatchQueue::Clear()
 }
 
 void BatchQueue::Sort(Vector<Matrix3x4>& instanceTransforms)
+{
+    SortBatches();
+    BuildInstances(instanceTransforms);
+}
+
+void BatchQueue::SortBatches()
 {
     switch (sort)
     {
     case SORT_STATE:
-        Turso3D::Sort(batches.Begin(), batches.End(), CompareBatchState);
-        Turso3D::Sort(additiveBatches.Begin(), additiveBatches.End(), CompareBatchState);
+        SortBatches(batches, SORT_STATE);
+        SortBatches(additiveBatches, SORT_STATE);
         break;
 
     case SORT_FRONT_TO_BACK:
-        Turso3D::Sort(batches.Begin(), batches.End(), CompareBatchDistanceFrontToBack);
+        SortBatches(batches, SORT_FRONT_TO_BACK);
         // After drawing the base batches, the Z buffer has been prepared. Additive batches can be sorted per state now
-        Turso3D::Sort(additiveBatches.Begin(), additiveBatches.End(), CompareBatchState);
+        SortBatches(additiveBatches, SORT_STATE);
         break;
 
     case SORT_BACK_TO_FRONT:
-        Turso3D::Sort(batches.Begin(), batches.End(), CompareBatchDistanceBackToFront);
-        Turso3D::Sort(additiveBatches.Begin(), additiveBatches.End(), CompareBatchDistanceBackToFront);
+        SortBatches(batches, SORT_BACK_TO_FRONT);
+        SortBatches(additiveBatches, SORT_BACK_TO_FRONT);
         break;
 
     default:
         break;
     }
+}
+
+void BatchQueue::SortBatches(Vector<Batch>& batches_, BatchSortMode sortMode)
+{
+    size_t count = batches_.Size();
+
+    if (count < BATCH_RADIX_SORT_THRESHOLD)
+    {
+        switch (sortMode)
+        {
+        case SORT_STATE:
+            Turso3D::Sort(batches_.Begin(), batches_.End(), CompareBatchState);
+            break;
+
+        case SORT_FRONT_TO_BACK:
+            Turso3D::Sort(batches_.Begin(), batches_.End(), CompareBatchDistanceFrontToBack);
+            break;
+
+        case SORT_BACK_TO_FRONT:
+            Turso3D::Sort(batches_.Begin(), batches_.End(), CompareBatchDistanceBackToFront);
+            break;
+
+        default:
+            break;
+        }
+        return;
+    }
+
+    // Sort compact key and index pairs instead of moving the batches on each pass
+    sortPairs.Resize(count);
+    sortTemp.Resize(count);
+    RadixSortPair<unsigned long long>* pairs = &sortPairs[0];
+    const Batch* src = &batches_[0];
+
+    switch (sortMode)
+    {
+    case SORT_STATE:
+        for (size_t i = 0; i < count; ++i)
+        {
+            pairs[i].key = src[i].sortKey;
+            pairs[i].index = (unsigned)i;
+        }
+        break;
+
+    case SORT_FRONT_TO_BACK:
+        for (size_t i = 0; i < count; ++i)
+        {
+            pairs[i].key = FloatToSortKey(src[i].distance);
+            pairs[i].index = (unsigned)i;
+        }
+        break;
+
+    case SORT_BACK_TO_FRONT:
+        // Invert the lower 32 bits for descending order. The upper bits stay zero so that their passes are skipped
+        for (size_t i = 0; i < count; ++i)
+        {
+            pairs[i].key = FloatToSortKey(src[i].distance) ^ 0xffffffffULL;
+            pairs[i].index = (unsigned)i;
+        }
+        break;
+
+    default:
+        return;
+    }
+
+    RadixSortPair<unsigned long long>* sorted = RadixSort(pairs, &sortTemp[0], count);
+
+    sortedBatches.Resize(count);
+    Batch* dest = &sortedBatches[0];
+    for (size_t i = 0; i < count; ++i)
+        dest[i] = src[sorted[i].index];
+
+    batches_.Swap(sortedBatches);
+}
 
-    // Build instances where adjacent batches have same state
-    BuildInstances(batches, instanceTransforms);
-    BuildInstances(additiveBatches, instanceTransforms);
+void BatchQueue::BuildInstances(Vector<Matrix3x4>& instanceTransforms)
+{
+    bool adjacentOnly = sort == SORT_BACK_TO_FRONT;
+    BuildInstances(batches, instanceTransforms, adjacentOnly);
+    BuildInstances(additiveBatches, instanceTransforms, adjacentOnly);
 }
 
-void BatchQueue::BuildInstances(Vector<Batch>& batches, Vector<Matrix3x4>& instanceTransforms)
+void BatchQueue::BuildInstances(Vector<Batch>& batches_, Vector<Matrix3x4>& instanceTransforms, bool adjacentOnly)
 {
-    Batch* start = nullptr;
-    for (auto it = batches.Begin(), end = batches.End(); it != end; ++it)
+    size_t count = batches_.Size();
+    if (count < 2)
+        return;
+
+    Batch* src = &batches_[0];
+    instanceGroupIndices.Clear();
+    instanceGroupCounts.Clear();
+    batchInstanceGroups.Resize(count);
+    size_t* groups = &batchInstanceGroups[0];
+
+    // Assign static batches to groups. State sorting keeps most of a group's batches adjacent, so compare to the previous
+    // batch first before looking up the group
+    const Batch* last = nullptr;
+    size_t lastGroup = M_MAX_UNSIGNED;
+    bool hasInstances = false;
+
+    for (size_t i = 0; i < count; ++i)
     {
-        Batch* current = &*it;
-        if (start && current->type == GEOM_STATIC && current->pass == start->pass && current->geometry == start->geometry &&
-            current->lights == start->lights)
+        const Batch& batch = src[i];
+        if (batch.type != GEOM_STATIC)
         {
-            if (start->type == GEOM_INSTANCED)
-            {
-                instanceTransforms.Push(*current->worldMatrix);
-                ++start->instanceCount;
-            }
+            groups[i] = M_MAX_UNSIGNED;
+            last = nullptr;
+            continue;
+        }
+
+        size_t group;
+        if (last && batch.geometry == last->geometry && batch.pass == last->pass && batch.lights == last->lights)
+            group = lastGroup;
+        else if (adjacentOnly)
+        {
+            group = instanceGroupCounts.Size();
+            instanceGroupCounts.Push(0);
+        }
+        else
+        {
+            InstanceKey key(&batches_, batch);
+            auto it = instanceGroupIndices.Find(key);
+            if (it != instanceGroupIndices.End())
+                group = it->second;
             else
             {
-                // Begin new instanced batch
-                start->type = GEOM_INSTANCED;
-                size_t instanceStart = instanceTransforms.Size();
-                instanceTransforms.Push(*start->worldMatrix);
-                instanceTransforms.Push(*current->worldMatrix);
-                start->instanceStart = instanceStart; // Overwrites non-instance world matrix
-                start->instanceCount = 2; // Overwrites sort key / distance
+                group = instanceGroupCounts.Size();
+                instanceGroupIndices[key] = group;
+                instanceGroupCounts.Push(0);
             }
         }
+
+        hasInstances |= (++instanceGroupCounts[group] > 1);
+        groups[i] = group;
+        last = &batch;
+        lastGroup = group;
+    }
+
+    if (!hasInstances)
+        return;
+
+    // Reserve contiguous transforms for each group with more than one batch
+    size_t numGroups = instanceGroupCounts.Size();
+    instanceGroupStarts.Resize(numGroups);
+    size_t* groupCounts = &instanceGroupCounts[0];
+    size_t* groupStarts = &instanceGroupStarts[0];
+    size_t firstInstance = instanceTransforms.Size();
+    size_t numInstances = 0;
+    for (size_t i = 0; i < numGroups; ++i)
+    {
+        if (groupCounts[i] > 1)
+        {
+            groupStarts[i] = firstInstance + numInstances;
+            numInstances += groupCounts[i];
+        }
         else
-            start = (current->type == GEOM_STATIC) ? current : nullptr;
+            groupStarts[i] = M_MAX_UNSIGNED;
+        // From now on the count is the number of transforms written so far
+        groupCounts[i] = 0;
+    }
+    instanceTransforms.Resize(firstInstance + numInstances);
+    Matrix3x4* transforms = &instanceTransforms[0];
+
+    // Write the transforms and compact the batch vector, so that each group is drawn at the position of its first batch
+    size_t dest = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        size_t group = groups[i];
+        if (group == M_MAX_UNSIGNED || groupStarts[group] == M_MAX_UNSIGNED)
+        {
+            if (dest != i)
+                src[dest] = src[i];
+            ++dest;
+            continue;
+        }
+
+        size_t groupStart = groupStarts[group];
+        size_t instanceIndex = groupCounts[group]++;
+        transforms[groupStart + instanceIndex] = *src[i].worldMatrix;
+
+        if (!instanceIndex)
+        {
+            Batch& instanceBatch = src[dest++];
+            instanceBatch = src[i];
+            instanceBatch.type = GEOM_INSTANCED;
+            instanceBatch.instanceStart = groupStart;
+            // The group's final count is written after all batches have been seen
+            batchInstanceGroups[dest - 1] = group;
+        }
+    }
+
+    batches_.Resize(dest);
+
+    for (size_t i = 0; i < dest; ++i)
+    {
+        Batch& batch = src[i];
+        if (batch.type == GEOM_INSTANCED)
+            batch.instanceCount = groupCounts[groups[i]];
     }
 }
 
@@ -2,6 +2,8 @@
 
 #pragma once
 
+#include "../Base/HashMap.h"
+#include "../Base/Sort.h"
 #include "../Math/AreaAllocator.h"
 #include "Camera.h"
 #include "GeometryNode.h"
@@ -65,6 +67,48 @@ struct TURSO3D_API Batch
     };
 };
 
+/// Key for grouping batches into instances. Also identifies the instance group across frames by the batch vector it is in.
+struct TURSO3D_API InstanceKey
+{
+    /// Construct undefined.
+    InstanceKey()
+    {
+    }
+
+    /// Construct from a batch and the batch vector it is in.
+    InstanceKey(const Vector<Batch>* batches_, const Batch& batch) :
+        batches(batches_),
+        geometry(batch.geometry),
+        pass(batch.pass),
+        lights(batch.lights)
+    {
+    }
+
+    /// Test for equality with another key.
+    bool operator == (const InstanceKey& rhs) const { return geometry == rhs.geometry && pass == rhs.pass && lights == rhs.lights && batches == rhs.batches; }
+    /// Test for inequality with another key.
+    bool operator != (const InstanceKey& rhs) const { return !(*this == rhs); }
+
+    /// Return hash value for HashMap.
+    unsigned ToHash() const
+    {
+        size_t hash = (size_t)geometry / sizeof(void*);
+        hash = hash * 31 + (size_t)pass / sizeof(void*);
+        hash = hash * 31 + (size_t)lights / sizeof(void*);
+        hash = hash * 31 + (size_t)batches / sizeof(void*);
+        return (unsigned)hash;
+    }
+
+    /// Batch vector of the group.
+    const Vector<Batch>* batches;
+    /// Geometry.
+    Geometry* geometry;
+    /// Material pass.
+    Pass* pass;
+    /// Light pass.
+    LightPass* lights;
+};
+
 /// Per-pass batch queue structure.
 struct TURSO3D_API BatchQueue
 {
@@ -72,9 +116,15 @@ struct TURSO3D_API BatchQueue
     void Clear();
     /// Sort batches and build instances.
     void Sort(Vector<Matrix3x4>& instanceTransforms);
+    /// Sort batches without building instances. Touches only the queue's own data, so different queues can be sorted in worker threads.
+    void SortBatches();
+    /// Build instances in both the base and additive batches. Static batches with the same geometry, pass and lights are grouped across the whole batch vector, except in back-to-front mode, where only adjacent batches can be grouped without breaking the draw order. The group's first batch becomes the instanced batch, and the rest are removed.
+    void BuildInstances(Vector<Matrix3x4>& instanceTransforms);
 
-    /// Build instances from adjacent batches with same state.
-    static void BuildInstances(Vector<Batch>& batches, Vector<Matrix3x4>& instanceTransforms);
+    /// Sort a batch vector. Uses radix sort on the state sort keys or distances, except for small vectors.
+    void SortBatches(Vector<Batch>& batches, BatchSortMode sortMode);
+    /// Build instances in a batch vector and append their transforms. Group transforms are contiguous and in draw order.
+    void BuildInstances(Vector<Batch>& batches, Vector<Matrix3x4>& instanceTransforms, bool adjacentOnly);
 
     /// Batches, which may be instanced or non-instanced.
     Vector<Batch> batches;
@@ -88,6 +138,20 @@ struct TURSO3D_API BatchQueue
     unsigned char baseIndex;
     /// Additive pass index (if needed.)
     unsigned char additiveIndex;
+    /// Radix sort key and index pairs.
+    Vector<RadixSortPair<unsigned long long> > sortPairs;
+    /// Radix sort temporary buffer.
+    Vector<RadixSortPair<unsigned long long> > sortTemp;
+    /// Batches reordered by the radix sort.
+    Vector<Batch> sortedBatches;
+    /// Instance group index by key for building instances.
+    HashMap<InstanceKey, size_t> instanceGroupIndices;
+    /// Instance group of each batch for building instances.
+    Vector<size_t> batchInstanceGroups;
+    /// Instance group batch counts, later the number of transforms written.
+    Vector<size_t> instanceGroupCounts;
+    /// Instance group transform start indices.
+    Vector<size_t> instanceGroupStarts;
 };
 
 /// %List of lights for a geometry node.
@@ -130,6 +194,34 @@ struct TURSO3D_API LightPass
     unsigned short vsBits;
     /// Pixel shader variation bits.
     unsigned short psBits;
+    /// Last frame number the light pass was used on. Light passes are kept across frames so that cached batches can refer to them.
+    unsigned lastFrameNumber;
+};
+
+/// Per-node cache of batches built by the Renderer. Reused on subsequent frames while the node's geometries, materials and light passes, and the requested batch queues stay the same. The world matrices are not cached.
+struct TURSO3D_API BatchCache
+{
+    /// Construct as empty.
+    BatchCache() :
+        queueSetup(0),
+        passesVersion(0)
+    {
+    }
+
+    /// Identifier of the Renderer's batch queue setup the batches were built for. Zero if not built yet.
+    unsigned queueSetup;
+    /// Material passes version the batches were built with.
+    unsigned passesVersion;
+    /// %Light passes the batches were built with. Ambient-only if the node had no lights.
+    Vector<LightPass*> lightPasses;
+    /// Base batches of all queues.
+    Vector<Batch> batches;
+    /// Additive batches of all queues.
+    Vector<Batch> additiveBatches;
+    /// End index of each queue's base batches.
+    Vector<size_t> batchEnds;
+    /// End index of each queue's additive batches.
+    Vector<size_t> additiveBatchEnds;
 };
 
 /// Shadow rendering view data structure.
@@ -6,6 +6,7 @@
 #include "../Graphics/IndexBuffer.h"
 #include "../Graphics/VertexBuffer.h"
 #include "../Resource/ResourceCache.h"
+#include "Batch.h"
 #include "Camera.h"
 #include "GeometryNode.h"
 #include "Material.h"
@@ -63,7 +64,7 @@ GeometryNode::GeometryNode() :
     lightList(nullptr),
     geometryType(GEOM_STATIC)
 {
-    SetFlag(NF_GEOMETRY, true);
+    SetFlag(NF_GEOMETRY | NF_BATCHES_DIRTY, true);
 }
 
 GeometryNode::~GeometryNode()
@@ -76,6 +77,7 @@ void GeometryNode::RegisterObject()
     CopyBaseAttributes<GeometryNode, OctreeNode>();
     RegisterMixedRefAttribute("materials", &GeometryNode::MaterialsAttr, &GeometryNode::SetMaterialsAttr,
         ResourceRefList(Material::TypeStatic()));
+    RegisterAttribute("occluder", &GeometryNode::IsOccluder, &GeometryNode::SetOccluder, false);
 }
 
 void GeometryNode::OnPrepareRender(unsigned frameNumber, Camera* camera)
@@ -88,6 +90,7 @@ void GeometryNode::OnPrepareRender(unsigned frameNumber, Camera* camera)
 void GeometryNode::SetGeometryType(GeometryType type)
 {
     geometryType = type;
+    SetFlag(NF_BATCHES_DIRTY, true);
 }
 
 void GeometryNode::SetNumGeometries(size_t num)
@@ -100,6 +103,8 @@ void GeometryNode::SetNumGeometries(size_t num)
         if (!it->material.Get())
             it->material = Material::DefaultMaterial();
     }
+
+    SetFlag(NF_BATCHES_DIRTY, true);
 }
 
 void GeometryNode::SetGeometry(size_t index, Geometry* geometry)
@@ -111,7 +116,10 @@ void GeometryNode::SetGeometry(size_t index, Geometry* geometry)
     }
 
     if (index < batches.Size())
+    {
         batches[index].geometry = geometry;
+        SetFlag(NF_BATCHES_DIRTY, true);
+    }
     else
         LOGERRORF("Out of bounds batch index %d for setting geometry", (int)index);
 }
@@ -123,6 +131,8 @@ void GeometryNode::SetMaterial(Material* material)
 
     for (size_t i = 0; i < batches.Size(); ++i)
         batches[i].material = material;
+
+    SetFlag(NF_BATCHES_DIRTY, true);
 }
 
 void GeometryNode::SetMaterial(size_t index, Material* material)
@@ -132,6 +142,7 @@ void GeometryNode::SetMaterial(size_t index, Material* material)
         if (!material)
             material = Material::DefaultMaterial();
         batches[index].material = material;
+        SetFlag(NF_BATCHES_DIRTY, true);
     }
     else
         LOGERRORF("Out of bounds batch index %d for setting material", (int)index);
@@ -144,6 +155,19 @@ void GeometryNode::SetLocalBoundingBox(const BoundingBox& box)
     OctreeNode::OnTransformChanged();
 }
 
+void GeometryNode::SetOccluder(bool enable)
+{
+    SetFlag(NF_OCCLUDER, enable);
+    QueueOctreeUpdate();
+}
+
+BatchCache* GeometryNode::GetBatchCache()
+{
+    if (!batchCache)
+        batchCache = new BatchCache();
+    return batchCache.Get();
+}
+
 Geometry* GeometryNode::GetGeometry(size_t index) const
 {
     return index < batches.Size() ? batches[index].geometry.Get() : nullptr;
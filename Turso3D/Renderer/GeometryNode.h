@@ -2,6 +2,7 @@
 
 #pragma once
 
+#include "../Base/AutoPtr.h"
 #include "../Graphics/GraphicsDefs.h"
 #include "../IO/ResourceRef.h"
 #include "OctreeNode.h"
@@ -14,6 +15,7 @@ class Graphics;
 class IndexBuffer;
 class Material;
 class VertexBuffer;
+struct BatchCache;
 struct LightList;
 
 /// Geometry types.
@@ -95,6 +97,8 @@ public:
     void SetMaterial(size_t index, Material* material);
     /// Set local space bounding box.
     void SetLocalBoundingBox(const BoundingBox& box);
+    /// Set whether to rasterize into the occlusion buffer to hide other objects. Requires CPU-side vertex data. Default false.
+    void SetOccluder(bool enable);
 
     /// Return geometry type.
     GeometryType GetGeometryType() const { return geometryType; }
@@ -108,11 +112,15 @@ public:
     const Vector<SourceBatch>& Batches() const { return batches; }
     /// Return local space bounding box.
     const BoundingBox& LocalBoundingBox() const { return boundingBox; }
+    /// Return whether is an occluder.
+    bool IsOccluder() const { return TestFlag(NF_OCCLUDER); }
 
     /// Set new light list. Called by Renderer.
     void SetLightList(LightList* list) { lightList = list; }
     /// Return current light list.
     LightList* GetLightList() const { return lightList; }
+    /// Return the batch cache, creating it on first use. Called by Renderer.
+    BatchCache* GetBatchCache();
 
 protected:
     /// Recalculate the world space bounding box.
@@ -124,6 +132,8 @@ protected:
 
     /// %Light list for rendering.
     LightList* lightList;
+    /// Batches built by the Renderer on previous frames.
+    AutoPtr<BatchCache> batchCache;
     /// Geometry type.
     GeometryType geometryType;
     /// Draw call source datas.
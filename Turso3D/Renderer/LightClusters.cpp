@@ -0,0 +1,411 @@
+// For conditions of distribution and use, see copyright notice in License.txt
+
+#include "../Debug/Profiler.h"
+#include "Camera.h"
+#include "Light.h"
+#include "LightClusters.h"
+
+#include <cmath>
+
+#ifdef TURSO3D_SSE
+#include <xmmintrin.h>
+#endif
+
+#include "../Debug/DebugNew.h"
+
+namespace Turso3D
+{
+
+static const size_t POINT_LIGHT_BLOCK_SIZE = 16;
+static const size_t SPOT_LIGHT_BLOCK_SIZE = 36;
+
+LightClusters::LightClusters() :
+    nearClip(0.0f),
+    farClip(0.0f),
+    orthographic(false),
+    #ifdef TURSO3D_SSE
+    useSSE(true)
+    #else
+    useSSE(false)
+    #endif
+{
+    clusters.Resize(NUM_CLUSTERS);
+    for (size_t i = 0; i < NUM_CLUSTERS; ++i)
+    {
+        clusters[i].start = 0;
+        clusters[i].count = 0;
+    }
+}
+
+LightClusters::~LightClusters()
+{
+}
+
+void LightClusters::AssignLights(Camera* camera, const Vector<Light*>& lights, WorkQueue* workQueue)
+{
+    PROFILE(AssignClusterLights);
+
+    lightIndices.Clear();
+    clusterLights.Clear();
+
+    camera->FrustumSize(nearSize, farSize);
+    nearSize.y = fabsf(nearSize.y);
+    farSize.y = fabsf(farSize.y);
+    nearClip = camera->NearClip();
+    farClip = camera->FarClip();
+    orthographic = camera->IsOrthographic();
+
+    // Transform point and spot lights to view space
+    const Matrix3x4& view = camera->ViewMatrix();
+    size_t numLights = lights.Size() < MAX_CLUSTERED_LIGHTS ? lights.Size() : MAX_CLUSTERED_LIGHTS;
+
+    for (size_t i = 0; i < numLights; ++i)
+    {
+        Light* light = lights[i];
+        LightType type = light->GetLightType();
+        if (type == LIGHT_DIRECTIONAL)
+            continue;
+
+        ClusterLight newLight;
+        newLight.position = view * light->WorldPosition();
+        newLight.range = light->Range();
+        newLight.index = (unsigned short)i;
+        newLight.spot = type == LIGHT_SPOT;
+        if (newLight.spot)
+        {
+            newLight.direction = (view * Vector4(light->WorldDirection(), 0.0f)).Normalized();
+            newLight.cosHalfAngle = cosf(light->Fov() * 0.5f * M_DEGTORAD);
+            newLight.sinHalfAngle = sinf(light->Fov() * 0.5f * M_DEGTORAD);
+        }
+        else
+        {
+            newLight.direction = Vector3::ZERO;
+            newLight.cosHalfAngle = 1.0f;
+            newLight.sinHalfAngle = 0.0f;
+        }
+        newLight.minZ = newLight.position.z - newLight.range;
+        newLight.maxZ = newLight.position.z + newLight.range;
+
+        // Skip lights fully outside the depth range
+        if (newLight.maxZ < nearClip || newLight.minZ > farClip)
+            continue;
+
+        clusterLights.Push(newLight);
+    }
+
+    // Divide the depth slices into tasks. Each task writes the ranges of its own slices only
+    size_t numTasks = (workQueue && workQueue->NumThreads()) ? NUM_CLUSTERS_Z : 1;
+    while (tasks.Size() < numTasks)
+        tasks.Push(new LightClustersTask(this, &LightClusters::AssignLightsWork));
+
+    size_t slicesPerTask = NUM_CLUSTERS_Z / numTasks;
+    for (size_t i = 0; i < numTasks; ++i)
+    {
+        LightClustersTask* task = tasks[i].Get();
+        task->startSlice = i * slicesPerTask;
+        task->endSlice = (i == numTasks - 1) ? NUM_CLUSTERS_Z : (i + 1) * slicesPerTask;
+        task->lightIndices.Clear();
+
+        if (numTasks > 1)
+            workQueue->AddTask(task);
+        else
+            task->Complete(0);
+    }
+
+    if (numTasks > 1)
+        workQueue->Complete();
+
+    // Merge the light indices in slice order and offset the cluster ranges accordingly
+    for (size_t i = 0; i < numTasks; ++i)
+    {
+        LightClustersTask* task = tasks[i].Get();
+        unsigned offset = (unsigned)lightIndices.Size();
+        lightIndices.Push(task->lightIndices);
+
+        if (offset)
+        {
+            for (size_t j = ClusterIndex(0, 0, task->startSlice); j < ClusterIndex(0, 0, task->endSlice); ++j)
+                clusters[j].start += offset;
+        }
+    }
+}
+
+void LightClusters::SetUseSSE(bool enable)
+{
+    #ifdef TURSO3D_SSE
+    useSSE = enable;
+    #else
+    (void)enable;
+    #endif
+}
+
+size_t LightClusters::DepthSlice(float z) const
+{
+    if (z <= nearClip)
+        return 0;
+    if (z >= farClip)
+        return NUM_CLUSTERS_Z - 1;
+
+    float slice;
+    if (!orthographic)
+        slice = logf(z / nearClip) / logf(farClip / nearClip) * NUM_CLUSTERS_Z;
+    else
+        slice = (z - nearClip) / (farClip - nearClip) * NUM_CLUSTERS_Z;
+
+    size_t ret = (size_t)slice;
+    return ret < NUM_CLUSTERS_Z ? ret : NUM_CLUSTERS_Z - 1;
+}
+
+float LightClusters::SliceDepth(size_t slice) const
+{
+    if (slice >= NUM_CLUSTERS_Z)
+        return farClip;
+
+    float t = (float)slice / (float)NUM_CLUSTERS_Z;
+    if (!orthographic)
+        return nearClip * powf(farClip / nearClip, t);
+    else
+        return nearClip + (farClip - nearClip) * t;
+}
+
+Vector4 LightClusters::SizeParameters() const
+{
+    float depthRange = farSize.z - nearSize.z;
+    float scaleX = depthRange > 0.0f ? (farSize.x - nearSize.x) / depthRange : 0.0f;
+    float scaleY = depthRange > 0.0f ? (farSize.y - nearSize.y) / depthRange : 0.0f;
+    return Vector4(nearSize.x - scaleX * nearSize.z, scaleX, nearSize.y - scaleY * nearSize.z, scaleY);
+}
+
+Vector4 LightClusters::DepthParameters() const
+{
+    if (!orthographic)
+    {
+        float logScale = (float)NUM_CLUSTERS_Z / log2f(farClip / nearClip);
+        return Vector4(logScale, 0.0f, -log2f(nearClip) * logScale, nearClip);
+    }
+    else
+    {
+        float scale = (float)NUM_CLUSTERS_Z / (farClip - nearClip);
+        return Vector4(0.0f, scale, -nearClip * scale, nearClip);
+    }
+}
+
+void LightClusters::AssignLightsWork(Task* task_, unsigned /* threadIndex */)
+{
+    LightClustersTask* task = static_cast<LightClustersTask*>(task_);
+
+    for (size_t i = task->startSlice; i < task->endSlice; ++i)
+        AssignLightsToSlice(task, i);
+}
+
+void LightClusters::AssignLightsToSlice(LightClustersTask* task, size_t slice)
+{
+    float z0 = SliceDepth(slice);
+    float z1 = SliceDepth(slice + 1);
+
+    // Gather the lights overlapping the slice in blocks of four for the cluster tests. Pad the last blocks with lights that
+    // never pass the tests
+    Vector<float>& pointData = task->pointLightData;
+    Vector<unsigned short>& pointIndices = task->pointLightIndices;
+    Vector<float>& spotData = task->spotLightData;
+    Vector<unsigned short>& spotIndices = task->spotLightIndices;
+    pointData.Clear();
+    pointIndices.Clear();
+    spotData.Clear();
+    spotIndices.Clear();
+
+    for (auto it = clusterLights.Begin(), end = clusterLights.End(); it != end; ++it)
+    {
+        const ClusterLight& light = *it;
+        if (light.maxZ < z0 || light.minZ > z1)
+            continue;
+
+        if (!light.spot)
+        {
+            size_t lane = pointIndices.Size() & 3;
+            if (!lane)
+                pointData.Resize(pointData.Size() + POINT_LIGHT_BLOCK_SIZE);
+            float* block = &pointData[pointData.Size() - POINT_LIGHT_BLOCK_SIZE];
+            block[lane] = light.position.x;
+            block[4 + lane] = light.position.y;
+            block[8 + lane] = light.position.z;
+            block[12 + lane] = light.range * light.range;
+            pointIndices.Push(light.index);
+        }
+        else
+        {
+            size_t lane = spotIndices.Size() & 3;
+            if (!lane)
+                spotData.Resize(spotData.Size() + SPOT_LIGHT_BLOCK_SIZE);
+            float* block = &spotData[spotData.Size() - SPOT_LIGHT_BLOCK_SIZE];
+            block[lane] = light.position.x;
+            block[4 + lane] = light.position.y;
+            block[8 + lane] = light.position.z;
+            block[12 + lane] = light.direction.x;
+            block[16 + lane] = light.direction.y;
+            block[20 + lane] = light.direction.z;
+            block[24 + lane] = light.range;
+            block[28 + lane] = light.cosHalfAngle;
+            block[32 + lane] = light.sinHalfAngle;
+            spotIndices.Push(light.index);
+        }
+    }
+
+    for (size_t i = pointIndices.Size(); i & 3; ++i)
+    {
+        float* block = &pointData[pointData.Size() - POINT_LIGHT_BLOCK_SIZE];
+        size_t lane = i & 3;
+        block[lane] = block[4 + lane] = block[8 + lane] = 0.0f;
+        block[12 + lane] = -1.0f;
+    }
+
+    for (size_t i = spotIndices.Size(); i & 3; ++i)
+    {
+        float* block = &spotData[spotData.Size() - SPOT_LIGHT_BLOCK_SIZE];
+        size_t lane = i & 3;
+        for (size_t j = 0; j < SPOT_LIGHT_BLOCK_SIZE; j += 4)
+            block[j + lane] = 0.0f;
+        block[24 + lane] = -M_MAX_FLOAT;
+    }
+
+    size_t numPointBlocks = pointData.Size() / POINT_LIGHT_BLOCK_SIZE;
+    size_t numSpotBlocks = spotData.Size() / SPOT_LIGHT_BLOCK_SIZE;
+
+    // Frustum half size at the slice's near and far depths
+    float t0 = (z0 - nearSize.z) / (farSize.z - nearSize.z);
+    float t1 = (z1 - nearSize.z) / (farSize.z - nearSize.z);
+    float halfWidth0 = nearSize.x + (farSize.x - nearSize.x) * t0;
+    float halfWidth1 = nearSize.x + (farSize.x - nearSize.x) * t1;
+    float halfHeight0 = nearSize.y + (farSize.y - nearSize.y) * t0;
+    float halfHeight1 = nearSize.y + (farSize.y - nearSize.y) * t1;
+
+    for (size_t y = 0; y < NUM_CLUSTERS_Y; ++y)
+    {
+        float tileMinY = -1.0f + 2.0f * (float)y / (float)NUM_CLUSTERS_Y;
+        float tileMaxY = -1.0f + 2.0f * (float)(y + 1) / (float)NUM_CLUSTERS_Y;
+        float minY = Min(tileMinY * halfHeight0, tileMinY * halfHeight1);
+        float maxY = Max(tileMaxY * halfHeight0, tileMaxY * halfHeight1);
+
+        for (size_t x = 0; x < NUM_CLUSTERS_X; ++x)
+        {
+            float tileMinX = -1.0f + 2.0f * (float)x / (float)NUM_CLUSTERS_X;
+            float tileMaxX = -1.0f + 2.0f * (float)(x + 1) / (float)NUM_CLUSTERS_X;
+            float minX = Min(tileMinX * halfWidth0, tileMinX * halfWidth1);
+            float maxX = Max(tileMaxX * halfWidth0, tileMaxX * halfWidth1);
+
+            LightClusterRange& range = clusters[ClusterIndex(x, y, slice)];
+            range.start = (unsigned)task->lightIndices.Size();
+
+            // Spot lights are tested against the bounding sphere of the cluster
+            float centerX = (minX + maxX) * 0.5f;
+            float centerY = (minY + maxY) * 0.5f;
+            float centerZ = (z0 + z1) * 0.5f;
+            float radius = sqrtf((maxX - minX) * (maxX - minX) + (maxY - minY) * (maxY - minY) + (z1 - z0) * (z1 - z0)) * 0.5f;
+
+            #ifdef TURSO3D_SSE
+            if (useSSE)
+            {
+                __m128 zero = _mm_setzero_ps();
+                __m128 boxMinX = _mm_set1_ps(minX);
+                __m128 boxMinY = _mm_set1_ps(minY);
+                __m128 boxMinZ = _mm_set1_ps(z0);
+                __m128 boxMaxX = _mm_set1_ps(maxX);
+                __m128 boxMaxY = _mm_set1_ps(maxY);
+                __m128 boxMaxZ = _mm_set1_ps(z1);
+
+                for (size_t i = 0; i < numPointBlocks; ++i)
+                {
+                    const float* block = &pointData[i * POINT_LIGHT_BLOCK_SIZE];
+                    __m128 px = _mm_loadu_ps(block);
+                    __m128 py = _mm_loadu_ps(block + 4);
+                    __m128 pz = _mm_loadu_ps(block + 8);
+                    __m128 rangeSquared = _mm_loadu_ps(block + 12);
+
+                    // Distance from the sphere center to the box along each axis, zero if inside
+                    __m128 dx = _mm_max_ps(_mm_max_ps(_mm_sub_ps(boxMinX, px), _mm_sub_ps(px, boxMaxX)), zero);
+                    __m128 dy = _mm_max_ps(_mm_max_ps(_mm_sub_ps(boxMinY, py), _mm_sub_ps(py, boxMaxY)), zero);
+                    __m128 dz = _mm_max_ps(_mm_max_ps(_mm_sub_ps(boxMinZ, pz), _mm_sub_ps(pz, boxMaxZ)), zero);
+                    __m128 distSquared = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+                    int mask = _mm_movemask_ps(_mm_cmple_ps(distSquared, rangeSquared));
+
+                    for (size_t j = 0; mask; ++j, mask >>= 1)
+                    {
+                        if (mask & 1)
+                            task->lightIndices.Push(pointIndices[i * 4 + j]);
+                    }
+                }
+
+                __m128 sphereX = _mm_set1_ps(centerX);
+                __m128 sphereY = _mm_set1_ps(centerY);
+                __m128 sphereZ = _mm_set1_ps(centerZ);
+                __m128 sphereRadius = _mm_set1_ps(radius);
+
+                for (size_t i = 0; i < numSpotBlocks; ++i)
+                {
+                    const float* block = &spotData[i * SPOT_LIGHT_BLOCK_SIZE];
+                    __m128 vx = _mm_sub_ps(sphereX, _mm_loadu_ps(block));
+                    __m128 vy = _mm_sub_ps(sphereY, _mm_loadu_ps(block + 4));
+                    __m128 vz = _mm_sub_ps(sphereZ, _mm_loadu_ps(block + 8));
+                    __m128 lengthSquared = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vx, vx), _mm_mul_ps(vy, vy)), _mm_mul_ps(vz, vz));
+                    __m128 axisLength = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vx, _mm_loadu_ps(block + 12)), _mm_mul_ps(vy,
+                        _mm_loadu_ps(block + 16))), _mm_mul_ps(vz, _mm_loadu_ps(block + 20)));
+                    __m128 lightRange = _mm_loadu_ps(block + 24);
+                    __m128 perpLength = _mm_sqrt_ps(_mm_max_ps(_mm_sub_ps(lengthSquared, _mm_mul_ps(axisLength, axisLength)), zero));
+                    __m128 closestDistance = _mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(block + 28), perpLength), _mm_mul_ps(axisLength,
+                        _mm_loadu_ps(block + 32)));
+
+                    // Cull if outside the cone angle, beyond the range or behind the apex
+                    __m128 culled = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(closestDistance, sphereRadius), _mm_cmpgt_ps(axisLength,
+                        _mm_add_ps(sphereRadius, lightRange))), _mm_cmplt_ps(axisLength, _mm_sub_ps(zero, sphereRadius)));
+                    int mask = ~_mm_movemask_ps(culled) & 0xf;
+
+                    for (size_t j = 0; mask; ++j, mask >>= 1)
+                    {
+                        if (mask & 1)
+                            task->lightIndices.Push(spotIndices[i * 4 + j]);
+                    }
+                }
+            }
+            else
+            #endif
+            {
+                for (size_t i = 0; i < numPointBlocks * 4; ++i)
+                {
+                    const float* block = &pointData[(i >> 2) * POINT_LIGHT_BLOCK_SIZE];
+                    size_t lane = i & 3;
+                    float px = block[lane];
+                    float py = block[4 + lane];
+                    float pz = block[8 + lane];
+
+                    float dx = Max(Max(minX - px, px - maxX), 0.0f);
+                    float dy = Max(Max(minY - py, py - maxY), 0.0f);
+                    float dz = Max(Max(z0 - pz, pz - z1), 0.0f);
+                    if (dx * dx + dy * dy + dz * dz <= block[12 + lane])
+                        task->lightIndices.Push(pointIndices[i]);
+                }
+
+                for (size_t i = 0; i < numSpotBlocks * 4; ++i)
+                {
+                    const float* block = &spotData[(i >> 2) * SPOT_LIGHT_BLOCK_SIZE];
+                    size_t lane = i & 3;
+                    float vx = centerX - block[lane];
+                    float vy = centerY - block[4 + lane];
+                    float vz = centerZ - block[8 + lane];
+                    float lengthSquared = vx * vx + vy * vy + vz * vz;
+                    float axisLength = vx * block[12 + lane] + vy * block[16 + lane] + vz * block[20 + lane];
+                    float perpLength = sqrtf(Max(lengthSquared - axisLength * axisLength, 0.0f));
+                    float closestDistance = block[28 + lane] * perpLength - axisLength * block[32 + lane];
+
+                    // Cull if outside the cone angle, beyond the range or behind the apex
+                    if (closestDistance > radius || axisLength > radius + block[24 + lane] || axisLength < -radius)
+                        continue;
+                    task->lightIndices.Push(spotIndices[i]);
+                }
+            }
+
+            range.count = (unsigned)task->lightIndices.Size() - range.start;
+        }
+    }
+}
+
+}
@@ -0,0 +1,147 @@
+// For conditions of distribution and use, see copyright notice in License.txt
+
+#pragma once
+
+#include "../Math/Vector4.h"
+#include "../Thread/WorkQueue.h"
+
+namespace Turso3D
+{
+
+class Camera;
+class Light;
+class LightClusters;
+
+/// Number of light clusters in the horizontal direction.
+static const size_t NUM_CLUSTERS_X = 16;
+/// Number of light clusters in the vertical direction.
+static const size_t NUM_CLUSTERS_Y = 8;
+/// Number of light cluster depth slices.
+static const size_t NUM_CLUSTERS_Z = 24;
+/// Total number of light clusters.
+static const size_t NUM_CLUSTERS = NUM_CLUSTERS_X * NUM_CLUSTERS_Y * NUM_CLUSTERS_Z;
+/// Maximum number of lights that can be assigned to clusters, limited by the light index size.
+static const size_t MAX_CLUSTERED_LIGHTS = 65536;
+
+/// %Light index range of a cluster.
+struct TURSO3D_API LightClusterRange
+{
+    /// Start index in the light index list.
+    unsigned start;
+    /// Number of lights.
+    unsigned count;
+};
+
+/// %Light data in view space for the cluster tests.
+struct TURSO3D_API ClusterLight
+{
+    /// View space position.
+    Vector3 position;
+    /// View space direction. Used by spot lights.
+    Vector3 direction;
+    /// Range.
+    float range;
+    /// Cosine of the half cone angle. Used by spot lights.
+    float cosHalfAngle;
+    /// Sine of the half cone angle. Used by spot lights.
+    float sinHalfAngle;
+    /// Minimum view space depth affected.
+    float minZ;
+    /// Maximum view space depth affected.
+    float maxZ;
+    /// Index in the light list.
+    unsigned short index;
+    /// Spot light flag.
+    bool spot;
+};
+
+/// %Task for assigning lights to the clusters of a range of depth slices in a worker thread.
+class TURSO3D_API LightClustersTask : public MemberFunctionTask<LightClusters>
+{
+public:
+    /// Construct.
+    LightClustersTask(LightClusters* clusters, WorkFunctionPtr function) :
+        MemberFunctionTask<LightClusters>(clusters, function),
+        startSlice(0),
+        endSlice(0)
+    {
+    }
+
+    /// First depth slice to process.
+    size_t startSlice;
+    /// One past the last depth slice to process.
+    size_t endSlice;
+    /// %Light indices found by this task. The cluster ranges of the task's slices are relative to these until merged.
+    Vector<unsigned short> lightIndices;
+    /// Point light data of the current slice in blocks of four lights: positions X, Y, Z and squared ranges.
+    Vector<float> pointLightData;
+    /// Point light indices of the current slice.
+    Vector<unsigned short> pointLightIndices;
+    /// Spot light data of the current slice in blocks of four lights: positions X, Y, Z, directions X, Y, Z, ranges, cone cosines and sines.
+    Vector<float> spotLightData;
+    /// Spot light indices of the current slice.
+    Vector<unsigned short> spotLightIndices;
+};
+
+/// Clustered light culling. Divides the camera's view frustum into a grid of clusters (froxels) with exponentially distributed depth slices, and finds the point and spot lights affecting each cluster. Directional lights are not assigned, as they affect all clusters. The renderer uses it for lighting the nearest unshadowed point and spot lights in the base pass when clustered lighting is enabled.
+class TURSO3D_API LightClusters
+{
+public:
+    /// Construct.
+    LightClusters();
+    /// Destruct.
+    ~LightClusters();
+
+    /// Assign lights to the clusters of a camera. Lights are referred to by their index in the light vector. If a work queue with worker threads is given, the depth slices are divided between them. The result does not depend on the number of threads.
+    void AssignLights(Camera* camera, const Vector<Light*>& lights, WorkQueue* workQueue = nullptr);
+    /// Set whether to use SSE for the cluster tests. Enabled by default, and has no effect if SSE is not compiled in. The scalar tests give the same result.
+    void SetUseSSE(bool enable);
+
+    /// Return cluster index from grid coordinates. Row 0 is at the bottom of the view.
+    static size_t ClusterIndex(size_t x, size_t y, size_t z) { return (z * NUM_CLUSTERS_Y + y) * NUM_CLUSTERS_X + x; }
+    /// Return whether SSE is used for the cluster tests.
+    bool UseSSE() const { return useSSE; }
+    /// Return depth slice index of a view space depth.
+    size_t DepthSlice(float z) const;
+    /// Return view space start depth of a depth slice. The slice count returns the far clip distance.
+    float SliceDepth(size_t slice) const;
+    /// Return the parameters for finding the frustum half size at a view space depth: X half size is x + y * depth and Y half size is z + w * depth.
+    Vector4 SizeParameters() const;
+    /// Return the parameters for finding the depth slice of a view space depth: the slice is log2(depth) * x + depth * y + z, and depths are clamped to the near clip distance w first.
+    Vector4 DepthParameters() const;
+    /// Return light index ranges of all clusters.
+    const Vector<LightClusterRange>& Clusters() const { return clusters; }
+    /// Return light index range of a cluster.
+    const LightClusterRange& Cluster(size_t x, size_t y, size_t z) const { return clusters[ClusterIndex(x, y, z)]; }
+    /// Return the compact light index list of all clusters.
+    const Vector<unsigned short>& LightIndices() const { return lightIndices; }
+
+private:
+    /// Work function for assigning lights to the clusters of a depth slice range.
+    void AssignLightsWork(Task* task, unsigned threadIndex);
+    /// Assign lights to the clusters of one depth slice.
+    void AssignLightsToSlice(LightClustersTask* task, size_t slice);
+
+    /// %Light index ranges of the clusters.
+    Vector<LightClusterRange> clusters;
+    /// Compact light index list.
+    Vector<unsigned short> lightIndices;
+    /// Point and spot lights in view space.
+    Vector<ClusterLight> clusterLights;
+    /// Depth slice tasks.
+    Vector<AutoPtr<LightClustersTask> > tasks;
+    /// View space frustum half size at the near plane.
+    Vector3 nearSize;
+    /// View space frustum half size at the far plane.
+    Vector3 farSize;
+    /// Near clip distance.
+    float nearClip;
+    /// Far clip distance.
+    float farClip;
+    /// Orthographic flag. Orthographic cameras use linear depth slices.
+    bool orthographic;
+    /// SSE cluster tests flag.
+    bool useSSE;
+};
+
+}
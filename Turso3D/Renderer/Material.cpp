@@ -18,6 +18,7 @@ SharedPtr<Material> Material::defaultMaterial;
 HashMap<String, unsigned char> Material::passIndices;
 Vector<String> Material::passNames;
 unsigned char Material::nextPassIndex = 0;
+unsigned Material::passesVersion = 0;
 
 Pass::Pass(Material* parent_, const String& name_) :
     parent(parent_),
@@ -184,6 +185,7 @@ void Pass::OnShadersChanged()
 
     shaderHash = StringHash(shaderNames[SHADER_VS] + shaderNames[SHADER_PS] + combinedShaderDefines[SHADER_VS] +
         combinedShaderDefines[SHADER_PS]).Value();
+    ++Material::passesVersion;
 }
 
 Material::Material()
@@ -226,6 +228,7 @@ bool Material::EndLoad()
     const JSONValue& root = loadJSON->Root();
 
     passes.Clear();
+    ++passesVersion;
     if (root.Contains("passes"))
     {
         const JSONObject& jsonPasses = root["passes"].GetObject();
@@ -249,8 +252,8 @@ bool Material::EndLoad()
         constantBuffers[SHADER_PS] = new ConstantBuffer();
         constantBuffers[SHADER_PS]->LoadJSON(root["psConstantBuffer"].GetObject());
     }
-    
-    /// \todo Queue texture loads during BeginLoad()
+
+    // Textures that were loaded beforehand, see Dependencies(), are found in the resource cache
     ResetTextures();
     if (root.Contains("textures"))
     {
@@ -264,6 +267,20 @@ bool Material::EndLoad()
     return true;
 }
 
+void Material::Dependencies(Vector<ResourceRef>& dest) const
+{
+    if (!loadJSON)
+        return;
+
+    const JSONValue& root = loadJSON->Root();
+    if (root.Contains("textures"))
+    {
+        const JSONObject& jsonTextures = root["textures"].GetObject();
+        for (auto it = jsonTextures.Begin(); it != jsonTextures.End(); ++it)
+            dest.Push(ResourceRef(Texture::TypeStatic(), it->second.GetString()));
+    }
+}
+
 bool Material::Save(Stream& dest)
 {
     PROFILE(SaveMaterial);
@@ -310,7 +327,10 @@ Pass* Material::CreatePass(const String& name)
         passes.Resize(index + 1);
 
     if (!passes[index])
+    {
         passes[index] = new Pass(this, name);
+        ++passesVersion;
+    }
     
     return passes[index];
 }
@@ -318,8 +338,11 @@ Pass* Material::CreatePass(const String& name)
 void Material::RemovePass(const String& name)
 {
     size_t index = PassIndex(name, false);
-    if (index < passes.Size())
+    if (index < passes.Size() && passes[index])
+    {
         passes[index].Reset();
+        ++passesVersion;
+    }
 }
 
 void Material::SetTexture(size_t index, Texture* texture)
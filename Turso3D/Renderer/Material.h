@@ -72,7 +72,7 @@ public:
     /// Shader resources. Filled by Renderer.
     SharedPtr<Shader> shaders[MAX_SHADER_STAGES];
     /// Cached shader variations. Filled by Renderer.
-    HashMap<unsigned short, WeakPtr<ShaderVariation> > shaderVariations[MAX_SHADER_STAGES];
+    HashMap<unsigned, WeakPtr<ShaderVariation> > shaderVariations[MAX_SHADER_STAGES];
     /// Shader load attempted flag. Filled by Renderer.
     bool shadersLoaded;
 
@@ -96,6 +96,8 @@ class Material : public Resource
 {
     OBJECT(Material);
 
+    friend class Pass;
+
 public:
     /// Construct.
     Material();
@@ -111,6 +113,8 @@ public:
     bool EndLoad() override;
     /// Save the material to a stream. Return true on success.
     bool Save(Stream& dest) override;
+    /// Return the textures to be loaded in EndLoad().
+    void Dependencies(Vector<ResourceRef>& dest) const override;
 
     /// Create and return a new pass. If pass with same name exists, it will be returned.
     Pass* CreatePass(const String& name);
@@ -142,6 +146,8 @@ public:
     static const String& PassName(unsigned char index);
     /// Return a default opaque untextured material.
     static Material* DefaultMaterial();
+    /// Return the global version number of material passes. Changes whenever passes are created or removed, or their shaders change in any material.
+    static unsigned PassesVersion() { return passesVersion; }
 
     /// Material textures.
     SharedPtr<Texture> textures[MAX_MATERIAL_TEXTURE_UNITS];
@@ -164,6 +170,8 @@ private:
     static Vector<String> passNames;
     /// Next free pass index.
     static unsigned char nextPassIndex;
+    /// Global version number of material passes.
+    static unsigned passesVersion;
 };
 
 }
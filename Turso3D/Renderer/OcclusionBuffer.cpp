@@ -0,0 +1,473 @@
+// For conditions of distribution and use, see copyright notice in License.txt
+
+#include "../Debug/Log.h"
+#include "../Graphics/IndexBuffer.h"
+#include "../Graphics/VertexBuffer.h"
+#include "Camera.h"
+#include "GeometryNode.h"
+#include "OcclusionBuffer.h"
+
+#include <cmath>
+
+#ifdef TURSO3D_SSE
+#include <xmmintrin.h>
+#endif
+
+#include "../Debug/DebugNew.h"
+
+namespace Turso3D
+{
+
+/// Relative depth tolerance for the visibility test, so that an occluder does not hide its own bounding box.
+static const float OCCLUSION_DEPTH_BIAS = 0.0001f;
+/// Minimum screen space triangle area in pixels to rasterize.
+static const float MIN_TRIANGLE_AREA = 0.0001f;
+/// Rasterization tasks per worker thread, including the main thread.
+static const size_t OCCLUSION_TASKS_PER_THREAD = 2;
+/// Minimum pixel rows per rasterization task.
+static const int MIN_ROWS_PER_OCCLUSION_TASK = 8;
+
+OcclusionBuffer::OcclusionBuffer() :
+    width(0),
+    height(0),
+    maxTriangles(DEFAULT_MAX_OCCLUDER_TRIANGLES),
+    nearClip(0.0f),
+    farClip(0.0f),
+    orthographic(false)
+{
+}
+
+OcclusionBuffer::~OcclusionBuffer()
+{
+}
+
+bool OcclusionBuffer::SetSize(int newWidth, int newHeight)
+{
+    if (newWidth < 1 || newHeight < 1)
+    {
+        LOGERROR("Can not set zero or negative occlusion buffer size");
+        return false;
+    }
+
+    // Round the width up so that rows can be processed four pixels at a time
+    newWidth = (newWidth + 3) & ~3;
+    if (newWidth == width && newHeight == height)
+        return true;
+
+    width = newWidth;
+    height = newHeight;
+    levels.Clear();
+    levelWidths.Clear();
+    levelHeights.Clear();
+
+    int levelWidth = width;
+    int levelHeight = height;
+    for (;;)
+    {
+        levels.Resize(levels.Size() + 1);
+        levels.Back().Resize(levelWidth * levelHeight);
+        levelWidths.Push(levelWidth);
+        levelHeights.Push(levelHeight);
+        if (levelWidth == 1 && levelHeight == 1)
+            break;
+
+        levelWidth = (levelWidth + 1) / 2;
+        levelHeight = (levelHeight + 1) / 2;
+    }
+
+    for (auto it = levels.Begin(); it != levels.End(); ++it)
+    {
+        for (auto dIt = it->Begin(); dIt != it->End(); ++dIt)
+            *dIt = 0.0f;
+    }
+
+    return true;
+}
+
+void OcclusionBuffer::SetMaxTriangles(size_t num)
+{
+    maxTriangles = num;
+}
+
+void OcclusionBuffer::SetView(Camera* camera)
+{
+    view = camera->ViewMatrix();
+    projection = camera->ProjectionMatrix(false);
+    nearClip = camera->NearClip();
+    farClip = camera->FarClip();
+    orthographic = camera->IsOrthographic();
+    triangles.Clear();
+}
+
+bool OcclusionBuffer::AddOccluder(GeometryNode* node)
+{
+    const Matrix3x4& worldTransform = node->WorldTransform();
+
+    for (size_t i = 0; i < node->NumGeometries(); ++i)
+    {
+        Geometry* geometry = node->GetGeometry(i);
+        if (!geometry || geometry->primitiveType != TRIANGLE_LIST)
+            continue;
+
+        VertexBuffer* vertexBuffer = geometry->vertexBuffer;
+        IndexBuffer* indexBuffer = geometry->indexBuffer;
+        if (!vertexBuffer || !vertexBuffer->ShadowData() || (indexBuffer && !indexBuffer->ShadowData()))
+            continue;
+
+        const Vector<VertexElement>& elements = vertexBuffer->Elements();
+        for (auto it = elements.Begin(); it != elements.End(); ++it)
+        {
+            if (it->semantic == SEM_POSITION && it->type == ELEM_VECTOR3 && !it->index && !it->perInstance)
+            {
+                if (!AddTriangles(worldTransform, vertexBuffer->ShadowData(), vertexBuffer->VertexSize(), it->offset,
+                    indexBuffer ? indexBuffer->ShadowData() : nullptr, indexBuffer ? indexBuffer->IndexSize() : 0,
+                    geometry->drawStart, geometry->drawCount))
+                    return false;
+                break;
+            }
+        }
+    }
+
+    return true;
+}
+
+bool OcclusionBuffer::AddTriangles(const Matrix3x4& worldTransform, const unsigned char* vertexData, size_t vertexSize,
+    size_t positionOffset, const unsigned char* indexData, size_t indexSize, size_t drawStart, size_t drawCount)
+{
+    Matrix3x4 worldView = view * worldTransform;
+    const unsigned char* positionData = vertexData + positionOffset;
+
+    for (size_t i = drawStart; i + 2 < drawStart + drawCount; i += 3)
+    {
+        if (triangles.Size() >= maxTriangles)
+            return false;
+
+        Vector3 vertices[3];
+        for (size_t j = 0; j < 3; ++j)
+        {
+            size_t index;
+            if (!indexData)
+                index = i + j;
+            else if (indexSize == sizeof(unsigned short))
+                index = ((const unsigned short*)indexData)[i + j];
+            else
+                index = ((const unsigned*)indexData)[i + j];
+
+            vertices[j] = worldView * *((const Vector3*)(positionData + index * vertexSize));
+        }
+
+        AddTriangle(vertices[0], vertices[1], vertices[2]);
+    }
+
+    return triangles.Size() < maxTriangles;
+}
+
+void OcclusionBuffer::DrawTriangles(WorkQueue* workQueue)
+{
+    if (!width || !height)
+        return;
+
+    Vector<float>& buffer = levels[0];
+    for (auto it = buffer.Begin(); it != buffer.End(); ++it)
+        *it = 0.0f;
+
+    // Divide the rows into bands. Each task rasterizes all triangles into its own rows only, so the bands can be written
+    // without synchronization, and as the depth test keeps the nearest depth, the order of triangles does not matter
+    size_t numTasks = 1;
+    if (workQueue && workQueue->NumThreads() && triangles.Size())
+    {
+        numTasks = (workQueue->NumThreads() + 1) * OCCLUSION_TASKS_PER_THREAD;
+        size_t maxTasks = (size_t)((height + MIN_ROWS_PER_OCCLUSION_TASK - 1) / MIN_ROWS_PER_OCCLUSION_TASK);
+        if (numTasks > maxTasks)
+            numTasks = maxTasks;
+    }
+
+    while (tasks.Size() < numTasks)
+        tasks.Push(new OcclusionBufferTask(this, &OcclusionBuffer::DrawTrianglesWork));
+
+    int rowsPerTask = (height + (int)numTasks - 1) / (int)numTasks;
+    for (size_t i = 0; i < numTasks; ++i)
+    {
+        OcclusionBufferTask* task = tasks[i].Get();
+        task->startRow = (int)i * rowsPerTask;
+        task->endRow = Min(task->startRow + rowsPerTask, height);
+
+        if (numTasks > 1)
+            workQueue->AddTask(task);
+        else
+            task->Complete(0);
+    }
+
+    if (numTasks > 1)
+        workQueue->Complete();
+
+    BuildDepthHierarchy();
+}
+
+bool OcclusionBuffer::IsVisible(const BoundingBox& worldBox) const
+{
+    if (!width || !height)
+        return true;
+
+    // Use the view space bounding box, whose screen rectangle can be found from its extreme coordinates
+    BoundingBox viewBox = worldBox.Transformed(view);
+    // If the box crosses the near plane, can not determine the screen rectangle
+    if (viewBox.min.z < nearClip)
+        return true;
+
+    float minX, minY, maxX, maxY, maxDepth;
+    if (!orthographic)
+    {
+        float invNear = 1.0f / viewBox.min.z;
+        float invFar = 1.0f / viewBox.max.z;
+        minX = projection.m00 * viewBox.min.x * (viewBox.min.x < 0.0f ? invNear : invFar) + projection.m02;
+        maxX = projection.m00 * viewBox.max.x * (viewBox.max.x > 0.0f ? invNear : invFar) + projection.m02;
+        minY = projection.m11 * viewBox.min.y * (viewBox.min.y < 0.0f ? invNear : invFar) + projection.m12;
+        maxY = projection.m11 * viewBox.max.y * (viewBox.max.y > 0.0f ? invNear : invFar) + projection.m12;
+        maxDepth = invNear;
+    }
+    else
+    {
+        minX = projection.m00 * viewBox.min.x + projection.m03;
+        maxX = projection.m00 * viewBox.max.x + projection.m03;
+        minY = projection.m11 * viewBox.min.y + projection.m13;
+        maxY = projection.m11 * viewBox.max.y + projection.m13;
+        maxDepth = 1.0f - viewBox.min.z / farClip;
+    }
+
+    // Convert to pixels. The Y axis is flipped, so the top of the view box is the top of the screen rectangle
+    float left = (minX * 0.5f + 0.5f) * (float)width;
+    float right = (maxX * 0.5f + 0.5f) * (float)width;
+    float top = (0.5f - maxY * 0.5f) * (float)height;
+    float bottom = (0.5f - minY * 0.5f) * (float)height;
+
+    // Boxes outside the screen should not pass the frustum test, but consider them visible to be safe
+    if (right < 0.0f || bottom < 0.0f || left >= (float)width || top >= (float)height)
+        return true;
+
+    int rect[4];
+    rect[0] = (int)Max(left, 0.0f);
+    rect[1] = (int)Max(top, 0.0f);
+    rect[2] = (int)Min(right, (float)(width - 1));
+    rect[3] = (int)Min(bottom, (float)(height - 1));
+
+    // Start from the finest level where the rectangle spans at most 2x2 texels
+    size_t level = 0;
+    while (level + 1 < levels.Size() && ((rect[2] >> level) - (rect[0] >> level) > 1 || (rect[3] >> level) - (rect[1] >> level) > 1))
+        ++level;
+
+    return IsVisible(level, rect[0] >> level, rect[1] >> level, rect[2] >> level, rect[3] >> level, rect, maxDepth *
+        (1.0f + OCCLUSION_DEPTH_BIAS));
+}
+
+void OcclusionBuffer::DrawTrianglesWork(Task* task_, unsigned /* threadIndex */)
+{
+    OcclusionBufferTask* task = static_cast<OcclusionBufferTask*>(task_);
+
+    for (auto it = triangles.Begin(); it != triangles.End(); ++it)
+    {
+        if (it->maxY >= task->startRow && it->minY < task->endRow)
+            DrawTriangle(*it, task->startRow, task->endRow);
+    }
+}
+
+void OcclusionBuffer::DrawTriangle(const OcclusionTriangle& triangle, int startRow, int endRow)
+{
+    const float* x = triangle.x;
+    const float* y = triangle.y;
+    const float* d = triangle.depth;
+
+    // Edge functions of the form a * x + b * y + c, positive inside the triangle
+    float a0 = y[1] - y[2], b0 = x[2] - x[1], c0 = x[1] * y[2] - x[2] * y[1];
+    float a1 = y[2] - y[0], b1 = x[0] - x[2], c1 = x[2] * y[0] - x[0] * y[2];
+    float a2 = y[0] - y[1], b2 = x[1] - x[0], c2 = x[0] * y[1] - x[1] * y[0];
+    float invArea = 1.0f / (c0 + c1 + c2);
+
+    // Depth plane from the barycentric coordinates
+    float da = (a0 * d[0] + a1 * d[1] + a2 * d[2]) * invArea;
+    float db = (b0 * d[0] + b1 * d[1] + b2 * d[2]) * invArea;
+    float dc = (c0 * d[0] + c1 * d[1] + c2 * d[2]) * invArea;
+
+    int top = Max(triangle.minY, startRow);
+    int bottom = Min(triangle.maxY, endRow - 1);
+    int left = (int)Max(Min(Min(x[0], x[1]), x[2]), 0.0f) & ~3;
+    int right = (int)Min(Max(Max(x[0], x[1]), x[2]), (float)(width - 1));
+
+    float* row = &levels[0][top * width];
+
+    for (int py = top; py <= bottom; ++py, row += width)
+    {
+        float cx = (float)left + 0.5f;
+        float cy = (float)py + 0.5f;
+        float e0 = a0 * cx + b0 * cy + c0;
+        float e1 = a1 * cx + b1 * cy + c1;
+        float e2 = a2 * cx + b2 * cy + c2;
+        float depth = da * cx + db * cy + dc;
+
+        #ifdef TURSO3D_SSE
+        __m128 offsets = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+        __m128 edge0 = _mm_add_ps(_mm_set1_ps(e0), _mm_mul_ps(_mm_set1_ps(a0), offsets));
+        __m128 edge1 = _mm_add_ps(_mm_set1_ps(e1), _mm_mul_ps(_mm_set1_ps(a1), offsets));
+        __m128 edge2 = _mm_add_ps(_mm_set1_ps(e2), _mm_mul_ps(_mm_set1_ps(a2), offsets));
+        __m128 depths = _mm_add_ps(_mm_set1_ps(depth), _mm_mul_ps(_mm_set1_ps(da), offsets));
+        __m128 step0 = _mm_set1_ps(a0 * 4.0f);
+        __m128 step1 = _mm_set1_ps(a1 * 4.0f);
+        __m128 step2 = _mm_set1_ps(a2 * 4.0f);
+        __m128 depthStep = _mm_set1_ps(da * 4.0f);
+        __m128 zero = _mm_setzero_ps();
+
+        for (int px = left; px <= right; px += 4)
+        {
+            __m128 mask = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(edge0, zero), _mm_cmpge_ps(edge1, zero)), _mm_cmpge_ps(edge2, zero));
+            if (_mm_movemask_ps(mask))
+            {
+                __m128 old = _mm_loadu_ps(row + px);
+                __m128 nearest = _mm_max_ps(old, depths);
+                _mm_storeu_ps(row + px, _mm_or_ps(_mm_and_ps(mask, nearest), _mm_andnot_ps(mask, old)));
+            }
+
+            edge0 = _mm_add_ps(edge0, step0);
+            edge1 = _mm_add_ps(edge1, step1);
+            edge2 = _mm_add_ps(edge2, step2);
+            depths = _mm_add_ps(depths, depthStep);
+        }
+        #else
+        for (int px = left; px <= right; ++px)
+        {
+            if (e0 >= 0.0f && e1 >= 0.0f && e2 >= 0.0f && depth > row[px])
+                row[px] = depth;
+
+            e0 += a0;
+            e1 += a1;
+            e2 += a2;
+            depth += da;
+        }
+        #endif
+    }
+}
+
+void OcclusionBuffer::AddTriangle(const Vector3& v0, const Vector3& v1, const Vector3& v2)
+{
+    // Clip to the near plane, which may result in a quad
+    const Vector3* in[3] = { &v0, &v1, &v2 };
+    Vector3 clipped[4];
+    size_t numClipped = 0;
+
+    for (size_t i = 0; i < 3; ++i)
+    {
+        const Vector3& start = *in[i];
+        const Vector3& end = *in[(i + 1) % 3];
+        bool startInside = start.z >= nearClip;
+        bool endInside = end.z >= nearClip;
+
+        if (startInside)
+            clipped[numClipped++] = start;
+        if (startInside != endInside)
+            clipped[numClipped++] = start + (end - start) * ((nearClip - start.z) / (end.z - start.z));
+    }
+
+    if (numClipped < 3)
+        return;
+
+    float x[4], y[4], depth[4];
+    for (size_t i = 0; i < numClipped; ++i)
+        ProjectVertex(clipped[i], x[i], y[i], depth[i]);
+
+    for (size_t i = 2; i < numClipped; ++i)
+    {
+        OcclusionTriangle triangle;
+        triangle.x[0] = x[0];
+        triangle.y[0] = y[0];
+        triangle.depth[0] = depth[0];
+
+        // Wind the triangle so that the edge functions are positive inside. Both front and back faces are rasterized
+        float area = (x[i - 1] - x[0]) * (y[i] - y[0]) - (x[i] - x[0]) * (y[i - 1] - y[0]);
+        if (fabsf(area) < MIN_TRIANGLE_AREA)
+            continue;
+        size_t first = area > 0.0f ? i - 1 : i;
+        size_t second = area > 0.0f ? i : i - 1;
+        triangle.x[1] = x[first];
+        triangle.y[1] = y[first];
+        triangle.depth[1] = depth[first];
+        triangle.x[2] = x[second];
+        triangle.y[2] = y[second];
+        triangle.depth[2] = depth[second];
+
+        float minX = Min(Min(triangle.x[0], triangle.x[1]), triangle.x[2]);
+        float maxX = Max(Max(triangle.x[0], triangle.x[1]), triangle.x[2]);
+        float minY = Min(Min(triangle.y[0], triangle.y[1]), triangle.y[2]);
+        float maxY = Max(Max(triangle.y[0], triangle.y[1]), triangle.y[2]);
+        if (maxX < 0.0f || maxY < 0.0f || minX >= (float)width || minY >= (float)height)
+            continue;
+
+        triangle.minY = (int)Max(minY, 0.0f);
+        triangle.maxY = (int)Min(maxY, (float)(height - 1));
+        triangles.Push(triangle);
+    }
+}
+
+void OcclusionBuffer::ProjectVertex(const Vector3& vertex, float& x, float& y, float& depth) const
+{
+    float invW = 1.0f / (projection.m30 * vertex.x + projection.m31 * vertex.y + projection.m32 * vertex.z + projection.m33);
+    float clipX = (projection.m00 * vertex.x + projection.m01 * vertex.y + projection.m02 * vertex.z + projection.m03) * invW;
+    float clipY = (projection.m10 * vertex.x + projection.m11 * vertex.y + projection.m12 * vertex.z + projection.m13) * invW;
+
+    x = (clipX * 0.5f + 0.5f) * (float)width;
+    y = (0.5f - clipY * 0.5f) * (float)height;
+    // Use a depth that is linear in screen space: reciprocal depth for perspective and linear depth for orthographic views
+    depth = orthographic ? 1.0f - vertex.z / farClip : 1.0f / vertex.z;
+}
+
+void OcclusionBuffer::BuildDepthHierarchy()
+{
+    // Each texel of a coarser level stores the farthest (smallest) depth of the texels it covers
+    for (size_t i = 1; i < levels.Size(); ++i)
+    {
+        const float* src = &levels[i - 1][0];
+        float* dest = &levels[i][0];
+        int srcWidth = levelWidths[i - 1];
+        int srcHeight = levelHeights[i - 1];
+        int destWidth = levelWidths[i];
+        int destHeight = levelHeights[i];
+
+        for (int y = 0; y < destHeight; ++y)
+        {
+            const float* row0 = src + (y * 2) * srcWidth;
+            const float* row1 = (y * 2 + 1 < srcHeight) ? row0 + srcWidth : row0;
+
+            for (int x = 0; x < destWidth; ++x)
+            {
+                int x0 = x * 2;
+                int x1 = (x0 + 1 < srcWidth) ? x0 + 1 : x0;
+                dest[y * destWidth + x] = Min(Min(row0[x0], row0[x1]), Min(row1[x0], row1[x1]));
+            }
+        }
+    }
+}
+
+bool OcclusionBuffer::IsVisible(size_t level, int left, int top, int right, int bottom, const int* rect, float depth) const
+{
+    const float* data = &levels[level][0];
+    int levelWidth = levelWidths[level];
+
+    for (int y = top; y <= bottom; ++y)
+    {
+        for (int x = left; x <= right; ++x)
+        {
+            // If the farthest depth of the texel is nearer than the box, the box is hidden in this texel
+            if (data[y * levelWidth + x] > depth)
+                continue;
+            if (!level)
+                return true;
+
+            size_t childLevel = level - 1;
+            if (IsVisible(childLevel, Max(x * 2, rect[0] >> childLevel), Max(y * 2, rect[1] >> childLevel), Min(x * 2 + 1,
+                rect[2] >> childLevel), Min(y * 2 + 1, rect[3] >> childLevel), rect, depth))
+                return true;
+        }
+    }
+
+    return false;
+}
+
+}
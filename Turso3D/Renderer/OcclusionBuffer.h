@@ -0,0 +1,161 @@
+// For conditions of distribution and use, see copyright notice in License.txt
+
+#pragma once
+
+#include "../Math/Frustum.h"
+#include "../Math/Matrix4.h"
+#include "../Thread/WorkQueue.h"
+
+namespace Turso3D
+{
+
+class Camera;
+class GeometryNode;
+class OcclusionBuffer;
+
+/// Default occlusion buffer width in pixels. The height follows the camera's aspect ratio.
+static const int DEFAULT_OCCLUSION_BUFFER_WIDTH = 256;
+/// Default maximum number of occluder triangles rasterized per view.
+static const size_t DEFAULT_MAX_OCCLUDER_TRIANGLES = 5000;
+
+/// Screen space occluder triangle.
+struct TURSO3D_API OcclusionTriangle
+{
+    /// Vertex X coordinates in pixels.
+    float x[3];
+    /// Vertex Y coordinates in pixels, growing downward.
+    float y[3];
+    /// Vertex depth values. Larger values are nearer to the camera.
+    float depth[3];
+    /// First pixel row covered.
+    int minY;
+    /// Last pixel row covered.
+    int maxY;
+};
+
+/// %Task for rasterizing the occluder triangles into a horizontal band of the occlusion buffer in a worker thread.
+class TURSO3D_API OcclusionBufferTask : public MemberFunctionTask<OcclusionBuffer>
+{
+public:
+    /// Construct.
+    OcclusionBufferTask(OcclusionBuffer* buffer, WorkFunctionPtr function) :
+        MemberFunctionTask<OcclusionBuffer>(buffer, function),
+        startRow(0),
+        endRow(0)
+    {
+    }
+
+    /// First pixel row to rasterize.
+    int startRow;
+    /// One past the last pixel row to rasterize.
+    int endRow;
+};
+
+/// Low resolution software depth buffer for CPU occlusion culling. Occluder triangles are rasterized into it, after which a hierarchy of farthest depths is built for rejecting bounding boxes conservatively.
+class TURSO3D_API OcclusionBuffer
+{
+public:
+    /// Construct.
+    OcclusionBuffer();
+    /// Destruct.
+    ~OcclusionBuffer();
+
+    /// Set buffer size. The width is rounded up to a multiple of 4. Return true on success.
+    bool SetSize(int width, int height);
+    /// Set maximum number of occluder triangles per view.
+    void SetMaxTriangles(size_t num);
+    /// Begin a new view from a camera. Clears the occluder triangles.
+    void SetView(Camera* camera);
+    /// Add the triangles of an occluder node's geometries from their CPU-side vertex and index data. Return false if the triangle budget is exhausted.
+    bool AddOccluder(GeometryNode* node);
+    /// Add indexed triangles from CPU-side vertex and index data. Non-indexed if index data is null. Return false if the triangle budget is exhausted.
+    bool AddTriangles(const Matrix3x4& worldTransform, const unsigned char* vertexData, size_t vertexSize, size_t positionOffset, const unsigned char* indexData, size_t indexSize, size_t drawStart, size_t drawCount);
+    /// Clear and rasterize the triangles added so far, then build the depth hierarchy. If a work queue with worker threads is given, the rows are divided between them. The result does not depend on the number of threads.
+    void DrawTriangles(WorkQueue* workQueue = nullptr);
+    /// Test a world space bounding box for visibility. Return true if possibly visible. Safe to call from several threads after DrawTriangles().
+    bool IsVisible(const BoundingBox& worldBox) const;
+
+    /// Return buffer width.
+    int Width() const { return width; }
+    /// Return buffer height.
+    int Height() const { return height; }
+    /// Return maximum number of occluder triangles per view.
+    size_t MaxTriangles() const { return maxTriangles; }
+    /// Return number of occluder triangles added to the current view.
+    size_t NumTriangles() const { return triangles.Size(); }
+    /// Return number of depth hierarchy levels, including the full resolution level.
+    size_t NumLevels() const { return levels.Size(); }
+    /// Return depth values of a hierarchy level. Larger values are nearer to the camera, and zero means nothing was rasterized.
+    const Vector<float>& LevelData(size_t level) const { return levels[level]; }
+
+private:
+    /// Work function for rasterizing a band of rows.
+    void DrawTrianglesWork(Task* task, unsigned threadIndex);
+    /// Rasterize one triangle, limited to a band of rows.
+    void DrawTriangle(const OcclusionTriangle& triangle, int startRow, int endRow);
+    /// Clip a view space triangle to the near plane, project and add it.
+    void AddTriangle(const Vector3& v0, const Vector3& v1, const Vector3& v2);
+    /// Project a view space vertex to the screen.
+    void ProjectVertex(const Vector3& vertex, float& x, float& y, float& depth) const;
+    /// Build the farthest depth hierarchy.
+    void BuildDepthHierarchy();
+    /// Test a pixel rectangle at a hierarchy level, refining towards full resolution. Return true if any pixel may be farther than the depth.
+    bool IsVisible(size_t level, int left, int top, int right, int bottom, const int* rect, float depth) const;
+
+    /// Depth hierarchy levels. The first level is the full resolution buffer.
+    Vector<Vector<float> > levels;
+    /// Depth hierarchy level widths.
+    Vector<int> levelWidths;
+    /// Depth hierarchy level heights.
+    Vector<int> levelHeights;
+    /// Occluder triangles of the current view.
+    Vector<OcclusionTriangle> triangles;
+    /// Rasterization tasks.
+    Vector<AutoPtr<OcclusionBufferTask> > tasks;
+    /// Camera view matrix.
+    Matrix3x4 view;
+    /// Camera projection matrix.
+    Matrix4 projection;
+    /// Buffer width.
+    int width;
+    /// Buffer height.
+    int height;
+    /// Maximum number of occluder triangles.
+    size_t maxTriangles;
+    /// Near clip distance.
+    float nearClip;
+    /// Far clip distance.
+    float farClip;
+    /// Orthographic flag. Orthographic views store linear depth instead of reciprocal depth.
+    bool orthographic;
+};
+
+/// Frustum query volume that also rejects bounding boxes hidden in an occlusion buffer. Rejects whole octants during octree traversal.
+struct TURSO3D_API OccludedFrustum
+{
+    /// Construct.
+    OccludedFrustum(const Frustum& frustum_, const OcclusionBuffer& buffer_) :
+        frustum(frustum_),
+        buffer(buffer_)
+    {
+    }
+
+    /// Test if a bounding box is outside or intersects. Occluded boxes are outside. Never returns inside, so that the child octants of a fully visible octant are still tested for occlusion.
+    Intersection IsInside(const BoundingBox& box) const
+    {
+        return (frustum.IsInside(box) == OUTSIDE || !buffer.IsVisible(box)) ? OUTSIDE : INTERSECTS;
+    }
+
+    /// Test if a bounding box is (partially) inside or outside. Occluded boxes are outside.
+    Intersection IsInsideFast(const BoundingBox& box) const
+    {
+        return (frustum.IsInsideFast(box) == OUTSIDE || !buffer.IsVisible(box)) ? OUTSIDE : INSIDE;
+    }
+
+    /// View frustum.
+    const Frustum& frustum;
+    /// Occlusion buffer.
+    const OcclusionBuffer& buffer;
+};
+
+}
@@ -1,10 +1,17 @@
 // For conditions of distribution and use, see copyright notice in License.txt
 
 #include "../Debug/Log.h"
+#include "../Math/Frustum.h"
 #include "../Math/Ray.h"
+#include "../Thread/ThreadLocalValue.h"
 #include "Octree.h"
 
 #include <cassert>
+#include <cstring>
+
+#ifdef TURSO3D_SSE
+#include <xmmintrin.h>
+#endif
 
 #include "../Debug/DebugNew.h"
 
@@ -14,6 +21,12 @@ namespace Turso3D
 static const float DEFAULT_OCTREE_SIZE = 1000.0f;
 static const int DEFAULT_OCTREE_LEVELS = 8;
 static const int MAX_OCTREE_LEVELS = 256;
+/// Minimum number of nodes outside the octree bounds to grow the octree automatically.
+static const size_t MIN_AUTO_RESIZE_OVERFLOW_NODES = 8;
+/// Fraction of all nodes, as a divisor, that must be outside the octree bounds to grow the octree automatically.
+static const size_t AUTO_RESIZE_OVERFLOW_DIVISOR = 64;
+/// Maximum number of nodes outside the promoted child octant to reinsert when shrinking the octree automatically.
+static const size_t MAX_AUTO_SHRINK_REINSERT_NODES = 1024;
 
 bool CompareRaycastResults(const RaycastResult& lhs, const RaycastResult& rhs)
 {
@@ -25,6 +38,386 @@ bool CompareNodeDistances(const Pair<OctreeNode*, float>& lhs, const Pair<Octree
     return lhs.second < rhs.second;
 }
 
+/// Return whether the root octant could grow to contain a bounding box. Non-finite boxes, such as those of directional lights, never fit.
+static bool FitsGrownRoot(const BoundingBox& rootBox, const Vector3& maxRootSize, const BoundingBox& box)
+{
+    BoundingBox grownBox(rootBox);
+    grownBox.Merge(box);
+    Vector3 grownSize = grownBox.Size();
+    return grownSize.x <= maxRootSize.x && grownSize.y <= maxRootSize.y && grownSize.z <= maxRootSize.z;
+}
+
+/// Child octant hit by a ray, for visiting the child octants in ray order.
+struct ChildOctantHit
+{
+    /// Child octant.
+    const Octant* octant;
+    /// Entry distance.
+    float distance;
+};
+
+/// Sort child octant hits by entry distance. There are at most 8, so use insertion sort.
+static void SortChildOctantHits(ChildOctantHit* hits, size_t count)
+{
+    for (size_t i = 1; i < count; ++i)
+    {
+        ChildOctantHit hit = hits[i];
+        size_t j = i;
+        for (; j > 0 && hits[j - 1].distance > hit.distance; --j)
+            hits[j] = hits[j - 1];
+        hits[j] = hit;
+    }
+}
+
+/// Return the sign bits of a direction: 1 for negative X, 2 for negative Y and 4 for negative Z.
+static unsigned DirectionSigns(const Vector3& direction)
+{
+    return (direction.x < 0.0f ? 1 : 0) | (direction.y < 0.0f ? 2 : 0) | (direction.z < 0.0f ? 4 : 0);
+}
+
+/// Rays with the same direction signs traversed together. The axes where the directions are negative are mirrored, so that all directions are positive and each slab's entry is at its minimum. This also makes one child octant order front to back for all the rays.
+struct RayPacket
+{
+    /// Initialize from rays and their results. The rays' directions must have the same signs.
+    void Define(const Ray* rays_, RaycastResult* results_, size_t count_, float maxDistance)
+    {
+        rays = rays_;
+        results = results_;
+        count = count_;
+
+        flipMask = DirectionSigns(rays[0].direction);
+
+        for (size_t i = 0; i < RAY_PACKET_SIZE; ++i)
+        {
+            // Unused rays never hit
+            if (i >= count)
+            {
+                originX[i] = originY[i] = originZ[i] = 0.0f;
+                invDirX[i] = invDirY[i] = invDirZ[i] = 1.0f;
+                distances[i] = -1.0f;
+                continue;
+            }
+
+            Vector3 origin = Mirror(rays[i].origin);
+            Vector3 direction = Mirror(rays[i].direction);
+            originX[i] = origin.x;
+            originY[i] = origin.y;
+            originZ[i] = origin.z;
+            // Zero components are replaced with a large value to avoid NaNs
+            invDirX[i] = direction.x > 0.0f ? 1.0f / direction.x : 1.0e30f;
+            invDirY[i] = direction.y > 0.0f ? 1.0f / direction.y : 1.0e30f;
+            invDirZ[i] = direction.z > 0.0f ? 1.0f / direction.z : 1.0e30f;
+            distances[i] = maxDistance;
+
+            Vector3 invDirection(invDirX[i], invDirY[i], invDirZ[i]);
+            for (size_t j = 0; j < 3; ++j)
+            {
+                minOrigin[j] = i ? Min(minOrigin[j], origin.Data()[j]) : origin.Data()[j];
+                maxOrigin[j] = i ? Max(maxOrigin[j], origin.Data()[j]) : origin.Data()[j];
+                minInvDir[j] = i ? Min(minInvDir[j], invDirection.Data()[j]) : invDirection.Data()[j];
+                maxInvDir[j] = i ? Max(maxInvDir[j], invDirection.Data()[j]) : invDirection.Data()[j];
+            }
+
+            results[i].distance = maxDistance;
+            results[i].node = nullptr;
+        }
+    }
+
+    /// Mirror a vector on the axes where the directions are negative.
+    Vector3 Mirror(const Vector3& vec) const
+    {
+        return Vector3(flipMask & 1 ? -vec.x : vec.x, flipMask & 2 ? -vec.y : vec.y, flipMask & 4 ? -vec.z : vec.z);
+    }
+
+    /// Mirror a bounding box on the axes where the directions are negative.
+    BoundingBox Mirror(const BoundingBox& box) const
+    {
+        BoundingBox ret(box);
+        if (flipMask & 1)
+        {
+            ret.min.x = -box.max.x;
+            ret.max.x = -box.min.x;
+        }
+        if (flipMask & 2)
+        {
+            ret.min.y = -box.max.y;
+            ret.max.y = -box.min.y;
+        }
+        if (flipMask & 4)
+        {
+            ret.min.z = -box.max.z;
+            ret.max.z = -box.min.z;
+        }
+        return ret;
+    }
+
+    /// Return whether any ray of the packet may hit a mirrored bounding box. Bounds the slab distances of all the rays at once with interval arithmetic over the origins and reciprocal directions.
+    bool MayHit(const BoundingBox& box) const
+    {
+        float tNear = 0.0f;
+        float tFar = M_INFINITY;
+        for (size_t i = 0; i < 3; ++i)
+        {
+            float entry = box.min.Data()[i] - maxOrigin[i];
+            float exit = box.max.Data()[i] - minOrigin[i];
+            tNear = Max(tNear, entry * (entry >= 0.0f ? minInvDir[i] : maxInvDir[i]));
+            tFar = Min(tFar, exit * (exit >= 0.0f ? maxInvDir[i] : minInvDir[i]));
+        }
+
+        // Allow for rounding like in the per-ray test
+        return tNear <= tFar + 0.002f * (tNear + Abs(tFar)) + 0.002f;
+    }
+
+    /// Test a mirrored bounding box against the active rays. Return a bit for each ray whose slab entry distance is nearer than its closest hit so far. The test is conservative: rounding may let through rays that miss, which their exact tests reject.
+    unsigned Test(const BoundingBox& box, unsigned activeMask) const
+    {
+        unsigned bits = 0;
+        size_t i = 0;
+
+        #ifdef TURSO3D_SSE
+        __m128 minX = _mm_set1_ps(box.min.x);
+        __m128 minY = _mm_set1_ps(box.min.y);
+        __m128 minZ = _mm_set1_ps(box.min.z);
+        __m128 maxX = _mm_set1_ps(box.max.x);
+        __m128 maxY = _mm_set1_ps(box.max.y);
+        __m128 maxZ = _mm_set1_ps(box.max.z);
+        __m128 zero = _mm_setzero_ps();
+        __m128 epsilon = _mm_set1_ps(0.001f);
+        __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+
+        for (; i < count; i += 4)
+        {
+            if (!((activeMask >> i) & 0xf))
+                continue;
+
+            __m128 ox = _mm_loadu_ps(originX + i);
+            __m128 oy = _mm_loadu_ps(originY + i);
+            __m128 oz = _mm_loadu_ps(originZ + i);
+            __m128 ix = _mm_loadu_ps(invDirX + i);
+            __m128 iy = _mm_loadu_ps(invDirY + i);
+            __m128 iz = _mm_loadu_ps(invDirZ + i);
+            __m128 tNear = _mm_max_ps(_mm_max_ps(_mm_mul_ps(_mm_sub_ps(minX, ox), ix), _mm_mul_ps(_mm_sub_ps(minY, oy), iy)),
+                _mm_max_ps(_mm_mul_ps(_mm_sub_ps(minZ, oz), iz), zero));
+            __m128 tFar = _mm_min_ps(_mm_min_ps(_mm_mul_ps(_mm_sub_ps(maxX, ox), ix), _mm_mul_ps(_mm_sub_ps(maxY, oy), iy)),
+                _mm_mul_ps(_mm_sub_ps(maxZ, oz), iz));
+            __m128 margin = _mm_add_ps(_mm_mul_ps(_mm_add_ps(tNear, _mm_and_ps(tFar, absMask)), epsilon), epsilon);
+            __m128 near = _mm_sub_ps(tNear, margin);
+            __m128 hit = _mm_and_ps(_mm_cmple_ps(near, _mm_add_ps(tFar, margin)), _mm_cmplt_ps(near, _mm_loadu_ps(distances + i)));
+            bits |= (unsigned)_mm_movemask_ps(hit) << i;
+        }
+        #else
+        for (; i < count; ++i)
+        {
+            if (!(activeMask & (1u << i)))
+                continue;
+
+            float tNear = Max(Max((box.min.x - originX[i]) * invDirX[i], (box.min.y - originY[i]) * invDirY[i]), Max((box.min.z -
+                originZ[i]) * invDirZ[i], 0.0f));
+            float tFar = Min(Min((box.max.x - originX[i]) * invDirX[i], (box.max.y - originY[i]) * invDirY[i]), (box.max.z -
+                originZ[i]) * invDirZ[i]);
+            float margin = 0.001f * (tNear + Abs(tFar)) + 0.001f;
+            if (tNear - margin <= tFar + margin && tNear - margin < distances[i])
+                bits |= 1u << i;
+        }
+        #endif
+
+        return bits & activeMask;
+    }
+
+    /// Rays.
+    const Ray* rays;
+    /// Closest results of the rays.
+    RaycastResult* results;
+    /// Number of rays.
+    size_t count;
+    /// Mirrored ray origin X coordinates.
+    float originX[RAY_PACKET_SIZE];
+    /// Mirrored ray origin Y coordinates.
+    float originY[RAY_PACKET_SIZE];
+    /// Mirrored ray origin Z coordinates.
+    float originZ[RAY_PACKET_SIZE];
+    /// Reciprocals of the mirrored ray direction X components.
+    float invDirX[RAY_PACKET_SIZE];
+    /// Reciprocals of the mirrored ray direction Y components.
+    float invDirY[RAY_PACKET_SIZE];
+    /// Reciprocals of the mirrored ray direction Z components.
+    float invDirZ[RAY_PACKET_SIZE];
+    /// Closest hit distances so far.
+    float distances[RAY_PACKET_SIZE];
+    /// Minimum of the mirrored origins per axis.
+    float minOrigin[3];
+    /// Maximum of the mirrored origins per axis.
+    float maxOrigin[3];
+    /// Minimum of the reciprocal directions per axis.
+    float minInvDir[3];
+    /// Maximum of the reciprocal directions per axis.
+    float maxInvDir[3];
+    /// Axes where the directions are negative: 1 for X, 2 for Y and 4 for Z, like the child octant index bits.
+    unsigned flipMask;
+};
+
+/// Fill a raycast result for no hit.
+static void SetEmptyResult(RaycastResult& result)
+{
+    result.position = result.normal = Vector3::ZERO;
+    result.distance = M_INFINITY;
+    result.node = nullptr;
+    result.subObject = 0;
+}
+
+/// Return the squared distance from a position to a bounding box, or zero if inside.
+static inline float SquaredDistance(const BoundingBox& box, const Vector3& position)
+{
+    float dx = Max(Max(box.min.x - position.x, position.x - box.max.x), 0.0f);
+    float dy = Max(Max(box.min.y - position.y, position.y - box.max.y), 0.0f);
+    float dz = Max(Max(box.min.z - position.z, position.z - box.max.z), 0.0f);
+    return dx * dx + dy * dy + dz * dz;
+}
+
+/// Add an octant to the nearest node query's priority queue, which is a binary heap with the nearest octant first.
+static void PushNearestOctant(Vector<Pair<const Octant*, float> >& queue, const Octant* octant, float distance)
+{
+    size_t i = queue.Size();
+    queue.Resize(i + 1);
+    while (i > 0)
+    {
+        size_t parent = (i - 1) >> 1;
+        if (queue[parent].second <= distance)
+            break;
+        queue[i] = queue[parent];
+        i = parent;
+    }
+    queue[i] = MakePair(octant, distance);
+}
+
+/// Remove and return the nearest octant from the nearest node query's priority queue.
+static Pair<const Octant*, float> PopNearestOctant(Vector<Pair<const Octant*, float> >& queue)
+{
+    Pair<const Octant*, float> ret = queue[0];
+    Pair<const Octant*, float> last = queue.Back();
+    queue.Pop();
+
+    size_t size = queue.Size();
+    if (size)
+    {
+        size_t i = 0;
+        for (;;)
+        {
+            size_t child = 2 * i + 1;
+            if (child >= size)
+                break;
+            if (child + 1 < size && queue[child + 1].second < queue[child].second)
+                ++child;
+            if (last.second <= queue[child].second)
+                break;
+            queue[i] = queue[child];
+            i = child;
+        }
+        queue[i] = last;
+    }
+
+    return ret;
+}
+
+/// Insert a node into the nearest node query's results, which are kept sorted by distance and limited to count.
+static void InsertNearestResult(Vector<NearestResult>& result, OctreeNode* node, float distance, size_t count)
+{
+    if (result.Size() == count)
+        result.Pop();
+
+    size_t pos = result.Size();
+    while (pos > 0 && result[pos - 1].distance > distance)
+        --pos;
+
+    NearestResult newResult;
+    newResult.node = node;
+    newResult.distance = distance;
+    result.Insert(pos, newResult);
+}
+
+/// Maximum number of node pairs between two octant hierarchies to test without splitting the hierarchies further.
+static const size_t MAX_BRUTE_FORCE_PAIR_TESTS = 64;
+
+/// Test whether two bounding boxes overlap. Undefined boxes do not overlap anything.
+static inline bool Overlaps(const BoundingBox& lhs, const BoundingBox& rhs)
+{
+    return lhs.min.x <= rhs.max.x && rhs.min.x <= lhs.max.x && lhs.min.y <= rhs.max.y && rhs.min.y <= lhs.max.y &&
+        lhs.min.z <= rhs.max.z && rhs.min.z <= lhs.max.z;
+}
+
+/// Return a node pair with the lower node address first.
+static inline NodePair MakeNodePair(OctreeNode* lhs, OctreeNode* rhs)
+{
+    return lhs < rhs ? MakePair(lhs, rhs) : MakePair(rhs, lhs);
+}
+
+/// Compare node pairs for sorting.
+static bool CompareNodePairs(const NodePair& lhs, const NodePair& rhs)
+{
+    return lhs.first != rhs.first ? lhs.first < rhs.first : lhs.second < rhs.second;
+}
+
+/// Return whether a node is in a sorted node vector.
+static bool ContainsNode(const Vector<OctreeNode*>& nodes, OctreeNode* node)
+{
+    size_t low = 0;
+    size_t high = nodes.Size();
+    while (low < high)
+    {
+        size_t mid = (low + high) >> 1;
+        if (nodes[mid] < node)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low < nodes.Size() && nodes[low] == node;
+}
+
+// Id of the query buffers owner the calling thread used last, and its buffers. Shared by all octrees and AABB trees
+static ThreadLocalValue lastBuffersOwner;
+static ThreadLocalValue lastBuffers;
+static Mutex nextBuffersIdMutex;
+static size_t nextBuffersId = 1;
+
+ThreadQueryBuffers::ThreadQueryBuffers()
+{
+    MutexLock lock(nextBuffersIdMutex);
+    id = nextBuffersId++;
+}
+
+QueryBuffers& ThreadQueryBuffers::Buffers()
+{
+    if (lastBuffersOwner.Value() == reinterpret_cast<void*>(id))
+        return *static_cast<QueryBuffers*>(lastBuffers.Value());
+
+    // The thread used another octree or AABB tree last, or thread local storage is not available. Find the thread's own
+    // buffers, so that buffers are never shared between threads
+    ThreadID threadID = Thread::CurrentThreadID();
+    QueryBuffers* threadBuffers = nullptr;
+    {
+        MutexLock lock(buffersMutex);
+        for (size_t i = 0; i < bufferThreads.Size(); ++i)
+        {
+            if (bufferThreads[i] == threadID)
+            {
+                threadBuffers = buffers[i];
+                break;
+            }
+        }
+
+        if (!threadBuffers)
+        {
+            threadBuffers = new QueryBuffers();
+            buffers.Push(AutoPtr<QueryBuffers>(threadBuffers));
+            bufferThreads.Push(threadID);
+        }
+    }
+
+    lastBuffersOwner.SetValue(reinterpret_cast<void*>(id));
+    lastBuffers.SetValue(threadBuffers);
+    return *threadBuffers;
+}
+
 Octant::Octant() :
     parent(nullptr),
     numNodes(0)
@@ -61,14 +454,194 @@ bool Octant::FitBoundingBox(const BoundingBox& box, const Vector3& boxSize) cons
     return false;
 }
 
-Octree::Octree()
+NodeCullingData::NodeCullingData() :
+    nodeMinX(nullptr),
+    nodeMinY(nullptr),
+    nodeMinZ(nullptr),
+    nodeMaxX(nullptr),
+    nodeMaxY(nullptr),
+    nodeMaxZ(nullptr),
+    nodeLayerMasks(nullptr),
+    nodeFlags(nullptr),
+    capacity(0)
+{
+}
+
+NodeCullingData::~NodeCullingData()
+{
+    delete[] reinterpret_cast<unsigned char*>(nodeMinX);
+}
+
+size_t NodeCullingData::AddNode(OctreeNode* node)
+{
+    size_t index = nodes.Size();
+    if (index == capacity)
+        Reserve(Max((int)MIN_NODE_CAPACITY, (int)(capacity * 2)));
+    nodes.Push(node);
+    SetNodeData(index, node);
+    return index;
+}
+
+size_t NodeCullingData::AddNode(const NodeCullingData& source, size_t sourceIndex)
+{
+    size_t index = nodes.Size();
+    if (index == capacity)
+        Reserve(Max((int)MIN_NODE_CAPACITY, (int)(capacity * 2)));
+    nodes.Push(source.nodes[sourceIndex]);
+    nodeMinX[index] = source.nodeMinX[sourceIndex];
+    nodeMinY[index] = source.nodeMinY[sourceIndex];
+    nodeMinZ[index] = source.nodeMinZ[sourceIndex];
+    nodeMaxX[index] = source.nodeMaxX[sourceIndex];
+    nodeMaxY[index] = source.nodeMaxY[sourceIndex];
+    nodeMaxZ[index] = source.nodeMaxZ[sourceIndex];
+    nodeLayerMasks[index] = source.nodeLayerMasks[sourceIndex];
+    nodeFlags[index] = source.nodeFlags[sourceIndex];
+    return index;
+}
+
+OctreeNode* NodeCullingData::RemoveNode(size_t index)
+{
+    // Move the last node into the removed node's place to keep the culling data contiguous
+    OctreeNode* moved = nullptr;
+    size_t last = nodes.Size() - 1;
+    if (index != last)
+    {
+        moved = nodes[last];
+        nodes[index] = moved;
+        nodeMinX[index] = nodeMinX[last];
+        nodeMinY[index] = nodeMinY[last];
+        nodeMinZ[index] = nodeMinZ[last];
+        nodeMaxX[index] = nodeMaxX[last];
+        nodeMaxY[index] = nodeMaxY[last];
+        nodeMaxZ[index] = nodeMaxZ[last];
+        nodeLayerMasks[index] = nodeLayerMasks[last];
+        nodeFlags[index] = nodeFlags[last];
+    }
+
+    nodes.Pop();
+    return moved;
+}
+
+void NodeCullingData::Clear()
+{
+    nodes.Clear();
+}
+
+void NodeCullingData::Reserve(size_t capacity_)
+{
+    if (capacity_ <= capacity)
+        return;
+
+    nodes.Reserve(capacity_);
+
+    // Allocate the arrays in one buffer, the floats first and the flags last so that each array stays aligned
+    unsigned char* buffer = new unsigned char[capacity_ * (6 * sizeof(float) + sizeof(unsigned) + sizeof(unsigned short))];
+    float* newMinX = reinterpret_cast<float*>(buffer);
+    float* newMinY = newMinX + capacity_;
+    float* newMinZ = newMinY + capacity_;
+    float* newMaxX = newMinZ + capacity_;
+    float* newMaxY = newMaxX + capacity_;
+    float* newMaxZ = newMaxY + capacity_;
+    unsigned* newLayerMasks = reinterpret_cast<unsigned*>(newMaxZ + capacity_);
+    unsigned short* newFlags = reinterpret_cast<unsigned short*>(newLayerMasks + capacity_);
+
+    size_t size = nodes.Size();
+    if (size)
+    {
+        memcpy(newMinX, nodeMinX, size * sizeof(float));
+        memcpy(newMinY, nodeMinY, size * sizeof(float));
+        memcpy(newMinZ, nodeMinZ, size * sizeof(float));
+        memcpy(newMaxX, nodeMaxX, size * sizeof(float));
+        memcpy(newMaxY, nodeMaxY, size * sizeof(float));
+        memcpy(newMaxZ, nodeMaxZ, size * sizeof(float));
+        memcpy(newLayerMasks, nodeLayerMasks, size * sizeof(unsigned));
+        memcpy(newFlags, nodeFlags, size * sizeof(unsigned short));
+    }
+
+    delete[] reinterpret_cast<unsigned char*>(nodeMinX);
+    nodeMinX = newMinX;
+    nodeMinY = newMinY;
+    nodeMinZ = newMinZ;
+    nodeMaxX = newMaxX;
+    nodeMaxY = newMaxY;
+    nodeMaxZ = newMaxZ;
+    nodeLayerMasks = newLayerMasks;
+    nodeFlags = newFlags;
+    capacity = capacity_;
+}
+
+size_t NodeCullingData::MemoryUse() const
+{
+    return nodes.Capacity() * sizeof(OctreeNode*) + capacity * (6 * sizeof(float) + sizeof(unsigned) + sizeof(unsigned short));
+}
+
+void NodeCullingData::Swap(NodeCullingData& other)
+{
+    nodes.Swap(other.nodes);
+    Turso3D::Swap(nodeMinX, other.nodeMinX);
+    Turso3D::Swap(nodeMinY, other.nodeMinY);
+    Turso3D::Swap(nodeMinZ, other.nodeMinZ);
+    Turso3D::Swap(nodeMaxX, other.nodeMaxX);
+    Turso3D::Swap(nodeMaxY, other.nodeMaxY);
+    Turso3D::Swap(nodeMaxZ, other.nodeMaxZ);
+    Turso3D::Swap(nodeLayerMasks, other.nodeLayerMasks);
+    Turso3D::Swap(nodeFlags, other.nodeFlags);
+    Turso3D::Swap(capacity, other.capacity);
+}
+
+void NodeCullingData::SetNodeData(size_t index, const OctreeNode* node)
+{
+    const BoundingBox& box = node->WorldBoundingBox();
+    nodeMinX[index] = box.min.x;
+    nodeMinY[index] = box.min.y;
+    nodeMinZ[index] = box.min.z;
+    nodeMaxX[index] = box.max.x;
+    nodeMaxY[index] = box.max.y;
+    nodeMaxZ[index] = box.max.z;
+    nodeFlags[index] = node->Flags();
+    nodeLayerMasks[index] = node->LayerMask();
+}
+
+BoundingBoxArrays NodeCullingData::NodeBoundingBoxes(size_t start, size_t end) const
+{
+    BoundingBoxArrays ret;
+    ret.count = end - start;
+    if (ret.count)
+    {
+        ret.minX = &nodeMinX[start];
+        ret.minY = &nodeMinY[start];
+        ret.minZ = &nodeMinZ[start];
+        ret.maxX = &nodeMaxX[start];
+        ret.maxY = &nodeMaxY[start];
+        ret.maxZ = &nodeMaxZ[start];
+    }
+    else
+        ret.minX = ret.minY = ret.minZ = ret.maxX = ret.maxY = ret.maxZ = nullptr;
+    return ret;
+}
+
+Octree::Octree() :
+    threadedUpdate(true),
+    autoResize(false)
 {
     root.Initialize(nullptr, BoundingBox(-DEFAULT_OCTREE_SIZE, DEFAULT_OCTREE_SIZE), DEFAULT_OCTREE_LEVELS);
 }
 
 Octree::~Octree()
 {
+    // Nodes that are only queued for insertion must also forget the octree
+    for (auto it = updateQueue.Begin(); it != updateQueue.End(); ++it)
+    {
+        OctreeNode* node = *it;
+        if (node)
+        {
+            node->SetFlag(NF_OCTREE_UPDATE_QUEUED, false);
+            node->octree = nullptr;
+        }
+    }
+
     DeleteChildOctants(&root, true);
+    FreeOctantPool();
 }
 
 void Octree::RegisterObject()
@@ -77,174 +650,694 @@ void Octree::RegisterObject()
     CopyBaseAttributes<Octree, Node>();
     RegisterRefAttribute("boundingBox", &Octree::BoundingBoxAttr, &Octree::SetBoundingBoxAttr);
     RegisterAttribute("numLevels", &Octree::NumLevelsAttr, &Octree::SetNumLevelsAttr);
+    RegisterAttribute("autoResize", &Octree::AutoResize, &Octree::SetAutoResize, false);
 }
 
 void Octree::Update()
 {
     PROFILE(UpdateOctree);
 
-    for (auto it = updateQueue.Begin(); it != updateQueue.End(); ++it)
-    {
-        OctreeNode* node = *it;
-        // If node was removed before update could happen, a null pointer will be in its place
-        if (node)
-        {
-            node->SetFlag(NF_OCTREE_UPDATE_QUEUED, false);
+    ProcessUpdateQueue();
 
-            // Do nothing if still fits the current octant
-            const BoundingBox& box = node->WorldBoundingBox();
-            Vector3 boxSize = box.Size();
-            Octant* oldOctant = node->octant;
-            if (oldOctant && oldOctant->cullingBox.IsInside(box) == INSIDE && oldOctant->FitBoundingBox(box, boxSize))
-                continue;
+    // The resize step queues a limited number of nodes, so they can be reinserted right away without a hitch
+    if (autoResize && AutoResizeStep())
+        ProcessUpdateQueue();
+}
 
-            // Begin reinsert process. Start from root and check what level child needs to be used
-            Octant* newOctant = &root;
-            Vector3 boxCenter = box.Center();
+void Octree::SetThreadedUpdate(bool enable)
+{
+    threadedUpdate = enable;
+}
 
-            for (;;)
+void Octree::SetAutoResize(bool enable)
+{
+    autoResize = enable;
+}
+
+void Octree::ProcessUpdateQueue()
+{
+    WorkQueue* workQueue = threadedUpdate ? Subsystem<WorkQueue>() : nullptr;
+    size_t numQueued = updateQueue.Size();
+
+    if (!workQueue || !workQueue->NumThreads() || numQueued < 2 * MIN_NODES_PER_UPDATE_TASK)
+    {
+        for (auto it = updateQueue.Begin(); it != updateQueue.End(); ++it)
+        {
+            OctreeNode* node = *it;
+            // If node was removed before update could happen, a null pointer will be in its place
+            if (node)
             {
-                bool insertHere;
-                // If node does not fit fully inside root octant, must remain in it
-                if (newOctant == &root)
-                    insertHere = newOctant->cullingBox.IsInside(box) != INSIDE || newOctant->FitBoundingBox(box, boxSize);
-                else
-                    insertHere = newOctant->FitBoundingBox(box, boxSize);
+                node->SetFlag(NF_OCTREE_UPDATE_QUEUED, false);
 
-                if (insertHere)
-                {
-                    if (newOctant != oldOctant)
-                    {
-                        // Add first, then remove, because node count going to zero deletes the octree branch in question
-                        AddNode(node, newOctant);
-                        if (oldOctant)
-                            RemoveNode(node, oldOctant);
-                    }
-                    break;
-                }
+                // Only refresh the culling data if still fits the current octant
+                const BoundingBox& box = node->WorldBoundingBox();
+                Octant* oldOctant = node->octant;
+                if (oldOctant && oldOctant->cullingBox.IsInside(box) == INSIDE && oldOctant->FitBoundingBox(box, box.Size()))
+                    oldOctant->SetNodeData(node->octantIndex, node);
                 else
-                    newOctant = CreateChildOctant(newOctant, newOctant->ChildIndex(boxCenter));
+                    ReinsertNode(node, &root, true);
             }
         }
     }
+    else
+    {
+        // Resolve the world bounding boxes first, as they may recompute world transforms that are shared through the parent
+        // chain. The worker threads then only read them
+        for (auto it = updateQueue.Begin(); it != updateQueue.End(); ++it)
+        {
+            OctreeNode* node = *it;
+            if (node)
+            {
+                node->SetFlag(NF_OCTREE_UPDATE_QUEUED, false);
+                node->WorldBoundingBox();
+            }
+        }
+
+        // Search the target octants in worker threads without modifying the octree
+        updateOctants.Resize(numQueued);
+
+        size_t maxTasks = workQueue->NumThreads() + 1;
+        size_t nodesPerTask = Max((int)((numQueued + maxTasks - 1) / maxTasks), (int)MIN_NODES_PER_UPDATE_TASK);
+        size_t numTasks = 0;
+
+        for (size_t i = 0; i < numQueued; i += nodesPerTask)
+        {
+            if (updateTasks.Size() <= numTasks)
+                updateTasks.Push(new MemberFunctionTask<Octree>(this, &Octree::UpdateWork));
+
+            MemberFunctionTask<Octree>* task = updateTasks[numTasks++];
+            task->start = &updateQueue[i];
+            task->end = &updateQueue[0] + Min((int)(i + nodesPerTask), (int)numQueued);
+            workQueue->AddTask(task);
+        }
+
+        workQueue->Complete();
+
+        // Then create child octants and move the nodes in queue order. Octants that become empty are deleted only at the end,
+        // so that the octants found by the search stay valid. An empty octant would have been recreated with the same bounds
+        // and no nodes, so the octree ends up the same as with the single-threaded update
+        bool removed = false;
+
+        for (size_t i = 0; i < numQueued; ++i)
+        {
+            OctreeNode* node = updateQueue[i];
+            if (node && updateOctants[i])
+            {
+                removed |= node->octant != nullptr;
+                ReinsertNode(node, updateOctants[i], false);
+            }
+        }
+
+        if (removed)
+            DeleteEmptyOctants(&root);
+    }
 
     updateQueue.Clear();
 }
 
-void Octree::Resize(const BoundingBox& boundingBox, int numLevels)
+OctreeStats Octree::Stats() const
+{
+    OctreeStats stats;
+    stats.numOctants = 0;
+    stats.numFreeOctants = freeOctants.Size();
+    stats.numNodes = 0;
+    stats.numRootOverflowNodes = 0;
+    stats.octantsPerLevel.Resize(root.level + 1);
+    for (size_t i = 0; i < stats.octantsPerLevel.Size(); ++i)
+        stats.octantsPerLevel[i] = 0;
+    for (size_t i = 0; i < NUM_OCTANT_NODE_BUCKETS; ++i)
+        stats.nodesPerOctant[i] = 0;
+    stats.memoryUse = (allocator.Capacity() + 1) * sizeof(Octant);
+
+    CollectStats(stats, &root);
+
+    for (size_t i = 0; i < root.nodes.Size(); ++i)
+    {
+        if (root.cullingBox.IsInside(root.NodeBoundingBox(i)) != INSIDE)
+            ++stats.numRootOverflowNodes;
+    }
+
+    for (auto it = freeOctants.Begin(); it != freeOctants.End(); ++it)
+        stats.memoryUse += (*it)->MemoryUse();
+
+    return stats;
+}
+
+void Octree::Resize(const BoundingBox& boundingBox, int numLevels)
+{
+    PROFILE(ResizeOctree);
+
+    // Collect nodes to the root and delete all child octants
+    updateQueue.Clear();
+    CollectNodes(updateQueue, &root);
+    DeleteChildOctants(&root, false);
+    FreeOctantPool();
+    allocator.Reset();
+    root.Initialize(nullptr, boundingBox, Clamp(numLevels, 1, MAX_OCTREE_LEVELS));
+
+    // Reinsert all nodes (recreates new child octants as necessary)
+    Update();
+}
+
+void Octree::RemoveNode(OctreeNode* node)
+{
+    assert(node);
+    if (node->octant)
+        RemoveNode(node->octant, node->octantIndex);
+    if (node->TestFlag(NF_OCTREE_UPDATE_QUEUED))
+        CancelUpdate(node);
+    node->octant = nullptr;
+
+    // The node may be destroyed before the next overlap pair query, so its stored pairs must not be reported
+    if (overlapPairs.Size())
+        removedPairNodes.Push(node);
+}
+
+void Octree::QueueUpdate(OctreeNode* node)
+{
+    assert(node);
+    updateQueue.Push(node);
+    node->SetFlag(NF_OCTREE_UPDATE_QUEUED, true);
+}
+
+void Octree::CancelUpdate(OctreeNode* node)
+{
+    assert(node);
+    // Search from the back and drop the cancelled entries at the end, so that removing many nodes in the reverse order of
+    // adding them, such as when unloading a scene partition, does not search the whole queue for each node
+    for (size_t i = updateQueue.Size(); i > 0; --i)
+    {
+        if (updateQueue[i - 1] == node)
+        {
+            updateQueue[i - 1] = nullptr;
+            break;
+        }
+    }
+    while (updateQueue.Size() && !updateQueue.Back())
+        updateQueue.Pop();
+    node->SetFlag(NF_OCTREE_UPDATE_QUEUED, false);
+}
+
+void Octree::Raycast(Vector<RaycastResult>& result, const Ray& ray, unsigned short nodeFlags, float maxDistance, unsigned layerMask) const
+{
+    PROFILE(OctreeRaycast);
+
+    result.Clear();
+    CollectNodes(result, &root, ray, nodeFlags, maxDistance, layerMask);
+    Sort(result.Begin(), result.End(), CompareRaycastResults);
+}
+
+RaycastResult Octree::RaycastSingle(const Ray& ray, unsigned short nodeFlags, float maxDistance, unsigned layerMask) const
+{
+    PROFILE(OctreeRaycastSingle);
+
+    RaycastResult result;
+    result.distance = maxDistance;
+    result.node = nullptr;
+
+    if (ray.HitDistance(root.cullingBox) < maxDistance)
+        CollectClosestHit(result, queryBuffers.Buffers(), &root, ray, nodeFlags, layerMask);
+
+    if (!result.node)
+        SetEmptyResult(result);
+    return result;
+}
+
+void Octree::RaycastSingle(RaycastResult* results, const Ray* rays, size_t numRays, unsigned short nodeFlags, float maxDistance,
+    unsigned layerMask) const
+{
+    PROFILE(OctreeRaycastPacket);
+
+    QueryBuffers& buffers = queryBuffers.Buffers();
+    RayPacket packet;
+
+    for (size_t i = 0; i < numRays;)
+    {
+        // Find the run of rays with the same direction signs, up to the packet size
+        unsigned signs = DirectionSigns(rays[i].direction);
+        size_t end = i + 1;
+        while (end < numRays && end - i < RAY_PACKET_SIZE && DirectionSigns(rays[end].direction) == signs)
+            ++end;
+
+        if (end - i < MIN_RAY_PACKET_SIZE)
+        {
+            for (; i < end; ++i)
+                results[i] = RaycastSingle(rays[i], nodeFlags, maxDistance, layerMask);
+            continue;
+        }
+
+        packet.Define(rays + i, results + i, end - i, maxDistance);
+        unsigned activeMask = packet.Test(packet.Mirror(root.cullingBox), end - i < 32 ? (1u << (end - i)) - 1 : 0xffffffff);
+        if (activeMask)
+            CollectClosestHits(packet, buffers, &root, activeMask, nodeFlags, layerMask);
+
+        for (; i < end; ++i)
+        {
+            if (!results[i].node)
+                SetEmptyResult(results[i]);
+        }
+    }
+}
+
+void Octree::FindNearest(Vector<NearestResult>& result, const Vector3& position, size_t count, unsigned short nodeFlags,
+    float maxDistance, unsigned layerMask) const
+{
+    PROFILE(OctreeFindNearest);
+
+    result.Clear();
+    if (!count)
+        return;
+
+    // Use squared distances until the end. The root octant may contain nodes outside its bounds, so it is always visited
+    float maxDistSquared = maxDistance < M_INFINITY ? maxDistance * maxDistance : M_INFINITY;
+    Vector<Pair<const Octant*, float> >& nearestQueue = queryBuffers.Buffers().nearestQueue;
+    nearestQueue.Clear();
+    PushNearestOctant(nearestQueue, &root, 0.0f);
+
+    while (nearestQueue.Size())
+    {
+        Pair<const Octant*, float> nearest = PopNearestOctant(nearestQueue);
+        // Once the results are full, the farthest result bounds the distance of the remaining octants
+        float limit = result.Size() == count ? result.Back().distance : maxDistSquared;
+        if (nearest.second > limit)
+            break;
+
+        const Octant* octant = nearest.first;
+        size_t numNodes = octant->nodes.Size();
+        if (numNodes)
+        {
+            const float* minX = &octant->nodeMinX[0];
+            const float* minY = &octant->nodeMinY[0];
+            const float* minZ = &octant->nodeMinZ[0];
+            const float* maxX = &octant->nodeMaxX[0];
+            const float* maxY = &octant->nodeMaxY[0];
+            const float* maxZ = &octant->nodeMaxZ[0];
+            const unsigned short* flags = &octant->nodeFlags[0];
+            const unsigned* layerMasks = &octant->nodeLayerMasks[0];
+
+            for (size_t i = 0; i < numNodes; ++i)
+            {
+                if ((flags[i] & nodeFlags) != nodeFlags || !(layerMasks[i] & layerMask))
+                    continue;
+
+                float dx = Max(Max(minX[i] - position.x, position.x - maxX[i]), 0.0f);
+                float dy = Max(Max(minY[i] - position.y, position.y - maxY[i]), 0.0f);
+                float dz = Max(Max(minZ[i] - position.z, position.z - maxZ[i]), 0.0f);
+                float distSquared = dx * dx + dy * dy + dz * dz;
+                if (distSquared <= maxDistSquared && (result.Size() < count || distSquared < result.Back().distance))
+                    InsertNearestResult(result, octant->nodes[i], distSquared, count);
+            }
+
+            limit = result.Size() == count ? result.Back().distance : maxDistSquared;
+        }
+
+        // The nodes of a child octant are within its culling box
+        for (size_t i = 0; i < NUM_OCTANTS; ++i)
+        {
+            const Octant* child = octant->children[i];
+            if (child)
+            {
+                float distSquared = SquaredDistance(child->cullingBox, position);
+                if (distSquared <= limit)
+                    PushNearestOctant(nearestQueue, child, distSquared);
+            }
+        }
+    }
+
+    for (auto it = result.Begin(); it != result.End(); ++it)
+        it->distance = sqrtf(it->distance);
+}
+
+NearestResult Octree::FindNearest(const Vector3& position, unsigned short nodeFlags, float maxDistance, unsigned layerMask) const
+{
+    Vector<NearestResult>& nearestRes = queryBuffers.Buffers().nearestRes;
+    FindNearest(nearestRes, position, 1, nodeFlags, maxDistance, layerMask);
+    if (nearestRes.Size())
+        return nearestRes[0];
+
+    NearestResult result;
+    result.node = nullptr;
+    result.distance = M_INFINITY;
+    return result;
+}
+
+void Octree::FindOverlappingPairs(Vector<NodePair>& result, unsigned short nodeFlags, unsigned layerMask)
+{
+    PROFILE(OctreeFindOverlappingPairs);
+
+    result.Clear();
+    broadphaseOctants.Clear();
+    broadphaseData.Clear();
+    CollectBroadphaseOctants(&root, nodeFlags, layerMask);
+
+    for (size_t i = 0; i < broadphaseOctants.Size(); ++i)
+    {
+        const BroadphaseOctant& octant = broadphaseOctants[i];
+
+        // Own nodes against each other and against the nodes of the child octants
+        CollectPairs(result, octant.nodeStart, octant.nodeEnd);
+        if (octant.nodeEnd > octant.nodeStart)
+        {
+            for (size_t j = i + 1; j < octant.subtreeEnd; j = broadphaseOctants[j].subtreeEnd)
+                CollectPairs(result, octant.nodeStart, octant.nodeEnd, octant.nodeBounds, j);
+        }
+
+        // The culling boxes of the child octants overlap, so test the child octant hierarchies against each other
+        for (size_t j = i + 1; j < octant.subtreeEnd; j = broadphaseOctants[j].subtreeEnd)
+        {
+            for (size_t k = broadphaseOctants[j].subtreeEnd; k < octant.subtreeEnd; k = broadphaseOctants[k].subtreeEnd)
+                CollectSubtreePairs(result, j, k);
+        }
+    }
+}
+
+void Octree::FindOverlappingPairChanges(Vector<NodePair>& began, Vector<NodePair>& ended, unsigned short nodeFlags,
+    unsigned layerMask)
+{
+    began.Clear();
+    ended.Clear();
+
+    FindOverlappingPairs(newOverlapPairs, nodeFlags, layerMask);
+
+    PROFILE(CompareOverlappingPairs);
+
+    Sort(newOverlapPairs.Begin(), newOverlapPairs.End(), CompareNodePairs);
+    if (removedPairNodes.Size())
+        Sort(removedPairNodes.Begin(), removedPairNodes.End());
+
+    // Both pair vectors are sorted, so merge them. A removed node's address may have been reused by a new node, so its old
+    // pairs are dropped rather than matched
+    size_t i = 0;
+    size_t j = 0;
+    while (i < overlapPairs.Size() || j < newOverlapPairs.Size())
+    {
+        if (i < overlapPairs.Size() && removedPairNodes.Size() && (ContainsNode(removedPairNodes, overlapPairs[i].first) ||
+            ContainsNode(removedPairNodes, overlapPairs[i].second)))
+            ++i;
+        else if (j == newOverlapPairs.Size() || (i < overlapPairs.Size() && CompareNodePairs(overlapPairs[i], newOverlapPairs[j])))
+            ended.Push(overlapPairs[i++]);
+        else if (i == overlapPairs.Size() || CompareNodePairs(newOverlapPairs[j], overlapPairs[i]))
+            began.Push(newOverlapPairs[j++]);
+        else
+        {
+            ++i;
+            ++j;
+        }
+    }
+
+    overlapPairs.Swap(newOverlapPairs);
+    removedPairNodes.Clear();
+}
+
+void Octree::ClearOverlappingPairs()
+{
+    overlapPairs.Clear();
+    removedPairNodes.Clear();
+}
+
+void Octree::FindNodes(Vector<Pair<OctreeNode*, unsigned> >& result, const Frustum* frusta, size_t numFrusta,
+    unsigned short nodeFlags, unsigned layerMask) const
+{
+    PROFILE(QueryOctree);
+
+    assert(numFrusta <= MAX_QUERY_FRUSTA);
+    if (!numFrusta)
+        return;
+
+    unsigned activeMask = numFrusta < MAX_QUERY_FRUSTA ? (1u << numFrusta) - 1 : 0xffffffff;
+    CollectNodes(result, &root, frusta, activeMask, 0, nodeFlags, layerMask);
+}
+
+void Octree::SetBoundingBoxAttr(const BoundingBox& boundingBox)
+{
+    root.worldBoundingBox = boundingBox;
+}
+
+const BoundingBox& Octree::BoundingBoxAttr() const
+{
+    return root.worldBoundingBox;
+}
+
+void Octree::SetNumLevelsAttr(int numLevels)
+{
+    /// Setting the number of level (last attribute) triggers octree resize when deserializing
+    Resize(root.worldBoundingBox, numLevels);
+}
+
+int Octree::NumLevelsAttr() const
+{
+    return root.level;
+}
+
+bool Octree::AutoResizeStep()
+{
+    if (!root.numNodes)
+        return false;
+
+    // Find the largest root size that growing can reach before the levels run out or the size becomes infinite
+    Vector3 maxRootSize = root.worldBoundingBox.Size();
+    for (int level = root.level; level < MAX_OCTREE_LEVELS; ++level)
+    {
+        Vector3 newSize = 2.0f * maxRootSize;
+        if (!(newSize.x < M_INFINITY && newSize.y < M_INFINITY && newSize.z < M_INFINITY))
+            break;
+        maxRootSize = newSize;
+    }
+
+    // Nodes outside the root's culling box can only be in the root itself. Leave out the nodes that would not fit even the
+    // largest root, so that they do not make the root grow without limit
+    BoundingBox overflowBox;
+    size_t numOverflowNodes = 0;
+    for (size_t i = 0; i < root.nodes.Size(); ++i)
+    {
+        BoundingBox box = root.NodeBoundingBox(i);
+        if (root.cullingBox.IsInside(box) != INSIDE && FitsGrownRoot(root.worldBoundingBox, maxRootSize, box))
+        {
+            overflowBox.Merge(box);
+            ++numOverflowNodes;
+        }
+    }
+
+    if (numOverflowNodes)
+    {
+        size_t minOverflowNodes = root.numNodes / AUTO_RESIZE_OVERFLOW_DIVISOR;
+        if (minOverflowNodes < MIN_AUTO_RESIZE_OVERFLOW_NODES)
+            minOverflowNodes = MIN_AUTO_RESIZE_OVERFLOW_NODES;
+        if (numOverflowNodes < minOverflowNodes || root.level >= MAX_OCTREE_LEVELS)
+            return false;
+
+        // Do not grow without limit because of nodes at infinity
+        Vector3 newSize = 2.0f * root.worldBoundingBox.Size();
+        if (!(newSize.x < M_INFINITY && newSize.y < M_INFINITY && newSize.z < M_INFINITY))
+            return false;
+
+        // Grow towards the overflowing nodes: the old root becomes the child octant on the opposite side
+        GrowRoot(root.ChildIndex(overflowBox.Center()) ^ (NUM_OCTANTS - 1));
+        return true;
+    }
+
+    // Shrink if the nodes are mostly in one child octant hierarchy, and the rest fit inside that child octant's actual bounds,
+    // which leaves a margin before they would overflow again. The rest are reinserted, so there is a limit to how many
+    if (root.level <= 1)
+        return false;
+
+    Octant* child = nullptr;
+    size_t childIndex = 0;
+    for (size_t i = 0; i < NUM_OCTANTS; ++i)
+    {
+        if (root.children[i] && (!child || root.children[i]->numNodes > child->numNodes))
+        {
+            child = root.children[i];
+            childIndex = i;
+        }
+    }
+    if (!child || root.numNodes - child->numNodes > MAX_AUTO_SHRINK_REINSERT_NODES)
+        return false;
+
+    // The update queue has just been processed, so it can hold the nodes to be reinserted
+    updateQueue.Push(root.nodes);
+    for (size_t i = 0; i < NUM_OCTANTS; ++i)
+    {
+        if (i != childIndex && root.children[i])
+            CollectNodes(updateQueue, root.children[i]);
+    }
+
+    // Nodes that never fit any root stay in the root's own node list either way, so they do not prevent shrinking
+    for (auto it = updateQueue.Begin(); it != updateQueue.End(); ++it)
+    {
+        const BoundingBox& box = (*it)->WorldBoundingBox();
+        if (child->worldBoundingBox.IsInside(box) != INSIDE && FitsGrownRoot(root.worldBoundingBox, maxRootSize, box))
+        {
+            updateQueue.Clear();
+            return false;
+        }
+    }
+
+    ShrinkRoot(childIndex);
+    return true;
+}
+
+void Octree::GrowRoot(size_t index)
 {
-    PROFILE(ResizeOctree);
+    PROFILE(GrowOctree);
 
-    // Collect nodes to the root and delete all child octants
-    updateQueue.Clear();
-    CollectNodes(updateQueue, &root);
-    DeleteChildOctants(&root, false);
-    allocator.Reset();
-    root.Initialize(nullptr, boundingBox, Clamp(numLevels, 1, MAX_OCTREE_LEVELS));
+    Vector3 size = root.worldBoundingBox.Size();
+    Vector3 newMin = root.worldBoundingBox.min;
+    Vector3 newMax = root.worldBoundingBox.max;
 
-    // Reinsert all nodes (recreates new child octants as necessary)
-    Update();
-}
+    if (index & 1)
+        newMin.x -= size.x;
+    else
+        newMax.x += size.x;
 
-void Octree::RemoveNode(OctreeNode* node)
-{
-    assert(node);
-    RemoveNode(node, node->octant);
-    if (node->TestFlag(NF_OCTREE_UPDATE_QUEUED))
-        CancelUpdate(node);
-    node->octant = nullptr;
-}
+    if (index & 2)
+        newMin.y -= size.y;
+    else
+        newMax.y += size.y;
 
-void Octree::QueueUpdate(OctreeNode* node)
-{
-    assert(node);
-    updateQueue.Push(node);
-    node->SetFlag(NF_OCTREE_UPDATE_QUEUED, true);
-}
+    if (index & 4)
+        newMin.z -= size.z;
+    else
+        newMax.z += size.z;
 
-void Octree::CancelUpdate(OctreeNode* node)
-{
-    assert(node);
-    auto it = updateQueue.Find(node);
-    if (it != updateQueue.End())
-        *it = nullptr;
-    node->SetFlag(NF_OCTREE_UPDATE_QUEUED, false);
-}
+    // Move the child octants under a new octant with the old root's bounds. Their bounds and levels stay the same
+    bool hasChildren = false;
+    for (size_t i = 0; i < NUM_OCTANTS; ++i)
+        hasChildren |= root.children[i] != nullptr;
 
-void Octree::Raycast(Vector<RaycastResult>& result, const Ray& ray, unsigned short nodeFlags, float maxDistance, unsigned layerMask)
-{
-    PROFILE(OctreeRaycast);
+    if (hasChildren)
+    {
+        Octant* child = AllocateOctant();
+        child->Initialize(&root, root.worldBoundingBox, root.level);
+        child->numNodes = root.numNodes - root.nodes.Size();
+        for (size_t i = 0; i < NUM_OCTANTS; ++i)
+        {
+            child->children[i] = root.children[i];
+            if (child->children[i])
+                child->children[i]->parent = child;
+            root.children[i] = nullptr;
+        }
+        root.children[index] = child;
+    }
 
-    result.Clear();
-    CollectNodes(result, &root, ray, nodeFlags, maxDistance, layerMask);
-    Sort(result.Begin(), result.End(), CompareRaycastResults);
+    root.Initialize(nullptr, BoundingBox(newMin, newMax), root.level + 1);
+
+    // The root's own nodes may now fit in the child octants
+    for (auto it = root.nodes.Begin(); it != root.nodes.End(); ++it)
+    {
+        if (!(*it)->TestFlag(NF_OCTREE_UPDATE_QUEUED))
+            QueueUpdate(*it);
+    }
 }
 
-RaycastResult Octree::RaycastSingle(const Ray& ray, unsigned short nodeFlags, float maxDistance, unsigned layerMask)
+void Octree::ShrinkRoot(size_t index)
 {
-    PROFILE(OctreeRaycastSingle);
-
-    // Get first the potential hits
-    initialRes.Clear();
-    CollectNodes(initialRes, &root, ray, nodeFlags, maxDistance, layerMask);
-    Sort(initialRes.Begin(), initialRes.End(), CompareNodeDistances);
+    PROFILE(ShrinkOctree);
 
-    // Then perform actual per-node ray tests and early-out when possible
-    finalRes.Clear();
-    float closestHit = M_INFINITY;
-    for (auto it = initialRes.Begin(); it != initialRes.End(); ++it)
+    // Detach the nodes outside the child octant
+    for (size_t i = 0; i < NUM_OCTANTS; ++i)
     {
-        if (it->second < Min(closestHit, maxDistance))
+        if (i != index && root.children[i])
         {
-            size_t oldSize = finalRes.Size();
-            it->first->OnRaycast(finalRes, ray, maxDistance);
-            if (finalRes.Size() > oldSize)
-                closestHit = Min(closestHit, finalRes.Back().distance);
+            DeleteChildOctants(root.children[i], false);
+            root.children[i] = nullptr;
         }
-        else
-            break;
     }
+    for (auto it = root.nodes.Begin(); it != root.nodes.End(); ++it)
+        (*it)->octant = nullptr;
+    root.Clear();
 
-    if (finalRes.Size())
+    // Move the child octant's nodes to the root and its child octants under the root
+    Octant* child = root.children[index];
+    for (size_t i = 0; i < child->nodes.Size(); ++i)
     {
-        Sort(finalRes.Begin(), finalRes.End(), CompareRaycastResults);
-        return finalRes.Front();
+        OctreeNode* node = child->nodes[i];
+        node->octantIndex = root.AddNode(*child, i);
+        node->octant = &root;
     }
-    else
+
+    for (size_t i = 0; i < NUM_OCTANTS; ++i)
     {
-        RaycastResult emptyRes;
-        emptyRes.position = emptyRes.normal = Vector3::ZERO;
-        emptyRes.distance = M_INFINITY;
-        emptyRes.node = nullptr;
-        emptyRes.subObject = 0;
-        return emptyRes;
+        root.children[i] = child->children[i];
+        if (root.children[i])
+            root.children[i]->parent = &root;
+        child->children[i] = nullptr;
     }
-}
 
-void Octree::SetBoundingBoxAttr(const BoundingBox& boundingBox)
-{
-    root.worldBoundingBox = boundingBox;
-}
+    root.numNodes = child->numNodes;
+    root.Initialize(nullptr, child->worldBoundingBox, child->level);
+    FreeOctant(child);
 
-const BoundingBox& Octree::BoundingBoxAttr() const
-{
-    return root.worldBoundingBox;
+    // Reinsert the detached nodes, which are already in the update queue
+    for (auto it = updateQueue.Begin(); it != updateQueue.End(); ++it)
+        (*it)->SetFlag(NF_OCTREE_UPDATE_QUEUED, true);
 }
 
-void Octree::SetNumLevelsAttr(int numLevels)
+void Octree::UpdateWork(Task* task, unsigned /* threadIndex */)
 {
-    /// Setting the number of level (last attribute) triggers octree resize when deserializing
-    Resize(root.worldBoundingBox, numLevels);
+    OctreeNode** start = static_cast<OctreeNode**>(task->start);
+    OctreeNode** end = static_cast<OctreeNode**>(task->end);
+    Octant** result = &updateOctants[start - &updateQueue[0]];
+
+    for (OctreeNode** it = start; it != end; ++it, ++result)
+    {
+        OctreeNode* node = *it;
+        *result = nullptr;
+        if (!node)
+            continue;
+
+        // The nodes are distinct, so their culling data slots can be refreshed concurrently
+        const BoundingBox& box = node->WorldBoundingBox();
+        Vector3 boxSize = box.Size();
+        Octant* oldOctant = node->octant;
+        if (oldOctant && oldOctant->cullingBox.IsInside(box) == INSIDE && oldOctant->FitBoundingBox(box, boxSize))
+        {
+            oldOctant->SetNodeData(node->octantIndex, node);
+            continue;
+        }
+
+        // Descend through the existing octants only. Child octants are created later in the main thread
+        Vector3 boxCenter = box.Center();
+        Octant* octant = &root;
+        while (!InsertHere(octant, box, boxSize))
+        {
+            Octant* child = octant->children[octant->ChildIndex(boxCenter)];
+            if (!child)
+                break;
+            octant = child;
+        }
+
+        *result = octant;
+    }
 }
 
-int Octree::NumLevelsAttr() const
+void Octree::ReinsertNode(OctreeNode* node, Octant* octant, bool deleteEmpty)
 {
-    return root.level;
+    const BoundingBox& box = node->WorldBoundingBox();
+    Vector3 boxSize = box.Size();
+    Vector3 boxCenter = box.Center();
+
+    // Check what level child needs to be used, starting from the given octant
+    while (!InsertHere(octant, box, boxSize))
+        octant = CreateChildOctant(octant, octant->ChildIndex(boxCenter));
+
+    Octant* oldOctant = node->octant;
+    size_t oldIndex = node->octantIndex;
+
+    if (octant != oldOctant)
+    {
+        // Add first, then remove, because node count going to zero deletes the octree branch in question
+        AddNode(node, octant);
+        if (oldOctant)
+            RemoveNode(oldOctant, oldIndex, deleteEmpty);
+    }
+    else
+        oldOctant->SetNodeData(oldIndex, node);
 }
 
 void Octree::AddNode(OctreeNode* node, Octant* octant)
 {
-    octant->nodes.Push(node);
+    node->octantIndex = octant->AddNode(node);
     node->octant = octant;
 
     // Increment the node count in the whole parent branch
@@ -255,17 +1348,19 @@ void Octree::AddNode(OctreeNode* node, Octant* octant)
     }
 }
 
-void Octree::RemoveNode(OctreeNode* node, Octant* octant)
+void Octree::RemoveNode(Octant* octant, size_t index, bool deleteEmpty)
 {
-    // Do not set the node's octant pointer to zero, as the node may already be added into another octant
-    octant->nodes.Remove(node);
-    
+    // Do not set the removed node's octant pointer to zero, as the node may already be added into another octant
+    OctreeNode* moved = octant->RemoveNode(index);
+    if (moved)
+        moved->octantIndex = index;
+
     // Decrement the node count in the whole parent branch and erase empty octants as necessary
     while (octant)
     {
         --octant->numNodes;
         Octant* next = octant->parent;
-        if (!octant->numNodes && next)
+        if (!octant->numNodes && next && deleteEmpty)
             DeleteChildOctant(next, next->ChildIndex(octant->center));
         octant = next;
     }
@@ -295,19 +1390,49 @@ Octant* Octree::CreateChildOctant(Octant* octant, size_t index)
     else
         newMax.z = oldCenter.z;
 
-    Octant* child = allocator.Allocate();
+    Octant* child = AllocateOctant();
     child->Initialize(octant, BoundingBox(newMin, newMax), octant->level - 1);
     octant->children[index] = child;
 
     return child;
 }
 
+Octant* Octree::AllocateOctant()
+{
+    if (freeOctants.Size())
+    {
+        Octant* octant = freeOctants.Back();
+        freeOctants.Pop();
+        return octant;
+    }
+
+    // Allocate the first octants in one contiguous block
+    allocator.Reserve(OCTANT_BLOCK_SIZE);
+    return allocator.Allocate();
+}
+
 void Octree::DeleteChildOctant(Octant* octant, size_t index)
 {
-    allocator.Free(octant->children[index]);
+    FreeOctant(octant->children[index]);
     octant->children[index] = nullptr;
 }
 
+void Octree::FreeOctant(Octant* octant)
+{
+    octant->Clear();
+    octant->numNodes = 0;
+    for (size_t i = 0; i < NUM_OCTANTS; ++i)
+        octant->children[i] = nullptr;
+    freeOctants.Push(octant);
+}
+
+void Octree::FreeOctantPool()
+{
+    for (auto it = freeOctants.Begin(); it != freeOctants.End(); ++it)
+        allocator.Free(*it);
+    freeOctants.Clear();
+}
+
 void Octree::DeleteChildOctants(Octant* octant, bool deletingOctree)
 {
     for (auto it = octant->nodes.Begin(); it != octant->nodes.End(); ++it)
@@ -318,7 +1443,7 @@ void Octree::DeleteChildOctants(Octant* octant, bool deletingOctree)
         if (deletingOctree)
             node->octree = nullptr;
     }
-    octant->nodes.Clear();
+    octant->Clear();
     octant->numNodes = 0;
 
     for (size_t i = 0; i < NUM_OCTANTS; ++i)
@@ -331,7 +1456,45 @@ void Octree::DeleteChildOctants(Octant* octant, bool deletingOctree)
     }
 
     if (octant != &root)
-        allocator.Free(octant);
+        FreeOctant(octant);
+}
+
+void Octree::CollectStats(OctreeStats& stats, const Octant* octant) const
+{
+    size_t numNodes = octant->nodes.Size();
+    size_t bucket = 0;
+    while (numNodes >> bucket && bucket < NUM_OCTANT_NODE_BUCKETS - 1)
+        ++bucket;
+
+    ++stats.numOctants;
+    stats.numNodes += numNodes;
+    ++stats.octantsPerLevel[octant->level];
+    ++stats.nodesPerOctant[bucket];
+    stats.memoryUse += octant->MemoryUse();
+
+    for (size_t i = 0; i < NUM_OCTANTS; ++i)
+    {
+        if (octant->children[i])
+            CollectStats(stats, octant->children[i]);
+    }
+}
+
+void Octree::DeleteEmptyOctants(Octant* octant)
+{
+    for (size_t i = 0; i < NUM_OCTANTS; ++i)
+    {
+        Octant* child = octant->children[i];
+        if (!child)
+            continue;
+
+        if (!child->numNodes)
+        {
+            DeleteChildOctants(child, false);
+            octant->children[i] = nullptr;
+        }
+        else
+            DeleteEmptyOctants(child);
+    }
 }
 
 void Octree::CollectNodes(Vector<OctreeNode*>& result, const Octant* octant) const
@@ -347,12 +1510,10 @@ void Octree::CollectNodes(Vector<OctreeNode*>& result, const Octant* octant) con
 
 void Octree::CollectNodes(Vector<OctreeNode*>& result, const Octant* octant, unsigned short nodeFlags, unsigned layerMask) const
 {
-    const Vector<OctreeNode*>& octantNodes = octant->nodes;
-    for (auto it = octantNodes.Begin(); it != octantNodes.End(); ++it)
+    for (size_t i = 0; i < octant->nodes.Size(); ++i)
     {
-        OctreeNode* node = *it;
-        if ((node->Flags() & nodeFlags) == nodeFlags && (node->LayerMask() & layerMask))
-            result.Push(node);
+        if ((octant->nodeFlags[i] & nodeFlags) == nodeFlags && (octant->nodeLayerMasks[i] & layerMask))
+            result.Push(octant->nodes[i]);
     }
 
     for (size_t i = 0; i < NUM_OCTANTS; ++i)
@@ -362,6 +1523,94 @@ void Octree::CollectNodes(Vector<OctreeNode*>& result, const Octant* octant, uns
     }
 }
 
+void Octree::CollectNodes(Vector<Pair<OctreeNode*, unsigned> >& result, const Octant* octant, const Frustum* frusta,
+    unsigned activeMask, unsigned insideMask, unsigned short nodeFlags, unsigned layerMask) const
+{
+    // Test the octant only against the frusta that still intersect it partially
+    unsigned testMask = activeMask & ~insideMask;
+    for (unsigned i = 0; i < MAX_QUERY_FRUSTA && (testMask >> i); ++i)
+    {
+        unsigned bit = 1u << i;
+        if (!(testMask & bit))
+            continue;
+
+        Intersection res = frusta[i].IsInside(octant->cullingBox);
+        if (res == OUTSIDE)
+            activeMask &= ~bit;
+        else if (res == INSIDE)
+            insideMask |= bit;
+    }
+
+    if (!activeMask)
+        return;
+
+    testMask = activeMask & ~insideMask;
+
+    // Test the nodes in batches against each partially intersecting frustum, then combine the results per node
+    unsigned visibleMask[NODE_TEST_BATCH / 32];
+    unsigned nodeMasks[NODE_TEST_BATCH];
+    size_t numNodes = octant->nodes.Size();
+
+    for (size_t start = 0; start < numNodes; start += NODE_TEST_BATCH)
+    {
+        size_t end = start + NODE_TEST_BATCH < numNodes ? start + NODE_TEST_BATCH : numNodes;
+        for (size_t i = start; i < end; ++i)
+            nodeMasks[i - start] = insideMask;
+
+        if (testMask)
+        {
+            BoundingBoxArrays boxes = octant->NodeBoundingBoxes(start, end);
+            for (unsigned i = 0; i < MAX_QUERY_FRUSTA && (testMask >> i); ++i)
+            {
+                unsigned bit = 1u << i;
+                if (!(testMask & bit) || !frusta[i].IsInsideFast(boxes, visibleMask))
+                    continue;
+
+                for (size_t j = 0; j < end - start; ++j)
+                {
+                    if (visibleMask[j >> 5] & (1u << (j & 31)))
+                        nodeMasks[j] |= bit;
+                }
+            }
+        }
+
+        for (size_t i = start; i < end; ++i)
+        {
+            unsigned nodeMask = nodeMasks[i - start];
+            if (nodeMask && (octant->nodeFlags[i] & nodeFlags) == nodeFlags && (octant->nodeLayerMasks[i] & layerMask))
+                result.Push(MakePair(octant->nodes[i], nodeMask));
+        }
+    }
+
+    for (size_t i = 0; i < NUM_OCTANTS; ++i)
+    {
+        if (octant->children[i])
+            CollectNodes(result, octant->children[i], frusta, activeMask, insideMask, nodeFlags, layerMask);
+    }
+}
+
+void Octree::CollectOctantNodes(Vector<OctreeNode*>& result, const Octant* octant, const Frustum& frustum, unsigned short nodeFlags,
+    unsigned layerMask) const
+{
+    unsigned visibleMask[NODE_TEST_BATCH / 32];
+    size_t numNodes = octant->nodes.Size();
+
+    for (size_t start = 0; start < numNodes; start += NODE_TEST_BATCH)
+    {
+        size_t end = start + NODE_TEST_BATCH < numNodes ? start + NODE_TEST_BATCH : numNodes;
+        if (!frustum.IsInsideFast(octant->NodeBoundingBoxes(start, end), visibleMask))
+            continue;
+
+        for (size_t i = start; i < end; ++i)
+        {
+            size_t j = i - start;
+            if ((visibleMask[j >> 5] & (1u << (j & 31))) && (octant->nodeFlags[i] & nodeFlags) == nodeFlags &&
+                (octant->nodeLayerMasks[i] & layerMask))
+                result.Push(octant->nodes[i]);
+        }
+    }
+}
+
 void Octree::CollectNodes(Vector<RaycastResult>& result, const Octant* octant, const Ray& ray, unsigned short nodeFlags, 
     float maxDistance, unsigned layerMask) const
 {
@@ -369,12 +1618,11 @@ void Octree::CollectNodes(Vector<RaycastResult>& result, const Octant* octant, c
     if (octantDist >= maxDistance)
         return;
 
-    const Vector<OctreeNode*>& octantNodes = octant->nodes;
-    for (auto it = octantNodes.Begin(); it != octantNodes.End(); ++it)
+    for (size_t i = 0; i < octant->nodes.Size(); ++i)
     {
-        OctreeNode* node = *it;
-        if ((node->Flags() & nodeFlags) == nodeFlags && (node->LayerMask() & layerMask))
-            node->OnRaycast(result, ray, maxDistance);
+        if ((octant->nodeFlags[i] & nodeFlags) == nodeFlags && (octant->nodeLayerMasks[i] & layerMask) &&
+            ray.HitDistance(octant->NodeBoundingBox(i)) < maxDistance)
+            octant->nodes[i]->OnRaycast(result, ray, maxDistance);
     }
 
     for (size_t i = 0; i < NUM_OCTANTS; ++i)
@@ -384,29 +1632,239 @@ void Octree::CollectNodes(Vector<RaycastResult>& result, const Octant* octant, c
     }
 }
 
-void Octree::CollectNodes(Vector<Pair<OctreeNode*, float> >& result, const Octant* octant, const Ray& ray, unsigned short nodeFlags,
-    float maxDistance, unsigned layerMask) const
+void Octree::CollectClosestHit(RaycastResult& result, QueryBuffers& buffers, const Octant* octant, const Ray& ray,
+    unsigned short nodeFlags, unsigned layerMask) const
 {
-    float octantDist = ray.HitDistance(octant->cullingBox);
-    if (octantDist >= maxDistance)
-        return;
+    Vector<Pair<OctreeNode*, float> >& initialRes = buffers.initialRes;
+    Vector<RaycastResult>& finalRes = buffers.finalRes;
+
+    // Test the octant's own nodes in order of their bounding box hit distance, using the culling data
+    initialRes.Clear();
+    for (size_t i = 0; i < octant->nodes.Size(); ++i)
+    {
+        if ((octant->nodeFlags[i] & nodeFlags) == nodeFlags && (octant->nodeLayerMasks[i] & layerMask))
+        {
+            float distance = ray.HitDistance(octant->NodeBoundingBox(i));
+            if (distance < result.distance)
+                initialRes.Push(MakePair(octant->nodes[i], distance));
+        }
+    }
+
+    if (initialRes.Size() > 1)
+        Sort(initialRes.Begin(), initialRes.End(), CompareNodeDistances);
 
-    const Vector<OctreeNode*>& octantNodes = octant->nodes;
-    for (auto it = octantNodes.Begin(); it != octantNodes.End(); ++it)
+    for (auto it = initialRes.Begin(); it != initialRes.End() && it->second < result.distance; ++it)
     {
-        OctreeNode* node = *it;
-        if ((node->Flags() & nodeFlags) == nodeFlags && (node->LayerMask() & layerMask))
+        finalRes.Clear();
+        it->first->OnRaycast(finalRes, ray, result.distance);
+        for (auto hit = finalRes.Begin(); hit != finalRes.End(); ++hit)
+        {
+            if (hit->distance < result.distance)
+                result = *hit;
+        }
+    }
+
+    // Then visit the child octants in order of entry distance. The nodes of a child octant are inside its culling box, so
+    // the rest can be skipped once the closest hit is nearer than the next octant
+    ChildOctantHit childHits[NUM_OCTANTS];
+    size_t numChildHits = 0;
+    for (size_t i = 0; i < NUM_OCTANTS; ++i)
+    {
+        const Octant* child = octant->children[i];
+        if (child)
+        {
+            float distance = ray.HitDistance(child->cullingBox);
+            if (distance < result.distance)
+            {
+                ChildOctantHit& hit = childHits[numChildHits++];
+                hit.octant = child;
+                hit.distance = distance;
+            }
+        }
+    }
+
+    SortChildOctantHits(childHits, numChildHits);
+
+    for (size_t i = 0; i < numChildHits && childHits[i].distance < result.distance; ++i)
+        CollectClosestHit(result, buffers, childHits[i].octant, ray, nodeFlags, layerMask);
+}
+
+void Octree::CollectClosestHits(RayPacket& packet, QueryBuffers& buffers, const Octant* octant, unsigned activeMask,
+    unsigned short nodeFlags, unsigned layerMask) const
+{
+    Vector<RaycastResult>& finalRes = buffers.finalRes;
+
+    // Test the octant's own nodes first against the whole packet, then against the rays which may hit them
+    for (size_t i = 0; i < octant->nodes.Size(); ++i)
+    {
+        if ((octant->nodeFlags[i] & nodeFlags) != nodeFlags || !(octant->nodeLayerMasks[i] & layerMask))
+            continue;
+
+        BoundingBox box = packet.Mirror(octant->NodeBoundingBox(i));
+        if (!packet.MayHit(box))
+            continue;
+
+        unsigned hitMask = packet.Test(box, activeMask);
+        for (size_t j = 0; j < packet.count; ++j)
+        {
+            if (!(hitMask & (1u << j)))
+                continue;
+
+            RaycastResult& result = packet.results[j];
+            finalRes.Clear();
+            octant->nodes[i]->OnRaycast(finalRes, packet.rays[j], result.distance);
+            for (auto hit = finalRes.Begin(); hit != finalRes.End(); ++hit)
+            {
+                if (hit->distance < result.distance)
+                    result = *hit;
+            }
+            packet.distances[j] = result.distance;
+        }
+    }
+
+    // Then visit the child octants front to back in the order given by the direction signs, passing on the rays whose closest
+    // hit so far is farther than the child octant
+    for (size_t i = 0; i < NUM_OCTANTS; ++i)
+    {
+        const Octant* child = octant->children[i ^ packet.flipMask];
+        if (!child)
+            continue;
+
+        BoundingBox box = packet.Mirror(child->cullingBox);
+        if (!packet.MayHit(box))
+            continue;
+
+        unsigned childMask = packet.Test(box, activeMask);
+        if (childMask)
+            CollectClosestHits(packet, buffers, child, childMask, nodeFlags, layerMask);
+    }
+}
+
+void Octree::CollectBroadphaseOctants(const Octant* octant, unsigned short nodeFlags, unsigned layerMask)
+{
+    size_t index = broadphaseOctants.Size();
+    broadphaseOctants.Resize(index + 1);
+
+    BoundingBox nodeBounds;
+    size_t nodeStart = broadphaseData.nodes.Size();
+    size_t numNodes = octant->nodes.Size();
+    for (size_t i = 0; i < numNodes; ++i)
+    {
+        if ((octant->nodeFlags[i] & nodeFlags) == nodeFlags && (octant->nodeLayerMasks[i] & layerMask))
         {
-            float distance = ray.HitDistance(node->WorldBoundingBox());
-            if (distance < maxDistance)
-                result.Push(MakePair(node, distance));
+            broadphaseData.AddNode(*octant, i);
+            nodeBounds.Merge(octant->NodeBoundingBox(i));
         }
     }
+    size_t nodeEnd = broadphaseData.nodes.Size();
 
+    BoundingBox bounds = nodeBounds;
     for (size_t i = 0; i < NUM_OCTANTS; ++i)
     {
         if (octant->children[i])
-            CollectNodes(result, octant->children[i], ray, nodeFlags, maxDistance, layerMask);
+        {
+            size_t childIndex = broadphaseOctants.Size();
+            CollectBroadphaseOctants(octant->children[i], nodeFlags, layerMask);
+            if (broadphaseOctants.Size() > childIndex)
+                bounds.Merge(broadphaseOctants[childIndex].bounds);
+        }
+    }
+
+    if (broadphaseData.nodes.Size() == nodeStart)
+    {
+        broadphaseOctants.Resize(index);
+        return;
+    }
+
+    BroadphaseOctant& broadphaseOctant = broadphaseOctants[index];
+    broadphaseOctant.nodeBounds = nodeBounds;
+    broadphaseOctant.bounds = bounds;
+    broadphaseOctant.nodeStart = nodeStart;
+    broadphaseOctant.nodeEnd = nodeEnd;
+    broadphaseOctant.subtreeNodeEnd = broadphaseData.nodes.Size();
+    broadphaseOctant.subtreeEnd = broadphaseOctants.Size();
+}
+
+void Octree::CollectPairs(Vector<NodePair>& result, size_t start, size_t end) const
+{
+    const float* minX = &broadphaseData.nodeMinX[0];
+    const float* minY = &broadphaseData.nodeMinY[0];
+    const float* minZ = &broadphaseData.nodeMinZ[0];
+    const float* maxX = &broadphaseData.nodeMaxX[0];
+    const float* maxY = &broadphaseData.nodeMaxY[0];
+    const float* maxZ = &broadphaseData.nodeMaxZ[0];
+
+    for (size_t i = start; i < end; ++i)
+    {
+        for (size_t j = i + 1; j < end; ++j)
+        {
+            if (minX[i] <= maxX[j] && minX[j] <= maxX[i] && minY[i] <= maxY[j] && minY[j] <= maxY[i] && minZ[i] <= maxZ[j] &&
+                minZ[j] <= maxZ[i])
+                result.Push(MakeNodePair(broadphaseData.nodes[i], broadphaseData.nodes[j]));
+        }
+    }
+}
+
+void Octree::CollectPairs(Vector<NodePair>& result, size_t start1, size_t end1, size_t start2, size_t end2) const
+{
+    const float* minX = &broadphaseData.nodeMinX[0];
+    const float* minY = &broadphaseData.nodeMinY[0];
+    const float* minZ = &broadphaseData.nodeMinZ[0];
+    const float* maxX = &broadphaseData.nodeMaxX[0];
+    const float* maxY = &broadphaseData.nodeMaxY[0];
+    const float* maxZ = &broadphaseData.nodeMaxZ[0];
+
+    for (size_t i = start1; i < end1; ++i)
+    {
+        for (size_t j = start2; j < end2; ++j)
+        {
+            if (minX[i] <= maxX[j] && minX[j] <= maxX[i] && minY[i] <= maxY[j] && minY[j] <= maxY[i] && minZ[i] <= maxZ[j] &&
+                minZ[j] <= maxZ[i])
+                result.Push(MakeNodePair(broadphaseData.nodes[i], broadphaseData.nodes[j]));
+        }
+    }
+}
+
+void Octree::CollectPairs(Vector<NodePair>& result, size_t start, size_t end, const BoundingBox& bounds, size_t octantIndex) const
+{
+    const BroadphaseOctant& octant = broadphaseOctants[octantIndex];
+    if (!Overlaps(bounds, octant.bounds))
+        return;
+
+    CollectPairs(result, start, end, octant.nodeStart, octant.nodeEnd);
+    for (size_t i = octantIndex + 1; i < octant.subtreeEnd; i = broadphaseOctants[i].subtreeEnd)
+        CollectPairs(result, start, end, bounds, i);
+}
+
+void Octree::CollectSubtreePairs(Vector<NodePair>& result, size_t octantIndex1, size_t octantIndex2) const
+{
+    const BroadphaseOctant& octant1 = broadphaseOctants[octantIndex1];
+    const BroadphaseOctant& octant2 = broadphaseOctants[octantIndex2];
+    if (!Overlaps(octant1.bounds, octant2.bounds))
+        return;
+
+    // Test small hierarchies node against node, otherwise split the one with more nodes into its own nodes and child octants
+    size_t numNodes1 = octant1.subtreeNodeEnd - octant1.nodeStart;
+    size_t numNodes2 = octant2.subtreeNodeEnd - octant2.nodeStart;
+    bool hasChildren1 = octant1.subtreeEnd > octantIndex1 + 1;
+    bool hasChildren2 = octant2.subtreeEnd > octantIndex2 + 1;
+    if (numNodes1 * numNodes2 <= MAX_BRUTE_FORCE_PAIR_TESTS || (!hasChildren1 && !hasChildren2))
+    {
+        CollectPairs(result, octant1.nodeStart, octant1.subtreeNodeEnd, octant2.nodeStart, octant2.subtreeNodeEnd);
+        return;
+    }
+
+    if (!hasChildren2 || (hasChildren1 && numNodes1 >= numNodes2))
+    {
+        CollectPairs(result, octant1.nodeStart, octant1.nodeEnd, octant1.nodeBounds, octantIndex2);
+        for (size_t i = octantIndex1 + 1; i < octant1.subtreeEnd; i = broadphaseOctants[i].subtreeEnd)
+            CollectSubtreePairs(result, i, octantIndex2);
+    }
+    else
+    {
+        CollectPairs(result, octant2.nodeStart, octant2.nodeEnd, octant2.nodeBounds, octantIndex1);
+        for (size_t i = octantIndex2 + 1; i < octant2.subtreeEnd; i = broadphaseOctants[i].subtreeEnd)
+            CollectSubtreePairs(result, octantIndex1, i);
     }
 }
 
@@ -4,17 +4,36 @@
 
 #include "../Base/Allocator.h"
 #include "../Debug/Profiler.h"
-#include "../Math/BoundingBox.h"
+#include "../Math/Frustum.h"
+#include "../Thread/WorkQueue.h"
 #include "OctreeNode.h"
 
 namespace Turso3D
 {
 
 static const size_t NUM_OCTANTS = 8;
+/// Maximum number of frusta in a multi-frustum query.
+static const size_t MAX_QUERY_FRUSTA = 32;
+/// Maximum number of nodes tested at once with the batched frustum test.
+static const size_t NODE_TEST_BATCH = 256;
+/// Maximum number of rays traversed together in a ray packet.
+static const size_t RAY_PACKET_SIZE = 32;
+/// Minimum number of consecutive rays with the same direction signs to be traversed as a packet. Shorter runs are cast one by one.
+static const size_t MIN_RAY_PACKET_SIZE = 4;
+/// Minimum number of queued nodes for each task of the threaded octree update.
+static const size_t MIN_NODES_PER_UPDATE_TASK = 256;
+/// Number of octants in the first block of the octant allocator.
+static const size_t OCTANT_BLOCK_SIZE = 64;
+/// Initial node capacity of culling data.
+static const size_t MIN_NODE_CAPACITY = 4;
+/// Number of buckets in the nodes per octant histogram of the octree statistics.
+static const size_t NUM_OCTANT_NODE_BUCKETS = 16;
 
 class Octree;
 class OctreeNode;
 class Ray;
+struct Octant;
+struct RayPacket;
 
 /// Structure for raycast query results.
 struct TURSO3D_API RaycastResult
@@ -31,8 +50,115 @@ struct TURSO3D_API RaycastResult
     size_t subObject;
 };
 
-/// %Octree cell, contains up to 8 child octants.
-struct TURSO3D_API Octant
+/// Compare raycast results by distance for sorting.
+TURSO3D_API bool CompareRaycastResults(const RaycastResult& lhs, const RaycastResult& rhs);
+
+/// Structure for nearest node query results.
+struct TURSO3D_API NearestResult
+{
+    /// Node.
+    OctreeNode* node;
+    /// Distance from the query position to the node's world bounding box. Zero if the position is inside the box.
+    float distance;
+};
+
+/// Temporary buffers of the raycast and nearest node queries.
+struct TURSO3D_API QueryBuffers
+{
+    /// RaycastSingle candidate nodes of an octant and their bounding box hit distances.
+    Vector<Pair<OctreeNode*, float> > initialRes;
+    /// RaycastSingle per-node results.
+    Vector<RaycastResult> finalRes;
+    /// FindNearest priority queue of octants and their squared distances, as a binary heap with the nearest first.
+    Vector<Pair<const Octant*, float> > nearestQueue;
+    /// Single node FindNearest result.
+    Vector<NearestResult> nearestRes;
+};
+
+/// Query buffers for each thread, so that the queries of an octree or an AABB tree can run in several threads at once. All instances share the same thread local storage keys, so creating many of them does not use up the keys.
+class TURSO3D_API ThreadQueryBuffers
+{
+public:
+    /// Construct.
+    ThreadQueryBuffers();
+
+    /// Return the calling thread's buffers. Create if necessary.
+    QueryBuffers& Buffers();
+
+private:
+    /// Unique id, which identifies the instance in the calling thread's cached buffers even if the address is reused.
+    size_t id;
+    /// Mutex for finding and creating buffers.
+    Mutex buffersMutex;
+    /// Buffers of all threads.
+    Vector<AutoPtr<QueryBuffers> > buffers;
+    /// Thread ids of the buffers.
+    Vector<ThreadID> bufferThreads;
+};
+
+/// Pair of nodes with overlapping world bounding boxes, with the lower node address first.
+typedef Pair<OctreeNode*, OctreeNode*> NodePair;
+
+/// Culling data of octree nodes: world bounding boxes, flags and layer masks in structure-of-arrays form, in the same order as the nodes. Updated when the spatial structure is updated, so that culling does not need to access the nodes. The arrays share one allocation.
+struct TURSO3D_API NodeCullingData
+{
+    /// Construct.
+    NodeCullingData();
+    /// Destruct.
+    ~NodeCullingData();
+
+    /// Add a node to the end and copy its culling data. Return the index.
+    size_t AddNode(OctreeNode* node);
+    /// Remove a node by index. The last node is moved into its place. Return the moved node, or null if the removed node was the last.
+    OctreeNode* RemoveNode(size_t index);
+    /// Remove all nodes. The capacity is kept.
+    void Clear();
+    /// Reserve capacity for nodes.
+    void Reserve(size_t capacity);
+    /// Return memory used by the nodes and their culling data in bytes.
+    size_t MemoryUse() const;
+    /// Swap contents with other culling data.
+    void Swap(NodeCullingData& other);
+    /// Add a node to the end and copy its culling data from other culling data. Return the index.
+    size_t AddNode(const NodeCullingData& source, size_t sourceIndex);
+    /// Copy a node's world bounding box, flags and layer mask to the culling data.
+    void SetNodeData(size_t index, const OctreeNode* node);
+    /// Return a node's world bounding box from the culling data.
+    BoundingBox NodeBoundingBox(size_t index) const { return BoundingBox(Vector3(nodeMinX[index], nodeMinY[index], nodeMinZ[index]), Vector3(nodeMaxX[index], nodeMaxY[index], nodeMaxZ[index])); }
+    /// Return the world bounding boxes of a node range from the culling data for batched tests.
+    BoundingBoxArrays NodeBoundingBoxes(size_t start, size_t end) const;
+
+    /// Nodes.
+    Vector<OctreeNode*> nodes;
+    /// Node world bounding box minimum X coordinates.
+    float* nodeMinX;
+    /// Node world bounding box minimum Y coordinates.
+    float* nodeMinY;
+    /// Node world bounding box minimum Z coordinates.
+    float* nodeMinZ;
+    /// Node world bounding box maximum X coordinates.
+    float* nodeMaxX;
+    /// Node world bounding box maximum Y coordinates.
+    float* nodeMaxY;
+    /// Node world bounding box maximum Z coordinates.
+    float* nodeMaxZ;
+    /// Node layer masks.
+    unsigned* nodeLayerMasks;
+    /// Node flags.
+    unsigned short* nodeFlags;
+
+private:
+    /// Prevent copy construction.
+    NodeCullingData(const NodeCullingData& rhs);
+    /// Prevent assignment.
+    NodeCullingData& operator = (const NodeCullingData& rhs);
+
+    /// Number of nodes the culling data arrays can hold.
+    size_t capacity;
+};
+
+/// %Octree cell, contains up to 8 child octants. The culling data of the nodes in the octant is refreshed by Octree::Update().
+struct TURSO3D_API Octant : public NodeCullingData
 {
     /// Construct.
     Octant();
@@ -54,8 +180,6 @@ struct TURSO3D_API Octant
     Vector3 halfSize;
     /// Subdivision level.
     int level;
-    /// Nodes contained in the octant.
-    Vector<OctreeNode*> nodes;
     /// Child octants.
     Octant* children[NUM_OCTANTS];
     /// Parent octant.
@@ -64,7 +188,43 @@ struct TURSO3D_API Octant
     size_t numNodes;
 };
 
-/// Acceleration structure for rendering. Should be created as a child of the scene root.
+/// %Octree statistics for tuning the octree size and number of levels.
+struct TURSO3D_API OctreeStats
+{
+    /// Number of octants in use, including the root.
+    size_t numOctants;
+    /// Number of deleted octants kept for reuse.
+    size_t numFreeOctants;
+    /// Number of nodes.
+    size_t numNodes;
+    /// Number of nodes in the root octant that are not inside the octree's culling bounds, and so can not be inserted deeper.
+    size_t numRootOverflowNodes;
+    /// Number of octants in use on each subdivision level, indexed by level. The root has the highest level.
+    Vector<size_t> octantsPerLevel;
+    /// Histogram of octants by their own node count. Bucket 0 counts octants without nodes and bucket i octants with 2^(i-1) to 2^i - 1 nodes, except that the last bucket also counts all larger octants.
+    size_t nodesPerOctant[NUM_OCTANT_NODE_BUCKETS];
+    /// Memory used by the octants and their culling data in bytes, including the octants kept for reuse.
+    size_t memoryUse;
+};
+
+/// Octant of the broadphase overlap query. The nodes matching the query are copied in depth-first order, so that the nodes of each octant and its child octants are contiguous.
+struct TURSO3D_API BroadphaseOctant
+{
+    /// Bounding box of the octant's own nodes.
+    BoundingBox nodeBounds;
+    /// Bounding box of the nodes in the octant and its child octants.
+    BoundingBox bounds;
+    /// Index of the first own node.
+    size_t nodeStart;
+    /// Index after the own nodes.
+    size_t nodeEnd;
+    /// Index after the nodes of the child octants.
+    size_t subtreeNodeEnd;
+    /// Index after the child octants in the broadphase octants. The child octants follow the octant.
+    size_t subtreeEnd;
+};
+
+/// Acceleration structure for rendering. Should be created as a child of the scene root. Queries that do not modify the octree, which are FindNodes(), FindNodeRanges(), Raycast(), RaycastSingle() and FindNearest(), can be run from any number of threads at once, each with its own result buffers, while the octree is not being updated. Update() must have been called after the last scene changes, so that the nodes' bounding boxes are up to date, and the scene must not be modified until the queries finish. Renderer::PrepareView() updates the octree and writes the nodes' render state, so it must not run at the same time. The overlapping pair queries use buffers of the octree and are main thread only.
 class TURSO3D_API Octree : public Node
 {
     OBJECT(Octree);
@@ -78,8 +238,12 @@ public:
     /// Register factory and attributes.
     static void RegisterObject();
     
-    /// Process the queue of nodes to be reinserted.
+    /// Process the queue of nodes to be reinserted. Also copies the queued nodes' bounding boxes, flags and layer masks to the octants' culling data, which the queries use. With threaded update enabled and worker threads available, the target octants are searched in worker threads, after which the child octants are created and the nodes moved in queue order in the main thread. The result is identical to the single-threaded update. With automatic resize enabled, then grows or shrinks the octree by one step if necessary.
     void Update();
+    /// Set whether to use worker threads in Update() when there are enough queued nodes. Enabled by default.
+    void SetThreadedUpdate(bool enable);
+    /// Set whether to fit the octree bounds to the nodes automatically. When too many nodes are outside the octree bounds, the root octant is doubled in size towards them, and when the nodes fit in one child octant of the root, that child becomes the root. Update() takes at most one step, which reinserts only the root's nodes and a limited number of nodes outside the promoted child octant, so the rest of the octree and the size of the smallest octants are kept. Disabled by default.
+    void SetAutoResize(bool enable);
     /// Resize octree.
     void Resize(const BoundingBox& boundingBox, int numLevels);
     /// Remove a node from the octree.
@@ -88,10 +252,34 @@ public:
     void QueueUpdate(OctreeNode* node);
     /// Cancel a pending reinsertion.
     void CancelUpdate(OctreeNode* node);
+    /// Return whether worker threads are used in Update().
+    bool ThreadedUpdate() const { return threadedUpdate; }
+    /// Return whether the octree bounds are fitted to the nodes automatically.
+    bool AutoResize() const { return autoResize; }
+    /// Return the octree bounds. Nodes outside the bounds are stored in the root octant.
+    const BoundingBox& Bounds() const { return root.worldBoundingBox; }
+    /// Return the number of subdivision levels.
+    int NumLevels() const { return root.level; }
+    /// Return statistics of the octants and nodes.
+    OctreeStats Stats() const;
+
     /// Query for nodes with a raycast and return all results.
-    void Raycast(Vector<RaycastResult>& result, const Ray& ray, unsigned short nodeFlags, float maxDistance = M_INFINITY, unsigned layerMask = LAYERMASK_ALL);
-    /// Query for nodes with a raycast and return the closest result.
-    RaycastResult RaycastSingle(const Ray& ray, unsigned short nodeFlags, float maxDistance = M_INFINITY, unsigned layerMask = LAYERMASK_ALL);
+    void Raycast(Vector<RaycastResult>& result, const Ray& ray, unsigned short nodeFlags, float maxDistance = M_INFINITY, unsigned layerMask = LAYERMASK_ALL) const;
+    /// Query for nodes with a raycast and return the closest result. Visits the octants in ray order and stops when the closest hit is nearer than the next octant.
+    RaycastResult RaycastSingle(const Ray& ray, unsigned short nodeFlags, float maxDistance = M_INFINITY, unsigned layerMask = LAYERMASK_ALL) const;
+    /// Query for nodes with several rays and return the closest result of each. Runs of consecutive rays whose directions have the same signs are traversed together in packets, which share the octant traversal in one front-to-back order and test each bounding box against the whole packet before the single rays. Coherent rays, such as those with nearby origins and directions, benefit; other rays are cast one by one.
+    void RaycastSingle(RaycastResult* results, const Ray* rays, size_t numRays, unsigned short nodeFlags, float maxDistance = M_INFINITY, unsigned layerMask = LAYERMASK_ALL) const;
+    /// Query for the nodes nearest to a position, measured to their world bounding boxes, and return up to count results sorted by distance. Visits the octants nearest first and stops when the remaining octants are farther than the found nodes.
+    void FindNearest(Vector<NearestResult>& result, const Vector3& position, size_t count, unsigned short nodeFlags, float maxDistance = M_INFINITY, unsigned layerMask = LAYERMASK_ALL) const;
+    /// Query for the node nearest to a position, measured to its world bounding box. Return a result with null node if none found.
+    NearestResult FindNearest(const Vector3& position, unsigned short nodeFlags, float maxDistance = M_INFINITY, unsigned layerMask = LAYERMASK_ALL) const;
+
+    /// Query for all pairs of nodes matching flags whose world bounding boxes overlap. Each pair is returned once. Each octant's nodes are tested against each other and the nodes of its child octants, and the child octant hierarchies against each other where their node bounds overlap.
+    void FindOverlappingPairs(Vector<NodePair>& result, unsigned short nodeFlags, unsigned layerMask = LAYERMASK_ALL);
+    /// Query for the overlapping node pairs that began or ended since the previous call, which are returned sorted. The first call reports all pairs as begun. Pairs of nodes removed from the octree in between are forgotten without reporting.
+    void FindOverlappingPairChanges(Vector<NodePair>& began, Vector<NodePair>& ended, unsigned short nodeFlags, unsigned layerMask = LAYERMASK_ALL);
+    /// Forget the overlapping pairs stored for FindOverlappingPairChanges().
+    void ClearOverlappingPairs();
 
     /// Query for nodes using a volume such as frustum or sphere.
     template <class T> void FindNodes(Vector<OctreeNode*>& result, const T& volume, unsigned short nodeFlags, unsigned layerMask = LAYERMASK_ALL) const
@@ -100,6 +288,9 @@ public:
         CollectNodes(result, &root, volume, nodeFlags, layerMask);
     }
 
+    /// Query for nodes using several frusta in one traversal, such as the shadow views of a light. Return each node inside any of the frusta once, with a bitmask of the frusta it is inside.
+    void FindNodes(Vector<Pair<OctreeNode*, unsigned> >& result, const Frustum* frusta, size_t numFrusta, unsigned short nodeFlags, unsigned layerMask = LAYERMASK_ALL) const;
+
     /// Query for nodes using a volume such as frustum or sphere. Invoke a function for each octant.
     template <class T> void FindNodes(const T& volume, void(*callback)(Vector<OctreeNode*>::ConstIterator, Vector<OctreeNode*>::ConstIterator, bool)) const
     {
@@ -114,6 +305,13 @@ public:
         CollectNodesMemberCallback(&root, volume, object, callback);
     }
 
+    /// Query for node ranges using a volume such as frustum or sphere. Invoke a member function for the nodes of each octant that has nodes, with a flag of whether the octant is completely inside the volume. The nodes can be tested using the culling data.
+    template <class T, class U> void FindNodeRanges(const T& volume, U* object, void (U::*callback)(const NodeCullingData*, size_t, size_t, bool)) const
+    {
+        PROFILE(QueryOctree);
+        CollectNodeRangesMemberCallback(&root, volume, object, callback);
+    }
+
 private:
     /// Set bounding box. Used in serialization.
     void SetBoundingBoxAttr(const BoundingBox& boundingBox);
@@ -123,24 +321,64 @@ private:
     void SetNumLevelsAttr(int numLevels);
     /// Return number of levels. Used in serialization.
     int NumLevelsAttr() const;
+    /// Reinsert the queued nodes.
+    void ProcessUpdateQueue();
+    /// Grow or shrink the root octant by one level if the nodes' extent calls for it and queue the root's nodes for reinsertion. Return true if resized.
+    bool AutoResizeStep();
+    /// Double the root octant's size. The old root's child octants move under a new child octant with the given index.
+    void GrowRoot(size_t index);
+    /// Make a child octant the root. The nodes outside it must be in the update queue, from where they are reinserted.
+    void ShrinkRoot(size_t index);
+    /// Work function for searching the target octants of a range of queued nodes. The world bounding boxes must have been resolved.
+    void UpdateWork(Task* task, unsigned threadIndex);
+    /// Test if a node's bounding box should be inserted in an octant or if a smaller child octant should be used.
+    bool InsertHere(const Octant* octant, const BoundingBox& box, const Vector3& boxSize) const { return (octant == &root && octant->cullingBox.IsInside(box) != INSIDE) || octant->FitBoundingBox(box, boxSize); }
+    /// Reinsert a node by descending from an octant, creating child octants as necessary. Optionally leave empty octants to be deleted later.
+    void ReinsertNode(OctreeNode* node, Octant* octant, bool deleteEmpty);
     /// Add node to a specific octant.
     void AddNode(OctreeNode* node, Octant* octant);
-    /// Remove node from an octant.
-    void RemoveNode(OctreeNode* node, Octant* octant);
-    /// Create a new child octant.
+    /// Remove node from an octant by its index in the octant. The last node of the octant is moved into its place. Optionally leave empty octants to be deleted later.
+    void RemoveNode(Octant* octant, size_t index, bool deleteEmpty = true);
+    /// Create a new child octant. Reuse a deleted octant if available.
     Octant* CreateChildOctant(Octant* octant, size_t index);
+    /// Allocate an octant or reuse a deleted one.
+    Octant* AllocateOctant();
+    /// Keep a deleted octant for reuse. Its culling data keeps its capacity, so reusing it does not allocate.
+    void FreeOctant(Octant* octant);
+    /// Free the octants kept for reuse.
+    void FreeOctantPool();
+    /// Collect statistics from an octant and its child octants recursively.
+    void CollectStats(OctreeStats& stats, const Octant* octant) const;
     /// Delete one child octant.
     void DeleteChildOctant(Octant* octant, size_t index);
     /// Delete a child octant hierarchy. If not deleting the octree for good, moves any nodes back to the root octant.
     void DeleteChildOctants(Octant* octant, bool deletingOctree);
+    /// Delete the empty child octants of an octant recursively.
+    void DeleteEmptyOctants(Octant* octant);
     /// Get all nodes from an octant recursively.
     void CollectNodes(Vector<OctreeNode*>& result, const Octant* octant) const;
     /// Get all visible nodes matching flags from an octant recursively.
     void CollectNodes(Vector<OctreeNode*>& result, const Octant* octant, unsigned short nodeFlags, unsigned layerMask) const;
+    /// Get the nodes matching flags from an octant that intersects a frustum. Uses the batched frustum test.
+    void CollectOctantNodes(Vector<OctreeNode*>& result, const Octant* octant, const Frustum& frustum, unsigned short nodeFlags, unsigned layerMask) const;
+    /// Get all visible nodes matching flags using several frusta. The frusta in the inside mask contain the whole octant and are not tested further.
+    void CollectNodes(Vector<Pair<OctreeNode*, unsigned> >& result, const Octant* octant, const Frustum* frusta, unsigned activeMask, unsigned insideMask, unsigned short nodeFlags, unsigned layerMask) const;
     /// Get all visible nodes matching flags along a ray.
     void CollectNodes(Vector<RaycastResult>& result, const Octant* octant, const Ray& ray, unsigned short nodeFlags, float maxDistance, unsigned layerMask) const;
-    /// Get all visible nodes matching flags that could be potential raycast hits.
-    void CollectNodes(Vector<Pair<OctreeNode*, float> >& result, const Octant* octant, const Ray& ray, unsigned short nodeFlags, float maxDistance, unsigned layerMask) const;
+    /// Find the closest raycast hit from an octant and its child octants, visiting the child octants in ray order. Update the closest distance.
+    void CollectClosestHit(RaycastResult& result, QueryBuffers& buffers, const Octant* octant, const Ray& ray, unsigned short nodeFlags, unsigned layerMask) const;
+    /// Find the closest raycast hits of a ray packet from an octant and its child octants. The active mask tells which rays may still hit the octant.
+    void CollectClosestHits(RayPacket& packet, QueryBuffers& buffers, const Octant* octant, unsigned activeMask, unsigned short nodeFlags, unsigned layerMask) const;
+    /// Copy the nodes matching flags from an octant and its child octants to the broadphase data. Empty octant hierarchies are left out.
+    void CollectBroadphaseOctants(const Octant* octant, unsigned short nodeFlags, unsigned layerMask);
+    /// Find the overlapping pairs between the nodes of a range of the broadphase data.
+    void CollectPairs(Vector<NodePair>& result, size_t start, size_t end) const;
+    /// Find the overlapping pairs between two separate ranges of the broadphase data.
+    void CollectPairs(Vector<NodePair>& result, size_t start1, size_t end1, size_t start2, size_t end2) const;
+    /// Find the overlapping pairs between a range of the broadphase data and the nodes of a broadphase octant hierarchy.
+    void CollectPairs(Vector<NodePair>& result, size_t start, size_t end, const BoundingBox& bounds, size_t octantIndex) const;
+    /// Find the overlapping pairs between the nodes of two separate broadphase octant hierarchies.
+    void CollectSubtreePairs(Vector<NodePair>& result, size_t octantIndex1, size_t octantIndex2) const;
 
     /// Collect nodes matching flags using a volume such as frustum or sphere.
     template <class T> void CollectNodes(Vector<OctreeNode*>& result, const Octant* octant, const T& volume, unsigned short nodeFlags, unsigned layerMask) const
@@ -154,14 +392,7 @@ private:
             CollectNodes(result, octant, nodeFlags, layerMask);
         else
         {
-            const Vector<OctreeNode*>& octantNodes = octant->nodes;
-            for (auto it = octantNodes.Begin(); it != octantNodes.End(); ++it)
-            {
-                OctreeNode* node = *it;
-                if ((node->Flags() & nodeFlags) == nodeFlags && (node->LayerMask() & layerMask) &&
-                    volume.IsInsideFast(node->WorldBoundingBox()) != OUTSIDE)
-                    result.Push(node);
-            }
+            CollectOctantNodes(result, octant, volume, nodeFlags, layerMask);
             
             for (size_t i = 0; i < NUM_OCTANTS; ++i)
             {
@@ -171,6 +402,23 @@ private:
         }
     }
     
+    /// Get the nodes matching flags from an octant that intersects a volume, testing their bounding boxes from the culling data.
+    template <class T> void CollectOctantNodes(Vector<OctreeNode*>& result, const Octant* octant, const T& volume, unsigned short nodeFlags, unsigned layerMask) const
+    {
+        size_t numNodes = octant->nodes.Size();
+        if (!numNodes)
+            return;
+
+        const unsigned short* flags = &octant->nodeFlags[0];
+        const unsigned* layerMasks = &octant->nodeLayerMasks[0];
+
+        for (size_t i = 0; i < numNodes; ++i)
+        {
+            if ((flags[i] & nodeFlags) == nodeFlags && (layerMasks[i] & layerMask) && volume.IsInsideFast(octant->NodeBoundingBox(i)) != OUTSIDE)
+                result.Push(octant->nodes[i]);
+        }
+    }
+
     /// Collect nodes from octant and child octants. Invoke a function for each octant.
     void CollectNodesCallback(const Octant* octant, void(*callback)(Vector<OctreeNode*>::ConstIterator, Vector<OctreeNode*>::ConstIterator, bool)) const
     {
@@ -243,16 +491,70 @@ private:
         }
     }
 
+    /// Collect the node ranges of an octant and its child octants. Invoke a member function for each octant that has nodes.
+    template <class T> void CollectNodeRangesMemberCallback(const Octant* octant, T* object, void (T::*callback)(const NodeCullingData*, size_t, size_t, bool)) const
+    {
+        if (octant->nodes.Size())
+            (object->*callback)(octant, 0, octant->nodes.Size(), true);
+
+        for (size_t i = 0; i < NUM_OCTANTS; ++i)
+        {
+            if (octant->children[i])
+                CollectNodeRangesMemberCallback(octant->children[i], object, callback);
+        }
+    }
+
+    /// Collect node ranges using a volume such as frustum or sphere. Invoke a member function for each octant that has nodes.
+    template <class T, class U> void CollectNodeRangesMemberCallback(const Octant* octant, const T& volume, U* object, void (U::*callback)(const NodeCullingData*, size_t, size_t, bool)) const
+    {
+        Intersection res = volume.IsInside(octant->cullingBox);
+        if (res == OUTSIDE)
+            return;
+
+        // If this octant is completely inside the volume, can include all contained octants and their nodes without further tests
+        if (res == INSIDE)
+            CollectNodeRangesMemberCallback(octant, object, callback);
+        else
+        {
+            if (octant->nodes.Size())
+                (object->*callback)(octant, 0, octant->nodes.Size(), false);
+
+            for (size_t i = 0; i < NUM_OCTANTS; ++i)
+            {
+                if (octant->children[i])
+                    CollectNodeRangesMemberCallback(octant->children[i], volume, object, callback);
+            }
+        }
+    }
+
     /// Queue of nodes to be reinserted.
     Vector<OctreeNode*> updateQueue;
-    /// RaycastSingle initial coarse result.
-    Vector<Pair<OctreeNode*, float> > initialRes;
-    /// RaycastSingle final result.
-    Vector<RaycastResult> finalRes;
+    /// Threaded update: deepest existing octant on each queued node's insertion path, or null if the node stays in its octant.
+    Vector<Octant*> updateOctants;
+    /// Threaded update tasks.
+    Vector<AutoPtr<MemberFunctionTask<Octree> > > updateTasks;
+    /// Query buffers of each thread.
+    mutable ThreadQueryBuffers queryBuffers;
+    /// Broadphase query octants.
+    Vector<BroadphaseOctant> broadphaseOctants;
+    /// Broadphase query nodes and their bounding boxes.
+    NodeCullingData broadphaseData;
+    /// Overlapping pairs from the previous FindOverlappingPairChanges() call, sorted.
+    Vector<NodePair> overlapPairs;
+    /// Overlapping pairs of the current FindOverlappingPairChanges() call.
+    Vector<NodePair> newOverlapPairs;
+    /// Nodes removed from the octree since the previous FindOverlappingPairChanges() call.
+    Vector<OctreeNode*> removedPairNodes;
     /// Allocator for child octants.
     Allocator<Octant> allocator;
+    /// Deleted octants kept for reuse.
+    Vector<Octant*> freeOctants;
     /// Root octant.
     Octant root;
+    /// Threaded update flag.
+    bool threadedUpdate;
+    /// Automatic resize flag.
+    bool autoResize;
 };
 
 }
\ No newline at end of file
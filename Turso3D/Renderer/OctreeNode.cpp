@@ -2,19 +2,22 @@
 
 #include "../Math/Ray.h"
 #include "../Scene/Scene.h"
+#include "AABBTree.h"
 #include "Camera.h"
-#include "Octree.h"
 
 namespace Turso3D
 {
 
 OctreeNode::OctreeNode() :
+    distance(0.0f),
+    lastFrameNumber(0),
     octree(nullptr),
+    aabbTree(nullptr),
     octant(nullptr),
-    lastFrameNumber(0),
-    distance(0.0f)
+    octantIndex(0)
 {
     SetFlag(NF_BOUNDING_BOX_DIRTY, true);
+    SetFlag(NF_TRANSFORM_LISTENER, true);
 }
 
 OctreeNode::~OctreeNode()
@@ -31,6 +34,7 @@ void OctreeNode::RegisterObject()
 void OctreeNode::SetCastShadows(bool enable)
 {
     SetFlag(NF_CASTSHADOWS, enable);
+    QueueOctreeUpdate();
 }
 
 void OctreeNode::OnPrepareRender(unsigned frameNumber, Camera* camera)
@@ -54,18 +58,24 @@ void OctreeNode::OnRaycast(Vector<RaycastResult>& dest, const Ray& ray, float ma
     }
 }
 
-void OctreeNode::OnSceneSet(Scene* newScene, Scene*)
+void OctreeNode::OnSceneSet(Scene* newScene, Scene* oldScene)
 {
+    SpatialNode::OnSceneSet(newScene, oldScene);
+
     /// Remove from current octree if any
     RemoveFromOctree();
 
     if (newScene)
     {
-        // Octree must be attached to the scene root as a child
+        // Octree or AABB tree must be attached to the scene root as a child
         octree = newScene->FindChild<Octree>();
-        // Transform may not be final yet. Schedule update but do not insert into octree yet
+        if (!octree)
+            aabbTree = newScene->FindChild<AABBTree>();
+        // Transform may not be final yet. Schedule update but do not insert yet
         if (octree)
             octree->QueueUpdate(this);
+        else if (aabbTree)
+            aabbTree->QueueUpdate(this);
     }
 }
 
@@ -73,9 +83,35 @@ void OctreeNode::OnTransformChanged()
 {
     SpatialNode::OnTransformChanged();
     SetFlag(NF_BOUNDING_BOX_DIRTY, true);
+    // In a transform system the update is queued once the world transform has been recomputed
+    if (!InTransformSystem())
+        QueueOctreeUpdate();
+}
+
+void OctreeNode::OnWorldTransformUpdated()
+{
+    QueueOctreeUpdate();
+}
+
+void OctreeNode::OnSetEnabled(bool)
+{
+    QueueOctreeUpdate();
+}
 
-    if (!TestFlag(NF_OCTREE_UPDATE_QUEUED) && octree)
-        octree->QueueUpdate(this);
+void OctreeNode::OnSetLayer(unsigned char)
+{
+    QueueOctreeUpdate();
+}
+
+void OctreeNode::QueueOctreeUpdate()
+{
+    if (!TestFlag(NF_OCTREE_UPDATE_QUEUED))
+    {
+        if (octree)
+            octree->QueueUpdate(this);
+        else if (aabbTree)
+            aabbTree->QueueUpdate(this);
+    }
 }
 
 void OctreeNode::OnWorldBoundingBoxUpdate() const
@@ -92,6 +128,11 @@ void OctreeNode::RemoveFromOctree()
         octree->RemoveNode(this);
         octree = nullptr;
     }
+    if (aabbTree)
+    {
+        aabbTree->RemoveNode(this);
+        aabbTree = nullptr;
+    }
 }
 
 }
\ No newline at end of file
@@ -8,6 +8,7 @@
 namespace Turso3D
 {
 
+class AABBTree;
 class Camera;
 class Octree;
 class Ray;
@@ -17,6 +18,7 @@ struct RaycastResult;
 /// Base class for scene nodes that insert themselves to the octree for rendering.
 class TURSO3D_API OctreeNode : public SpatialNode
 {
+    friend class AABBTree;
     friend class Octree;
 
     OBJECT(OctreeNode);
@@ -46,16 +48,26 @@ public:
     Octree* GetOctree() const { return octree; }
     /// Return current octree octant this node resides in.
     Octant* GetOctant() const { return octant; }
+    /// Return current AABB tree this node resides in. Used instead of an octree if the scene has an AABB tree and no octree.
+    AABBTree* GetAABBTree() const { return aabbTree; }
     /// Return distance from camera in the current view.
     float Distance() const { return distance; }
     /// Return last frame number when was visible. The frames are counted by Renderer internally and have no significance outside it.
     unsigned LastFrameNumber() const { return lastFrameNumber; }
 
 protected:
-    /// Search for an octree from the scene root and add self to it.
+    /// Search for an octree, or an AABB tree, from the scene root and add self to it.
     void OnSceneSet(Scene* newScene, Scene* oldScene) override;
     /// Handle the transform matrix changing.
     void OnTransformChanged() override;
+    /// Handle the transform system having recomputed the world transform.
+    void OnWorldTransformUpdated() override;
+    /// Handle the enabled status changing.
+    void OnSetEnabled(bool newEnabled) override;
+    /// Handle the layer changing.
+    void OnSetLayer(unsigned char newLayer) override;
+    /// Queue an octree or AABB tree update, if not queued yet, to refresh the culling data after a change in flags or layer.
+    void QueueOctreeUpdate();
     /// Recalculate the world space bounding box.
     virtual void OnWorldBoundingBoxUpdate() const;
 
@@ -67,13 +79,17 @@ protected:
     unsigned lastFrameNumber;
 
 private:
-    /// Remove from the current octree.
+    /// Remove from the current octree or AABB tree.
     void RemoveFromOctree();
 
     /// Current octree.
     Octree* octree;
+    /// Current AABB tree.
+    AABBTree* aabbTree;
     /// Current octree octant.
     Octant* octant;
+    /// Index in the current octant's or AABB tree's nodes and culling data.
+    size_t octantIndex;
 };
 
 }
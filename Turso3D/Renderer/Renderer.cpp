@@ -10,10 +10,10 @@
 #include "../Graphics/VertexBuffer.h"
 #include "../Resource/ResourceCache.h"
 #include "../Scene/Scene.h"
+#include "AABBTree.h"
 #include "Light.h"
 #include "Material.h"
 #include "Model.h"
-#include "Octree.h"
 #include "Renderer.h"
 #include "StaticModel.h"
 
@@ -22,6 +22,9 @@
 namespace Turso3D
 {
 
+static const size_t MIN_NODES_PER_CULLING_TASK = 256;
+static const size_t CULLING_TASKS_PER_THREAD = 4;
+
 static const unsigned LVS_GEOMETRY = (0x1 | 0x2);
 static const unsigned LVS_NUMSHADOWCOORDS = (0x4 | 0x8 | 0x10);
 
@@ -31,6 +34,7 @@ static const unsigned LPS_LIGHT0 = (0x10 | 0x20 | 0x40);
 static const unsigned LPS_LIGHT1 = (0x80 | 0x100 | 0x200);
 static const unsigned LPS_LIGHT2 = (0x400 | 0x800 | 0x1000);
 static const unsigned LPS_LIGHT3 = (0x2000 | 0x4000 | 0x8000);
+static const unsigned LPS_CLUSTERED = 0x10000;
 
 static const CullMode cullModeFlip[] =
 {
@@ -53,7 +57,8 @@ const String lightDefines[] =
     "DIRLIGHT",
     "POINTLIGHT",
     "SPOTLIGHT",
-    "SHADOW"
+    "SHADOW",
+    "CLUSTERED"
 };
 
 inline bool CompareLights(Light* lhs, Light* rhs)
@@ -62,8 +67,17 @@ inline bool CompareLights(Light* lhs, Light* rhs)
 }
 
 Renderer::Renderer() :
+    instanceBufferPosition(0),
+    instanceBufferLap(0),
+    instanceBufferUpdate(0),
     frameNumber(0),
-    instanceTransformsDirty(false)
+    transformLayoutVersion(0),
+    instanceTransformsDirty(false),
+    clusteredLighting(false),
+    clusterConstantsDirty(false),
+    occlusionBufferWidth(DEFAULT_OCCLUSION_BUFFER_WIDTH),
+    occlusionCulling(false),
+    useOcclusion(false)
 {
 }
 
@@ -88,6 +102,24 @@ void Renderer::SetupShadowMaps(size_t num, int size, ImageFormat format)
     }
 }
 
+void Renderer::SetClusteredLighting(bool enable)
+{
+    clusteredLighting = enable;
+}
+
+void Renderer::SetOcclusionCulling(bool enable, int bufferWidth, size_t maxTriangles)
+{
+    if (bufferWidth < 1)
+    {
+        LOGERROR("Can not set zero or negative occlusion buffer width");
+        return;
+    }
+
+    occlusionCulling = enable;
+    occlusionBufferWidth = bufferWidth;
+    occlusionBuffer.SetMaxTriangles(maxTriangles);
+}
+
 bool Renderer::PrepareView(Scene* scene_, Camera* camera_, const Vector<PassDesc>& passes)
 {
     if (!CollectObjects(scene_, camera_))
@@ -109,8 +141,8 @@ bool Renderer::CollectObjects(Scene* scene_, Camera* camera_)
     geometries.Clear();
     lights.Clear();
     instanceTransforms.Clear();
+    instanceQueues.Clear();
     lightLists.Clear();
-    lightPasses.Clear();
     for (auto it = batchQueues.Begin(); it != batchQueues.End(); ++it)
         it->second.Clear();
     for (auto it = shadowMaps.Begin(); it != shadowMaps.End(); ++it)
@@ -120,7 +152,8 @@ bool Renderer::CollectObjects(Scene* scene_, Camera* camera_)
     scene = scene_;
     camera = camera_;
     octree = scene ? scene->FindChild<Octree>() : nullptr;
-    if (!scene || !camera || !octree)
+    aabbTree = scene && !octree ? scene->FindChild<AABBTree>() : nullptr;
+    if (!scene || !camera || (!octree && !aabbTree))
         return false;
 
     // Increment frame number. Never use 0, as that is the default for objects that have never been rendered
@@ -128,12 +161,27 @@ bool Renderer::CollectObjects(Scene* scene_, Camera* camera_)
     if (!frameNumber)
         ++frameNumber;
 
-    // Reinsert moved objects to the octree
-    octree->Update();
+    // Update the world transforms in a batch if the scene has a transform system
+    scene->UpdateTransforms();
+    TransformSystem* transformSystem = scene->GetTransformSystem();
+    transformLayoutVersion = transformSystem ? transformSystem->LayoutVersion() : 0;
+
+    // Reinsert moved objects to the octree or AABB tree
+    if (octree)
+        octree->Update();
+    else
+        aabbTree->Update();
 
     frustum = camera->WorldFrustum();
     viewMask = camera->ViewMask();
-    octree->FindNodes(frustum, this, &Renderer::CollectGeometriesAndLights);
+
+    WorkQueue* workQueue = Subsystem<WorkQueue>();
+    useOcclusion = occlusionCulling && DrawOccluders(workQueue);
+
+    if (workQueue && workQueue->NumThreads())
+        CollectGeometriesAndLightsThreaded(workQueue);
+    else
+        FindNodeRanges(&Renderer::CollectGeometriesAndLights);
 
     return true;
 }
@@ -149,162 +197,131 @@ void Renderer::CollectLightInteractions()
         Sort(lights.Begin(), lights.End(), CompareLights);
     }
 
-    for (auto it = lights.Begin(), end = lights.End(); it != end; ++it)
-    {
-        Light* light = *it;
-        unsigned lightMask = light->LightMask();
-
-        litGeometries.Clear();
-        bool hasReceivers = false;
-
-        // Create a light list that contains only this light. It will be used for nodes that have no light interactions so far
-        unsigned long long key = (unsigned long long)light;
-        LightList* lightList = &lightLists[key];
-        lightList->lights.Push(light);
-        lightList->key = key;
-        lightList->useCount = 0;
-        
-        switch (light->GetLightType())
-        {
-        case LIGHT_DIRECTIONAL:
-            for (auto gIt = geometries.Begin(), gEnd = geometries.End(); gIt != gEnd; ++gIt)
-            {
-                GeometryNode* node = *gIt;
-                if (node->LayerMask() & lightMask)
-                {
-                    AddLightToNode(node, light, lightList);
-                    hasReceivers = true;
-                }
-            }
-            break;
+    WorkQueue* workQueue = Subsystem<WorkQueue>();
+    if (workQueue && !workQueue->NumThreads())
+        workQueue = nullptr;
 
-        case LIGHT_POINT:
-            octree->FindNodes(reinterpret_cast<Vector<OctreeNode*>&>(litGeometries), light->WorldSphere(), NF_ENABLED |
-                NF_GEOMETRY, lightMask);
-            for (auto gIt = litGeometries.Begin(), gEnd = litGeometries.End(); gIt != gEnd; ++gIt)
-            {
-                GeometryNode* node = *gIt;
-                // Add light only to nodes which are actually inside the frustum this frame
-                if (node->LastFrameNumber() == frameNumber)
-                {
-                    AddLightToNode(node, light, lightList);
-                    hasReceivers = true;
-                }
-            }
-            break;
+    if (clusteredLighting)
+        AssignClusteredLights(workQueue);
+    else
+        clusteredLights.Clear();
 
-        case LIGHT_SPOT:
-            octree->FindNodes(reinterpret_cast<Vector<OctreeNode*>&>(litGeometries), light->WorldFrustum(), NF_ENABLED |
-                NF_GEOMETRY, lightMask);
-            for (auto gIt = litGeometries.Begin(), gEnd = litGeometries.End(); gIt != gEnd; ++gIt)
-            {
-                GeometryNode* node = *gIt;
-                if (node->LastFrameNumber() == frameNumber)
-                {
-                    AddLightToNode(node, light, lightList);
-                    hasReceivers = true;
-                }
-            }
-            break;
-        }
+    {
+        // Query the lit geometries of point and spot lights. The queries only read the octree, so they can be run in worker
+        // threads. Directional lights use the visible geometries directly
+        PROFILE(QueryLitGeometries);
+
+        while (litGeometriesTasks.Size() < lights.Size())
+            litGeometriesTasks.Push(new CollectLitGeometriesTask(this, &Renderer::CollectLitGeometriesWork));
 
-        if (!light->CastShadows() || !hasReceivers)
+        for (size_t i = 0; i < lights.Size(); ++i)
         {
-            light->SetShadowMap(nullptr);
-            continue;
+            CollectLitGeometriesTask* task = litGeometriesTasks[i].Get();
+            task->function = &Renderer::CollectLitGeometriesWork;
+            task->light = lights[i];
+            task->litGeometries.Clear();
+            if (task->light->GetLightType() == LIGHT_DIRECTIONAL)
+                continue;
+
+            if (workQueue)
+                workQueue->AddTask(task);
+            else
+                task->Complete(0);
         }
 
-        // Try to allocate shadow map rectangle. Retry with smaller size two times if fails
-        IntVector2 request = light->TotalShadowMapSize();
-        IntRect shadowRect;
-        size_t retries = 3;
-        size_t index = 0;
+        if (workQueue)
+            workQueue->Complete();
+    }
+
+    // Assign lights to nodes, allocate shadow maps and find shadow casters in light order in the main thread, so that the
+    // result is the same as in a serial traversal. A light's receivers include the casters outside the main view that earlier
+    // lights have prepared, so the casters of each light must be prepared before assigning the next. The leading directional
+    // lights are an exception, as they light only the visible geometries: their shadow caster queries traverse the octree and
+    // can be run in worker threads together
+    size_t numDirectional = 0;
+    while (numDirectional < lights.Size() && lights[numDirectional]->GetLightType() == LIGHT_DIRECTIONAL)
+        ++numDirectional;
+
+    {
+        PROFILE(AssignLights);
 
-        while (retries--)
+        for (size_t i = 0; i < numDirectional; ++i)
         {
-            for (index = 0; index < shadowMaps.Size(); ++index)
-            {
-                ShadowMap& shadowMap = shadowMaps[index];
-                int x, y;
-                if (shadowMap.allocator.Allocate(request.x, request.y, x, y))
-                {
-                    light->SetShadowMap(shadowMaps[index].texture, IntRect(x, y, x + request.x, y + request.y));
-                    break;
-                }
-            }
+            CollectLitGeometriesTask* task = litGeometriesTasks[i].Get();
+            if (!AssignLight(task))
+                continue;
 
-            if (index < shadowMaps.Size())
-                break;
+            if (workQueue)
+                workQueue->AddTask(task);
             else
-            {
-                request.x /= 2;
-                request.y /= 2;
-            }
+                task->Complete(0);
         }
 
-        // If no room in any shadow map, render unshadowed
-        if (index >= shadowMaps.Size())
+        if (workQueue)
+            workQueue->Complete();
+
+        for (size_t i = 0; i < numDirectional; ++i)
+            PrepareShadowCasters(litGeometriesTasks[i].Get());
+
+        for (size_t i = numDirectional; i < lights.Size(); ++i)
         {
-            light->SetShadowMap(nullptr);
-            continue;
+            CollectLitGeometriesTask* task = litGeometriesTasks[i].Get();
+            if (AssignLight(task))
+            {
+                task->Complete(0);
+                PrepareShadowCasters(task);
+            }
         }
+    }
 
-        // Setup shadow cameras & find shadow casters
-        size_t startIndex = usedShadowViews;
-        light->SetupShadowViews(camera, shadowViews, usedShadowViews);
-        bool hasShadowBatches = false;
+    if (usedShadowViews)
+    {
+        PROFILE(CollectShadowBatches);
 
-        for (size_t i = startIndex; i < usedShadowViews; ++i)
+        // Collect and sort the shadow batches
+        for (size_t i = 0; i < usedShadowViews; ++i)
         {
-            ShadowView* view = shadowViews[i].Get();
-            Frustum shadowFrustum = view->shadowCamera.WorldFrustum();
-            BatchQueue& shadowQueue = view->shadowQueue;
-            shadowQueue.sort = SORT_STATE;
-            shadowQueue.lit = false;
-            shadowQueue.baseIndex = Material::PassIndex("shadow");
-            shadowQueue.additiveIndex = 0;
-
-            switch (light->GetLightType())
-            {
-            case LIGHT_DIRECTIONAL:
-                // Directional light needs a new frustum query for each split, as the shadow cameras are typically far outside
-                // the main view
-                litGeometries.Clear();
-                octree->FindNodes(reinterpret_cast<Vector<OctreeNode*>&>(litGeometries),
-                    shadowFrustum, NF_ENABLED | NF_GEOMETRY | NF_CASTSHADOWS, light->LightMask());
-                CollectShadowBatches(litGeometries, shadowQueue, shadowFrustum, false, false);
-                break;
+            CollectShadowCastersTask* task = shadowCastersTasks[i].Get();
+            if (workQueue)
+                workQueue->AddTask(task);
+            else
+                task->Complete(0);
+        }
 
-            case LIGHT_POINT:
-                // Check which lit geometries are shadow casters and inside each shadow frustum. First check whether the
-                // shadow frustum is inside the view at all
-                /// \todo Could use a frustum-frustum test for more accuracy
-                if (frustum.IsInsideFast(BoundingBox(shadowFrustum)))
-                    CollectShadowBatches(litGeometries, shadowQueue, shadowFrustum, true, true);
-                break;
+        if (workQueue)
+            workQueue->Complete();
 
-            case LIGHT_SPOT:
-                // For spot light only need to check which lit geometries are shadow casters
-                CollectShadowBatches(litGeometries, shadowQueue, shadowFrustum, true, false);
-                break;
-            }
+        // Build instances and mark shadow maps for rendering in light order
+        for (size_t i = 0; i < lights.Size(); ++i)
+        {
+            CollectLitGeometriesTask* lightTask = litGeometriesTasks[i].Get();
+            if (lightTask->firstShadowView == lightTask->lastShadowView)
+                continue;
 
-            shadowQueue.Sort(instanceTransforms);
+            ShadowMap& shadowMap = shadowMaps[lightTask->shadowMapIndex];
+            bool hasShadowBatches = false;
 
-            // Mark shadow map for rendering only if it has a view with some batches
-            if (shadowQueue.batches.Size())
+            for (size_t j = lightTask->firstShadowView; j < lightTask->lastShadowView; ++j)
             {
-                shadowMaps[index].shadowViews.Push(view);
-                shadowMaps[index].used = true;
-                hasShadowBatches = true;
+                ShadowView* view = shadowViews[j].Get();
+                BatchQueue& shadowQueue = view->shadowQueue;
+                size_t oldSize = instanceTransforms.Size();
+                shadowQueue.BuildInstances(instanceTransforms);
+                if (instanceTransforms.Size() != oldSize)
+                    AddInstanceQueue(&shadowQueue);
+
+                // Mark shadow map for rendering only if it has a view with some batches
+                if (shadowQueue.batches.Size())
+                {
+                    shadowMap.shadowViews.Push(view);
+                    shadowMap.used = true;
+                    hasShadowBatches = true;
+                }
             }
-        }
 
-        if (!hasShadowBatches)
-        {
-            // Light did not have any shadow batches: convert to unshadowed and reuse the views
-            light->SetShadowMap(nullptr);
-            usedShadowViews = startIndex;
+            // Light did not have any shadow batches: convert to unshadowed
+            if (!hasShadowBatches)
+                lightTask->light->SetShadowMap(nullptr);
         }
     }
 
@@ -362,12 +379,15 @@ void Renderer::CollectLightInteractions()
                 if (list.lightPasses.IsEmpty())
                     ++passKey; // First pass includes ambient light
 
+                // Light passes are kept across frames so that their addresses stay the same for the node batch caches,
+                // but their data is refreshed on first use each frame
                 HashMap<unsigned long long, LightPass>::Iterator lpIt = lightPasses.Find(passKey);
-                if (lpIt != lightPasses.End())
-                    list.lightPasses.Push(&lpIt->second);
+                LightPass* newLightPass = lpIt != lightPasses.End() ? &lpIt->second : &lightPasses[passKey];
+                if (lpIt != lightPasses.End() && newLightPass->lastFrameNumber == frameNumber)
+                    list.lightPasses.Push(newLightPass);
                 else
                 {
-                    LightPass* newLightPass = &lightPasses[passKey];
+                    newLightPass->lastFrameNumber = frameNumber;
                     newLightPass->vsBits = 0;
                     newLightPass->psBits = list.lightPasses.IsEmpty() ? LPS_AMBIENT : 0;
                     for (size_t i = 0; i < MAX_LIGHTS_PER_PASS; ++i)
@@ -417,6 +437,15 @@ void Renderer::CollectLightInteractions()
                 }
             }
         }
+
+        // Remove light passes that were not used on this frame
+        for (auto it = lightPasses.Begin(); it != lightPasses.End();)
+        {
+            if (it->second.lastFrameNumber != frameNumber)
+                it = lightPasses.Erase(it);
+            else
+                ++it;
+        }
     }
 }
 
@@ -439,79 +468,126 @@ void Renderer::CollectBatches(const Vector<PassDesc>& passes)
         batchQueue->additiveIndex = srcPass.lit ? Material::PassIndex(srcPass.name + "add") : 0;
     }
 
+    // Identify the batch queue setup for the node batch caches
+    currentSetup.Resize(currentQueues.Size());
+    for (size_t i = 0; i < currentQueues.Size(); ++i)
+    {
+        BatchQueue* batchQueue = currentQueues[i];
+        currentSetup[i] = batchQueue->baseIndex | (batchQueue->additiveIndex << 8) | ((unsigned)batchQueue->lit << 16) |
+            ((unsigned)batchQueue->sort << 17);
+    }
+
+    size_t setupIndex;
+    for (setupIndex = 0; setupIndex < batchQueueSetups.Size(); ++setupIndex)
+    {
+        if (batchQueueSetups[setupIndex] == currentSetup)
+            break;
+    }
+    if (setupIndex == batchQueueSetups.Size())
+        batchQueueSetups.Push(currentSetup);
+
+    unsigned queueSetup = (unsigned)setupIndex + 1;
+    unsigned passesVersion = Material::PassesVersion();
+
     // Loop through geometry nodes
     for (auto gIt = geometries.Begin(), gEnd = geometries.End(); gIt != gEnd; ++gIt)
     {
         GeometryNode* node = *gIt;
         LightList* lightList = node->GetLightList();
+        BatchCache* cache = node->GetBatchCache();
 
-        Batch newBatch;
-        newBatch.type = node->GetGeometryType();
-        newBatch.worldMatrix = &node->WorldTransform();
-
-        // Loop through node's geometries
-        for (auto bIt = node->Batches().Begin(), bEnd = node->Batches().End(); bIt != bEnd; ++bIt)
+        // Rebuild the cached batches if the node's geometries, materials or light passes have changed
+        bool rebuild = node->TestFlag(NF_BATCHES_DIRTY) || cache->queueSetup != queueSetup || cache->passesVersion !=
+            passesVersion;
+        if (!rebuild)
         {
-            newBatch.geometry = bIt->geometry.Get();
-            Material* material = bIt->material.Get();
-            assert(material);
+            if (lightList)
+                rebuild = cache->lightPasses != lightList->lightPasses;
+            else
+                rebuild = cache->lightPasses.Size() != 1 || cache->lightPasses[0] != &ambientLightPass;
+        }
 
-            // Loop through requested queues
-            for (auto qIt = currentQueues.Begin(); qIt != currentQueues.End(); ++qIt)
-            {
-                BatchQueue& batchQueue = **qIt;
-                newBatch.pass = material->GetPass(batchQueue.baseIndex);
-                // Material may not have the requested pass at all, skip further processing as fast as possible in that case
-                if (!newBatch.pass)
-                    continue;
+        if (rebuild)
+        {
+            BuildBatchCache(node, cache, currentQueues, queueSetup);
+            cache->passesVersion = passesVersion;
+            node->SetFlag(NF_BATCHES_DIRTY, false);
+        }
 
-                newBatch.lights = batchQueue.lit ? lightList ? lightList->lightPasses[0] : &ambientLightPass : nullptr;
-                if (batchQueue.sort < SORT_BACK_TO_FRONT)
-                    newBatch.CalculateSortKey();
-                else
-                    newBatch.distance = node->Distance();
+        // Append the cached batches to the queues. Only the distances and world matrices need to be updated. The world matrix
+        // is not cached, as a transform system may move it in memory
+        const Matrix3x4* worldMatrix = &node->WorldTransform();
+        float distance = node->Distance();
+        size_t batchStart = 0;
+        size_t additiveStart = 0;
 
-                batchQueue.batches.Push(newBatch);
+        for (size_t i = 0; i < currentQueues.Size(); ++i)
+        {
+            BatchQueue& batchQueue = *currentQueues[i];
+            size_t batchEnd = cache->batchEnds[i];
+            size_t additiveEnd = cache->additiveBatchEnds[i];
 
-                // Create additive light batches if necessary
-                if (batchQueue.lit && lightList && lightList->lightPasses.Size() > 1)
+            if (batchEnd > batchStart)
+            {
+                size_t oldSize = batchQueue.batches.Size();
+                batchQueue.batches.Push(&cache->batches[batchStart], batchEnd - batchStart);
+                bool setDistance = batchQueue.sort >= SORT_BACK_TO_FRONT;
+                for (size_t j = oldSize; j < batchQueue.batches.Size(); ++j)
                 {
-                    newBatch.pass = material->GetPass(batchQueue.additiveIndex);
-                    if (!newBatch.pass)
-                        continue;
+                    Batch& batch = batchQueue.batches[j];
+                    batch.worldMatrix = worldMatrix;
+                    if (setDistance)
+                        batch.distance = distance;
+                }
+            }
 
-                    for (size_t i = 1; i < lightList->lightPasses.Size(); ++i)
+            if (additiveEnd > additiveStart)
+            {
+                if (batchQueue.sort != SORT_BACK_TO_FRONT)
+                {
+                    size_t oldSize = batchQueue.additiveBatches.Size();
+                    batchQueue.additiveBatches.Push(&cache->additiveBatches[additiveStart], additiveEnd - additiveStart);
+                    for (size_t j = oldSize; j < batchQueue.additiveBatches.Size(); ++j)
+                        batchQueue.additiveBatches[j].worldMatrix = worldMatrix;
+                }
+                else
+                {
+                    // In back-to-front mode base and additive batches must be mixed. Manipulate distance to make the additive
+                    // batches render later
+                    size_t oldSize = batchQueue.batches.Size();
+                    batchQueue.batches.Push(&cache->additiveBatches[additiveStart], additiveEnd - additiveStart);
+                    for (size_t j = oldSize; j < batchQueue.batches.Size(); ++j)
                     {
-                        newBatch.lights = lightList->lightPasses[i];
-                        if (batchQueue.sort != SORT_BACK_TO_FRONT)
-                        {
-                            newBatch.CalculateSortKey();
-                            batchQueue.additiveBatches.Push(newBatch);
-                        }
-                        else
-                        {
-                            // In back-to-front mode base and additive batches must be mixed. Manipulate distance to make
-                            // the additive batches render later
-                            newBatch.distance = node->Distance() * 0.99999f;
-                            batchQueue.batches.Push(newBatch);
-                        }
+                        Batch& batch = batchQueue.batches[j];
+                        batch.worldMatrix = worldMatrix;
+                        batch.distance = distance * 0.99999f;
                     }
                 }
             }
+
+            batchStart = batchEnd;
+            additiveStart = additiveEnd;
         }
     }
 
-    size_t oldSize = instanceTransforms.Size();
-
-    for (auto qIt = currentQueues.Begin(); qIt != currentQueues.End(); ++qIt)
     {
-        BatchQueue& batchQueue = **qIt;
-        batchQueue.Sort(instanceTransforms);
+        PROFILE(SortBatches);
+
+        for (auto qIt = currentQueues.Begin(); qIt != currentQueues.End(); ++qIt)
+        {
+            BatchQueue& batchQueue = **qIt;
+            size_t oldSize = instanceTransforms.Size();
+            batchQueue.Sort(instanceTransforms);
+            if (instanceTransforms.Size() != oldSize)
+                AddInstanceQueue(&batchQueue);
+        }
     }
+}
 
-    // Check if more instances where added
-    if (instanceTransforms.Size() != oldSize)
-        instanceTransformsDirty = true;
+const BatchQueue* Renderer::GetBatchQueue(const String& pass) const
+{
+    auto it = batchQueues.Find(Material::PassIndex(pass, false));
+    return it != batchQueues.End() ? &it->second : nullptr;
 }
 
 void Renderer::CollectBatches(const PassDesc& pass)
@@ -610,6 +686,28 @@ void Renderer::Initialize()
     constants.Push(Constant(ELEM_VECTOR4, "dirShadowFade"));
     psLightConstantBuffer->Define(USAGE_DEFAULT, constants);
 
+    psClusterLightConstantBuffer = new ConstantBuffer();
+    constants.Clear();
+    constants.Push(Constant(ELEM_VECTOR4, "clusterViewRows", 3));
+    constants.Push(Constant(ELEM_VECTOR4, "clusterSizeParameters"));
+    constants.Push(Constant(ELEM_VECTOR4, "clusterDepthParameters"));
+    constants.Push(Constant(ELEM_VECTOR4, "clusterLightPositions", MAX_CLUSTER_LIGHTS));
+    constants.Push(Constant(ELEM_VECTOR4, "clusterLightDirections", MAX_CLUSTER_LIGHTS));
+    constants.Push(Constant(ELEM_VECTOR4, "clusterLightAttenuations", MAX_CLUSTER_LIGHTS));
+    constants.Push(Constant(ELEM_VECTOR4, "clusterLightColors", MAX_CLUSTER_LIGHTS));
+    psClusterLightConstantBuffer->Define(USAGE_DEFAULT, constants);
+
+    // The cluster ranges and light indices are unsigned ints, declared here as vectors of the same size
+    psClusterRangeConstantBuffer = new ConstantBuffer();
+    constants.Clear();
+    constants.Push(Constant(ELEM_VECTOR4, "clusterRanges", NUM_CLUSTERS / 4));
+    psClusterRangeConstantBuffer->Define(USAGE_DEFAULT, constants);
+
+    psClusterIndexConstantBuffer = new ConstantBuffer();
+    constants.Clear();
+    constants.Push(Constant(ELEM_VECTOR4, "clusterLightIndices", MAX_CLUSTER_LIGHT_INDICES / 16));
+    psClusterIndexConstantBuffer->Define(USAGE_DEFAULT, constants);
+
     // Instance vertex buffer contains texcoords 4-6 which define the instances' world matrices
     instanceVertexBuffer = new VertexBuffer();
     instanceVertexElements.Push(VertexElement(ELEM_VECTOR4, SEM_TEXCOORD, INSTANCE_TEXCOORD, true));
@@ -669,55 +767,379 @@ void Renderer::DefineFaceSelectionTextures()
     faceSelectionTexture2->SetDataLost(false);
 }
 
-void Renderer::CollectGeometriesAndLights(Vector<OctreeNode*>::ConstIterator begin, Vector<OctreeNode*>::ConstIterator end,
-    bool inside)
+bool Renderer::DrawOccluders(WorkQueue* workQueue)
 {
-    if (inside)
+    PROFILE(DrawOccluders);
+
+    occluders.Clear();
+    FindNodes(occluders, frustum, NF_ENABLED | NF_GEOMETRY | NF_OCCLUDER, viewMask);
+    if (occluders.IsEmpty())
+        return false;
+
+    // Draw the nearest occluders first, so that the triangle budget is spent on them
+    sortedOccluders.Clear();
+    for (auto it = occluders.Begin(); it != occluders.End(); ++it)
+    {
+        GeometryNode* occluder = static_cast<GeometryNode*>(*it);
+        sortedOccluders.Push(MakePair(camera->Distance(occluder->WorldPosition()), occluder));
+    }
+    Sort(sortedOccluders.Begin(), sortedOccluders.End());
+
+    int height = (int)(occlusionBufferWidth / camera->AspectRatio() + 0.5f);
+    if (!occlusionBuffer.SetSize(occlusionBufferWidth, height > 0 ? height : 1))
+        return false;
+
+    occlusionBuffer.SetView(camera);
+    for (auto it = sortedOccluders.Begin(); it != sortedOccluders.End(); ++it)
     {
-        for (auto it = begin; it != end; ++it)
+        if (!occlusionBuffer.AddOccluder(it->second))
+            break;
+    }
+
+    if (!occlusionBuffer.NumTriangles())
+        return false;
+
+    occlusionBuffer.DrawTriangles(workQueue);
+    return true;
+}
+
+template <class T> void Renderer::FindNodes(Vector<OctreeNode*>& result, const T& volume, unsigned short nodeFlags,
+    unsigned layerMask) const
+{
+    if (octree)
+        octree->FindNodes(result, volume, nodeFlags, layerMask);
+    else
+        aabbTree->FindNodes(result, volume, nodeFlags, layerMask);
+}
+
+void Renderer::FindNodeRanges(void (Renderer::*callback)(const NodeCullingData*, size_t, size_t, bool))
+{
+    if (useOcclusion)
+    {
+        if (octree)
+            octree->FindNodeRanges(OccludedFrustum(frustum, occlusionBuffer), this, callback);
+        else
+            aabbTree->FindNodeRanges(OccludedFrustum(frustum, occlusionBuffer), this, callback);
+    }
+    else
+    {
+        if (octree)
+            octree->FindNodeRanges(frustum, this, callback);
+        else
+            aabbTree->FindNodeRanges(frustum, this, callback);
+    }
+}
+
+void Renderer::CollectGeometriesAndLights(const NodeCullingData* data, size_t start, size_t end, bool inside)
+{
+    CollectGeometriesAndLights(data, start, end, inside, geometries, lights);
+}
+
+void Renderer::CollectGeometriesAndLights(const NodeCullingData* data, size_t start, size_t end, bool inside,
+    Vector<GeometryNode*>& geometryResult, Vector<Light*>& lightResult)
+{
+    unsigned visibleMask[NODE_TEST_BATCH / 32];
+
+    for (size_t batchStart = start; batchStart < end; batchStart += NODE_TEST_BATCH)
+    {
+        size_t batchEnd = batchStart + NODE_TEST_BATCH < end ? batchStart + NODE_TEST_BATCH : end;
+
+        // Test the bounding boxes in a batch, unless they are known to be inside the frustum
+        if (!inside && !frustum.IsInsideFast(data->NodeBoundingBoxes(batchStart, batchEnd), visibleMask))
+            continue;
+
+        for (size_t i = batchStart; i < batchEnd; ++i)
         {
-            OctreeNode* node = *it;
-            unsigned short flags = node->Flags();
-            if ((flags & NF_ENABLED) && (flags & (NF_GEOMETRY | NF_LIGHT)) && (node->LayerMask() & viewMask))
+            size_t j = i - batchStart;
+            if (!inside && !(visibleMask[j >> 5] & (1u << (j & 31))))
+                continue;
+
+            unsigned short flags = data->nodeFlags[i];
+            if (!(flags & NF_ENABLED) || !(flags & (NF_GEOMETRY | NF_LIGHT)) || !(data->nodeLayerMasks[i] & viewMask))
+                continue;
+            if (useOcclusion && !occlusionBuffer.IsVisible(data->NodeBoundingBox(i)))
+                continue;
+
+            OctreeNode* node = data->nodes[i];
+            if (flags & NF_GEOMETRY)
             {
-                if (flags & NF_GEOMETRY)
-                {
-                    GeometryNode* geometry = static_cast<GeometryNode*>(node);
-                    geometry->OnPrepareRender(frameNumber, camera);
-                    geometries.Push(geometry);
-                }
-                else
-                {
-                    Light* light = static_cast<Light*>(node);
-                    light->OnPrepareRender(frameNumber, camera);
-                    lights.Push(light);
-                }
+                GeometryNode* geometry = static_cast<GeometryNode*>(node);
+                geometry->OnPrepareRender(frameNumber, camera);
+                geometryResult.Push(geometry);
             }
+            else
+            {
+                Light* light = static_cast<Light*>(node);
+                light->OnPrepareRender(frameNumber, camera);
+                lightResult.Push(light);
+            }
+        }
+    }
+}
+
+void Renderer::CollectOctantNodeRanges(const NodeCullingData* data, size_t start, size_t end, bool inside)
+{
+    OctantNodeRange range;
+    range.data = data;
+    range.start = start;
+    range.end = end;
+    range.inside = inside;
+    octantNodeRanges.Push(range);
+}
+
+void Renderer::CollectGeometriesAndLightsThreaded(WorkQueue* workQueue)
+{
+    // The octant traversal is cheap compared to the per-node tests, so do it first in the main thread
+    octantNodeRanges.Clear();
+    FindNodeRanges(&Renderer::CollectOctantNodeRanges);
+
+    size_t totalNodes = 0;
+    for (auto it = octantNodeRanges.Begin(); it != octantNodeRanges.End(); ++it)
+        totalNodes += it->end - it->start;
+    if (!totalNodes)
+        return;
+
+    // Worker threads must not trigger the lazy update of the camera view matrix
+    camera->ViewMatrix();
+
+    size_t maxTasks = (workQueue->NumThreads() + 1) * CULLING_TASKS_PER_THREAD;
+    size_t nodesPerTask = (totalNodes + maxTasks - 1) / maxTasks;
+    if (nodesPerTask < MIN_NODES_PER_CULLING_TASK)
+        nodesPerTask = MIN_NODES_PER_CULLING_TASK;
+
+    // Split large octants so that each task gets approximately the same amount of nodes. The ranges stay in traversal order,
+    // so that merging the task results in order gives the same result as the single-threaded traversal
+    for (size_t i = 0; i < octantNodeRanges.Size(); ++i)
+    {
+        OctantNodeRange& range = octantNodeRanges[i];
+        if (range.end - range.start > nodesPerTask)
+        {
+            OctantNodeRange remainder = range;
+            remainder.start = range.start + nodesPerTask;
+            range.end = remainder.start;
+            octantNodeRanges.Insert(i + 1, remainder);
+        }
+    }
+
+    size_t numTasks = 0;
+    size_t taskNodes = 0;
+    OctantNodeRange* taskStart = &octantNodeRanges[0];
+    OctantNodeRange* rangesEnd = taskStart + octantNodeRanges.Size();
+
+    for (OctantNodeRange* range = taskStart; range != rangesEnd; ++range)
+    {
+        taskNodes += range->end - range->start;
+        if (taskNodes >= nodesPerTask || range + 1 == rangesEnd)
+        {
+            if (collectObjectsTasks.Size() <= numTasks)
+                collectObjectsTasks.Push(new CollectObjectsTask(this, &Renderer::CollectObjectsWork));
+
+            CollectObjectsTask* task = collectObjectsTasks[numTasks++];
+            task->start = taskStart;
+            task->end = range + 1;
+            workQueue->AddTask(task);
+            taskStart = range + 1;
+            taskNodes = 0;
         }
     }
+
+    workQueue->Complete();
+
+    for (size_t i = 0; i < numTasks; ++i)
+    {
+        CollectObjectsTask* task = collectObjectsTasks[i];
+        geometries.Push(task->geometries);
+        lights.Push(task->lights);
+    }
+}
+
+void Renderer::CollectObjectsWork(Task* task_, unsigned /* threadIndex */)
+{
+    CollectObjectsTask* task = static_cast<CollectObjectsTask*>(task_);
+    task->geometries.Clear();
+    task->lights.Clear();
+
+    for (OctantNodeRange* range = static_cast<OctantNodeRange*>(task->start); range != task->end; ++range)
+        CollectGeometriesAndLights(range->data, range->start, range->end, range->inside, task->geometries, task->lights);
+}
+
+void Renderer::BuildBatchCache(GeometryNode* node, BatchCache* cache, const Vector<BatchQueue*>& queues, unsigned queueSetup)
+{
+    LightList* lightList = node->GetLightList();
+
+    cache->queueSetup = queueSetup;
+    cache->batches.Clear();
+    cache->additiveBatches.Clear();
+    cache->batchEnds.Resize(queues.Size());
+    cache->additiveBatchEnds.Resize(queues.Size());
+    if (lightList)
+        cache->lightPasses = lightList->lightPasses;
     else
     {
-        for (auto it = begin; it != end; ++it)
+        cache->lightPasses.Clear();
+        cache->lightPasses.Push(&ambientLightPass);
+    }
+
+    // World matrices are filled when the batches are added to the queues
+    Batch newBatch;
+    newBatch.type = node->GetGeometryType();
+    newBatch.worldMatrix = nullptr;
+
+    for (size_t i = 0; i < queues.Size(); ++i)
+    {
+        BatchQueue& batchQueue = *queues[i];
+
+        // Loop through node's geometries
+        for (auto bIt = node->Batches().Begin(), bEnd = node->Batches().End(); bIt != bEnd; ++bIt)
         {
-            OctreeNode* node = *it;
-            unsigned short flags = node->Flags();
-            if ((flags & NF_ENABLED) && (flags & (NF_GEOMETRY | NF_LIGHT)) && (node->LayerMask() & viewMask) &&
-                frustum.IsInsideFast(node->WorldBoundingBox()))
+            newBatch.geometry = bIt->geometry.Get();
+            Material* material = bIt->material.Get();
+            assert(material);
+
+            newBatch.pass = material->GetPass(batchQueue.baseIndex);
+            // Material may not have the requested pass at all, skip further processing as fast as possible in that case
+            if (!newBatch.pass)
+                continue;
+
+            // Distances are filled when the batches are added to the queues
+            newBatch.lights = batchQueue.lit ? lightList ? lightList->lightPasses[0] : &ambientLightPass : nullptr;
+            if (batchQueue.sort < SORT_BACK_TO_FRONT)
+                newBatch.CalculateSortKey();
+            cache->batches.Push(newBatch);
+
+            // Create additive light batches if necessary
+            if (batchQueue.lit && lightList && lightList->lightPasses.Size() > 1)
             {
-                if (flags & NF_GEOMETRY)
-                {
-                    GeometryNode* geometry = static_cast<GeometryNode*>(node);
-                    geometry->OnPrepareRender(frameNumber, camera);
-                    geometries.Push(geometry);
-                }
-                else
+                newBatch.pass = material->GetPass(batchQueue.additiveIndex);
+                if (!newBatch.pass)
+                    continue;
+
+                for (size_t j = 1; j < lightList->lightPasses.Size(); ++j)
                 {
-                    Light* light = static_cast<Light*>(node);
-                    light->OnPrepareRender(frameNumber, camera);
-                    lights.Push(light);
+                    newBatch.lights = lightList->lightPasses[j];
+                    if (batchQueue.sort != SORT_BACK_TO_FRONT)
+                        newBatch.CalculateSortKey();
+                    cache->additiveBatches.Push(newBatch);
                 }
             }
         }
+
+        cache->batchEnds[i] = cache->batches.Size();
+        cache->additiveBatchEnds[i] = cache->additiveBatches.Size();
+    }
+}
+
+void Renderer::AssignClusteredLights(WorkQueue* workQueue)
+{
+    PROFILE(AssignClusteredLights);
+
+    // The lights are sorted by distance, so the nearest are clustered first. Shadowed lights need their own light passes for
+    // the shadow maps, and lights with a light mask can not be clustered, as the clusters light all geometries
+    clusteredLights.Clear();
+    size_t numLights = 0;
+    for (size_t i = 0; i < lights.Size(); ++i)
+    {
+        Light* light = lights[i];
+        if (clusteredLights.Size() < MAX_CLUSTER_LIGHTS && light->GetLightType() != LIGHT_DIRECTIONAL && !light->CastShadows() &&
+            light->LightMask() == M_MAX_UNSIGNED)
+        {
+            light->SetShadowMap(nullptr);
+            clusteredLights.Push(light);
+        }
+        else
+            lights[numLights++] = light;
+    }
+    lights.Resize(numLights);
+
+    bool lightsReturned = false;
+    while (clusteredLights.Size())
+    {
+        lightClusters.AssignLights(camera, clusteredLights, workQueue);
+        if (lightClusters.LightIndices().Size() <= MAX_CLUSTER_LIGHT_INDICES)
+            break;
+
+        // Too many light indices for the shader constants: light the farthest quarter of the clustered lights per node
+        for (size_t i = (clusteredLights.Size() + 3) / 4; i; --i)
+        {
+            lights.Push(clusteredLights.Back());
+            clusteredLights.Pop();
+        }
+        lightsReturned = true;
+    }
+
+    if (lightsReturned)
+        Sort(lights.Begin(), lights.End(), CompareLights);
+
+    clusterConstantsDirty = true;
+}
+
+void Renderer::UpdateClusterConstants()
+{
+    PROFILE(UpdateClusterConstants);
+
+    // The shaders find the cluster of a pixel from its view space position
+    const Matrix3x4& view = camera->ViewMatrix();
+    Vector4 viewRows[3] = {
+        Vector4(view.m00, view.m01, view.m02, view.m03),
+        Vector4(view.m10, view.m11, view.m12, view.m13),
+        Vector4(view.m20, view.m21, view.m22, view.m23)
+    };
+    psClusterLightConstantBuffer->SetConstant(PS_CLUSTER_VIEW_ROWS, viewRows);
+    psClusterLightConstantBuffer->SetConstant(PS_CLUSTER_SIZE_PARAMETERS, lightClusters.SizeParameters());
+    psClusterLightConstantBuffer->SetConstant(PS_CLUSTER_DEPTH_PARAMETERS, lightClusters.DepthParameters());
+
+    Vector4 lightPositions[MAX_CLUSTER_LIGHTS];
+    Vector4 lightDirections[MAX_CLUSTER_LIGHTS];
+    Vector4 lightAttenuations[MAX_CLUSTER_LIGHTS];
+    Color lightColors[MAX_CLUSTER_LIGHTS];
+    size_t numLights = clusteredLights.Size();
+
+    for (size_t i = 0; i < numLights; ++i)
+    {
+        Light* light = clusteredLights[i];
+        lightPositions[i] = Vector4(light->WorldPosition(), 1.0f);
+        lightDirections[i] = Vector4(-light->WorldDirection(), 0.0f);
+        if (light->GetLightType() == LIGHT_SPOT)
+        {
+            float cutoff = cosf(light->Fov() * 0.5f * M_DEGTORAD);
+            lightAttenuations[i] = Vector4(1.0f / Max(light->Range(), M_EPSILON), cutoff, 1.0f / (1.0f - cutoff), 0.0f);
+        }
+        else
+        {
+            // Point lights use the spot light attenuation with a cutoff of -2 and a scale of 1, so that the cone term is
+            // at least 1 in all directions and saturates to full intensity
+            lightAttenuations[i] = Vector4(1.0f / Max(light->Range(), M_EPSILON), -2.0f, 1.0f, 0.0f);
+        }
+        lightColors[i] = light->GetColor();
+    }
+
+    psClusterLightConstantBuffer->SetConstant(PS_CLUSTER_LIGHT_POSITIONS, lightPositions[0], numLights);
+    psClusterLightConstantBuffer->SetConstant(PS_CLUSTER_LIGHT_DIRECTIONS, lightDirections[0], numLights);
+    psClusterLightConstantBuffer->SetConstant(PS_CLUSTER_LIGHT_ATTENUATIONS, lightAttenuations[0], numLights);
+    psClusterLightConstantBuffer->SetConstant(PS_CLUSTER_LIGHT_COLORS, lightColors[0], numLights);
+    psClusterLightConstantBuffer->Apply();
+
+    // Pack the start index and light count of each cluster into one unsigned int, and four light indices into each unsigned
+    // int. The index list is padded to whole vectors
+    const Vector<LightClusterRange>& clusters = lightClusters.Clusters();
+    clusterRangeData.Resize(NUM_CLUSTERS);
+    for (size_t i = 0; i < NUM_CLUSTERS; ++i)
+        clusterRangeData[i] = clusters[i].start | (clusters[i].count << 16);
+    psClusterRangeConstantBuffer->SetConstant(PS_CLUSTER_RANGES, (const void*)&clusterRangeData[0]);
+    psClusterRangeConstantBuffer->Apply();
+
+    const Vector<unsigned short>& lightIndices = lightClusters.LightIndices();
+    if (lightIndices.Size())
+    {
+        size_t numVectors = (lightIndices.Size() + 15) / 16;
+        clusterIndexData.Resize(numVectors * 4);
+        for (size_t i = 0; i < clusterIndexData.Size(); ++i)
+            clusterIndexData[i] = 0;
+        for (size_t i = 0; i < lightIndices.Size(); ++i)
+            clusterIndexData[i >> 2] |= (unsigned)lightIndices[i] << ((i & 3) * 8);
+
+        psClusterIndexConstantBuffer->SetConstant(PS_CLUSTER_LIGHT_INDICES, (const void*)&clusterIndexData[0], numVectors);
+        psClusterIndexConstantBuffer->Apply();
     }
 }
 
@@ -756,24 +1178,250 @@ void Renderer::AddLightToNode(GeometryNode* node, Light* light, LightList* light
     }
 }
 
-void Renderer::CollectShadowBatches(const Vector<GeometryNode*>& nodes, BatchQueue& batchQueue, const Frustum& frustum,
-    bool checkShadowCaster, bool checkFrustum)
+bool Renderer::AssignLight(CollectLitGeometriesTask* task)
+{
+    Light* light = task->light;
+    unsigned lightMask = light->LightMask();
+    bool hasReceivers = false;
+    task->firstShadowView = task->lastShadowView = usedShadowViews;
+
+    // Create a light list that contains only this light. It will be used for nodes that have no light interactions so far
+    unsigned long long key = (unsigned long long)light;
+    LightList* lightList = &lightLists[key];
+    lightList->lights.Push(light);
+    lightList->key = key;
+    lightList->useCount = 0;
+
+    if (light->GetLightType() == LIGHT_DIRECTIONAL)
+    {
+        for (auto gIt = geometries.Begin(), gEnd = geometries.End(); gIt != gEnd; ++gIt)
+        {
+            GeometryNode* node = *gIt;
+            if (node->LayerMask() & lightMask)
+            {
+                AddLightToNode(node, light, lightList);
+                hasReceivers = true;
+            }
+        }
+    }
+    else
+    {
+        for (auto gIt = task->litGeometries.Begin(), gEnd = task->litGeometries.End(); gIt != gEnd; ++gIt)
+        {
+            GeometryNode* node = *gIt;
+            // Add light only to nodes which are actually inside the frustum this frame, or have been prepared as shadow casters
+            if (node->LastFrameNumber() == frameNumber)
+            {
+                AddLightToNode(node, light, lightList);
+                hasReceivers = true;
+            }
+        }
+    }
+
+    if (!light->CastShadows() || !hasReceivers)
+    {
+        light->SetShadowMap(nullptr);
+        return false;
+    }
+
+    // Try to allocate shadow map rectangle. Retry with smaller size two times if fails
+    IntVector2 request = light->TotalShadowMapSize();
+    size_t retries = 3;
+    size_t index = 0;
+
+    while (retries--)
+    {
+        for (index = 0; index < shadowMaps.Size(); ++index)
+        {
+            ShadowMap& shadowMap = shadowMaps[index];
+            int x, y;
+            if (shadowMap.allocator.Allocate(request.x, request.y, x, y))
+            {
+                light->SetShadowMap(shadowMaps[index].texture, IntRect(x, y, x + request.x, y + request.y));
+                break;
+            }
+        }
+
+        if (index < shadowMaps.Size())
+            break;
+        else
+        {
+            request.x /= 2;
+            request.y /= 2;
+        }
+    }
+
+    // If no room in any shadow map, render unshadowed
+    if (index >= shadowMaps.Size())
+    {
+        light->SetShadowMap(nullptr);
+        return false;
+    }
+
+    // Setup shadow cameras and the tasks for their shadow casters
+    task->shadowMapIndex = index;
+    light->SetupShadowViews(camera, shadowViews, usedShadowViews);
+    task->lastShadowView = usedShadowViews;
+    task->function = &Renderer::CollectShadowCastersWork;
+
+    while (shadowCastersTasks.Size() < usedShadowViews)
+        shadowCastersTasks.Push(new CollectShadowCastersTask(this, &Renderer::CollectShadowBatchesWork));
+
+    for (size_t i = task->firstShadowView; i < task->lastShadowView; ++i)
+    {
+        CollectShadowCastersTask* castersTask = shadowCastersTasks[i].Get();
+        castersTask->view = shadowViews[i].Get();
+        castersTask->shadowCasters.Clear();
+
+        BatchQueue& shadowQueue = castersTask->view->shadowQueue;
+        shadowQueue.sort = SORT_STATE;
+        shadowQueue.lit = false;
+        shadowQueue.baseIndex = Material::PassIndex("shadow");
+        shadowQueue.additiveIndex = 0;
+    }
+
+    return true;
+}
+
+void Renderer::PrepareShadowCasters(CollectLitGeometriesTask* task)
+{
+    for (size_t i = task->firstShadowView; i < task->lastShadowView; ++i)
+    {
+        const Vector<GeometryNode*>& shadowCasters = shadowCastersTasks[i]->shadowCasters;
+        for (auto gIt = shadowCasters.Begin(), gEnd = shadowCasters.End(); gIt != gEnd; ++gIt)
+        {
+            GeometryNode* node = *gIt;
+            if (node->LastFrameNumber() != frameNumber)
+                node->OnPrepareRender(frameNumber, camera);
+        }
+    }
+}
+
+void Renderer::CollectLitGeometriesWork(Task* task_, unsigned /* threadIndex */)
+{
+    CollectLitGeometriesTask* task = static_cast<CollectLitGeometriesTask*>(task_);
+    Light* light = task->light;
+
+    task->queryResult.Clear();
+    if (light->GetLightType() == LIGHT_POINT)
+        FindNodes(task->queryResult, light->WorldSphere(), NF_ENABLED | NF_GEOMETRY, light->LightMask());
+    else
+        FindNodes(task->queryResult, light->WorldFrustum(), NF_ENABLED | NF_GEOMETRY, light->LightMask());
+
+    // The query flags only match geometry nodes
+    size_t numGeometries = task->queryResult.Size();
+    size_t start = task->litGeometries.Size();
+    task->litGeometries.Resize(start + numGeometries);
+    for (size_t i = 0; i < numGeometries; ++i)
+        task->litGeometries[start + i] = static_cast<GeometryNode*>(task->queryResult[i]);
+}
+
+void Renderer::CollectShadowCastersWork(Task* task_, unsigned /* threadIndex */)
+{
+    CollectLitGeometriesTask* task = static_cast<CollectLitGeometriesTask*>(task_);
+    Light* light = task->light;
+    size_t firstView = task->firstShadowView;
+    size_t numViews = task->lastShadowView - firstView;
+    assert(numViews <= MAX_QUERY_FRUSTA);
+
+    task->shadowFrusta.Resize(numViews);
+    Frustum* shadowFrusta = &task->shadowFrusta[0];
+    for (size_t i = 0; i < numViews; ++i)
+        shadowFrusta[i] = shadowViews[firstView + i]->shadowCamera.WorldFrustum();
+
+    switch (light->GetLightType())
+    {
+    case LIGHT_DIRECTIONAL:
+        {
+            // Directional light needs a new query, as the shadow cameras are typically far outside the main view. Query all
+            // splits in one traversal, then distribute the casters to the splits they are in
+            Vector<Pair<OctreeNode*, unsigned> >& shadowCasterMasks = task->shadowCasterMasks;
+            shadowCasterMasks.Clear();
+            if (octree)
+            {
+                octree->FindNodes(shadowCasterMasks, shadowFrusta, numViews, NF_ENABLED | NF_GEOMETRY | NF_CASTSHADOWS,
+                    light->LightMask());
+            }
+            else
+            {
+                aabbTree->FindNodes(shadowCasterMasks, shadowFrusta, numViews, NF_ENABLED | NF_GEOMETRY | NF_CASTSHADOWS,
+                    light->LightMask());
+            }
+
+            for (auto it = shadowCasterMasks.Begin(), end = shadowCasterMasks.End(); it != end; ++it)
+            {
+                GeometryNode* node = static_cast<GeometryNode*>(it->first);
+                unsigned viewMask = it->second;
+                for (size_t i = 0; i < numViews; ++i)
+                {
+                    if (viewMask & (1u << i))
+                        shadowCastersTasks[firstView + i]->shadowCasters.Push(node);
+                }
+            }
+        }
+        break;
+
+    case LIGHT_POINT:
+        {
+            // Check which lit geometries are shadow casters and inside each shadow frustum. First check whether the shadow
+            // frusta are inside the view at all
+            /// \todo Could use a frustum-frustum test for more accuracy
+            unsigned viewMask = 0;
+            for (size_t i = 0; i < numViews; ++i)
+            {
+                if (frustum.IsInsideFast(BoundingBox(shadowFrusta[i])))
+                    viewMask |= 1u << i;
+            }
+            if (viewMask)
+                CollectShadowCasters(task->litGeometries, firstView, viewMask, shadowFrusta, true);
+        }
+        break;
+
+    case LIGHT_SPOT:
+        // For spot light only need to check which lit geometries are shadow casters
+        CollectShadowCasters(task->litGeometries, firstView, 1, shadowFrusta, false);
+        break;
+    }
+}
+
+void Renderer::CollectShadowBatchesWork(Task* task_, unsigned /* threadIndex */)
+{
+    CollectShadowCastersTask* task = static_cast<CollectShadowCastersTask*>(task_);
+    BatchQueue& shadowQueue = task->view->shadowQueue;
+    CollectShadowBatches(task->shadowCasters, shadowQueue);
+    shadowQueue.SortBatches();
+}
+
+void Renderer::CollectShadowCasters(const Vector<GeometryNode*>& nodes, size_t firstView, unsigned viewMask,
+    const Frustum* frusta, bool checkFrusta)
 {
-    Batch newBatch;
-    newBatch.lights = nullptr;
-    
     for (auto gIt = nodes.Begin(), gEnd = nodes.End(); gIt != gEnd; ++gIt)
     {
         GeometryNode* node = *gIt;
-        if (checkShadowCaster && !(node->Flags() & NF_CASTSHADOWS))
-            continue;
-        if (checkFrustum && !frustum.IsInsideFast(node->WorldBoundingBox()))
+        if (!(node->Flags() & NF_CASTSHADOWS))
             continue;
 
-        // Node was possibly not in the main view. Update geometry first in that case
-        if (node->LastFrameNumber() != frameNumber)
-            node->OnPrepareRender(frameNumber, camera);
+        const BoundingBox& box = node->WorldBoundingBox();
+        for (size_t i = 0; i < MAX_QUERY_FRUSTA && (viewMask >> i); ++i)
+        {
+            if (!(viewMask & (1u << i)))
+                continue;
+            if (checkFrusta && !frusta[i].IsInsideFast(box))
+                continue;
+
+            shadowCastersTasks[firstView + i]->shadowCasters.Push(node);
+        }
+    }
+}
 
+void Renderer::CollectShadowBatches(const Vector<GeometryNode*>& nodes, BatchQueue& batchQueue)
+{
+    Batch newBatch;
+    newBatch.lights = nullptr;
+    
+    for (auto gIt = nodes.Begin(), gEnd = nodes.End(); gIt != gEnd; ++gIt)
+    {
+        GeometryNode* node = *gIt;
         newBatch.type = node->GetGeometryType();
         newBatch.worldMatrix = &node->WorldTransform();
 
@@ -795,9 +1443,140 @@ void Renderer::CollectShadowBatches(const Vector<GeometryNode*>& nodes, BatchQue
     }
 }
 
+void Renderer::AddInstanceQueue(BatchQueue* batchQueue)
+{
+    // A queue's instance start indices refer to the current frame's transforms until the next update, so it must be added only once
+    if (!instanceQueues.Contains(batchQueue))
+        instanceQueues.Push(batchQueue);
+    instanceTransformsDirty = true;
+}
+
+void Renderer::UpdateInstanceBuffer()
+{
+    if (!instanceTransformsDirty)
+        return;
+
+    PROFILE(UpdateInstanceBuffer);
+
+    instanceTransformsDirty = false;
+    ++instanceBufferUpdate;
+
+    instanceBatches.Clear();
+    instanceKeys.Clear();
+    instanceBatchPositions.Clear();
+
+    // Find the instance groups whose transforms are already in the buffer from an earlier frame
+    size_t totalInstances = 0;
+    size_t newInstances = 0;
+
+    for (auto qIt = instanceQueues.Begin(); qIt != instanceQueues.End(); ++qIt)
+    {
+        BatchQueue* batchQueue = *qIt;
+
+        for (size_t i = 0; i < 2; ++i)
+        {
+            Vector<Batch>& batches = i ? batchQueue->additiveBatches : batchQueue->batches;
+
+            for (auto bIt = batches.Begin(); bIt != batches.End(); ++bIt)
+            {
+                Batch& batch = *bIt;
+                if (batch.type != GEOM_INSTANCED)
+                    continue;
+
+                InstanceKey key(&batches, batch);
+                size_t position = M_MAX_UNSIGNED;
+
+                auto rIt = instanceRegions.Find(key);
+                if (rIt != instanceRegions.End())
+                {
+                    InstanceRegion& region = rIt->second;
+                    if (region.lap == instanceBufferLap && region.update != instanceBufferUpdate && region.count ==
+                        batch.instanceCount && !memcmp(&instanceBufferData[region.start], &instanceTransforms[batch.instanceStart],
+                        batch.instanceCount * sizeof(Matrix3x4)))
+                    {
+                        region.update = instanceBufferUpdate;
+                        position = region.start;
+                    }
+                }
+
+                if (position == M_MAX_UNSIGNED)
+                    newInstances += batch.instanceCount;
+                totalInstances += batch.instanceCount;
+
+                instanceBatches.Push(&batch);
+                instanceKeys.Push(key);
+                instanceBatchPositions.Push(position);
+            }
+        }
+    }
+
+    instanceQueues.Clear();
+
+    if (!totalInstances)
+        return;
+
+    // Grow the buffer with room for several frames' worth of changed transforms, or start a new lap when the end is reached.
+    // Either way all transforms are written again
+    bool newLap = false;
+    if (instanceVertexBuffer->NumVertices() < totalInstances)
+    {
+        size_t newSize = NextPowerOfTwo(totalInstances * 2);
+        instanceVertexBuffer->Define(USAGE_DYNAMIC, newSize, instanceVertexElements, false);
+        instanceBufferData.Resize(newSize);
+        newLap = true;
+    }
+    else if (instanceBufferPosition + newInstances > instanceVertexBuffer->NumVertices())
+        newLap = true;
+
+    if (newLap)
+    {
+        ++instanceBufferLap;
+        instanceBufferPosition = 0;
+        instanceRegions.Clear();
+    }
+
+    // Append the changed transforms contiguously and remap the instance start indices
+    size_t writeStart = instanceBufferPosition;
+
+    for (size_t i = 0; i < instanceBatches.Size(); ++i)
+    {
+        Batch& batch = *instanceBatches[i];
+        size_t position = newLap ? M_MAX_UNSIGNED : instanceBatchPositions[i];
+
+        if (position == M_MAX_UNSIGNED)
+        {
+            position = instanceBufferPosition;
+            Matrix3x4* dest = &instanceBufferData[position];
+            const Matrix3x4* src = &instanceTransforms[batch.instanceStart];
+            for (size_t j = 0; j < batch.instanceCount; ++j)
+                dest[j] = src[j];
+            instanceBufferPosition += batch.instanceCount;
+
+            InstanceRegion& region = instanceRegions[instanceKeys[i]];
+            region.start = position;
+            region.count = batch.instanceCount;
+            region.lap = instanceBufferLap;
+            region.update = instanceBufferUpdate;
+        }
+
+        batch.instanceStart = position;
+    }
+
+    if (instanceBufferPosition > writeStart)
+    {
+        instanceVertexBuffer->SetData(writeStart, instanceBufferPosition - writeStart, &instanceBufferData[writeStart],
+            newLap);
+    }
+
+    graphics->SetVertexBuffer(1, instanceVertexBuffer);
+}
+
 void Renderer::RenderBatches(const Vector<Batch>& batches, Camera* camera_, bool setPerFrameConstants, bool overrideDepthBias,
     int depthBias, float slopeScaledDepthBias)
 {
+    // The batches' world matrices would point to moved transforms if the scene layout has changed since PrepareView()
+    assert(!scene || !scene->GetTransformSystem() || scene->GetTransformSystem()->LayoutVersion() == transformLayoutVersion);
+
     if (faceSelectionTexture1->IsDataLost() || faceSelectionTexture2->IsDataLost())
         DefineFaceSelectionTextures();
 
@@ -845,23 +1624,30 @@ void Renderer::RenderBatches(const Vector<Batch>& batches, Camera* camera_, bool
 
         graphics->SetConstantBuffer(SHADER_VS, CB_FRAME, vsFrameConstantBuffer);
         graphics->SetConstantBuffer(SHADER_PS, CB_FRAME, psFrameConstantBuffer);
-    }
 
-    if (instanceTransformsDirty && instanceTransforms.Size())
-    {
-        if (instanceVertexBuffer->NumVertices() < instanceTransforms.Size())
-            instanceVertexBuffer->Define(USAGE_DYNAMIC, NextPowerOfTwo(instanceTransforms.Size()), instanceVertexElements, false);
-        instanceVertexBuffer->SetData(0, instanceTransforms.Size(), &instanceTransforms[0]);
-        graphics->SetVertexBuffer(1, instanceVertexBuffer);
-        instanceTransformsDirty = false;
+        // Set the clustered lights for the base passes when rendering from the view's camera
+        if (camera_ == camera && clusteredLights.Size())
+        {
+            if (clusterConstantsDirty)
+            {
+                UpdateClusterConstants();
+                clusterConstantsDirty = false;
+            }
+
+            graphics->SetConstantBuffer(SHADER_PS, CB_CLUSTER_LIGHTS, psClusterLightConstantBuffer);
+            graphics->SetConstantBuffer(SHADER_PS, CB_CLUSTER_RANGES, psClusterRangeConstantBuffer);
+            graphics->SetConstantBuffer(SHADER_PS, CB_CLUSTER_INDICES, psClusterIndexConstantBuffer);
+        }
     }
-    
+
+    UpdateInstanceBuffer();
+
     {
         Pass* lastPass = nullptr;
         Material* lastMaterial = nullptr;
         LightPass* lastLights = nullptr;
 
-        for (auto it = batches.Begin(); it != batches.End();)
+        for (auto it = batches.Begin(); it != batches.End(); ++it)
         {
             const Batch& batch = *it;
             bool instanced = batch.type == GEOM_INSTANCED;
@@ -875,8 +1661,12 @@ void Renderer::RenderBatches(const Vector<Batch>& batches, Camera* camera_, bool
             {
                 // Get the shader variations
                 LightPass* lights = batch.lights;
+                unsigned psBits = lights ? lights->psBits : 0;
+                // The base pass, which includes the ambient light, also adds the clustered lights
+                if ((psBits & LPS_AMBIENT) && clusteredLights.Size() && camera_ == camera)
+                    psBits |= LPS_CLUSTERED;
                 ShaderVariation* vs = FindShaderVariation(SHADER_VS, pass, (unsigned short)batch.type | (lights ? lights->vsBits : 0));
-                ShaderVariation* ps = FindShaderVariation(SHADER_PS, pass, lights ? lights->psBits : 0);
+                ShaderVariation* ps = FindShaderVariation(SHADER_PS, pass, psBits);
                 graphics->SetShaders(vs, ps);
 
                 Geometry* geometry = batch.geometry;
@@ -954,9 +1744,6 @@ void Renderer::RenderBatches(const Vector<Batch>& batches, Camera* camera_, bool
                 else
                     geometry->Draw(graphics);
             }
-
-            // Advance. If instanced, skip over the batches that were converted
-            it += instanced ? batch.instanceCount : 1;
         }
     }
 
@@ -983,11 +1770,11 @@ void Renderer::LoadPassShaders(Pass* pass)
     pass->shadersLoaded = true;
 }
 
-ShaderVariation* Renderer::FindShaderVariation(ShaderStage stage, Pass* pass, unsigned short bits)
+ShaderVariation* Renderer::FindShaderVariation(ShaderStage stage, Pass* pass, unsigned bits)
 {
     /// \todo Evaluate whether the hash lookup is worth the memory save vs using just straightforward vectors
-    HashMap<unsigned short, WeakPtr<ShaderVariation> >& variations = pass->shaderVariations[stage];
-    HashMap<unsigned short, WeakPtr<ShaderVariation> >::Iterator it = variations.Find(bits);
+    HashMap<unsigned, WeakPtr<ShaderVariation> >& variations = pass->shaderVariations[stage];
+    HashMap<unsigned, WeakPtr<ShaderVariation> >::Iterator it = variations.Find(bits);
 
     if (it != variations.End())
         return it->second.Get();
@@ -1017,6 +1804,8 @@ ShaderVariation* Renderer::FindShaderVariation(ShaderStage stage, Pass* pass, un
                 if (lightBits & 4)
                     psString += " " + lightDefines[5] + String((int)i);
             }
+            if (bits & LPS_CLUSTERED)
+                psString += " " + lightDefines[6];
 
             it = variations.Insert(MakePair(bits, WeakPtr<ShaderVariation>(pass->shaders[stage]->CreateVariation(psString.Trimmed()))));
             return it->second.Get();
@@ -1034,6 +1823,7 @@ void RegisterRendererLibrary()
     // Scene node base attributes are needed
     RegisterSceneLibrary();
     Octree::RegisterObject();
+    AABBTree::RegisterObject();
     Camera::RegisterObject();
     OctreeNode::RegisterObject();
     GeometryNode::RegisterObject();
@@ -7,14 +7,19 @@
 #include "../Math/Color.h"
 #include "../Math/Frustum.h"
 #include "../Resource/Image.h"
+#include "../Thread/WorkQueue.h"
 #include "Batch.h"
+#include "LightClusters.h"
+#include "OcclusionBuffer.h"
 
 namespace Turso3D
 {
 
 class ConstantBuffer;
 class GeometryNode;
+class AABBTree;
 class Octree;
+class Renderer;
 class Scene;
 class VertexBuffer;
 
@@ -24,7 +29,10 @@ enum RendererConstantBuffer
     CB_FRAME = 0,
     CB_OBJECT,
     CB_MATERIAL,
-    CB_LIGHTS
+    CB_LIGHTS,
+    CB_CLUSTER_LIGHTS,
+    CB_CLUSTER_RANGES,
+    CB_CLUSTER_INDICES
 };
 
 /// Parameter indices in constant buffers used by high-level rendering.
@@ -43,6 +51,20 @@ static const size_t PS_LIGHT_SHADOW_PARAMETERS = 4;
 static const size_t PS_LIGHT_DIR_SHADOW_SPLITS = 5;
 static const size_t PS_LIGHT_DIR_SHADOW_FADE = 6;
 static const size_t PS_LIGHT_POINT_SHADOW_PARAMETERS = 7;
+static const size_t PS_CLUSTER_VIEW_ROWS = 0;
+static const size_t PS_CLUSTER_SIZE_PARAMETERS = 1;
+static const size_t PS_CLUSTER_DEPTH_PARAMETERS = 2;
+static const size_t PS_CLUSTER_LIGHT_POSITIONS = 3;
+static const size_t PS_CLUSTER_LIGHT_DIRECTIONS = 4;
+static const size_t PS_CLUSTER_LIGHT_ATTENUATIONS = 5;
+static const size_t PS_CLUSTER_LIGHT_COLORS = 6;
+static const size_t PS_CLUSTER_RANGES = 0;
+static const size_t PS_CLUSTER_LIGHT_INDICES = 0;
+
+/// Maximum number of lights lit through the clusters per view. The shaders use 8-bit light indices, so this can be at most 256.
+static const size_t MAX_CLUSTER_LIGHTS = 128;
+/// Maximum number of cluster light indices per view. Four 8-bit indices are packed into each unsigned int of the shader constants.
+static const size_t MAX_CLUSTER_LIGHT_INDICES = 16384;
 
 /// Texture coordinate index for the instance world matrix.
 static const size_t INSTANCE_TEXCOORD = 4;
@@ -71,6 +93,97 @@ struct TURSO3D_API PassDesc
     bool lit;
 };
 
+/// Region of an instance group's transforms in the instance vertex buffer, kept across frames to skip re-uploading unchanged transforms.
+struct TURSO3D_API InstanceRegion
+{
+    /// First vertex in the instance vertex buffer.
+    size_t start;
+    /// Number of instances.
+    size_t count;
+    /// Instance vertex buffer lap the region was written on. The region is valid only during the same lap.
+    unsigned lap;
+    /// Instance buffer update the region was last used on. Prevents two groups with the same key from sharing the region.
+    unsigned update;
+};
+
+/// Node range of an octant or AABB tree leaf in view. Used to divide view culling into tasks.
+struct TURSO3D_API OctantNodeRange
+{
+    /// Culling data of the octant or AABB tree.
+    const NodeCullingData* data;
+    /// Index of the first node.
+    size_t start;
+    /// One past the index of the last node.
+    size_t end;
+    /// Whether the nodes are known to be inside the view, so that they do not need to be frustum tested.
+    bool inside;
+};
+
+/// %Task for culling and preparing nodes from a sequence of octant node ranges in a worker thread.
+class TURSO3D_API CollectObjectsTask : public MemberFunctionTask<Renderer>
+{
+public:
+    /// Construct.
+    CollectObjectsTask(Renderer* renderer, WorkFunctionPtr function) :
+        MemberFunctionTask<Renderer>(renderer, function)
+    {
+    }
+
+    /// Geometries found by this task.
+    Vector<GeometryNode*> geometries;
+    /// Lights found by this task.
+    Vector<Light*> lights;
+};
+
+/// %Task for querying the geometries lit by a point or spot light in a worker thread, and later finding the shadow casters of all the light's shadow views at once. Also holds the light's shadow map allocation.
+class TURSO3D_API CollectLitGeometriesTask : public MemberFunctionTask<Renderer>
+{
+public:
+    /// Construct.
+    CollectLitGeometriesTask(Renderer* renderer, WorkFunctionPtr function) :
+        MemberFunctionTask<Renderer>(renderer, function),
+        light(nullptr),
+        shadowMapIndex(0),
+        firstShadowView(0),
+        lastShadowView(0)
+    {
+    }
+
+    /// %Light to query.
+    Light* light;
+    /// Geometries inside the light's volume, including those outside the main view.
+    Vector<GeometryNode*> litGeometries;
+    /// Octree or AABB tree query result, from which the lit geometries are converted.
+    Vector<OctreeNode*> queryResult;
+    /// Index of the shadow map the light was allocated into.
+    size_t shadowMapIndex;
+    /// First shadow view of the light.
+    size_t firstShadowView;
+    /// One past the last shadow view of the light. Equal to the first if the light is unshadowed.
+    size_t lastShadowView;
+    /// World space frusta of the light's shadow views.
+    Vector<Frustum> shadowFrusta;
+    /// Shadow casters with a bitmask of the shadow views they are in. Used by directional lights.
+    Vector<Pair<OctreeNode*, unsigned> > shadowCasterMasks;
+};
+
+/// %Task for collecting and sorting the shadow caster batches of a shadow view in a worker thread.
+class TURSO3D_API CollectShadowCastersTask : public MemberFunctionTask<Renderer>
+{
+public:
+    /// Construct.
+    CollectShadowCastersTask(Renderer* renderer, WorkFunctionPtr function) :
+        MemberFunctionTask<Renderer>(renderer, function),
+        view(nullptr)
+    {
+    }
+
+    /// Shadow view to process.
+    ShadowView* view;
+    /// Shadow casters of the view, found by the light's task.
+    Vector<GeometryNode*> shadowCasters;
+};
+
 /// High-level rendering subsystem. Performs rendering of 3D scenes.
 class TURSO3D_API Renderer : public Object
 {
@@ -84,13 +197,17 @@ public:
 
     /// Set number, size and format of shadow maps. These will be divided among the lights that need to render shadow maps.
     void SetupShadowMaps(size_t num, int size, ImageFormat format);
+    /// Set whether to light the nearest unshadowed point and spot lights through view space clusters instead of per-node light lists. The clustered lights are assigned to the clusters in CollectLightInteractions() and added in the base pass of each lit geometry, so they need no additive passes. Up to MAX_CLUSTER_LIGHTS lights are clustered per view; the rest and shadowed lights use the light lists as before. Disabled by default.
+    void SetClusteredLighting(bool enable);
+    /// Set whether to cull geometries and lights hidden behind occluder geometries in CollectObjects(). The occluders are rasterized into a software occlusion buffer of the specified width, whose height follows the camera's aspect ratio.
+    void SetOcclusionCulling(bool enable, int bufferWidth = DEFAULT_OCCLUSION_BUFFER_WIDTH, size_t maxTriangles = DEFAULT_MAX_OCCLUDER_TRIANGLES);
     /// Prepare a view for rendering. Convenience function that calls CollectObjects(), CollectLightInteractions() and CollectBatches() in one go. Return true on success.
     bool PrepareView(Scene* scene, Camera* camera, const Vector<PassDesc>& passes);
-    /// Initialize rendering of a new view and collect visible objects from the camera's point of view. Return true on success (scene, camera and octree are non-null.)
+    /// Initialize rendering of a new view and collect visible objects from the camera's point of view. If the WorkQueue subsystem exists and has worker threads, the culling is divided between them. Return true on success (scene, camera and octree are non-null.)
     bool CollectObjects(Scene* scene, Camera* camera);
-    /// Collect light interactions with geometries from the current view. If lights are shadowed, collects batches for shadow casters.
+    /// Collect light interactions with geometries from the current view. If lights are shadowed, collects batches for shadow casters. If the WorkQueue subsystem exists and has worker threads, the lit geometry queries, the directional light shadow caster queries and the shadow batch collection are divided between them. Light lists and shadow maps are assigned in light order in the main thread, so that the result is the same as without worker threads.
     void CollectLightInteractions();
-    /// Collect and sort batches from the visible objects. To not go through the objects several times, all the passes should be specified at once instead of multiple calls to CollectBatches().
+    /// Collect and sort batches from the visible objects. To not go through the objects several times, all the passes should be specified at once instead of multiple calls to CollectBatches(). The batches of each node are cached and reused on later frames until the node's geometries, materials or light passes change.
     void CollectBatches(const Vector<PassDesc>& passes);
     /// Collect and sort batches from the visible objects. Convenience function for one pass only.
     void CollectBatches(const PassDesc& pass);
@@ -101,6 +218,25 @@ public:
     /// Render a pass to the currently set rendertarget and viewport. Convenience function for one pass only.
     void RenderBatches(const String& pass);
 
+    /// Return whether clustered lighting is enabled.
+    bool ClusteredLighting() const { return clusteredLighting; }
+    /// Return whether occlusion culling is enabled.
+    bool OcclusionCulling() const { return occlusionCulling; }
+    /// Return the occlusion buffer of the current view. Valid after CollectObjects() if occlusion culling is enabled and there were occluders in view.
+    const OcclusionBuffer& GetOcclusionBuffer() const { return occlusionBuffer; }
+    /// Return the visible lights of the current view, sorted by distance after CollectLightInteractions(). After CollectLightInteractions(), does not include the clustered lights.
+    const Vector<Light*>& Lights() const { return lights; }
+    /// Return the lights of the current view lit through the clusters, sorted by distance. The cluster light indices refer to these. Valid after CollectLightInteractions().
+    const Vector<Light*>& ClusteredLights() const { return clusteredLights; }
+    /// Return the light clusters of the current view. Valid after CollectLightInteractions() if there are clustered lights.
+    const LightClusters& GetLightClusters() const { return lightClusters; }
+    /// Return the visible geometries of the current view.
+    const Vector<GeometryNode*>& Geometries() const { return geometries; }
+    /// Return the batch queue of a pass, or null if the pass has not been collected. Valid after CollectBatches().
+    const BatchQueue* GetBatchQueue(const String& pass) const;
+    /// Return the instance transforms of the current view. Valid after CollectBatches().
+    const Vector<Matrix3x4>& InstanceTransforms() const { return instanceTransforms; }
+
     /// Per-frame vertex shader constant buffer.
     SharedPtr<ConstantBuffer> vsFrameConstantBuffer;
     /// Per-frame pixel shader constant buffer.
@@ -111,24 +247,66 @@ public:
     SharedPtr<ConstantBuffer> vsLightConstantBuffer;
     /// Lights pixel shader constant buffer.
     SharedPtr<ConstantBuffer> psLightConstantBuffer;
+    /// Clustered lights pixel shader constant buffer.
+    SharedPtr<ConstantBuffer> psClusterLightConstantBuffer;
+    /// Cluster light index ranges pixel shader constant buffer.
+    SharedPtr<ConstantBuffer> psClusterRangeConstantBuffer;
+    /// Cluster light indices pixel shader constant buffer.
+    SharedPtr<ConstantBuffer> psClusterIndexConstantBuffer;
 
 private:
     /// Initialize. Needs the Graphics subsystem and rendering context to exist.
     void Initialize();
     /// (Re)define face selection textures.
     void DefineFaceSelectionTextures();
-    /// Octree callback for collecting lights and geometries.
-    void CollectGeometriesAndLights(Vector<OctreeNode*>::ConstIterator begin, Vector<OctreeNode*>::ConstIterator end, bool inside);
+    /// Rasterize the occluders in view into the occlusion buffer. Return true if any occluder triangles were drawn.
+    bool DrawOccluders(WorkQueue* workQueue);
+    /// Query the octree or the AABB tree, whichever the scene has, for nodes using a volume.
+    template <class T> void FindNodes(Vector<OctreeNode*>& result, const T& volume, unsigned short nodeFlags, unsigned layerMask) const;
+    /// Query the octree or the AABB tree for the node ranges in view, using the occlusion buffer if in use. Invoke a member function for each.
+    void FindNodeRanges(void (Renderer::*callback)(const NodeCullingData*, size_t, size_t, bool));
+    /// Octree or AABB tree callback for collecting lights and geometries.
+    void CollectGeometriesAndLights(const NodeCullingData* data, size_t start, size_t end, bool inside);
+    /// Collect lights and geometries from a node range into the specified result vectors. Tests the culling data and accesses only the nodes in view.
+    void CollectGeometriesAndLights(const NodeCullingData* data, size_t start, size_t end, bool inside, Vector<GeometryNode*>& geometryResult, Vector<Light*>& lightResult);
+    /// Octree or AABB tree callback for collecting the node ranges in view for threaded culling.
+    void CollectOctantNodeRanges(const NodeCullingData* data, size_t start, size_t end, bool inside);
+    /// Divide the octant node ranges in view into tasks, cull and prepare the nodes using worker threads, then merge the results in task order.
+    void CollectGeometriesAndLightsThreaded(WorkQueue* workQueue);
+    /// Work function for threaded culling.
+    void CollectObjectsWork(Task* task, unsigned threadIndex);
+    /// Move the nearest unshadowed point and spot lights from the light vector to the clustered lights and assign them to the clusters. If the cluster light indices would not fit in the shader constants, return the farthest clustered lights to the light vector until they do.
+    void AssignClusteredLights(WorkQueue* workQueue);
+    /// Write the clustered lights and the cluster light indices to the cluster constant buffers.
+    void UpdateClusterConstants();
+    /// Rebuild a node's cached batches for the current batch queues.
+    void BuildBatchCache(GeometryNode* node, BatchCache* cache, const Vector<BatchQueue*>& queues, unsigned queueSetup);
     /// Assign a light list to a node. Creates new light lists as necessary to handle multiple lights.
     void AddLightToNode(GeometryNode* node, Light* light, LightList* lightList);
-    /// Collect shadow caster batches.
-    void CollectShadowBatches(const Vector<GeometryNode*>& nodes, BatchQueue& batchQueue, const Frustum& frustum, bool checkShadowCaster, bool checkFrustum);
+    /// Assign a light to the geometries it lights on this frame and allocate its shadow map. Return true if the light has shadow views, in which case the task is set up to find their shadow casters.
+    bool AssignLight(CollectLitGeometriesTask* task);
+    /// Prepare the shadow casters of a light that were outside the main view for rendering.
+    void PrepareShadowCasters(CollectLitGeometriesTask* task);
+    /// Work function for querying the lit geometries of a light.
+    void CollectLitGeometriesWork(Task* task, unsigned threadIndex);
+    /// Work function for finding the shadow casters of all shadow views of a light.
+    void CollectShadowCastersWork(Task* task, unsigned threadIndex);
+    /// Work function for collecting and sorting the shadow caster batches of a shadow view.
+    void CollectShadowBatchesWork(Task* task, unsigned threadIndex);
+    /// Collect shadow casters from nodes into the shadow views in the view mask, starting from the first view. Optionally test the nodes against the views' frusta.
+    void CollectShadowCasters(const Vector<GeometryNode*>& nodes, size_t firstView, unsigned viewMask, const Frustum* frusta, bool checkFrusta);
+    /// Collect shadow caster batches. The shadow casters must have been prepared for rendering on this frame.
+    void CollectShadowBatches(const Vector<GeometryNode*>& nodes, BatchQueue& batchQueue);
+    /// Queue a batch queue's instanced batches for the next instance vertex buffer update after it has built instances.
+    void AddInstanceQueue(BatchQueue* batchQueue);
+    /// Write the transforms of the queued instanced batches into the instance vertex buffer if necessary and remap the batches' instance start indices to the buffer. Unchanged instance groups reuse their previous transforms in the buffer.
+    void UpdateInstanceBuffer();
     /// Render batches from a specific queue and camera.
     void RenderBatches(const Vector<Batch>& batches, Camera* camera, bool setPerFrameContants = true, bool overrideDepthBias = false, int depthBias = 0, float slopeScaledDepthBias = 0.0f);
     /// Load shaders for a pass.
     void LoadPassShaders(Pass* pass);
     /// Return or create a shader variation for a pass. Vertex shader variations handle different geometry types and pixel shader variations handle different light combinations.
-    ShaderVariation* FindShaderVariation(ShaderStage stage, Pass* pass, unsigned short bits);
+    ShaderVariation* FindShaderVariation(ShaderStage stage, Pass* pass, unsigned bits);
     
     /// Graphics subsystem pointer.
     WeakPtr<Graphics> graphics;
@@ -138,6 +316,8 @@ private:
     Camera* camera;
     /// Current octree.
     Octree* octree;
+    /// Current AABB tree, if the scene has no octree.
+    AABBTree* aabbTree;
     /// Camera's view frustum.
     Frustum frustum;
     /// Camera's view mask.
@@ -146,12 +326,40 @@ private:
     Vector<GeometryNode*> geometries;
     /// Lights in frustum.
     Vector<Light*> lights;
+    /// Octant node ranges in frustum for threaded culling.
+    Vector<OctantNodeRange> octantNodeRanges;
+    /// Threaded culling tasks.
+    Vector<AutoPtr<CollectObjectsTask> > collectObjectsTasks;
     /// Batch queues per pass.
     HashMap<unsigned char, BatchQueue> batchQueues;
-    /// Instance transforms for uploading to the instance vertex buffer.
+    /// Batch queue setups seen so far, for identifying the setup the node batch caches were built for.
+    Vector<Vector<unsigned> > batchQueueSetups;
+    /// Batch queue setup of the current frame.
+    Vector<unsigned> currentSetup;
+    /// Instance transforms built on the current frame.
     Vector<Matrix3x4> instanceTransforms;
-    /// Lit geometries query result.
-    Vector<GeometryNode*> litGeometries;
+    /// Batch queues with instanced batches waiting for the instance vertex buffer update.
+    Vector<BatchQueue*> instanceQueues;
+    /// Instanced batches of the current instance vertex buffer update.
+    Vector<Batch*> instanceBatches;
+    /// Instance group keys of the current instance vertex buffer update.
+    Vector<InstanceKey> instanceKeys;
+    /// Instance vertex buffer positions of the current update's instanced batches, or M_MAX_UNSIGNED if the transforms need to be written.
+    Vector<size_t> instanceBatchPositions;
+    /// Instance group regions in the instance vertex buffer.
+    HashMap<InstanceKey, InstanceRegion> instanceRegions;
+    /// CPU-side copy of the instance vertex buffer for detecting unchanged instance groups.
+    Vector<Matrix3x4> instanceBufferData;
+    /// Instance vertex buffer write position. The buffer is written as a ring: new transforms are appended after the data still in use, and the buffer is discarded when it is full.
+    size_t instanceBufferPosition;
+    /// Instance vertex buffer lap, incremented when the buffer is discarded.
+    unsigned instanceBufferLap;
+    /// Instance vertex buffer update counter.
+    unsigned instanceBufferUpdate;
+    /// Lit geometries query tasks, one per light.
+    Vector<AutoPtr<CollectLitGeometriesTask> > litGeometriesTasks;
+    /// Shadow caster tasks, one per shadow view.
+    Vector<AutoPtr<CollectShadowCastersTask> > shadowCastersTasks;
     /// %Light lists.
     HashMap<unsigned long long, LightList> lightLists;
     /// %Light passes.
@@ -160,6 +368,8 @@ private:
     LightPass ambientLightPass;
     /// Current frame number.
     unsigned frameNumber;
+    /// Transform system layout version when the objects were collected. The batches point to the world transforms, so the scene's spatial nodes must not be added, removed or reparented before the batches are rendered.
+    unsigned transformLayoutVersion;
     /// Instance vertex buffer dirty flag.
     bool instanceTransformsDirty;
     /// Shadow maps.
@@ -168,6 +378,30 @@ private:
     Vector<AutoPtr<ShadowView> > shadowViews;
     /// Used shadow views so far.
     size_t usedShadowViews;
+    /// Lights lit through the clusters.
+    Vector<Light*> clusteredLights;
+    /// View space light clusters.
+    LightClusters lightClusters;
+    /// Cluster light index ranges packed for the shader constants.
+    Vector<unsigned> clusterRangeData;
+    /// Cluster light indices packed for the shader constants.
+    Vector<unsigned> clusterIndexData;
+    /// Clustered lighting flag.
+    bool clusteredLighting;
+    /// Whether the cluster constant buffers need to be updated before rendering.
+    bool clusterConstantsDirty;
+    /// Occluders in frustum.
+    Vector<OctreeNode*> occluders;
+    /// Occluders sorted by distance.
+    Vector<Pair<float, GeometryNode*> > sortedOccluders;
+    /// Software occlusion buffer.
+    OcclusionBuffer occlusionBuffer;
+    /// Occlusion buffer width.
+    int occlusionBufferWidth;
+    /// Occlusion culling flag.
+    bool occlusionCulling;
+    /// Whether the occlusion buffer is used for culling the current view.
+    bool useOcclusion;
     /// Instance transform vertex buffer.
     AutoPtr<VertexBuffer> instanceVertexBuffer;
     /// Vertex elements for the instance vertex buffer.
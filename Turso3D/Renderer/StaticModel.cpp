@@ -4,6 +4,7 @@
 
 #include "../Debug/Log.h"
 #include "../Resource/ResourceCache.h"
+#include "../Thread/Mutex.h"
 #include "Camera.h"
 #include "Material.h"
 #include "Model.h"
@@ -16,6 +17,9 @@ namespace Turso3D
 
 static Vector3 DOT_SCALE(1 / 3.0f, 1 / 3.0f, 1 / 3.0f);
 
+// Mutex for changing LOD geometries, as OnPrepareRender may be called from several worker threads and the reference counts of shared geometries are not thread-safe.
+static Mutex lodMutex;
+
 StaticModel::StaticModel() :
     lodBias(1.0f),
     hasLodLevels(false)
@@ -34,6 +38,7 @@ void StaticModel::RegisterObject()
     CopyBaseAttributes<StaticModel, OctreeNode>();
     RegisterMixedRefAttribute("model", &StaticModel::ModelAttr, &StaticModel::SetModelAttr, ResourceRef(Model::TypeStatic()));
     CopyBaseAttribute<StaticModel, GeometryNode>("materials");
+    CopyBaseAttribute<StaticModel, GeometryNode>("occluder");
     RegisterAttribute("lodBias", &StaticModel::LodBias, &StaticModel::SetLodBias, 1.0f);
 }
 
@@ -59,7 +64,13 @@ void StaticModel::OnPrepareRender(unsigned frameNumber, Camera* camera)
                     if (lodDistance <= lodGeometries[j]->lodDistance)
                         break;
                 }
-                batches[i].geometry = lodGeometries[j - 1];
+                Geometry* lodGeometry = lodGeometries[j - 1];
+                if (batches[i].geometry != lodGeometry)
+                {
+                    MutexLock lock(lodMutex);
+                    batches[i].geometry = lodGeometry;
+                    SetFlag(NF_BATCHES_DIRTY, true);
+                }
             }
         }
     }
@@ -25,6 +25,10 @@ bool Resource::Save(Stream&)
     return false;
 }
 
+void Resource::Dependencies(Vector<ResourceRef>&) const
+{
+}
+
 bool Resource::Load(Stream& source)
 {
     bool success = BeginLoad(source);
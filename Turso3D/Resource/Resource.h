@@ -22,6 +22,8 @@ public:
     virtual bool EndLoad();
     /// Save the resource to a stream. Return true on success.
     virtual bool Save(Stream& dest);
+    /// Return the resources that EndLoad() will load from the resource cache, so that they can be loaded beforehand. Valid between BeginLoad() and EndLoad().
+    virtual void Dependencies(Vector<ResourceRef>& dest) const;
 
     /// Load the resource synchronously from a binary stream. Return true on success.
     bool Load(Stream& source);
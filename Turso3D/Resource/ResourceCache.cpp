@@ -276,6 +276,13 @@ Resource* ResourceCache::LoadResource(StringHash type, const String& nameIn)
     return newResource;
 }
 
+Resource* ResourceCache::FindResource(StringHash type, const String& nameIn) const
+{
+    String name = SanitateResourceName(nameIn);
+    auto it = resources.Find(MakePair(type, StringHash(name)));
+    return it != resources.End() ? it->second.Get() : nullptr;
+}
+
 void ResourceCache::ResourcesByType(Vector<Resource*>& result, StringHash type) const
 {
     result.Clear();
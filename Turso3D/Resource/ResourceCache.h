@@ -50,6 +50,8 @@ public:
     /// Load and return a resource, template version.
     template <class T> T* LoadResource(const char* name) { return static_cast<T*>(LoadResource(T::TypeStatic(), name)); }
 
+    /// Return an already loaded resource, or null if not loaded.
+    Resource* FindResource(StringHash type, const String& name) const;
     /// Return resources by type.
     void ResourcesByType(Vector<Resource*>& result, StringHash type) const;
     /// Return resource directories.
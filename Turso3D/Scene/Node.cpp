@@ -43,7 +43,13 @@ void Node::RegisterObject()
 
 void Node::Load(Stream& source, ObjectResolver& resolver)
 {
-    // Type and id has been read by the parent
+    // Type and id has been read by the parent. If the scene is loading this data from memory, use its load plans
+    if (scene && scene->IsLoadingFrom(source))
+    {
+        scene->LoadNode(this, resolver);
+        return;
+    }
+
     Serializable::Load(source, resolver);
 
     size_t numChildren = source.ReadVLE();
@@ -145,8 +151,11 @@ void Node::SetName(const char* newName)
 
 void Node::SetLayer(unsigned char newLayer)
 {
-    if (layer < 32)
+    if (newLayer < 32)
+    {
         layer = newLayer;
+        OnSetLayer(layer);
+    }
     else
         LOGERROR("Can not set layer 32 or higher");
 }
@@ -159,7 +168,7 @@ void Node::SetLayerName(const String& newLayerName)
     const HashMap<String, unsigned char>& layers = scene->Layers();
     auto it = layers.Find(newLayerName);
     if (it != layers.End())
-        layer = it->second;
+        SetLayer(it->second);
     else
         LOGERROR("Layer " + newLayerName + " not defined in the scene");
 }
@@ -267,6 +276,13 @@ void Node::AddChild(Node* child)
         current = current->parent;
     }
 
+    // Check for scene capacity before reparenting, so that a failed add leaves the child where it was
+    if (scene && !scene->HasRoomFor(child))
+    {
+        LOGERROR("Can not add child node, scene already has the maximum number of nodes");
+        return;
+    }
+
     Node* oldParent = child->parent;
     if (oldParent)
         oldParent->children.Remove(child);
@@ -584,4 +600,8 @@ void Node::OnSetEnabled(bool)
 {
 }
 
+void Node::OnSetLayer(unsigned char)
+{
+}
+
 }
@@ -20,6 +20,9 @@ static const unsigned short NF_OCTREE_UPDATE_QUEUED = 0x40;
 static const unsigned short NF_GEOMETRY = 0x80;
 static const unsigned short NF_LIGHT = 0x100;
 static const unsigned short NF_CASTSHADOWS = 0x200;
+static const unsigned short NF_BATCHES_DIRTY = 0x400;
+static const unsigned short NF_OCCLUDER = 0x800;
+static const unsigned short NF_TRANSFORM_LISTENER = 0x1000;
 static const unsigned char LAYER_DEFAULT = 0x0;
 static const unsigned char TAG_NONE = 0x0;
 static const unsigned LAYERMASK_ALL = 0xffffffff;
@@ -182,6 +185,8 @@ protected:
     virtual void OnSceneSet(Scene* newScene, Scene* oldScene);
     /// Handle the enabled status changing.
     virtual void OnSetEnabled(bool newEnabled);
+    /// Handle the layer changing.
+    virtual void OnSetLayer(unsigned char newLayer);
 
 private:
     /// Parent node.
@@ -2,19 +2,52 @@
 
 #include "../Debug/Log.h"
 #include "../Debug/Profiler.h"
-#include "../IO/Stream.h"
+#include "../IO/MemoryBuffer.h"
+#include "../IO/VectorBuffer.h"
 #include "../Object/ObjectResolver.h"
 #include "../Resource/JSONFile.h"
 #include "Scene.h"
+#include "SceneStreamer.h"
 #include "SpatialNode.h"
+#include "TransformSystem.h"
 
 #include "../Debug/DebugNew.h"
 
 namespace Turso3D
 {
 
+/// Free slot index that marks the end of the free list.
+static const unsigned NO_FREE_NODE_SLOT = 0xffffffff;
+
+NodeLoadPlan::NodeLoadPlan() :
+    factory(nullptr)
+{
+}
+
+NodeLoadPlan::NodeLoadPlan(StringHash type) :
+    factory(Object::Factory(type)),
+    attributes(Serializable::ClassAttributes(type))
+{
+    // Check the type once by creating one object, so that the nodes can be created without a dynamic cast
+    if (!factory)
+        LOGERROR("Could not create child node of unknown type " + type.ToString());
+    else
+    {
+        SharedPtr<Object> object(factory->Create());
+        if (!dynamic_cast<Node*>(object.Get()))
+        {
+            LOGERROR(factory->TypeName() + " is not a Node subclass, could not add as a child");
+            factory = nullptr;
+        }
+    }
+}
+
 Scene::Scene() :
-    nextNodeId(1)
+    firstFreeSlot(NO_FREE_NODE_SLOT),
+    lastFreeSlot(NO_FREE_NODE_SLOT),
+    numNodes(0),
+    transformSystem(nullptr),
+    loadBuffer(nullptr)
 {
     // Register self to allow finding by ID
     AddNode(this);
@@ -29,7 +62,7 @@ Scene::~Scene()
     // so must tear down the scene tree already here
     RemoveAllChildren();
     RemoveNode(this);
-    assert(nodes.IsEmpty());
+    assert(!numNodes);
 }
 
 void Scene::RegisterObject()
@@ -75,7 +108,8 @@ bool Scene::Load(Stream& source)
 
     ObjectResolver resolver;
     resolver.StoreObject(ownId, this);
-    Node::Load(source, resolver);
+    loadPlans.Clear();
+    LoadNode(this, source, resolver);
     resolver.Resolve();
 
     return true;
@@ -133,13 +167,16 @@ Node* Scene::Instantiate(Stream& source)
     StringHash childType(source.Read<StringHash>());
     unsigned childId = source.Read<unsigned>();
 
-    Node* child = CreateChild(childType);
-    if (child)
-    {
-        resolver.StoreObject(childId, child);
-        child->Load(source, resolver);
-        resolver.Resolve();
-    }
+    loadPlans.Clear();
+    const NodeLoadPlan& plan = FindLoadPlan(childType);
+    if (!plan.factory)
+        return nullptr;
+
+    Node* child = static_cast<Node*>(plan.factory->Create());
+    AddChild(child);
+    resolver.StoreObject(childId, child);
+    LoadNode(child, source, resolver);
+    resolver.Resolve();
 
     return child;
 }
@@ -195,13 +232,12 @@ void Scene::DefineTag(unsigned char index, const String& name)
 void Scene::Clear()
 {
     RemoveAllChildren();
-    nextNodeId = 1;
 }
 
-Node* Scene::FindNode(unsigned id) const
+void Scene::UpdateTransforms()
 {
-    auto it = nodes.Find(id);
-    return it != nodes.End() ? it->second : nullptr;
+    if (transformSystem)
+        transformSystem->Update();
 }
 
 void Scene::AddNode(Node* node)
@@ -209,32 +245,14 @@ void Scene::AddNode(Node* node)
     if (!node || node->ParentScene() == this)
         return;
 
-    while (nodes.Contains(nextNodeId))
-    {
-        ++nextNodeId;
-        if (!nextNodeId)
-            ++nextNodeId;
-    }
-
-    Scene* oldScene = node->ParentScene();
-    if (oldScene)
+    // Check the whole hierarchy up front, so that a full scene does not leave part of it added
+    if (!HasRoomFor(node))
     {
-        unsigned oldId = node->Id();
-        oldScene->nodes.Erase(oldId);
+        LOGERROR("Can not add node, scene already has the maximum number of nodes");
+        return;
     }
-    nodes[nextNodeId] = node;
-    node->SetScene(this);
-    node->SetId(nextNodeId);
 
-    ++nextNodeId;
-
-    // If node has children, add them to the scene as well
-    if (node->NumChildren())
-    {
-        const Vector<SharedPtr<Node> >& children = node->Children();
-        for (auto it = children.Begin(); it != children.End(); ++it)
-            AddNode(*it);
-    }
+    AddNodeHierarchy(node);
 }
 
 void Scene::RemoveNode(Node* node)
@@ -242,7 +260,7 @@ void Scene::RemoveNode(Node* node)
     if (!node || node->ParentScene() != this)
         return;
 
-    nodes.Erase(node->Id());
+    FreeNodeSlot(node->Id());
     node->SetScene(nullptr);
     node->SetId(0);
     
@@ -255,6 +273,184 @@ void Scene::RemoveNode(Node* node)
     }
 }
 
+void Scene::SetTransformSystem(TransformSystem* system)
+{
+    transformSystem = system;
+}
+
+const NodeLoadPlan& Scene::FindLoadPlan(StringHash type)
+{
+    auto it = loadPlans.Find(type);
+    if (it == loadPlans.End())
+        it = loadPlans.Insert(MakePair(type, NodeLoadPlan(type)));
+    return it->second;
+}
+
+bool Scene::IsLoadingFrom(const Stream& source) const
+{
+    return loadBuffer && &source == loadBuffer;
+}
+
+void Scene::LoadNode(Node* node, ObjectResolver& resolver)
+{
+    MemoryBuffer& source = *loadBuffer;
+    node->LoadAttributes(source, FindLoadPlan(node->Type()).attributes, resolver);
+
+    size_t numChildren = source.ReadVLE();
+    for (size_t i = 0; i < numChildren; ++i)
+    {
+        StringHash childType(source.Read<StringHash>());
+        unsigned childId = source.Read<unsigned>();
+        const NodeLoadPlan& childPlan = FindLoadPlan(childType);
+        if (childPlan.factory)
+        {
+            Node* child = static_cast<Node*>(childPlan.factory->Create());
+            node->AddChild(child);
+            resolver.StoreObject(childId, child);
+            child->Load(source, resolver);
+        }
+        else
+        {
+            // If child is unknown type, skip all its attributes and children
+            SkipHierarchy(source);
+        }
+    }
+}
+
+void Scene::LoadNode(Node* node, Stream& source, ObjectResolver& resolver)
+{
+    MemoryBuffer* memorySource = dynamic_cast<MemoryBuffer*>(&source);
+    if (memorySource)
+    {
+        LoadNode(node, *memorySource, resolver);
+        return;
+    }
+
+    // Parse a vector buffer in place, otherwise read the rest of the stream in one go to avoid a virtual stream call per value
+    size_t startPosition = source.Position();
+    VectorBuffer* vectorSource = dynamic_cast<VectorBuffer*>(&source);
+    if (vectorSource)
+    {
+        MemoryBuffer buffer(vectorSource->Data(), vectorSource->Size());
+        buffer.Seek(startPosition);
+        LoadNode(node, buffer, resolver);
+        source.Seek(buffer.Position());
+        return;
+    }
+
+    Vector<unsigned char> data(source.Size() - startPosition);
+    if (data.Size())
+        data.Resize(source.Read(&data[0], data.Size()));
+    MemoryBuffer buffer(data);
+    LoadNode(node, buffer, resolver);
+    source.Seek(startPosition + buffer.Position());
+}
+
+void Scene::LoadNode(Node* node, MemoryBuffer& source, ObjectResolver& resolver)
+{
+    // Node::Load() uses the load plans when it is given the buffer being loaded
+    MemoryBuffer* oldLoadBuffer = loadBuffer;
+    loadBuffer = &source;
+    node->Load(source, resolver);
+    loadBuffer = oldLoadBuffer;
+}
+
+bool Scene::HasRoomFor(Node* node) const
+{
+    // Count the nodes that would need a new slot. Children of a node already in the scene are in it as well
+    size_t count = 0;
+    Vector<Node*> stack;
+    stack.Push(node);
+    while (stack.Size())
+    {
+        Node* current = stack.Back();
+        stack.Pop();
+        if (current->ParentScene() == this)
+            continue;
+
+        ++count;
+        const Vector<SharedPtr<Node> >& children = current->Children();
+        for (auto it = children.Begin(); it != children.End(); ++it)
+            stack.Push(*it);
+    }
+
+    return count <= MAX_SCENE_NODES - numNodes;
+}
+
+void Scene::AddNodeHierarchy(Node* node)
+{
+    if (node->ParentScene() == this)
+        return;
+
+    unsigned newId = AllocateNodeSlot(node);
+    assert(newId);
+
+    Scene* oldScene = node->ParentScene();
+    if (oldScene)
+        oldScene->FreeNodeSlot(node->Id());
+    node->SetScene(this);
+    node->SetId(newId);
+
+    // If node has children, add them to the scene as well
+    if (node->NumChildren())
+    {
+        const Vector<SharedPtr<Node> >& children = node->Children();
+        for (auto it = children.Begin(); it != children.End(); ++it)
+            AddNodeHierarchy(*it);
+    }
+}
+
+unsigned Scene::AllocateNodeSlot(Node* node)
+{
+    unsigned index;
+
+    if (firstFreeSlot != NO_FREE_NODE_SLOT)
+    {
+        index = firstFreeSlot;
+        firstFreeSlot = nodeSlots[index].nextFree;
+        if (firstFreeSlot == NO_FREE_NODE_SLOT)
+            lastFreeSlot = NO_FREE_NODE_SLOT;
+    }
+    else
+    {
+        if (nodeSlots.Size() >= MAX_SCENE_NODES)
+            return 0;
+
+        // Generations start from 1 so that a valid id is never 0
+        index = (unsigned)nodeSlots.Size();
+        NodeSlot newSlot;
+        newSlot.id = (1 << NODE_ID_INDEX_BITS) | index;
+        nodeSlots.Push(newSlot);
+    }
+
+    NodeSlot& slot = nodeSlots[index];
+    slot.node = node;
+    slot.nextFree = NO_FREE_NODE_SLOT;
+    ++numNodes;
+    return slot.id;
+}
+
+void Scene::FreeNodeSlot(unsigned id)
+{
+    unsigned index = id & NODE_ID_INDEX_MASK;
+    assert(index < nodeSlots.Size() && nodeSlots[index].id == id);
+
+    NodeSlot& slot = nodeSlots[index];
+    unsigned generation = (id >> NODE_ID_INDEX_BITS) + 1;
+    if (generation > MAX_NODE_SLOT_GENERATION)
+        generation = 1;
+    slot.node = nullptr;
+    slot.id = (generation << NODE_ID_INDEX_BITS) | index;
+    slot.nextFree = NO_FREE_NODE_SLOT;
+
+    if (lastFreeSlot != NO_FREE_NODE_SLOT)
+        nodeSlots[lastFreeSlot].nextFree = index;
+    else
+        firstFreeSlot = index;
+    lastFreeSlot = index;
+    --numNodes;
+}
+
 void Scene::SetLayerNamesAttr(JSONValue names)
 {
     layerNames.Clear();
@@ -315,6 +511,8 @@ void RegisterSceneLibrary()
     Node::RegisterObject();
     Scene::RegisterObject();
     SpatialNode::RegisterObject();
+    TransformSystem::RegisterObject();
+    SceneStreamer::RegisterObject();
 }
 
 }
@@ -7,6 +7,44 @@
 namespace Turso3D
 {
 
+class MemoryBuffer;
+class ObjectFactory;
+class TransformSystem;
+
+/// Number of low bits of a node id that hold the index of the node's slot in the scene. The high bits hold the generation of the slot, so that the id of a removed node does not find the node that reuses its slot.
+static const unsigned NODE_ID_INDEX_BITS = 22;
+/// Mask for the slot index of a node id.
+static const unsigned NODE_ID_INDEX_MASK = (1 << NODE_ID_INDEX_BITS) - 1;
+/// Maximum generation of a node slot before wrapping back to 1.
+static const unsigned MAX_NODE_SLOT_GENERATION = 0xffffffff >> NODE_ID_INDEX_BITS;
+/// Maximum number of nodes in a scene.
+static const size_t MAX_SCENE_NODES = (size_t)NODE_ID_INDEX_MASK + 1;
+
+/// %Node id slot in a scene.
+struct TURSO3D_API NodeSlot
+{
+    /// %Node, or null if the slot is free.
+    Node* node;
+    /// Id of the node in the slot, or the id the next node in the slot will get if free.
+    unsigned id;
+    /// Index of the next free slot when free.
+    unsigned nextFree;
+};
+
+/// Cached plan for loading the nodes of one type from binary data.
+struct TURSO3D_API NodeLoadPlan
+{
+    /// Construct empty.
+    NodeLoadPlan();
+    /// Construct for a node type. Log an error if the type is unknown or not a node.
+    NodeLoadPlan(StringHash type);
+
+    /// Object factory, or null if the type is unknown or not a node.
+    ObjectFactory* factory;
+    /// Attribute load plan.
+    AttributeLoadPlan attributes;
+};
+
 /// %Scene root node, which also represents the whole scene.
 class TURSO3D_API Scene : public Node
 {
@@ -24,7 +62,7 @@ public:
     /// Save scene to binary stream.
     void Save(Stream& dest) override;
     
-    /// Load scene from a binary stream. Existing nodes will be destroyed. Return true on success.
+    /// Load scene from a binary stream. Existing nodes will be destroyed. Return true on success. The node data is read into memory in one go, unless the stream is already a memory or vector buffer, and loaded with a plan built once per node type. Nodes are still loaded through their virtual Load(), so subclasses that override it keep working.
     bool Load(Stream& source);
     /// Load scene from JSON data. Existing nodes will be destroyed. Return true on success.
     bool LoadJSON(const JSONValue& source);
@@ -32,7 +70,7 @@ public:
     bool LoadJSON(Stream& source);
     /// Save scene as JSON text data to a binary stream. Return true on success.
     bool SaveJSON(Stream& dest);
-    /// Instantiate node(s) from binary stream and return the root node.
+    /// Instantiate node(s) from binary stream and return the root node. Loads from memory like Load().
     Node* Instantiate(Stream& source);
     /// Instantiate node(s) from JSON data and return the root node.
     Node* InstantiateJSON(const JSONValue& source);
@@ -44,9 +82,17 @@ public:
     void DefineTag(unsigned char index, const String& name);
     /// Destroy child nodes recursively, leaving the scene empty.
     void Clear();
+    /// Recompute the dirty world transforms if the scene has a transform system, so that culling starts with clean transforms. Should be called each frame before updating the octree.
+    void UpdateTransforms();
 
-    /// Find node by id.
-    Node* FindNode(unsigned id) const;
+    /// Find node by id. Return null if the node has been removed from the scene, even if its slot has been reused.
+    Node* FindNode(unsigned id) const { unsigned index = id & NODE_ID_INDEX_MASK; return index < nodeSlots.Size() && nodeSlots[index].id == id ? nodeSlots[index].node : nullptr; }
+    /// Return number of nodes in the scene, including the scene itself.
+    size_t NumNodes() const { return numNodes; }
+    /// Return whether the scene has free slots for a node and its children that are not yet in the scene.
+    bool HasRoomFor(Node* node) const;
+    /// Return the transform system, or null if none.
+    TransformSystem* GetTransformSystem() const { return transformSystem; }
     /// Return the layer names.
     const Vector<String>& LayerNames() const { return layerNames; }
     /// Return the layer name-to-index map.
@@ -56,10 +102,17 @@ public:
     /// Return the tag name-to-index map.
     const HashMap<String, unsigned char>& Tags() const { return tags; }
 
-    /// Add node to the scene. This assigns a scene-unique id to it. Called internally.
+    /// Add node and its children to the scene. This assigns scene-unique ids to them from free slots. Nothing is added if the scene does not have room for all of them. Called internally.
     void AddNode(Node* node);
-    /// Remove node from the scene. This removes the id mapping but does not destroy the node. Called internally.
+    /// Remove node from the scene. This frees the id slot but does not destroy the node. Called internally.
     void RemoveNode(Node* node);
+    /// Set the transform system that spatial nodes added to the scene join. Called internally.
+    void SetTransformSystem(TransformSystem* system);
+    /// Load a node's attributes and children from the memory buffer being loaded, using the cached load plans. The children are loaded through their virtual Load(). Called internally by Node::Load().
+    void LoadNode(Node* node, ObjectResolver& resolver);
+
+    /// Return whether is loading from a stream with the cached load plans.
+    bool IsLoadingFrom(const Stream& source) const;
     
     using Node::Load;
     using Node::LoadJSON;
@@ -74,11 +127,33 @@ private:
     void SetTagNamesAttr(JSONValue names);
     /// Return tag names. Used in serialization.
     JSONValue TagNamesAttr() const;
+    /// Assign ids to a node and its children. The scene must have room for them.
+    void AddNodeHierarchy(Node* node);
+    /// Assign a node to a free slot and return its id, or 0 if the scene is full.
+    unsigned AllocateNodeSlot(Node* node);
+    /// Free the slot of a node id and advance the slot's generation.
+    void FreeNodeSlot(unsigned id);
+    /// Return the load plan of a node type, building it on first use.
+    const NodeLoadPlan& FindLoadPlan(StringHash type);
+    /// Load a node from binary data in a stream, reading the stream into memory first if it is not a memory or vector buffer.
+    void LoadNode(Node* node, Stream& source, ObjectResolver& resolver);
+    /// Load a node from a memory buffer through its virtual Load(), using the cached load plans.
+    void LoadNode(Node* node, MemoryBuffer& source, ObjectResolver& resolver);
 
-    /// Map from id's to nodes.
-    HashMap<unsigned, Node*> nodes;
-    /// Next free node id.
-    unsigned nextNodeId;
+    /// Node slots indexed by the low bits of the node ids.
+    Vector<NodeSlot> nodeSlots;
+    /// First free slot to reuse. Slots are reused in the order they were freed, so that a slot's generation advances slowly.
+    unsigned firstFreeSlot;
+    /// Last free slot.
+    unsigned lastFreeSlot;
+    /// Number of nodes in the scene.
+    size_t numNodes;
+    /// Transform system.
+    TransformSystem* transformSystem;
+    /// Node load plans by type. Rebuilt on each load, as attributes may be registered in between.
+    HashMap<StringHash, NodeLoadPlan> loadPlans;
+    /// Memory buffer being loaded with the load plans, or null.
+    MemoryBuffer* loadBuffer;
     /// List of layer names by index.
     Vector<String> layerNames;
     /// Map from layer names to indices.
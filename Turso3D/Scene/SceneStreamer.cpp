@@ -0,0 +1,741 @@
+// For conditions of distribution and use, see copyright notice in License.txt
+
+#include "../Debug/Log.h"
+#include "../Debug/Profiler.h"
+#include "../IO/MemoryBuffer.h"
+#include "../Resource/JSONFile.h"
+#include "../Resource/Resource.h"
+#include "../Resource/ResourceCache.h"
+#include "SceneStreamer.h"
+
+#include "../Debug/DebugNew.h"
+
+namespace Turso3D
+{
+
+ScenePartition::ScenePartition(Stream* source_, Node* parent_, bool json_) :
+    state(PARTITION_LOADING),
+    step(STEP_PARSE),
+    source(source_),
+    json(json_),
+    parent(parent_),
+    resolver(new ObjectResolver()),
+    nextIndex(0),
+    inBackground(false),
+    unloadRequested(false)
+{
+    // Resource refs are set in the main thread after parsing
+    resolver->SetDeferResourceRefs(true);
+}
+
+ScenePartition::~ScenePartition()
+{
+}
+
+SceneStreamerThread::SceneStreamerThread(SceneStreamer* owner_) :
+    owner(owner_)
+{
+}
+
+void SceneStreamerThread::ThreadFunction()
+{
+    // The thread runs while the main thread begins and ends profiling frames, which must not happen while other threads profile
+    Profiler::SetThreadProfiling(false);
+    owner->ProcessJobs();
+}
+
+SceneStreamer::SceneStreamer() :
+    timeBudget(DEFAULT_STREAMING_BUDGET),
+    unitUSec(0),
+    lastCheckUSec(-1),
+    shouldExit(false)
+{
+    SetTemporary(true);
+}
+
+SceneStreamer::~SceneStreamer()
+{
+    if (thread)
+    {
+        {
+            MutexLock lock(jobMutex);
+            jobs.Clear();
+            shouldExit = true;
+        }
+
+        jobAvailable.Set();
+        thread->Stop();
+        thread.Reset();
+    }
+}
+
+void SceneStreamer::RegisterObject()
+{
+    RegisterFactory<SceneStreamer>();
+    CopyBaseAttributes<SceneStreamer, Node>();
+}
+
+SharedPtr<ScenePartition> SceneStreamer::Load(Stream* source, Node* parent)
+{
+    return LoadPartition(source, parent, false);
+}
+
+SharedPtr<ScenePartition> SceneStreamer::LoadJSON(Stream* source, Node* parent)
+{
+    return LoadPartition(source, parent, true);
+}
+
+void SceneStreamer::Unload(ScenePartition* partition)
+{
+    if (!partition)
+        return;
+
+    switch (partition->state)
+    {
+    case PARTITION_LOADED:
+        partition->state = PARTITION_UNLOADING;
+        partition->unloadRequested = true;
+        partitions.Push(SharedPtr<ScenePartition>(partition));
+        break;
+
+    case PARTITION_LOADING:
+    case PARTITION_ATTACHING:
+        // The partition is already in progress, so it will be detached in Update()
+        partition->state = PARTITION_UNLOADING;
+        partition->unloadRequested = true;
+        break;
+
+    default:
+        break;
+    }
+}
+
+void SceneStreamer::Update()
+{
+    PROFILE(UpdateSceneStreamer);
+
+    HiresTimer timer;
+    // Decay the estimate so that one expensive unit of work does not throttle the following frames
+    unitUSec /= 2;
+    lastCheckUSec = -1;
+
+    // Take back the partitions that the background thread has finished with
+    if (thread)
+    {
+        MutexLock lock(jobMutex);
+        for (auto it = finishedJobs.Begin(); it != finishedJobs.End(); ++it)
+            (*it)->inBackground = false;
+        finishedJobs.Clear();
+    }
+
+    // Process the partitions in the order they were requested, so that the earliest ones finish first
+    for (size_t i = 0; i < partitions.Size();)
+    {
+        if (UpdatePartition(partitions[i], timer))
+            partitions.Erase(i);
+        else
+            ++i;
+
+        if (!HasTimeLeft(timer))
+            break;
+    }
+}
+
+void SceneStreamer::SetTimeBudget(int usec)
+{
+    timeBudget = Max(usec, 0);
+}
+
+void SceneStreamer::OnSceneSet(Scene*, Scene* oldScene)
+{
+    if (!oldScene)
+        return;
+
+    // Cancel the partitions in progress. Nodes that were already attached stay in the old scene
+    for (size_t i = 0; i < partitions.Size();)
+    {
+        ScenePartition* partition = partitions[i];
+        partition->unloadRequested = true;
+        partition->state = PARTITION_UNLOADED;
+
+        // The background thread may still be using the partition, so keep it until Update() or destruction
+        if (partition->inBackground)
+            ++i;
+        else
+        {
+            partition->nodes.Clear();
+            partition->parentIndices.Clear();
+            partition->resources.Clear();
+            partition->resolver.Reset();
+            partitions.Erase(i);
+        }
+    }
+}
+
+SharedPtr<ScenePartition> SceneStreamer::LoadPartition(Stream* source, Node* parent, bool json)
+{
+    AutoPtr<Stream> sourcePtr(source);
+
+    if (!ParentScene())
+    {
+        LOGERROR("Scene streamer must be in a scene to load partitions");
+        return SharedPtr<ScenePartition>();
+    }
+    if (!source)
+    {
+        LOGERROR("Null source stream for scene partition");
+        return SharedPtr<ScenePartition>();
+    }
+    if (parent && parent->ParentScene() != ParentScene())
+    {
+        LOGERROR("Parent node of scene partition is not in the same scene as the streamer");
+        return SharedPtr<ScenePartition>();
+    }
+
+    SharedPtr<ScenePartition> partition(new ScenePartition(sourcePtr.Detach(), parent ? parent : ParentScene(), json));
+    partitions.Push(partition);
+    QueueJob(partition);
+    return partition;
+}
+
+void SceneStreamer::QueueJob(ScenePartition* partition)
+{
+    partition->inBackground = true;
+
+    if (!thread)
+    {
+        thread = new SceneStreamerThread(this);
+        if (!thread->Run())
+        {
+            LOGERROR("Could not start scene streamer thread");
+            thread.Reset();
+        }
+    }
+
+    // Without a thread, do the work in the main thread to at least load the partition
+    if (!thread)
+    {
+        if (partition->step == STEP_PARSE)
+            ParsePartition(partition);
+        else
+            LoadResources(partition);
+        partition->inBackground = false;
+        return;
+    }
+
+    {
+        MutexLock lock(jobMutex);
+        jobs.Push(partition);
+    }
+
+    jobAvailable.Set();
+}
+
+void SceneStreamer::ProcessJobs()
+{
+    for (;;)
+    {
+        ScenePartition* partition = nullptr;
+
+        {
+            MutexLock lock(jobMutex);
+            if (shouldExit)
+                break;
+            if (jobs.Size())
+            {
+                partition = jobs[0];
+                jobs.Erase(0);
+            }
+        }
+
+        if (!partition)
+        {
+            jobAvailable.Wait();
+            continue;
+        }
+
+        if (partition->step == STEP_PARSE)
+            ParsePartition(partition);
+        else
+            LoadResources(partition);
+
+        MutexLock lock(jobMutex);
+        finishedJobs.Push(partition);
+    }
+}
+
+void SceneStreamer::ParsePartition(ScenePartition* partition)
+{
+    // Plans are rebuilt for each partition, as attributes may have been registered in between
+    loadPlans.Clear();
+
+    Stream& source = *partition->source;
+    if (partition->json)
+    {
+        JSONFile json;
+        if (json.Load(source))
+            LoadNodeJSON(partition, json.Root(), NO_PARTITION_PARENT);
+    }
+    else
+    {
+        // Read the whole partition in one go, then create the nodes from memory
+        Vector<unsigned char> data(source.Size() - source.Position());
+        if (data.Size())
+            data.Resize(source.Read(&data[0], data.Size()));
+        MemoryBuffer buffer(data);
+        if (buffer.Size() >= sizeof(StringHash) + sizeof(unsigned))
+        {
+            StringHash rootType(buffer.Read<StringHash>());
+            unsigned rootId = buffer.Read<unsigned>();
+            LoadNode(partition, rootType, rootId, NO_PARTITION_PARENT, buffer);
+        }
+    }
+
+    if (partition->nodes.IsEmpty())
+        LOGERROR("Could not load scene partition from " + source.Name());
+    // Sort the nodes by their old ids here, so that the main thread can resolve the object refs a few at a time
+    partition->resolver->SortObjects();
+
+    partition->source.Reset();
+    partition->step = STEP_QUEUE_RESOURCES;
+}
+
+void SceneStreamer::LoadNode(ScenePartition* partition, StringHash type, unsigned id, unsigned parentIndex, MemoryBuffer& source)
+{
+    const NodeLoadPlan& plan = FindLoadPlan(type);
+    if (!plan.factory)
+    {
+        // If node is unknown type, skip all its attributes and children
+        SkipHierarchy(source);
+        return;
+    }
+
+    Node* node = static_cast<Node*>(plan.factory->Create());
+    unsigned index = (unsigned)partition->nodes.Size();
+    partition->nodes.Push(SharedPtr<Node>(node));
+    partition->parentIndices.Push(parentIndex);
+    partition->resolver->StoreObject(id, node);
+    node->LoadAttributes(source, plan.attributes, *partition->resolver);
+
+    size_t numChildren = source.ReadVLE();
+    for (size_t i = 0; i < numChildren; ++i)
+    {
+        StringHash childType(source.Read<StringHash>());
+        unsigned childId = source.Read<unsigned>();
+        LoadNode(partition, childType, childId, index, source);
+    }
+}
+
+void SceneStreamer::LoadNodeJSON(ScenePartition* partition, const JSONValue& source, unsigned parentIndex)
+{
+    const NodeLoadPlan& plan = FindLoadPlan(StringHash(source["type"].GetString()));
+    if (!plan.factory)
+        return;
+
+    Node* node = static_cast<Node*>(plan.factory->Create());
+    unsigned index = (unsigned)partition->nodes.Size();
+    partition->nodes.Push(SharedPtr<Node>(node));
+    partition->parentIndices.Push(parentIndex);
+    partition->resolver->StoreObject((unsigned)source["id"].GetNumber(), node);
+    // Load only the attributes, as the children are created here instead of attaching them immediately
+    node->Serializable::LoadJSON(source, *partition->resolver);
+
+    const JSONArray& children = source["children"].GetArray();
+    for (auto it = children.Begin(); it != children.End(); ++it)
+        LoadNodeJSON(partition, *it, index);
+}
+
+void SceneStreamer::LoadResources(ScenePartition* partition)
+{
+    // The resources loaded in an earlier round no longer have a stream
+    for (auto it = partition->resources.Begin(); it != partition->resources.End(); ++it)
+    {
+        if (it->stream)
+        {
+            it->loaded = it->resource->BeginLoad(*it->stream);
+            it->stream.Reset();
+        }
+    }
+
+    partition->step = STEP_QUEUE_DEPENDENCIES;
+}
+
+const NodeLoadPlan& SceneStreamer::FindLoadPlan(StringHash type)
+{
+    auto it = loadPlans.Find(type);
+    if (it == loadPlans.End())
+        it = loadPlans.Insert(MakePair(type, NodeLoadPlan(type)));
+    return it->second;
+}
+
+bool SceneStreamer::UpdatePartition(ScenePartition* partition, HiresTimer& timer)
+{
+    if (partition->inBackground)
+        return false;
+
+    if (!ParentScene() || partition->state == PARTITION_UNLOADED)
+    {
+        partition->state = PARTITION_UNLOADED;
+        partition->nodes.Clear();
+        partition->parentIndices.Clear();
+        partition->resources.Clear();
+        partition->resolver.Reset();
+        return true;
+    }
+
+    if (partition->unloadRequested && partition->step != STEP_DETACH)
+        BeginDetach(partition);
+
+    // Continue with the next step in the same frame if there is time left
+    for (;;)
+    {
+        switch (partition->step)
+        {
+        case STEP_QUEUE_RESOURCES:
+            if (partition->nodes.IsEmpty())
+            {
+                partition->state = PARTITION_FAILED;
+                partition->step = STEP_DONE;
+                return true;
+            }
+            partition->state = PARTITION_ATTACHING;
+            if (!QueueResources(partition, timer))
+                return false;
+            if (partition->resources.Size())
+            {
+                partition->step = STEP_LOAD_RESOURCES;
+                QueueJob(partition);
+                if (partition->inBackground)
+                    return false;
+            }
+            else
+                partition->step = STEP_SET_RESOURCES;
+            break;
+
+        case STEP_QUEUE_DEPENDENCIES:
+            if (!QueueDependencies(partition, timer))
+                return false;
+            // Load the queued dependencies in the background, then check their dependencies in turn
+            if (partition->nextIndex < partition->resources.Size())
+            {
+                partition->step = STEP_LOAD_RESOURCES;
+                QueueJob(partition);
+                if (partition->inBackground)
+                    return false;
+            }
+            else
+            {
+                partition->nextIndex = 0;
+                partition->step = STEP_FINISH_RESOURCES;
+            }
+            break;
+
+        case STEP_FINISH_RESOURCES:
+            if (!FinishResources(partition, timer))
+                return false;
+            partition->step = STEP_SET_RESOURCES;
+            break;
+
+        case STEP_SET_RESOURCES:
+            if (!SetResources(partition, timer))
+                return false;
+            partition->step = STEP_ATTACH;
+            break;
+
+        case STEP_ATTACH:
+            if (!AttachNodes(partition, timer))
+                return false;
+            partition->step = STEP_RESOLVE_OBJECTS;
+            break;
+
+        case STEP_RESOLVE_OBJECTS:
+            if (!ResolveObjects(partition, timer))
+                return false;
+            partition->state = PARTITION_LOADED;
+            partition->step = STEP_DONE;
+            return true;
+
+        case STEP_DETACH:
+            if (!DetachNodes(partition, timer))
+                return false;
+            partition->state = PARTITION_UNLOADED;
+            partition->step = STEP_DONE;
+            return true;
+
+        default:
+            return true;
+        }
+
+        if (!HasTimeLeft(timer))
+            return false;
+    }
+}
+
+bool SceneStreamer::QueueResources(ScenePartition* partition, HiresTimer& timer)
+{
+    ResourceCache* cache = Subsystem<ResourceCache>();
+    if (!cache)
+        return true;
+
+    const Vector<StoredResourceRef>& resourceRefs = partition->resolver->ResourceRefs();
+    while (partition->nextIndex < resourceRefs.Size() && HasTimeLeft(timer))
+    {
+        const ResourceRefList& refs = resourceRefs[partition->nextIndex++].value;
+        for (auto it = refs.names.Begin(); it != refs.names.End(); ++it)
+            QueueResource(partition, cache, refs.type, *it);
+    }
+
+    if (partition->nextIndex < resourceRefs.Size())
+        return false;
+
+    partition->nextIndex = 0;
+    return true;
+}
+
+bool SceneStreamer::QueueDependencies(ScenePartition* partition, HiresTimer& timer)
+{
+    ResourceCache* cache = Subsystem<ResourceCache>();
+    if (!cache)
+    {
+        partition->nextIndex = partition->resources.Size();
+        return true;
+    }
+
+    // The dependencies are queued after the resources loaded so far, which still have to be checked while they have no stream
+    Vector<ResourceRef> dependencies;
+    while (partition->nextIndex < partition->resources.Size() && !partition->resources[partition->nextIndex].stream &&
+        HasTimeLeft(timer))
+    {
+        const PartitionResource& resource = partition->resources[partition->nextIndex++];
+        if (resource.loaded)
+        {
+            dependencies.Clear();
+            resource.resource->Dependencies(dependencies);
+            for (auto it = dependencies.Begin(); it != dependencies.End(); ++it)
+                QueueResource(partition, cache, it->type, it->name);
+        }
+    }
+
+    return partition->nextIndex == partition->resources.Size() || partition->resources[partition->nextIndex].stream;
+}
+
+void SceneStreamer::QueueResource(ScenePartition* partition, ResourceCache* cache, StringHash type, const String& name)
+{
+    if (name.IsEmpty() || cache->FindResource(type, name))
+        return;
+    String sanitatedName = cache->SanitateResourceName(name);
+
+    // Skip resources already queued by this partition
+    for (auto it = partition->resources.Begin(); it != partition->resources.End(); ++it)
+    {
+        if (it->resource->Type() == type && it->resource->Name() == sanitatedName)
+            return;
+    }
+
+    // If the resource can not be opened here, the attribute setter or the depending resource logs the error later
+    SharedPtr<Object> newObject(Create(type));
+    Resource* newResource = dynamic_cast<Resource*>(newObject.Get());
+    if (!newResource)
+        return;
+    AutoPtr<Stream> stream = cache->OpenResource(sanitatedName);
+    if (!stream)
+        return;
+
+    newResource->SetName(sanitatedName);
+    PartitionResource resource;
+    resource.resource = newResource;
+    resource.stream = stream;
+    resource.loaded = false;
+    partition->resources.Push(resource);
+}
+
+bool SceneStreamer::FinishResources(ScenePartition* partition, HiresTimer& timer)
+{
+    ResourceCache* cache = Subsystem<ResourceCache>();
+
+    // The dependencies were queued after the resources that depend on them, so finish from the end
+    while (partition->resources.Size() && HasTimeLeft(timer))
+    {
+        FinishResource(partition, cache, partition->resources.Size() - 1);
+        partition->resources.Pop();
+    }
+
+    return partition->resources.IsEmpty();
+}
+
+void SceneStreamer::FinishResource(ScenePartition* partition, ResourceCache* cache, size_t index)
+{
+    // Resources that are already finished have been released
+    SharedPtr<Resource> resource = partition->resources[index].resource;
+    if (!resource)
+        return;
+    partition->resources[index].resource.Reset();
+
+    // Another partition may have loaded the same resource in the meanwhile
+    if (!cache || !partition->resources[index].loaded || cache->FindResource(resource->Type(), resource->Name()))
+        return;
+
+    // A dependency may have been queued before the resource by the nodes, so finish it first if still pending. Otherwise
+    // EndLoad() would load it from the resource cache
+    Vector<ResourceRef> dependencies;
+    resource->Dependencies(dependencies);
+    for (auto it = dependencies.Begin(); it != dependencies.End(); ++it)
+    {
+        String name = cache->SanitateResourceName(it->name);
+        for (size_t i = 0; i < partition->resources.Size(); ++i)
+        {
+            Resource* dependency = partition->resources[i].resource;
+            if (dependency && dependency->Type() == it->type && dependency->Name() == name)
+            {
+                FinishResource(partition, cache, i);
+                break;
+            }
+        }
+    }
+
+    LOGDEBUG("Loaded resource " + resource->Name());
+    if (resource->EndLoad())
+        cache->AddManualResource(resource);
+}
+
+bool SceneStreamer::SetResources(ScenePartition* partition, HiresTimer& timer)
+{
+    ObjectResolver& resolver = *partition->resolver;
+
+    while (partition->nextIndex < resolver.ResourceRefs().Size() && HasTimeLeft(timer))
+        resolver.ResolveResourceRef(partition->nextIndex++);
+
+    if (partition->nextIndex < resolver.ResourceRefs().Size())
+        return false;
+
+    partition->nextIndex = 0;
+    return true;
+}
+
+bool SceneStreamer::AttachNodes(ScenePartition* partition, HiresTimer& timer)
+{
+    Node* parent = partition->parent.Get();
+    if (!parent || parent->ParentScene() != ParentScene())
+    {
+        LOGERROR("Parent node of scene partition was removed before the partition was attached");
+        partition->unloadRequested = true;
+        BeginDetach(partition);
+        return false;
+    }
+
+    // The nodes are in hierarchy order, so each parent is attached before its children and each node enters the scene alone
+    while (partition->nextIndex < partition->nodes.Size() && HasTimeLeft(timer))
+    {
+        size_t index = partition->nextIndex++;
+        unsigned parentIndex = partition->parentIndices[index];
+        Node* nodeParent = parentIndex != NO_PARTITION_PARENT ? partition->nodes[parentIndex].Get() : parent;
+        nodeParent->AddChild(partition->nodes[index]);
+    }
+
+    if (partition->nextIndex < partition->nodes.Size())
+        return false;
+
+    partition->root = partition->nodes[0];
+    partition->parentIndices.Clear();
+    partition->nextIndex = 0;
+    return true;
+}
+
+bool SceneStreamer::ResolveObjects(ScenePartition* partition, HiresTimer& timer)
+{
+    // Object refs can be resolved only once the nodes have their ids in the scene
+    if (partition->resolver)
+    {
+        const Vector<StoredObjectRef>& objectRefs = partition->resolver->ObjectRefs();
+        while (partition->nextIndex < objectRefs.Size() && HasTimeLeft(timer))
+            partition->resolver->ResolveObjectRef(partition->nextIndex++);
+
+        if (partition->nextIndex < objectRefs.Size())
+            return false;
+
+        partition->resolver.Reset();
+        partition->nextIndex = 0;
+    }
+
+    // Release the references last to first, as releasing a large partition at once would exceed the budget
+    while (partition->nodes.Size())
+    {
+        if (!HasTimeLeft(timer))
+            return false;
+        partition->nodes.Pop();
+    }
+
+    return true;
+}
+
+bool SceneStreamer::DetachNodes(ScenePartition* partition, HiresTimer& timer)
+{
+    // Release one unattached node or unfinished resource at a time, as a large partition may still have many
+    while (partition->nodes.Size() || partition->resources.Size())
+    {
+        if (!HasTimeLeft(timer))
+            return false;
+        if (partition->nodes.Size())
+            partition->nodes.Pop();
+        else
+            partition->resources.Pop();
+    }
+
+    // Remove the last leaf of the subtree at a time, so that each node leaves the scene alone and is the last child of its parent
+    Node* node = partition->root;
+    while (node)
+    {
+        if (!HasTimeLeft(timer))
+            return false;
+
+        while (node->NumChildren())
+            node = node->Children().Back();
+
+        Node* nodeParent = node->Parent();
+        if (node == partition->root)
+        {
+            if (nodeParent)
+                nodeParent->RemoveChild(node);
+            partition->root.Reset();
+            break;
+        }
+
+        nodeParent->RemoveChild(nodeParent->NumChildren() - 1);
+        node = nodeParent;
+    }
+
+    return true;
+}
+
+bool SceneStreamer::HasTimeLeft(HiresTimer& timer)
+{
+    // The time since the previous check is the cost of the unit of work done in between
+    long long elapsed = timer.ElapsedUSec();
+    if (lastCheckUSec < 0)
+    {
+        lastCheckUSec = elapsed;
+        return true;
+    }
+
+    if (elapsed - lastCheckUSec > unitUSec)
+        unitUSec = elapsed - lastCheckUSec;
+    lastCheckUSec = elapsed;
+    return elapsed + unitUSec <= timeBudget;
+}
+
+void SceneStreamer::BeginDetach(ScenePartition* partition)
+{
+    partition->state = PARTITION_UNLOADING;
+    partition->resolver.Reset();
+
+    // The nodes are attached in hierarchy order, so the attached ones form a subtree under the first node. The node references
+    // and the unfinished resources are released by DetachNodes()
+    if (!partition->root && partition->step == STEP_ATTACH && partition->nextIndex)
+        partition->root = partition->nodes[0];
+
+    partition->parentIndices.Clear();
+    partition->nextIndex = 0;
+    partition->step = STEP_DETACH;
+}
+
+}
@@ -0,0 +1,231 @@
+// For conditions of distribution and use, see copyright notice in License.txt
+
+#pragma once
+
+#include "../Base/AutoPtr.h"
+#include "../Object/ObjectResolver.h"
+#include "../Thread/Condition.h"
+#include "../Thread/Mutex.h"
+#include "../Thread/Thread.h"
+#include "../Thread/Timer.h"
+#include "Scene.h"
+
+namespace Turso3D
+{
+
+class JSONValue;
+class MemoryBuffer;
+class Resource;
+class ResourceCache;
+class SceneStreamer;
+class Stream;
+
+/// Parent index of a scene partition's root node.
+static const unsigned NO_PARTITION_PARENT = 0xffffffff;
+/// Default time budget of SceneStreamer::Update() in microseconds.
+static const int DEFAULT_STREAMING_BUDGET = 2000;
+
+/// Streaming state of a scene partition.
+enum PartitionState
+{
+    PARTITION_LOADING = 0,
+    PARTITION_ATTACHING,
+    PARTITION_LOADED,
+    PARTITION_UNLOADING,
+    PARTITION_UNLOADED,
+    PARTITION_FAILED
+};
+
+/// Streaming step of a scene partition. Used internally.
+enum PartitionStep
+{
+    STEP_PARSE = 0,
+    STEP_QUEUE_RESOURCES,
+    STEP_LOAD_RESOURCES,
+    STEP_QUEUE_DEPENDENCIES,
+    STEP_FINISH_RESOURCES,
+    STEP_SET_RESOURCES,
+    STEP_ATTACH,
+    STEP_RESOLVE_OBJECTS,
+    STEP_DETACH,
+    STEP_DONE
+};
+
+/// Resource loaded in the background for a scene partition.
+struct TURSO3D_API PartitionResource
+{
+    /// Resource.
+    SharedPtr<Resource> resource;
+    /// Stream to load from.
+    AutoPtr<Stream> stream;
+    /// Whether the background part of the load succeeded.
+    bool loaded;
+};
+
+/// Part of a scene, such as a world cell, that a SceneStreamer loads and unloads over several frames. The nodes are parsed and created on a background thread as a detached subtree.
+class TURSO3D_API ScenePartition : public RefCounted
+{
+    friend class SceneStreamer;
+
+public:
+    /// Construct. Take ownership of the stream.
+    ScenePartition(Stream* source, Node* parent, bool json);
+    /// Destruct.
+    ~ScenePartition();
+
+    /// Return the streaming state.
+    PartitionState State() const { return state; }
+    /// Return whether the partition has been fully attached to the scene.
+    bool IsLoaded() const { return state == PARTITION_LOADED; }
+    /// Return the root node while loaded or unloading, or null otherwise.
+    Node* Root() const { return state != PARTITION_ATTACHING ? root.Get() : nullptr; }
+
+private:
+    /// Streaming state.
+    PartitionState state;
+    /// Current step.
+    PartitionStep step;
+    /// Source stream, released once parsed.
+    AutoPtr<Stream> source;
+    /// Whether the source is JSON text.
+    bool json;
+    /// Parent node to attach to.
+    WeakPtr<Node> parent;
+    /// Loaded nodes in hierarchy order. When unloading, the nodes that are still to be released.
+    Vector<SharedPtr<Node> > nodes;
+    /// Parent indices of the loaded nodes.
+    Vector<unsigned> parentIndices;
+    /// Resolver for the object and resource ref attributes.
+    AutoPtr<ObjectResolver> resolver;
+    /// Resources loaded in the background.
+    Vector<PartitionResource> resources;
+    /// Root node of the attached nodes.
+    SharedPtr<Node> root;
+    /// Index of the next item to process in the current step.
+    size_t nextIndex;
+    /// Whether the background thread is processing the partition.
+    bool inBackground;
+    /// Whether unloading was requested before the partition finished loading.
+    bool unloadRequested;
+};
+
+/// Background loader thread of the scene streamer.
+class TURSO3D_API SceneStreamerThread : public Thread
+{
+public:
+    /// Construct.
+    SceneStreamerThread(SceneStreamer* owner);
+
+    /// Process jobs until the scene streamer is destroyed.
+    void ThreadFunction() override;
+
+private:
+    /// Scene streamer.
+    SceneStreamer* owner;
+};
+
+/// Streams scene partitions in and out without stalling the main thread. Should be created as a child of the scene root. A background thread reads and parses the partition and creates its nodes as a detached subtree, then reads the resources that the nodes refer to and that are not loaded yet. Update() finishes the resources, sets the resource attributes, attaches the nodes to the scene and resolves their object ref attributes one at a time, stopping when the per-frame time budget is used. Unloading removes the nodes the same way.
+///
+/// Partitions use the same data as Scene::Instantiate() and InstantiateJSON(), saved with Node::Save() or SaveJSON(). Node constructors and attribute setters other than resource refs must be safe to run outside the main thread. Resources that the loaded resources depend on, such as the textures of materials, are loaded in the background too if they are returned by Resource::Dependencies(). The background thread does not profile, as it runs while the main thread's profiling frames end. The resource directories should not be changed while partitions are loading.
+class TURSO3D_API SceneStreamer : public Node
+{
+    OBJECT(SceneStreamer);
+
+    friend class SceneStreamerThread;
+
+public:
+    /// Construct. The streamer is temporary, so it is not saved with the scene.
+    SceneStreamer();
+    /// Destruct. Wait for the background thread to finish its current partition.
+    ~SceneStreamer();
+
+    /// Register factory.
+    static void RegisterObject();
+
+    /// Start loading a partition from binary data and return it, or null if the streamer is not in a scene. The partition will be attached under the parent node, or the scene root if null. Take ownership of the stream.
+    SharedPtr<ScenePartition> Load(Stream* source, Node* parent = nullptr);
+    /// Start loading a partition from JSON text data and return it, or null if the streamer is not in a scene. The partition will be attached under the parent node, or the scene root if null. Take ownership of the stream.
+    SharedPtr<ScenePartition> LoadJSON(Stream* source, Node* parent = nullptr);
+    /// Start unloading a partition. A partition that is still loading is cancelled.
+    void Unload(ScenePartition* partition);
+    /// Finish background work and attach or detach nodes until the time budget is used. Should be called once per frame before updating transforms and rendering.
+    void Update();
+    /// Set the time budget of Update() in microseconds. At least one node or resource is processed per call. The budget is checked before each one against the most expensive recent one, so a frame exceeds it only when a single node or resource takes longer than estimated, such as finishing a large resource.
+    void SetTimeBudget(int usec);
+
+    /// Return the time budget of Update() in microseconds.
+    int TimeBudget() const { return timeBudget; }
+    /// Return number of partitions being loaded or unloaded.
+    size_t NumActivePartitions() const { return partitions.Size(); }
+
+protected:
+    /// Handle being assigned to a new scene. Cancel the partitions in progress.
+    void OnSceneSet(Scene* newScene, Scene* oldScene) override;
+
+private:
+    /// Start loading a partition.
+    SharedPtr<ScenePartition> LoadPartition(Stream* source, Node* parent, bool json);
+    /// Queue a partition to the background thread.
+    void QueueJob(ScenePartition* partition);
+    /// Process queued partitions in the background thread until the streamer is destroyed.
+    void ProcessJobs();
+    /// Parse a partition and create its nodes. Called in the background thread.
+    void ParsePartition(ScenePartition* partition);
+    /// Create a node and its children from binary data. Called in the background thread.
+    void LoadNode(ScenePartition* partition, StringHash type, unsigned id, unsigned parentIndex, MemoryBuffer& source);
+    /// Create a node and its children from JSON data. Called in the background thread.
+    void LoadNodeJSON(ScenePartition* partition, const JSONValue& source, unsigned parentIndex);
+    /// Load the queued resources of a partition. Called in the background thread.
+    void LoadResources(ScenePartition* partition);
+    /// Return the load plan of a node type, building it on first use. Called in the background thread.
+    const NodeLoadPlan& FindLoadPlan(StringHash type);
+    /// Advance the main thread steps of a partition. Return true when the partition is done.
+    bool UpdatePartition(ScenePartition* partition, HiresTimer& timer);
+    /// Queue the resources that the loaded nodes refer to and that are not loaded yet. Return true when done.
+    bool QueueResources(ScenePartition* partition, HiresTimer& timer);
+    /// Queue the dependencies of the resources loaded in the background that are not loaded yet. Return true when done.
+    bool QueueDependencies(ScenePartition* partition, HiresTimer& timer);
+    /// Queue a resource to be loaded in the background unless it is loaded or queued already.
+    void QueueResource(ScenePartition* partition, ResourceCache* cache, StringHash type, const String& name);
+    /// Finish the resources loaded in the background and store them to the resource cache. Return true when done.
+    bool FinishResources(ScenePartition* partition, HiresTimer& timer);
+    /// Finish a resource loaded in the background after its dependencies.
+    void FinishResource(ScenePartition* partition, ResourceCache* cache, size_t index);
+    /// Set the resource attributes of the loaded nodes. Return true when done.
+    bool SetResources(ScenePartition* partition, HiresTimer& timer);
+    /// Attach the loaded nodes to the scene. Return true when done.
+    bool AttachNodes(ScenePartition* partition, HiresTimer& timer);
+    /// Resolve the object ref attributes of the attached nodes, then release the loading data. Return true when done.
+    bool ResolveObjects(ScenePartition* partition, HiresTimer& timer);
+    /// Release the unattached nodes and the unfinished resources, then remove the attached nodes from the scene and release them. Return true when done.
+    bool DetachNodes(ScenePartition* partition, HiresTimer& timer);
+    /// Start unloading a partition.
+    void BeginDetach(ScenePartition* partition);
+    /// Return whether the time budget has room for one more unit of work. Always true on the first check of Update().
+    bool HasTimeLeft(HiresTimer& timer);
+
+    /// Partitions being loaded or unloaded.
+    Vector<SharedPtr<ScenePartition> > partitions;
+    /// Background thread, started on first load.
+    AutoPtr<SceneStreamerThread> thread;
+    /// Partitions queued to the background thread.
+    Vector<ScenePartition*> jobs;
+    /// Partitions the background thread has finished with.
+    Vector<ScenePartition*> finishedJobs;
+    /// Mutex for the job queues and the exit flag.
+    Mutex jobMutex;
+    /// Condition for waking up the background thread.
+    Condition jobAvailable;
+    /// Node load plans of the background thread by type. Rebuilt for each partition, as attributes may be registered in between.
+    HashMap<StringHash, NodeLoadPlan> loadPlans;
+    /// Time budget of Update() in microseconds.
+    int timeBudget;
+    /// Estimated time of one unit of work in microseconds, from the most expensive recent one.
+    long long unitUSec;
+    /// Elapsed time of Update() at the previous budget check, or negative before the first check.
+    long long lastCheckUSec;
+    /// Exit flag for the background thread.
+    bool shouldExit;
+};
+
+}
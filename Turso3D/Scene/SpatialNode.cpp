@@ -1,5 +1,6 @@
 // For conditions of distribution and use, see copyright notice in License.txt
 
+#include "Scene.h"
 #include "SpatialNode.h"
 
 #include "../Debug/DebugNew.h"
@@ -9,6 +10,8 @@ namespace Turso3D
 
 SpatialNode::SpatialNode() :
     worldTransform(Matrix3x4::IDENTITY),
+    transformSystem(nullptr),
+    transformIndex(0),
     position(Vector3::ZERO),
     rotation(Quaternion::IDENTITY),
     scale(Vector3::ONE)
@@ -28,19 +31,19 @@ void SpatialNode::RegisterObject()
 void SpatialNode::SetPosition(const Vector3& newPosition)
 {
     position = newPosition;
-    OnTransformChanged();
+    OnLocalTransformChanged();
 }
 
 void SpatialNode::SetRotation(const Quaternion& newRotation)
 {
     rotation = newRotation;
-    OnTransformChanged();
+    OnLocalTransformChanged();
 }
 
 void SpatialNode::SetDirection(const Vector3& newDirection)
 {
     rotation = Quaternion(Vector3::FORWARD, newDirection);
-    OnTransformChanged();
+    OnLocalTransformChanged();
 }
 
 void SpatialNode::SetScale(const Vector3& newScale)
@@ -54,7 +57,7 @@ void SpatialNode::SetScale(const Vector3& newScale)
     if (scale.z == 0.0f)
         scale.z = M_EPSILON;
 
-    OnTransformChanged();
+    OnLocalTransformChanged();
 }
 
 void SpatialNode::SetScale(float newScale)
@@ -66,7 +69,7 @@ void SpatialNode::SetTransform(const Vector3& newPosition, const Quaternion& new
 {
     position = newPosition;
     rotation = newRotation;
-    OnTransformChanged();
+    OnLocalTransformChanged();
 }
 
 void SpatialNode::SetTransform(const Vector3& newPosition, const Quaternion& newRotation, const Vector3& newScale)
@@ -74,7 +77,7 @@ void SpatialNode::SetTransform(const Vector3& newPosition, const Quaternion& new
     position = newPosition;
     rotation = newRotation;
     scale = newScale;
-    OnTransformChanged();
+    OnLocalTransformChanged();
 }
 
 void SpatialNode::SetTransform(const Vector3& newPosition, const Quaternion& newRotation, float newScale)
@@ -163,7 +166,7 @@ void SpatialNode::Translate(const Vector3& delta, TransformSpace space)
         break;
     }
 
-    OnTransformChanged();
+    OnLocalTransformChanged();
 }
 
 void SpatialNode::Rotate(const Quaternion& delta, TransformSpace space)
@@ -191,7 +194,7 @@ void SpatialNode::Rotate(const Quaternion& delta, TransformSpace space)
         break;
     }
 
-    OnTransformChanged();
+    OnLocalTransformChanged();
 }
 
 void SpatialNode::RotateAround(const Vector3& point, const Quaternion& delta, TransformSpace space)
@@ -230,7 +233,7 @@ void SpatialNode::RotateAround(const Vector3& point, const Quaternion& delta, Tr
     Vector3 oldRelativePos = oldRotation.Inverse() * (position - parentSpacePoint);
     position = rotation * oldRelativePos + parentSpacePoint;
 
-    OnTransformChanged();
+    OnLocalTransformChanged();
 }
 
 void SpatialNode::Yaw(float angle, TransformSpace space)
@@ -289,18 +292,33 @@ void SpatialNode::ApplyScale(float delta)
 void SpatialNode::ApplyScale(const Vector3& delta)
 {
     scale *= delta;
-    OnTransformChanged();
+    OnLocalTransformChanged();
 }
 
 void SpatialNode::OnParentSet(Node* newParent, Node*)
 {
     SetFlag(NF_SPATIAL_PARENT, dynamic_cast<SpatialNode*>(newParent) != 0);
+    if (transformSystem)
+        transformSystem->SetParent(this);
     OnTransformChanged();
 }
 
+void SpatialNode::OnSceneSet(Scene* newScene, Scene*)
+{
+    if (transformSystem)
+        transformSystem->RemoveNode(this);
+
+    if (newScene && newScene->GetTransformSystem())
+        newScene->GetTransformSystem()->AddNode(this);
+}
+
 void SpatialNode::OnTransformChanged()
 {
-    SetFlag(NF_WORLD_TRANSFORM_DIRTY, true);
+    // The descendants' local transforms are unchanged, so only their world transforms are marked dirty
+    if (transformSystem)
+        transformSystem->MarkDirty(transformIndex);
+    else
+        SetFlag(NF_WORLD_TRANSFORM_DIRTY, true);
 
     const Vector<SharedPtr<Node> >& children = Children();
     for (auto it = children.Begin(); it != children.End(); ++it)
@@ -311,6 +329,17 @@ void SpatialNode::OnTransformChanged()
     }
 }
 
+void SpatialNode::OnWorldTransformUpdated()
+{
+}
+
+void SpatialNode::OnLocalTransformChanged()
+{
+    if (transformSystem)
+        transformSystem->SetLocalTransform(transformIndex, position, rotation, scale);
+    OnTransformChanged();
+}
+
 void SpatialNode::UpdateWorldTransform() const
 {
     if (TestFlag(NF_SPATIAL_PARENT))
@@ -3,7 +3,7 @@
 #pragma once
 
 #include "../Math/Matrix3x4.h"
-#include "Node.h"
+#include "TransformSystem.h"
 
 namespace Turso3D
 {
@@ -16,11 +16,13 @@ enum TransformSpace
     TS_WORLD
 };
 
-/// Base class for scene nodes with position in three-dimensional space.
+/// Base class for scene nodes with position in three-dimensional space. If the scene has a transform system, the world transform is stored and updated there.
 class TURSO3D_API SpatialNode : public Node
 {
     OBJECT(SpatialNode);
 
+    friend class TransformSystem;
+
 public:
     /// Construct.
     SpatialNode();
@@ -81,6 +83,8 @@ public:
 
     /// Return the parent spatial node, or null if it is not spatial.
     SpatialNode* SpatialParent() const { return TestFlag(NF_SPATIAL_PARENT) ? static_cast<SpatialNode*>(Parent()) : nullptr; }
+    /// Return whether the node's transforms are stored in a transform system.
+    bool InTransformSystem() const { return transformSystem != nullptr; }
     /// Return position in parent space.
     const Vector3& Position() const { return position; }
     /// Return rotation in parent space.
@@ -99,8 +103,8 @@ public:
     Vector3 WorldDirection() const { return WorldRotation() * Vector3::FORWARD; }
     /// Return scale in world space. As it is calculated from the world transform matrix, it may not be meaningful or accurate in all cases.
     Vector3 WorldScale() const { return WorldTransform().Scale(); }
-    /// Return world transform matrix.
-    const Matrix3x4& WorldTransform() const { if (TestFlag(NF_WORLD_TRANSFORM_DIRTY)) UpdateWorldTransform(); return worldTransform; }
+    /// Return world transform matrix. Recompute if dirty, so worker threads should read it only after Scene::UpdateTransforms(). In a transform system the reference points into the transform arrays and is valid only until spatial nodes are added to or removed from the scene, or reparented; copy the matrix to keep it longer.
+    const Matrix3x4& WorldTransform() const { if (transformSystem) return transformSystem->WorldTransform(transformIndex); if (TestFlag(NF_WORLD_TRANSFORM_DIRTY)) UpdateWorldTransform(); return worldTransform; }
     /// Convert a local space position to world space.
     Vector3 LocalToWorld(const Vector3& point) const { return WorldTransform() * point; }
     /// Convert a local space vector (either position or direction) to world space.
@@ -112,16 +116,26 @@ public:
 
 protected:
     /// Handle being assigned to a new parent node.
-    virtual void OnParentSet(Node* newParent, Node* oldParent);
+    void OnParentSet(Node* newParent, Node* oldParent) override;
+    /// Handle being assigned to a new scene. Add self to the scene's transform system if it has one.
+    void OnSceneSet(Scene* newScene, Scene* oldScene) override;
     /// Handle the transform matrix changing.
     virtual void OnTransformChanged();
+    /// Handle the transform system having recomputed the world transform. Called only if the NF_TRANSFORM_LISTENER flag was set when the node was added to the transform system.
+    virtual void OnWorldTransformUpdated();
 
 private:
+    /// Store the changed local transform to the transform system, then handle the transform change.
+    void OnLocalTransformChanged();
     /// Update world transform matrix from spatial parent chain.
     void UpdateWorldTransform() const;
 
-    /// World transform matrix.
+    /// World transform matrix when not in a transform system.
     mutable Matrix3x4 worldTransform;
+    /// Transform system.
+    TransformSystem* transformSystem;
+    /// Index in the transform system.
+    size_t transformIndex;
     /// Parent space position.
     Vector3 position;
     /// Parent space rotation.
@@ -0,0 +1,486 @@
+// For conditions of distribution and use, see copyright notice in License.txt
+
+#include "../Debug/Profiler.h"
+#include "Scene.h"
+#include "SpatialNode.h"
+
+#include <cassert>
+#include <cstring>
+
+#ifdef TURSO3D_SSE
+#include <xmmintrin.h>
+#endif
+
+#include "../Debug/DebugNew.h"
+
+namespace Turso3D
+{
+
+#ifdef TURSO3D_SSE
+/// Load 4 consecutive values, or fewer padded with zeros.
+static inline __m128 LoadGroup(const float* src, size_t count)
+{
+    if (count == 4)
+        return _mm_loadu_ps(src);
+
+    float padded[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+    memcpy(padded, src, count * sizeof(float));
+    return _mm_loadu_ps(padded);
+}
+
+/// Multiply a parent world transform with the rows of a local transform and store the result.
+static inline void MultiplyTransform(Matrix3x4& dest, const Matrix3x4& parent, const __m128* local)
+{
+    const float* p = parent.Data();
+    float* d = &dest.m00;
+
+    // Add the parent translation only to the last column. Adding zero to the other columns does not change them
+    for (size_t i = 0; i < 3; ++i, p += 4, d += 4)
+    {
+        __m128 row = _mm_mul_ps(_mm_set1_ps(p[0]), local[0]);
+        row = _mm_add_ps(row, _mm_mul_ps(_mm_set1_ps(p[1]), local[1]));
+        row = _mm_add_ps(row, _mm_mul_ps(_mm_set1_ps(p[2]), local[2]));
+        row = _mm_add_ps(row, _mm_set_ps(p[3], 0.0f, 0.0f, 0.0f));
+        _mm_storeu_ps(d, row);
+    }
+}
+#endif
+
+void TransformData::Resize(size_t size)
+{
+    nodes.Resize(size);
+    parents.Resize(size);
+    flags.Resize(size);
+    worldTransforms.Resize(size);
+    positionX.Resize(size);
+    positionY.Resize(size);
+    positionZ.Resize(size);
+    rotationW.Resize(size);
+    rotationX.Resize(size);
+    rotationY.Resize(size);
+    rotationZ.Resize(size);
+    scaleX.Resize(size);
+    scaleY.Resize(size);
+    scaleZ.Resize(size);
+}
+
+void TransformData::Copy(size_t index, const TransformData& source, size_t sourceIndex)
+{
+    nodes[index] = source.nodes[sourceIndex];
+    parents[index] = source.parents[sourceIndex];
+    flags[index] = source.flags[sourceIndex];
+    worldTransforms[index] = source.worldTransforms[sourceIndex];
+    positionX[index] = source.positionX[sourceIndex];
+    positionY[index] = source.positionY[sourceIndex];
+    positionZ[index] = source.positionZ[sourceIndex];
+    rotationW[index] = source.rotationW[sourceIndex];
+    rotationX[index] = source.rotationX[sourceIndex];
+    rotationY[index] = source.rotationY[sourceIndex];
+    rotationZ[index] = source.rotationZ[sourceIndex];
+    scaleX[index] = source.scaleX[sourceIndex];
+    scaleY[index] = source.scaleY[sourceIndex];
+    scaleZ[index] = source.scaleZ[sourceIndex];
+}
+
+void TransformData::Swap(TransformData& other)
+{
+    nodes.Swap(other.nodes);
+    parents.Swap(other.parents);
+    flags.Swap(other.flags);
+    worldTransforms.Swap(other.worldTransforms);
+    positionX.Swap(other.positionX);
+    positionY.Swap(other.positionY);
+    positionZ.Swap(other.positionZ);
+    rotationW.Swap(other.rotationW);
+    rotationX.Swap(other.rotationX);
+    rotationY.Swap(other.rotationY);
+    rotationZ.Swap(other.rotationZ);
+    scaleX.Swap(other.scaleX);
+    scaleY.Swap(other.scaleY);
+    scaleZ.Swap(other.scaleZ);
+}
+
+void TransformData::SetLocalTransform(size_t index, const Vector3& position, const Quaternion& rotation, const Vector3& scale)
+{
+    positionX[index] = position.x;
+    positionY[index] = position.y;
+    positionZ[index] = position.z;
+    rotationW[index] = rotation.w;
+    rotationX[index] = rotation.x;
+    rotationY[index] = rotation.y;
+    rotationZ[index] = rotation.z;
+    scaleX[index] = scale.x;
+    scaleY[index] = scale.y;
+    scaleZ[index] = scale.z;
+}
+
+TransformSystem::TransformSystem() :
+    layoutVersion(0),
+    orderDirty(false),
+    subtreesSplit(false),
+    threadedUpdate(true)
+{
+}
+
+TransformSystem::~TransformSystem()
+{
+    RemoveAllNodes();
+}
+
+void TransformSystem::RegisterObject()
+{
+    RegisterFactory<TransformSystem>();
+    CopyBaseAttributes<TransformSystem, Node>();
+}
+
+void TransformSystem::Update()
+{
+    PROFILE(UpdateTransforms);
+
+    size_t count = data.Size();
+    WorkQueue* workQueue = threadedUpdate ? Subsystem<WorkQueue>() : nullptr;
+    bool threaded = workQueue && workQueue->NumThreads() && count >= 2 * MIN_TRANSFORMS_PER_TASK;
+
+    // The serial update needs only the parents to come before their children, so appending nodes does not require sorting
+    if (orderDirty || (threaded && subtreesSplit))
+        SortHierarchy();
+
+    if (!count)
+        return;
+
+    if (!threaded)
+        UpdateTransforms(0, count);
+    else
+    {
+        size_t maxTasks = workQueue->NumThreads() + 1;
+        size_t transformsPerTask = Max((int)((count + maxTasks - 1) / maxTasks), (int)MIN_TRANSFORMS_PER_TASK);
+        size_t numTasks = 0;
+        unsigned* parents = &data.parents[0];
+
+        for (size_t i = 0; i < count;)
+        {
+            // Extend the range to the end of the last subtree so that no transform depends on another task
+            size_t end = Min((int)(i + transformsPerTask), (int)count);
+            while (end < count && parents[end] != NO_TRANSFORM_PARENT)
+                ++end;
+
+            if (updateTasks.Size() <= numTasks)
+                updateTasks.Push(new MemberFunctionTask<TransformSystem>(this, &TransformSystem::UpdateWork));
+
+            MemberFunctionTask<TransformSystem>* task = updateTasks[numTasks++];
+            task->start = parents + i;
+            task->end = parents + end;
+            workQueue->AddTask(task);
+            i = end;
+        }
+
+        workQueue->Complete();
+    }
+
+    NotifyNodes();
+}
+
+void TransformSystem::SetThreadedUpdate(bool enable)
+{
+    threadedUpdate = enable;
+}
+
+void TransformSystem::AddNode(SpatialNode* node)
+{
+    assert(node);
+    if (node->transformSystem)
+        return;
+
+    size_t index = data.Size();
+    data.Resize(index + 1);
+    ++layoutVersion;
+    data.nodes[index] = node;
+    data.worldTransforms[index] = node->worldTransform;
+    data.SetLocalTransform(index, node->Position(), node->Rotation(), node->Scale());
+    data.flags[index] = (node->TestFlag(NF_WORLD_TRANSFORM_DIRTY) ? TF_DIRTY : 0) | (node->TestFlag(NF_TRANSFORM_LISTENER) ?
+        TF_LISTENER : 0);
+    node->transformSystem = this;
+    node->transformIndex = index;
+
+    SpatialNode* parent = node->SpatialParent();
+    if (parent && parent->transformSystem == this)
+    {
+        data.parents[index] = (unsigned)parent->transformIndex;
+
+        // The subtrees stay contiguous only if the previous transform belongs to the parent's subtree. This is the case when
+        // a hierarchy is added to the scene, as the nodes are added depth-first. The parent still comes before the child
+        SpatialNode* previous = data.nodes[index - 1];
+        while (previous && previous != parent)
+            previous = previous->SpatialParent();
+        if (!previous)
+            subtreesSplit = true;
+    }
+    else
+        data.parents[index] = NO_TRANSFORM_PARENT;
+}
+
+void TransformSystem::RemoveNode(SpatialNode* node)
+{
+    assert(node && node->transformSystem == this);
+
+    size_t index = node->transformIndex;
+    DetachNode(index);
+
+    // Move the last transform into the removed one's place. This breaks the hierarchy order
+    size_t last = data.Size() - 1;
+    if (index != last)
+    {
+        data.Copy(index, data, last);
+        data.nodes[index]->transformIndex = index;
+        orderDirty = true;
+    }
+    data.Resize(last);
+    ++layoutVersion;
+}
+
+void TransformSystem::SetParent(SpatialNode* node)
+{
+    assert(node && node->transformSystem == this);
+
+    // The parent index is recomputed when the hierarchy order is restored
+    orderDirty = true;
+}
+
+void TransformSystem::OnSceneSet(Scene* newScene, Scene* oldScene)
+{
+    RemoveAllNodes();
+    if (oldScene && oldScene->GetTransformSystem() == this)
+        oldScene->SetTransformSystem(nullptr);
+
+    // Spatial nodes added later find the transform system through the scene
+    if (newScene && !newScene->GetTransformSystem())
+    {
+        newScene->SetTransformSystem(this);
+        AddNodes(newScene);
+    }
+}
+
+void TransformSystem::UpdateWorldTransform(size_t index)
+{
+    // Worker threads may only read the world transforms, which Update() has recomputed
+    assert(Thread::IsMainThread());
+
+    // The parent indices may be out of date until the next Update(), so use the node hierarchy
+    SpatialNode* parent = data.nodes[index]->SpatialParent();
+    if (parent)
+        data.worldTransforms[index] = parent->WorldTransform() * data.LocalTransform(index);
+    else
+        data.worldTransforms[index] = data.LocalTransform(index);
+    data.flags[index] = (data.flags[index] & ~TF_DIRTY) | TF_UPDATED;
+}
+
+void TransformSystem::UpdateTransforms(size_t start, size_t end)
+{
+    const unsigned* parents = &data.parents[0];
+    const unsigned char* flags = &data.flags[0];
+    Matrix3x4* worldTransforms = &data.worldTransforms[0];
+    size_t i = start;
+
+    #ifdef TURSO3D_SSE
+    __m128 one = _mm_set1_ps(1.0f);
+    __m128 two = _mm_set1_ps(2.0f);
+
+    // Also process a partial last group with SSE, so that the results do not depend on how the range was divided between tasks
+    for (; i < end; i += 4)
+    {
+        size_t groupSize = Min((int)(end - i), 4);
+        unsigned flagMask = 0;
+        memcpy(&flagMask, flags + i, groupSize);
+        if (!(flagMask & 0x01010101))
+            continue;
+
+        // Build 4 local transforms from the structure-of-arrays data, in the same order of operations as Matrix3x4(position, rotation, scale)
+        __m128 w = LoadGroup(&data.rotationW[i], groupSize);
+        __m128 x = LoadGroup(&data.rotationX[i], groupSize);
+        __m128 y = LoadGroup(&data.rotationY[i], groupSize);
+        __m128 z = LoadGroup(&data.rotationZ[i], groupSize);
+        __m128 sx = LoadGroup(&data.scaleX[i], groupSize);
+        __m128 sy = LoadGroup(&data.scaleY[i], groupSize);
+        __m128 sz = LoadGroup(&data.scaleZ[i], groupSize);
+        __m128 w2 = _mm_mul_ps(two, w);
+        __m128 x2 = _mm_mul_ps(two, x);
+        __m128 y2 = _mm_mul_ps(two, y);
+        __m128 z2 = _mm_mul_ps(two, z);
+
+        __m128 m00 = _mm_mul_ps(_mm_sub_ps(_mm_sub_ps(one, _mm_mul_ps(y2, y)), _mm_mul_ps(z2, z)), sx);
+        __m128 m01 = _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(x2, y), _mm_mul_ps(w2, z)), sy);
+        __m128 m02 = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(x2, z), _mm_mul_ps(w2, y)), sz);
+        __m128 m03 = LoadGroup(&data.positionX[i], groupSize);
+        __m128 m10 = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(x2, y), _mm_mul_ps(w2, z)), sx);
+        __m128 m11 = _mm_mul_ps(_mm_sub_ps(_mm_sub_ps(one, _mm_mul_ps(x2, x)), _mm_mul_ps(z2, z)), sy);
+        __m128 m12 = _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(y2, z), _mm_mul_ps(w2, x)), sz);
+        __m128 m13 = LoadGroup(&data.positionY[i], groupSize);
+        __m128 m20 = _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(x2, z), _mm_mul_ps(w2, y)), sx);
+        __m128 m21 = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(y2, z), _mm_mul_ps(w2, x)), sy);
+        __m128 m22 = _mm_mul_ps(_mm_sub_ps(_mm_sub_ps(one, _mm_mul_ps(x2, x)), _mm_mul_ps(y2, y)), sz);
+        __m128 m23 = LoadGroup(&data.positionZ[i], groupSize);
+
+        // Transpose so that each register holds one row of one transform
+        _MM_TRANSPOSE4_PS(m00, m01, m02, m03);
+        _MM_TRANSPOSE4_PS(m10, m11, m12, m13);
+        _MM_TRANSPOSE4_PS(m20, m21, m22, m23);
+        __m128 local[4][3] = {
+            { m00, m10, m20 },
+            { m01, m11, m21 },
+            { m02, m12, m22 },
+            { m03, m13, m23 }
+        };
+
+        // Parents come before their children, also within the group
+        for (size_t j = 0; j < groupSize; ++j)
+        {
+            size_t index = i + j;
+            if (!(flags[index] & TF_DIRTY))
+                continue;
+
+            unsigned parent = parents[index];
+            if (parent != NO_TRANSFORM_PARENT)
+                MultiplyTransform(worldTransforms[index], worldTransforms[parent], local[j]);
+            else
+            {
+                float* dest = &worldTransforms[index].m00;
+                _mm_storeu_ps(dest, local[j][0]);
+                _mm_storeu_ps(dest + 4, local[j][1]);
+                _mm_storeu_ps(dest + 8, local[j][2]);
+            }
+        }
+    }
+    #endif
+
+    for (; i < end; ++i)
+    {
+        if (!(flags[i] & TF_DIRTY))
+            continue;
+
+        unsigned parent = parents[i];
+        if (parent != NO_TRANSFORM_PARENT)
+            worldTransforms[i] = worldTransforms[parent] * data.LocalTransform(i);
+        else
+            worldTransforms[i] = data.LocalTransform(i);
+    }
+}
+
+void TransformSystem::UpdateWork(Task* task, unsigned)
+{
+    const unsigned* parents = &data.parents[0];
+    UpdateTransforms(reinterpret_cast<unsigned*>(task->start) - parents, reinterpret_cast<unsigned*>(task->end) - parents);
+}
+
+void TransformSystem::NotifyNodes()
+{
+    unsigned char* flags = &data.flags[0];
+    size_t count = data.Size();
+    size_t i = 0;
+
+    // Skip unchanged transforms 8 at a time
+    for (;;)
+    {
+        for (; i + 8 <= count; i += 8)
+        {
+            unsigned long long flagMask;
+            memcpy(&flagMask, flags + i, sizeof flagMask);
+            if (flagMask & 0x0303030303030303ULL)
+                break;
+        }
+
+        size_t groupEnd = Min((int)(i + 8), (int)count);
+        if (i >= groupEnd)
+            break;
+
+        for (; i < groupEnd; ++i)
+        {
+            unsigned char nodeFlags = flags[i];
+            if (nodeFlags & (TF_DIRTY | TF_UPDATED))
+            {
+                flags[i] = nodeFlags & ~(TF_DIRTY | TF_UPDATED);
+                if (nodeFlags & TF_LISTENER)
+                    data.nodes[i]->OnWorldTransformUpdated();
+            }
+        }
+    }
+}
+
+void TransformSystem::DetachNode(size_t index)
+{
+    SpatialNode* node = data.nodes[index];
+    unsigned char nodeFlags = data.flags[index];
+    node->worldTransform = data.worldTransforms[index];
+    node->SetFlag(NF_WORLD_TRANSFORM_DIRTY, (nodeFlags & TF_DIRTY) != 0);
+    node->transformSystem = nullptr;
+
+    // Deliver a pending notification, as the node no longer gets one from Update()
+    if ((nodeFlags & (TF_DIRTY | TF_UPDATED)) && (nodeFlags & TF_LISTENER))
+        node->OnWorldTransformUpdated();
+}
+
+void TransformSystem::AddNodes(Node* node)
+{
+    const Vector<SharedPtr<Node> >& children = node->Children();
+    for (auto it = children.Begin(); it != children.End(); ++it)
+    {
+        Node* child = *it;
+        if (child->TestFlag(NF_SPATIAL))
+            AddNode(static_cast<SpatialNode*>(child));
+        AddNodes(child);
+    }
+}
+
+void TransformSystem::RemoveAllNodes()
+{
+    for (size_t i = 0; i < data.Size(); ++i)
+        DetachNode(i);
+
+    data.Resize(0);
+    ++layoutVersion;
+    orderDirty = false;
+    subtreesSplit = false;
+}
+
+void TransformSystem::CollectNodes(Node* node)
+{
+    const Vector<SharedPtr<Node> >& children = node->Children();
+    for (auto it = children.Begin(); it != children.End(); ++it)
+    {
+        Node* child = *it;
+        if (child->TestFlag(NF_SPATIAL) && static_cast<SpatialNode*>(child)->transformSystem == this)
+            sortNodes.Push(static_cast<SpatialNode*>(child));
+        CollectNodes(child);
+    }
+}
+
+void TransformSystem::SortHierarchy()
+{
+    PROFILE(SortTransforms);
+
+    // The nodes are added and removed along with the scene, so a depth-first traversal of the scene finds all of them
+    sortNodes.Clear();
+    if (ParentScene())
+        CollectNodes(ParentScene());
+    assert(sortNodes.Size() == data.Size());
+
+    sortData.Resize(sortNodes.Size());
+    for (size_t i = 0; i < sortNodes.Size(); ++i)
+    {
+        SpatialNode* node = sortNodes[i];
+        sortData.Copy(i, data, node->transformIndex);
+        node->transformIndex = i;
+    }
+
+    for (size_t i = 0; i < sortNodes.Size(); ++i)
+    {
+        SpatialNode* parent = sortNodes[i]->SpatialParent();
+        sortData.parents[i] = parent && parent->transformSystem == this ? (unsigned)parent->transformIndex : NO_TRANSFORM_PARENT;
+    }
+
+    data.Swap(sortData);
+    ++layoutVersion;
+    orderDirty = false;
+    subtreesSplit = false;
+}
+
+}
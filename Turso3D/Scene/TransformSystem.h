@@ -0,0 +1,159 @@
+// For conditions of distribution and use, see copyright notice in License.txt
+
+#pragma once
+
+#include "../Math/Matrix3x4.h"
+#include "../Thread/WorkQueue.h"
+#include "Node.h"
+
+namespace Turso3D
+{
+
+class SpatialNode;
+
+/// Parent index of a transform without a spatial parent in the same transform system.
+static const unsigned NO_TRANSFORM_PARENT = 0xffffffff;
+/// Minimum number of transforms for each task of the threaded transform update.
+static const size_t MIN_TRANSFORMS_PER_TASK = 1024;
+
+/// Transform flag: world transform needs to be recomputed.
+static const unsigned char TF_DIRTY = 0x1;
+/// Transform flag: world transform was recomputed on demand and the node has not been notified yet.
+static const unsigned char TF_UPDATED = 0x2;
+/// Transform flag: node is notified when its world transform changes.
+static const unsigned char TF_LISTENER = 0x4;
+
+/// Transforms of spatial nodes in structure-of-arrays form, in depth-first hierarchy order so that each subtree is contiguous.
+struct TURSO3D_API TransformData
+{
+    /// Return number of transforms.
+    size_t Size() const { return nodes.Size(); }
+    /// Resize the arrays.
+    void Resize(size_t size);
+    /// Copy a transform from other transform data.
+    void Copy(size_t index, const TransformData& source, size_t sourceIndex);
+    /// Swap the arrays with other transform data.
+    void Swap(TransformData& other);
+    /// Set a local transform.
+    void SetLocalTransform(size_t index, const Vector3& position, const Quaternion& rotation, const Vector3& scale);
+    /// Return a local transform matrix.
+    Matrix3x4 LocalTransform(size_t index) const { return Matrix3x4(Vector3(positionX[index], positionY[index], positionZ[index]), Quaternion(rotationW[index], rotationX[index], rotationY[index], rotationZ[index]), Vector3(scaleX[index], scaleY[index], scaleZ[index])); }
+
+    /// Nodes.
+    Vector<SpatialNode*> nodes;
+    /// Parent transform indices.
+    Vector<unsigned> parents;
+    /// Transform flags, one byte per transform so that several can be tested at once.
+    Vector<unsigned char> flags;
+    /// World transforms.
+    Vector<Matrix3x4> worldTransforms;
+    /// Local position X coordinates.
+    Vector<float> positionX;
+    /// Local position Y coordinates.
+    Vector<float> positionY;
+    /// Local position Z coordinates.
+    Vector<float> positionZ;
+    /// Local rotation W components.
+    Vector<float> rotationW;
+    /// Local rotation X components.
+    Vector<float> rotationX;
+    /// Local rotation Y components.
+    Vector<float> rotationY;
+    /// Local rotation Z components.
+    Vector<float> rotationZ;
+    /// Local scale X components.
+    Vector<float> scaleX;
+    /// Local scale Y components.
+    Vector<float> scaleY;
+    /// Local scale Z components.
+    Vector<float> scaleZ;
+};
+
+/// Batched transform update for the spatial nodes of a scene. Should be created as a child of the scene root. A scene uses only its first transform system. Stores the local and world transforms in contiguous arrays with parents before their children, and recomputes the dirty world transforms in one linear pass in Update(), 4 at a time if SSE is enabled. Independent subtrees are divided between worker threads, which needs each subtree to be contiguous. The SpatialNode transform functions work as before: a dirty world transform that is read before Update() is recomputed on demand through the parent chain.
+///
+/// Octree nodes in a transform system queue their octree update only when Update() has recomputed their world transform, so Update() must be called before updating the octree or AABB tree. Scene::UpdateTransforms() and the renderer do this.
+class TURSO3D_API TransformSystem : public Node
+{
+    OBJECT(TransformSystem);
+
+public:
+    /// Construct.
+    TransformSystem();
+    /// Destruct. Detach the nodes, which keep their transforms.
+    ~TransformSystem();
+
+    /// Register factory.
+    static void RegisterObject();
+
+    /// Recompute the dirty world transforms, then notify the nodes whose world transforms changed in hierarchy order. Restore the hierarchy order first if nodes were reparented or removed, or for a threaded update if nodes were added out of depth-first order. Uses worker threads only if enabled, the work queue has threads and there are enough transforms.
+    void Update();
+    /// Set whether to use worker threads in Update() when there are enough transforms. Enabled by default.
+    void SetThreadedUpdate(bool enable);
+
+    /// Add a spatial node. Called internally.
+    void AddNode(SpatialNode* node);
+    /// Remove a spatial node. The node keeps its transforms. Called internally.
+    void RemoveNode(SpatialNode* node);
+    /// Handle a spatial node being reparented. The parent index is updated when the hierarchy order is restored. Called internally.
+    void SetParent(SpatialNode* node);
+    /// Store a node's changed local transform. Called internally.
+    void SetLocalTransform(size_t index, const Vector3& position, const Quaternion& rotation, const Vector3& scale) { data.SetLocalTransform(index, position, rotation, scale); }
+    /// Mark a node's world transform dirty. Called internally.
+    void MarkDirty(size_t index) { data.flags[index] |= TF_DIRTY; }
+
+    /// Return number of nodes.
+    size_t NumNodes() const { return data.Size(); }
+    /// Return a node's world transform. Recompute through the parent chain if dirty, which is allowed only in the main thread, so worker threads may read world transforms only after Update(). The reference points into the transform arrays and is invalidated when the layout version changes.
+    const Matrix3x4& WorldTransform(size_t index) { if (data.flags[index] & TF_DIRTY) UpdateWorldTransform(index); return data.worldTransforms[index]; }
+    /// Return whether a node's world transform is dirty.
+    bool IsDirty(size_t index) const { return (data.flags[index] & TF_DIRTY) != 0; }
+    /// Return whether worker threads are used in Update().
+    bool ThreadedUpdate() const { return threadedUpdate; }
+    /// Return the layout version, which changes whenever the transforms may move in memory: when spatial nodes are added or removed, and when Update() restores the hierarchy order.
+    unsigned LayoutVersion() const { return layoutVersion; }
+    /// Return the transform data.
+    const TransformData& Data() const { return data; }
+
+protected:
+    /// Handle being assigned to a new scene. Add the scene's spatial nodes.
+    void OnSceneSet(Scene* newScene, Scene* oldScene) override;
+
+private:
+    /// Recompute one world transform through the parent chain.
+    void UpdateWorldTransform(size_t index);
+    /// Recompute the dirty world transforms of a range. Parents outside the range must be up to date. Does not modify the flags.
+    void UpdateTransforms(size_t start, size_t end);
+    /// Work function for recomputing the world transforms of whole subtrees in a worker thread.
+    void UpdateWork(Task* task, unsigned threadIndex);
+    /// Clear the dirty flags after an update and notify the nodes whose world transforms changed.
+    void NotifyNodes();
+    /// Give a node back its world transform when it leaves the transform system.
+    void DetachNode(size_t index);
+    /// Add the spatial nodes of a hierarchy.
+    void AddNodes(Node* node);
+    /// Remove all nodes.
+    void RemoveAllNodes();
+    /// Collect the nodes in hierarchy order.
+    void CollectNodes(Node* node);
+    /// Sort the transforms to hierarchy order and update the parent indices.
+    void SortHierarchy();
+
+    /// Transform data.
+    TransformData data;
+    /// Transform data being sorted into.
+    TransformData sortData;
+    /// Nodes in hierarchy order for sorting.
+    Vector<SpatialNode*> sortNodes;
+    /// Tasks for threaded update.
+    Vector<AutoPtr<MemberFunctionTask<TransformSystem> > > updateTasks;
+    /// Layout version.
+    unsigned layoutVersion;
+    /// Whether the hierarchy order needs to be restored because a parent may come after its child or a parent index is out of date.
+    bool orderDirty;
+    /// Whether subtrees may be split by nodes added out of depth-first order. Restored only before a threaded update.
+    bool subtreesSplit;
+    /// Threaded update flag.
+    bool threadedUpdate;
+};
+
+}
@@ -38,6 +38,7 @@ void Condition::Wait()
 #else
 Condition::Condition() :
     mutex(new pthread_mutex_t),
+    signaled(false),
     event(new pthread_cond_t)
 {
     pthread_mutex_init((pthread_mutex_t*)mutex, 0);
@@ -59,7 +60,14 @@ Condition::~Condition()
 
 void Condition::Set()
 {
-    pthread_cond_signal((pthread_cond_t*)event);
+    pthread_cond_t* c = (pthread_cond_t*)event;
+    pthread_mutex_t* m = (pthread_mutex_t*)mutex;
+
+    // Behave like an auto-reset Win32 event: stay signaled until a waiting thread consumes the signal
+    pthread_mutex_lock(m);
+    signaled = true;
+    pthread_cond_signal(c);
+    pthread_mutex_unlock(m);
 }
 
 void Condition::Wait()
@@ -68,7 +76,9 @@ void Condition::Wait()
     pthread_mutex_t* m = (pthread_mutex_t*)mutex;
 
     pthread_mutex_lock(m);
-    pthread_cond_wait(c, m);
+    while (!signaled)
+        pthread_cond_wait(c, m);
+    signaled = false;
     pthread_mutex_unlock(m);
 }
 #endif
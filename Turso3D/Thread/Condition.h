@@ -27,6 +27,8 @@ private:
     #ifndef WIN32
     /// Mutex for the event, necessary for pthreads-based implementation.
     void* mutex;
+    /// Signaled flag, necessary for pthreads-based implementation so that a set before waiting is not lost.
+    bool signaled;
     #endif
     /// Operating system specific event.
     void* event;
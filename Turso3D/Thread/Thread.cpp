@@ -122,4 +122,16 @@ bool Thread::IsMainThread()
     return CurrentThreadID() == mainThreadID;
 }
 
+unsigned Thread::NumCPUCores()
+{
+    #ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+    #else
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 0 ? (unsigned)cores : 1;
+    #endif
+}
+
 }
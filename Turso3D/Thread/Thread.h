@@ -47,6 +47,8 @@ public:
     static ThreadID CurrentThreadID();
     /// Return whether is executing in the main thread.
     static bool IsMainThread();
+    /// Return number of logical CPU cores.
+    static unsigned NumCPUCores();
     
 protected:
     /// Thread handle.
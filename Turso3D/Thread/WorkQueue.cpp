@@ -0,0 +1,166 @@
+// For conditions of distribution and use, see copyright notice in License.txt
+
+#include "WorkQueue.h"
+
+#include "../Debug/DebugNew.h"
+
+namespace Turso3D
+{
+
+Task::Task() :
+    start(nullptr),
+    end(nullptr)
+{
+}
+
+Task::~Task()
+{
+}
+
+WorkerThread::WorkerThread(WorkQueue* owner_, unsigned index_) :
+    owner(owner_),
+    index(index_)
+{
+}
+
+void WorkerThread::ThreadFunction()
+{
+    owner->ProcessTasks(index);
+}
+
+WorkQueue::WorkQueue(int numThreads) :
+    nextTask(0),
+    numPendingTasks(0),
+    shouldExit(false)
+{
+    if (numThreads < 0)
+        numThreads = (int)Thread::NumCPUCores() - 1;
+
+    for (int i = 0; i < numThreads; ++i)
+    {
+        AutoPtr<WorkerThread> thread(new WorkerThread(this, (unsigned)i + 1));
+        if (thread->Run())
+            threads.Push(thread);
+    }
+
+    RegisterSubsystem(this);
+}
+
+WorkQueue::~WorkQueue()
+{
+    RemoveSubsystem(this);
+
+    {
+        MutexLock lock(queueMutex);
+        tasks.Clear();
+        nextTask = 0;
+        numPendingTasks = 0;
+        shouldExit = true;
+    }
+
+    // Each exiting worker thread wakes up the next one
+    workAvailable.Set();
+    for (auto it = threads.Begin(); it != threads.End(); ++it)
+        (*it)->Stop();
+    threads.Clear();
+}
+
+void WorkQueue::AddTask(Task* task)
+{
+    AddTasks(&task, 1);
+}
+
+void WorkQueue::AddTasks(Task** tasks_, size_t count)
+{
+    if (!count)
+        return;
+
+    {
+        MutexLock lock(queueMutex);
+        for (size_t i = 0; i < count; ++i)
+            tasks.Push(tasks_[i]);
+        numPendingTasks += count;
+    }
+
+    workAvailable.Set();
+}
+
+void WorkQueue::Complete()
+{
+    for (;;)
+    {
+        Task* task = TakeTask();
+        if (!task)
+            break;
+
+        task->Complete(0);
+        FinishTask();
+    }
+
+    // The queue is empty, but worker threads may still be executing their last tasks. A signal left over from an earlier
+    // completion only causes another check
+    while (!IsCompleted())
+        tasksCompleted.Wait();
+}
+
+bool WorkQueue::IsCompleted() const
+{
+    MutexLock lock(queueMutex);
+    return numPendingTasks == 0;
+}
+
+Task* WorkQueue::TakeTask()
+{
+    MutexLock lock(queueMutex);
+    if (nextTask >= tasks.Size())
+        return nullptr;
+
+    Task* task = tasks[nextTask++];
+    if (nextTask == tasks.Size())
+    {
+        tasks.Clear();
+        nextTask = 0;
+    }
+    else
+    {
+        // More work left: wake up another worker thread
+        workAvailable.Set();
+    }
+
+    return task;
+}
+
+void WorkQueue::FinishTask()
+{
+    MutexLock lock(queueMutex);
+    if (!--numPendingTasks)
+        tasksCompleted.Set();
+}
+
+bool WorkQueue::ShouldExit() const
+{
+    MutexLock lock(queueMutex);
+    return shouldExit;
+}
+
+void WorkQueue::ProcessTasks(unsigned threadIndex)
+{
+    for (;;)
+    {
+        Task* task = TakeTask();
+        if (task)
+        {
+            task->Complete(threadIndex);
+            FinishTask();
+        }
+        else if (ShouldExit())
+        {
+            workAvailable.Set();
+            break;
+        }
+        else
+            workAvailable.Wait();
+    }
+}
+
+}
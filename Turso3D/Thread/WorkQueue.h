@@ -0,0 +1,129 @@
+// For conditions of distribution and use, see copyright notice in License.txt
+
+#pragma once
+
+#include "../Base/AutoPtr.h"
+#include "../Object/Object.h"
+#include "Condition.h"
+#include "Mutex.h"
+#include "Thread.h"
+
+namespace Turso3D
+{
+
+class WorkQueue;
+
+/// Unit of work to be executed by the work queue.
+class TURSO3D_API Task
+{
+public:
+    /// Construct.
+    Task();
+    /// Destruct.
+    virtual ~Task();
+
+    /// Do the work. The thread index is 0 for the main thread and 1 to n for the worker threads.
+    virtual void Complete(unsigned threadIndex) = 0;
+
+    /// Start pointer of the data to process. Usage is task-specific.
+    void* start;
+    /// End pointer of the data to process. Usage is task-specific.
+    void* end;
+};
+
+/// %Task that invokes a member function.
+template <class T> class MemberFunctionTask : public Task
+{
+public:
+    typedef void (T::*WorkFunctionPtr)(Task*, unsigned);
+
+    /// Construct.
+    MemberFunctionTask(T* object_, WorkFunctionPtr function_) :
+        object(object_),
+        function(function_)
+    {
+    }
+
+    /// Invoke the member function.
+    void Complete(unsigned threadIndex) override
+    {
+        (object->*function)(this, threadIndex);
+    }
+
+    /// %Object instance.
+    T* object;
+    /// Member function pointer.
+    WorkFunctionPtr function;
+};
+
+/// Worker thread owned by the work queue.
+class TURSO3D_API WorkerThread : public Thread
+{
+public:
+    /// Construct.
+    WorkerThread(WorkQueue* owner, unsigned index);
+
+    /// Process tasks until the work queue is destroyed.
+    void ThreadFunction() override;
+
+private:
+    /// Work queue.
+    WorkQueue* owner;
+    /// Thread index, starting from 1.
+    unsigned index;
+};
+
+/// Worker thread subsystem for dividing tasks between CPU cores. The main thread participates in executing the tasks when waiting for completion.
+class TURSO3D_API WorkQueue : public Object
+{
+    OBJECT(WorkQueue);
+
+    friend class WorkerThread;
+
+public:
+    /// Construct, create the worker threads and register subsystem. By default creates one less worker thread than there are CPU cores, so that together with the main thread all cores are used.
+    WorkQueue(int numThreads = -1);
+    /// Destruct. Stop the worker threads. Any tasks still in the queue will not be executed.
+    ~WorkQueue();
+
+    /// Add a task to the queue. The task is not owned by the queue and must stay alive until completed.
+    void AddTask(Task* task);
+    /// Add several tasks to the queue.
+    void AddTasks(Task** tasks, size_t count);
+    /// Execute tasks in the main thread until the queue is empty, then sleep until the worker threads have finished their current tasks.
+    void Complete();
+
+    /// Return number of worker threads, not counting the main thread.
+    size_t NumThreads() const { return threads.Size(); }
+    /// Return whether all queued tasks have been completed.
+    bool IsCompleted() const;
+
+private:
+    /// Take the next task from the queue. Return null if none.
+    Task* TakeTask();
+    /// Mark a task as completed.
+    void FinishTask();
+    /// Return whether worker threads should exit.
+    bool ShouldExit() const;
+    /// Worker thread main loop.
+    void ProcessTasks(unsigned threadIndex);
+
+    /// Worker threads.
+    Vector<AutoPtr<WorkerThread> > threads;
+    /// Queued tasks.
+    Vector<Task*> tasks;
+    /// Index of the next task to take from the queue.
+    size_t nextTask;
+    /// Number of tasks queued or in progress.
+    size_t numPendingTasks;
+    /// Mutex for the queue and the pending task count.
+    mutable Mutex queueMutex;
+    /// Condition for waking up worker threads.
+    Condition workAvailable;
+    /// Condition for waking up the main thread when the last pending task is finished.
+    Condition tasksCompleted;
+    /// Exit flag for the worker threads.
+    bool shouldExit;
+};
+
+}
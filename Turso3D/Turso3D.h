@@ -28,6 +28,7 @@
 #include "Math/Random.h"
 #include "Math/Ray.h"
 #include "Object/Serializable.h"
+#include "Renderer/AABBTree.h"
 #include "Renderer/Camera.h"
 #include "Renderer/Light.h"
 #include "Renderer/Material.h"
@@ -39,9 +40,12 @@
 #include "Resource/JSONFile.h"
 #include "Resource/ResourceCache.h"
 #include "Scene/Scene.h"
+#include "Scene/SceneStreamer.h"
+#include "Scene/TransformSystem.h"
 #include "Thread/Condition.h"
 #include "Thread/Mutex.h"
 #include "Thread/Thread.h"
 #include "Thread/Timer.h"
+#include "Thread/WorkQueue.h"
 #include "Window/Input.h"
 #include "Window/Window.h"
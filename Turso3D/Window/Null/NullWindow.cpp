@@ -0,0 +1,109 @@
+// For conditions of distribution and use, see copyright notice in License.txt
+
+#include "../../Debug/Log.h"
+#include "NullWindow.h"
+
+#include "../../Debug/DebugNew.h"
+
+namespace Turso3D
+{
+
+Window::Window() :
+    title("Turso3D Window"),
+    size(IntVector2::ZERO),
+    position(IntVector2::ZERO),
+    mousePosition(IntVector2::ZERO),
+    open(false),
+    minimized(false),
+    resizable(false),
+    fullscreen(false),
+    mouseVisible(true)
+{
+    RegisterSubsystem(this);
+}
+
+Window::~Window()
+{
+    Close();
+    RemoveSubsystem(this);
+}
+
+void Window::SetTitle(const String& newTitle)
+{
+    title = newTitle;
+}
+
+bool Window::SetSize(const IntVector2& size_, bool fullscreen_, bool resizable_)
+{
+    if (size_.x < 1 || size_.y < 1)
+    {
+        LOGERROR("Can not set zero or negative window size");
+        return false;
+    }
+
+    open = true;
+    minimized = false;
+    fullscreen = fullscreen_;
+    resizable = resizable_;
+
+    if (size_ != size)
+    {
+        size = size_;
+        resizeEvent.size = size_;
+        SendEvent(resizeEvent);
+    }
+
+    return true;
+}
+
+void Window::SetPosition(const IntVector2& position_)
+{
+    if (open)
+        position = position_;
+}
+
+void Window::SetMouseVisible(bool enable)
+{
+    mouseVisible = enable;
+}
+
+void Window::SetMousePosition(const IntVector2& position_)
+{
+    if (open)
+        mousePosition = position_;
+}
+
+void Window::Close()
+{
+    open = false;
+    minimized = false;
+}
+
+void Window::Minimize()
+{
+    if (open && !minimized)
+    {
+        minimized = true;
+        SendEvent(minimizeEvent);
+    }
+}
+
+void Window::Maximize()
+{
+    Restore();
+}
+
+void Window::Restore()
+{
+    if (open && minimized)
+    {
+        minimized = false;
+        SendEvent(restoreEvent);
+    }
+}
+
+void Window::PumpMessages()
+{
+}
+
+}
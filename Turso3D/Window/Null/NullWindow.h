@@ -0,0 +1,112 @@
+// For conditions of distribution and use, see copyright notice in License.txt
+
+#pragma once
+
+#include "../../Math/IntVector2.h"
+#include "../../Object/Object.h"
+
+namespace Turso3D
+{
+
+/// %Window resized event.
+class TURSO3D_API WindowResizeEvent : public Event
+{
+public:
+    /// New window size.
+    IntVector2 size;
+};
+
+/// Operating system window, headless implementation. Only tracks the window state, nothing is shown on screen and no input is received.
+class TURSO3D_API Window : public Object
+{
+    OBJECT(Window);
+
+public:
+    /// Construct and register subsystem. The window is not yet opened.
+    Window();
+    /// Destruct. Close window if open.
+    ~Window();
+
+    /// Set window title.
+    void SetTitle(const String& newTitle);
+    /// Set window size. Open the window if not opened yet. Return true on success.
+    bool SetSize(const IntVector2& size, bool fullscreen, bool resizable);
+    /// Set window position.
+    void SetPosition(const IntVector2& position);
+    /// Set mouse cursor visible. Default is true.
+    void SetMouseVisible(bool enable);
+    /// Move the mouse cursor to a window top-left relative position.
+    void SetMousePosition(const IntVector2& position);
+    /// Close the window.
+    void Close();
+    /// Minimize the window.
+    void Minimize();
+    /// Maximize the window.
+    void Maximize();
+    /// Restore window size.
+    void Restore();
+    /// Pump window messages from the operating system. No-op, as there are no messages.
+    void PumpMessages();
+
+    /// Return window title.
+    const String& Title() const { return title; }
+    /// Return window client area size.
+    const IntVector2& Size() const { return size; }
+    /// Return window client area width.
+    int Width() const { return size.x; }
+    /// Return window client area height.
+    int Height() const { return size.y; }
+    /// Return window position.
+    IntVector2 Position() const { return position; }
+    /// Return last known mouse cursor position relative to window top-left.
+    const IntVector2& MousePosition() const { return mousePosition; }
+    /// Return whether window is open.
+    bool IsOpen() const { return open; }
+    /// Return whether is resizable.
+    bool IsResizable() const { return resizable; }
+    /// Return whether is fullscren.
+    bool IsFullscreen() const { return fullscreen; }
+    /// Return whether is currently minimized.
+    bool IsMinimized() const { return minimized; }
+    /// Return whether has input focus.
+    bool HasFocus() const { return open && !minimized; }
+    /// Return whether mouse cursor is visible.
+    bool IsMouseVisible() const { return mouseVisible; }
+    /// Return window handle. Always null.
+    void* Handle() const { return nullptr; }
+
+    /// Close requested event.
+    Event closeRequestEvent;
+    /// Gained focus event.
+    Event gainFocusEvent;
+    /// Lost focus event.
+    Event loseFocusEvent;
+    /// Minimized event.
+    Event minimizeEvent;
+    /// Restored after minimization -event.
+    Event restoreEvent;
+    /// Size changed event.
+    WindowResizeEvent resizeEvent;
+
+private:
+    /// Window title.
+    String title;
+    /// Current client area size.
+    IntVector2 size;
+    /// Window position.
+    IntVector2 position;
+    /// Current mouse cursor position.
+    IntVector2 mousePosition;
+    /// Open flag.
+    bool open;
+    /// Current minimization state.
+    bool minimized;
+    /// Resizable flag.
+    bool resizable;
+    /// Fullscreen flag.
+    bool fullscreen;
+    /// Mouse visible flag.
+    bool mouseVisible;
+};
+
+}
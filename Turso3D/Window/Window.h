@@ -2,6 +2,10 @@
 
 #pragma once
 
-#ifdef _WIN32
+#include "../Turso3DConfig.h"
+
+#if defined(_WIN32) && !defined(TURSO3D_NULL)
 #include "Win32/Win32Window.h"
+#else
+#include "Null/NullWindow.h"
 #endif
\ No newline at end of file